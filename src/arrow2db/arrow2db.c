@@ -0,0 +1,180 @@
+// arrow2db
+//
+// Copyright (c) 2015, Los Alamos National Security, LLC
+// All rights reserved.
+//
+// Copyright (2015). Los Alamos National Security, LLC. This software was
+// produced under U.S. Government contract DE-AC52-06NA25396 for Los Alamos
+// National Laboratory (LANL), which is operated by Los Alamos National
+// Security, LLC for the U.S. Department of Energy. The U.S. Government has
+// rights to use, reproduce, and distribute this software. NEITHER THE
+// GOVERNMENT NOR LOS ALAMOS NATIONAL SECURITY, LLC MAKES ANY WARRANTY, EXPRESS
+// OR IMPLIED, OR ASSUMES ANY LIABILITY FOR THE USE OF THIS SOFTWARE. If
+// software is modified to produce derivative works, such modified software
+// should be clearly marked, so as not to confuse it with the version available
+// from LANL.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//
+//
+// Converts an Arrow IPC stream or file to db data.
+//
+// Author: Curt Hash <chash@lanl.gov>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "arrow.h"
+
+// Writes a string value. Tabs and newlines would split the record, so they
+// are replaced with spaces. Returns the number replaced.
+static size_t
+write_text(writer_t *out, const char *s, size_t len) {
+  size_t replaced = 0;
+  size_t i = 0;
+  size_t j;
+  for (j = 0; j < len; j++) {
+    if (s[j] == '\t' || s[j] == '\n') {
+      writer_write(out, s + i, j - i);
+      writer_write(out, " ", 1);
+      i = j + 1;
+      replaced++;
+    }
+  }
+  writer_write(out, s + i, len - i);
+
+  return replaced;
+}
+
+// Outputs the records of an Arrow stream or file.
+void
+convert(const char *path) {
+  int fd = STDIN_FILENO;
+  if (strcmp(path, "-") != 0) {
+    fd = open(path, O_RDONLY);
+    if (fd == -1) {
+      perror(path);
+      exit(1);
+    }
+  } else {
+    path = "stdin";
+  }
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  arrow_reader_t reader;
+  if (arrow_reader_init(&reader, fd, path) == -1) {
+    exit(1);
+  }
+
+  writer_t out;
+  writer_init(&out, STDOUT_FILENO, WRITER_BUFSIZE);
+
+  char *header = arrow_reader_header(&reader);
+  writer_write(&out, header, strlen(header));
+  writer_write(&out, "\n", 1);
+
+  char buf[ARROW_TEXT_MAX];
+  size_t replaced = 0;
+  int ret;
+  while ((ret = arrow_reader_next(&reader)) == 1) {
+    int64_t row;
+    for (row = 0; row < reader.nrows; row++) {
+      int i;
+      for (i = 1; i <= reader.ncols; i++) {
+        field_t field;
+        arrow_reader_value(&reader, i, row, buf, &field);
+        if (i > 1) {
+          writer_write(&out, "\t", 1);
+        }
+        replaced += write_text(&out, field.ptr, field.len);
+      }
+
+      if (writer_write(&out, "\n", 1) == -1) {
+        errno = out.error;
+        perror("write error");
+        exit(1);
+      }
+    }
+  }
+
+  if (ret == -1) {
+    exit(1);
+  }
+
+  if (replaced) {
+    fprintf(stderr, "%s: replaced %zu tabs and newlines in values with "
+            "spaces\n", path, replaced);
+  }
+
+  if (writer_free(&out) == -1) {
+    errno = out.error;
+    perror("write error");
+    exit(1);
+  }
+
+#ifdef DEBUG
+  arrow_reader_free(&reader);
+  free(header);
+  if (fd != STDIN_FILENO) {
+    close(fd);
+  }
+#endif
+}
+
+int
+main(int argc, char **argv) {
+  static struct option lopts[] = {
+    {"help", no_argument, NULL, 'h'},
+    {NULL, 0, NULL, 0}
+  };
+  const char *sopts = "h";
+  int opt;
+
+  // Parse arguments.
+  while ((opt = getopt_long(argc, argv, sopts, lopts, NULL)) != -1) {
+    switch (opt) {
+      default:
+        printf("Usage: %s [OPTIONS] [PATH]\n\n", argv[0]);
+        printf("-h | --help           print this text and exit\n\n");
+        printf("Reads an Arrow file or stream from PATH, or from stdin if "
+               "PATH is - or is\n");
+        printf("omitted, and outputs it as db data. int, float, bool, and "
+               "utf8 columns are\n");
+        printf("supported, including dictionary encoded utf8 columns.\n\n");
+        printf("Examples:\n\n");
+        printf("Output the records of an Arrow file:\n");
+        printf("%s flows.arrow\n", argv[0]);
+        return 0;
+    }
+  }
+
+  if (optind < argc - 1) {
+    fprintf(stderr, "too many arguments\n");
+    return 1;
+  }
+
+  convert(optind < argc ? argv[optind] : "-");
+
+  return 0;
+}
@@ -0,0 +1,178 @@
+// db2arrow
+//
+// Copyright (c) 2015, Los Alamos National Security, LLC
+// All rights reserved.
+//
+// Copyright (2015). Los Alamos National Security, LLC. This software was
+// produced under U.S. Government contract DE-AC52-06NA25396 for Los Alamos
+// National Laboratory (LANL), which is operated by Los Alamos National
+// Security, LLC for the U.S. Department of Energy. The U.S. Government has
+// rights to use, reproduce, and distribute this software. NEITHER THE
+// GOVERNMENT NOR LOS ALAMOS NATIONAL SECURITY, LLC MAKES ANY WARRANTY, EXPRESS
+// OR IMPLIED, OR ASSUMES ANY LIABILITY FOR THE USE OF THIS SOFTWARE. If
+// software is modified to produce derivative works, such modified software
+// should be clearly marked, so as not to confuse it with the version available
+// from LANL.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//
+//
+// Converts db data to Arrow IPC record batches.
+//
+// Author: Curt Hash <chash@lanl.gov>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "arrow.h"
+
+typedef struct {
+  size_t batch_rows;
+  char stream;
+} options_t;
+
+// Converts db data on stdin to Arrow at path, or to stdout if path is "-".
+void
+convert(options_t *options, const char *path) {
+  reader_t reader;
+  reader_init(&reader, STDIN_FILENO, READER_BUFSIZE);
+  posix_fadvise(STDIN_FILENO, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  char *header = reader_header(&reader);
+  schema_t schema;
+  if (!header || parse_header(header, &schema) != 0) {
+    fprintf(stderr, "error parsing #db header\n");
+    exit(1);
+  }
+
+  // A pipe gets the stream format, which needs no footer.
+  int fd = STDOUT_FILENO;
+  if (strcmp(path, "-") != 0) {
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd == -1) {
+      perror(path);
+      exit(1);
+    }
+  } else {
+    path = "stdout";
+    options->stream = 1;
+  }
+
+  arrow_writer_t writer;
+  int ret = arrow_writer_init(&writer, fd, &schema, options->batch_rows,
+                              !options->stream);
+
+  batch_t batch;
+  batch_init(&batch, BATCH_SIZE, schema.ncols);
+
+  size_t count;
+  while (ret == 0 && (count = reader_batch(&reader, &batch))) {
+    size_t i;
+    for (i = 0; i < count && ret == 0; i++) {
+      ret = arrow_writer_add(&writer, &batch.records[i]);
+    }
+  }
+
+  if (reader.error) {
+    errno = reader.error;
+    perror("read error");
+    exit(1);
+  }
+
+  int closed = arrow_writer_close(&writer);
+  if (closed == -1 || ret == -1) {
+    errno = writer.out.error;
+    perror(path);
+    exit(1);
+  }
+
+  if (fd != STDOUT_FILENO && close(fd) == -1) {
+    perror(path);
+    exit(1);
+  }
+
+  // The output is complete, but values were lost.
+  if (closed == 1) {
+    exit(1);
+  }
+
+#ifdef DEBUG
+  batch_free(&batch);
+  reader_free(&reader);
+  free_schema(&schema);
+  free(header);
+#endif
+}
+
+int
+main(int argc, char **argv) {
+  static struct option lopts[] = {
+    {"help", no_argument, NULL, 'h'},
+    {"batch-rows", required_argument, NULL, 'b'},
+    {"stream", no_argument, NULL, 's'},
+    {NULL, 0, NULL, 0}
+  };
+  const char *sopts = "hb:s";
+  int opt;
+
+  options_t options = {ARROW_BATCH_ROWS, 0};
+
+  // Parse arguments.
+  while ((opt = getopt_long(argc, argv, sopts, lopts, NULL)) != -1) {
+    switch (opt) {
+      case 'b':
+        options.batch_rows = strtoul(optarg, NULL, 10);
+        if (options.batch_rows < 1) {
+          fprintf(stderr, "invalid batch size '%s'\n", optarg);
+          return 1;
+        }
+        break;
+      case 's':
+        options.stream = 1;
+        break;
+      default:
+        printf("Usage: %s [OPTIONS] PATH\n\n", argv[0]);
+        printf("-h | --help           print this text and exit\n");
+        printf("-b | --batch-rows     records per record batch (default %d)\n",
+               ARROW_BATCH_ROWS);
+        printf("-s | --stream         write the Arrow stream format\n\n");
+        printf("Reads db data from stdin and writes it to PATH as an Arrow "
+               "file, or to stdout\n");
+        printf("as an Arrow stream if PATH is -.\n\n");
+        printf("Examples:\n\n");
+        printf("Convert a compressed db file:\n");
+        printf("dbcat flows.db.gz | %s flows.arrow\n", argv[0]);
+        return 0;
+    }
+  }
+
+  if (optind != argc - 1) {
+    fprintf(stderr, "an output path is required\n");
+    return 1;
+  }
+
+  convert(&options, argv[optind]);
+
+  return 0;
+}
@@ -0,0 +1,371 @@
+// dbc2db
+//
+// Copyright (c) 2015, Los Alamos National Security, LLC
+// All rights reserved.
+//
+// Copyright (2015). Los Alamos National Security, LLC. This software was
+// produced under U.S. Government contract DE-AC52-06NA25396 for Los Alamos
+// National Laboratory (LANL), which is operated by Los Alamos National
+// Security, LLC for the U.S. Department of Energy. The U.S. Government has
+// rights to use, reproduce, and distribute this software. NEITHER THE
+// GOVERNMENT NOR LOS ALAMOS NATIONAL SECURITY, LLC MAKES ANY WARRANTY, EXPRESS
+// OR IMPLIED, OR ASSUMES ANY LIABILITY FOR THE USE OF THIS SOFTWARE. If
+// software is modified to produce derivative works, such modified software
+// should be clearly marked, so as not to confuse it with the version available
+// from LANL.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//
+// Converts selected columns of a .dbc file back to db data.
+//
+// Author: Curt Hash <chash@lanl.gov>
+
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "dbc.h"
+
+#define MAX_RANGES 16
+
+// Only records whose value in column is within [lo, hi] are output.
+typedef struct {
+  int column;
+  dbc_type_t type;
+  dbc_value_t lo;
+  dbc_value_t hi;
+} range_t;
+
+typedef struct {
+  int *columns;
+  int ncolumns;
+  range_t ranges[MAX_RANGES];
+  int nranges;
+} options_t;
+
+// Parses a value of the given type. Returns 0 if successful.
+int
+parse_value(const char *s, size_t len, dbc_type_t type, dbc_value_t *v) {
+  if (type == DBC_INT) {
+    return parse_int64(s, len, &v->i);
+  }
+
+  return parse_double(s, len, &v->d);
+}
+
+// Parses a COLNAME:MIN:MAX range on an int or real column.
+void
+parse_range(const schema_t *schema, char *arg, range_t *range) {
+  char *saveptr;
+  char *name = strtok_r(arg, ":", &saveptr);
+  char *lo = strtok_r(NULL, ":", &saveptr);
+  char *hi = strtok_r(NULL, "", &saveptr);
+
+  column_t *column = name ? get_column(schema, name) : NULL;
+  if (!column) {
+    fprintf(stderr, "invalid range column '%s'\n", name ? name : "");
+    exit(1);
+  }
+
+  range->column = column->index;
+  range->type = dbc_type(column->type);
+  if (range->type == DBC_STR) {
+    fprintf(stderr, "range column '%s' is not int or real\n", name);
+    exit(1);
+  }
+
+  if (!lo || !hi || parse_value(lo, strlen(lo), range->type, &range->lo) ||
+      parse_value(hi, strlen(hi), range->type, &range->hi)) {
+    fprintf(stderr, "invalid range for '%s'\n", name);
+    exit(1);
+  }
+}
+
+// Returns whether a row group may have records within a range, going by the
+// min/max of its chunk.
+int
+group_overlaps(const dbc_chunk_t *chunk, const range_t *range) {
+  if (!(chunk->flags & DBC_STATS)) {
+    return 1;
+  }
+
+  if (chunk->type == DBC_INT) {
+    return chunk->max.i >= range->lo.i && chunk->min.i <= range->hi.i;
+  }
+
+  return chunk->max.d >= range->lo.d && chunk->min.d <= range->hi.d;
+}
+
+// Returns whether a row of a decoded column is within a range. Values in a
+// chunk that was stored as strings are parsed, and those that do not parse
+// are not within any range.
+int
+in_range(const dbc_column_t *column, uint64_t row, const range_t *range) {
+  dbc_value_t v;
+
+  switch (column->type) {
+    case DBC_INT:
+      v.i = column->ints[row];
+      break;
+    case DBC_REAL:
+      v.d = column->reals[row];
+      break;
+    default:
+      if (parse_value(column->strs[row].ptr, column->strs[row].len,
+                      range->type, &v)) {
+        return 0;
+      }
+      break;
+  }
+
+  if (range->type == DBC_INT) {
+    return v.i >= range->lo.i && v.i <= range->hi.i;
+  }
+
+  return v.d >= range->lo.d && v.d <= range->hi.d;
+}
+
+// Outputs a value of a decoded column.
+int
+write_value(writer_t *out, const dbc_column_t *column, uint64_t row) {
+  char buf[64];
+  int len;
+
+  switch (column->type) {
+    case DBC_INT:
+      len = snprintf(buf, sizeof buf, "%" PRId64, column->ints[row]);
+      return writer_write(out, buf, len);
+    case DBC_REAL:
+      len = dbc_format_real(buf, sizeof buf, column->reals[row]);
+      return writer_write(out, buf, len);
+    default:
+      return writer_write(out, column->strs[row].ptr, column->strs[row].len);
+  }
+}
+
+// Outputs the selected columns of the records of a row group that are within
+// the ranges. Columns are only decoded if they are needed.
+void
+dump_group(options_t *options, dbc_t *dbc, uint64_t g, dbc_column_t *columns,
+           writer_t *out) {
+  uint64_t nrows = dbc->groups[g].nrows;
+  int i;
+
+  for (i = 0; i < options->nranges; i++) {
+    const range_t *range = &options->ranges[i];
+    if (!group_overlaps(&dbc->groups[g].chunks[range->column - 1], range)) {
+      return;
+    }
+  }
+
+  char *keep = malloc(nrows ? nrows : 1);
+  if (!keep) {
+    fprintf(stderr, "%s: row group %" PRIu64 " too large\n", dbc->path, g);
+    exit(1);
+  }
+  memset(keep, 1, nrows);
+  uint64_t nkeep = nrows;
+
+  for (i = 0; i < options->nranges && nkeep; i++) {
+    const range_t *range = &options->ranges[i];
+    dbc_column_t *column = &columns[range->column - 1];
+    if (!column->nrows &&
+        dbc_read_column(dbc, g, range->column, column) == -1) {
+      exit(1);
+    }
+
+    uint64_t row;
+    for (row = 0; row < nrows; row++) {
+      if (keep[row] && !in_range(column, row, range)) {
+        keep[row] = 0;
+        nkeep--;
+      }
+    }
+  }
+
+  if (nkeep) {
+    for (i = 0; i < options->ncolumns; i++) {
+      dbc_column_t *column = &columns[options->columns[i] - 1];
+      if (!column->nrows &&
+          dbc_read_column(dbc, g, options->columns[i], column) == -1) {
+        exit(1);
+      }
+    }
+
+    uint64_t row;
+    for (row = 0; row < nrows; row++) {
+      if (!keep[row]) {
+        continue;
+      }
+
+      for (i = 0; i < options->ncolumns; i++) {
+        if ((i && writer_write(out, "\t", 1) == -1) ||
+            write_value(out, &columns[options->columns[i] - 1], row) == -1) {
+          break;
+        }
+      }
+      if (writer_write(out, "\n", 1) == -1) {
+        errno = out->error;
+        perror("write error");
+        exit(1);
+      }
+    }
+  }
+
+  for (i = 0; i < dbc->schema.ncols; i++) {
+    dbc_column_free(&columns[i]);
+    columns[i].nrows = 0;
+  }
+  free(keep);
+}
+
+// Parses a comma-separated list of column names.
+void
+parse_columns(const schema_t *schema, char *arg, options_t *options) {
+  options->columns = malloc(sizeof (int) * (strlen(arg) / 2 + 1));
+  options->ncolumns = 0;
+
+  char *saveptr;
+  char *name;
+  for (name = strtok_r(arg, ",", &saveptr); name;
+       name = strtok_r(NULL, ",", &saveptr)) {
+    column_t *column = get_column(schema, name);
+    if (!column) {
+      fprintf(stderr, "invalid column '%s'\n", name);
+      exit(1);
+    }
+    options->columns[options->ncolumns++] = column->index;
+  }
+
+  if (!options->ncolumns) {
+    fprintf(stderr, "no columns selected\n");
+    exit(1);
+  }
+}
+
+int
+main(int argc, char **argv) {
+  static struct option lopts[] = {
+    {"help", no_argument, NULL, 'h'},
+    {"columns", required_argument, NULL, 'c'},
+    {"range", required_argument, NULL, 'r'},
+    {NULL, 0, NULL, 0}
+  };
+  const char *sopts = "hc:r:";
+  int opt;
+
+  char *columns_arg = NULL;
+  char *range_args[MAX_RANGES];
+  int nranges = 0;
+
+  // Parse arguments.
+  while ((opt = getopt_long(argc, argv, sopts, lopts, NULL)) != -1) {
+    switch (opt) {
+      case 'c':
+        columns_arg = optarg;
+        break;
+      case 'r':
+        if (nranges == MAX_RANGES) {
+          fprintf(stderr, "too many ranges (max %d)\n", MAX_RANGES);
+          return 1;
+        }
+        range_args[nranges++] = optarg;
+        break;
+      default:
+        printf("Usage: %s [OPTIONS] PATH\n\n", argv[0]);
+        printf("-h | --help           print this text and exit\n");
+        printf("-c | --columns        comma-separated columns to output "
+               "(default all)\n");
+        printf("-r | --range          COLNAME:MIN:MAX, only output records "
+               "whose int or real\n");
+        printf("                      column is within MIN and MAX (can be "
+               "repeated)\n\n");
+        printf("Examples:\n\n");
+        printf("Output two columns of the records from a time period:\n");
+        printf("%s -c ts,sip -r ts:1420070400:1420156800 flows.dbc\n",
+               argv[0]);
+        return 0;
+    }
+  }
+
+  if (optind != argc - 1) {
+    fprintf(stderr, "a .dbc path is required\n");
+    return 1;
+  }
+
+  dbc_t dbc;
+  if (dbc_open(&dbc, argv[optind]) == -1) {
+    return 1;
+  }
+
+  options_t options;
+  int i;
+  if (columns_arg) {
+    parse_columns(&dbc.schema, columns_arg, &options);
+  } else {
+    options.ncolumns = dbc.schema.ncols;
+    options.columns = malloc(sizeof (int) * (options.ncolumns + 1));
+    for (i = 0; i < options.ncolumns; i++) {
+      options.columns[i] = i + 1;
+    }
+  }
+
+  options.nranges = nranges;
+  for (i = 0; i < nranges; i++) {
+    parse_range(&dbc.schema, range_args[i], &options.ranges[i]);
+  }
+
+  // Output the header of the selected columns.
+  printf("#db");
+  for (i = 0; i < options.ncolumns; i++) {
+    column_t *column;
+    for (column = dbc.schema.head; column->index != options.columns[i];
+         column = column->flink);
+    printf("\t%s:%s", column->name, column->type);
+  }
+  printf("\n");
+  fflush(stdout);
+
+  writer_t out;
+  writer_init(&out, STDOUT_FILENO, WRITER_BUFSIZE);
+
+  dbc_column_t *columns = calloc(dbc.schema.ncols, sizeof (dbc_column_t));
+  uint64_t g;
+  for (g = 0; g < dbc.ngroups; g++) {
+    dump_group(&options, &dbc, g, columns, &out);
+  }
+
+  if (writer_free(&out) == -1) {
+    errno = out.error;
+    perror("write error");
+    return 1;
+  }
+
+#ifdef DEBUG
+  free(columns);
+  free(options.columns);
+  dbc_close(&dbc);
+#endif
+
+  return 0;
+}
@@ -0,0 +1,214 @@
+// dbcut
+//
+// Copyright (c) 2015, Los Alamos National Security, LLC
+// All rights reserved.
+//
+// Copyright (2015). Los Alamos National Security, LLC. This software was
+// produced under U.S. Government contract DE-AC52-06NA25396 for Los Alamos
+// National Laboratory (LANL), which is operated by Los Alamos National
+// Security, LLC for the U.S. Department of Energy. The U.S. Government has
+// rights to use, reproduce, and distribute this software. NEITHER THE
+// GOVERNMENT NOR LOS ALAMOS NATIONAL SECURITY, LLC MAKES ANY WARRANTY, EXPRESS
+// OR IMPLIED, OR ASSUMES ANY LIABILITY FOR THE USE OF THIS SOFTWARE. If
+// software is modified to produce derivative works, such modified software
+// should be clearly marked, so as not to confuse it with the version available
+// from LANL.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//
+// Outputs selected columns of db data, in the specified order.
+//
+// Author: Curt Hash <chash@lanl.gov>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cdb.h"
+
+typedef struct {
+  int *columns;   // Index of each selected column.
+  int ncolumns;
+  int maxcolumn;  // Highest selected index; fields after it are not split.
+} projection_t;
+
+// Looks up a comma-separated list of column names.
+void
+parse_columns(const schema_t *schema, char *arg, projection_t *proj) {
+  proj->columns = malloc(sizeof (int) * (strlen(arg) / 2 + 1));
+  proj->ncolumns = 0;
+  proj->maxcolumn = 0;
+
+  char *saveptr;
+  char *name;
+  for (name = strtok_r(arg, ",", &saveptr); name;
+       name = strtok_r(NULL, ",", &saveptr)) {
+    column_t *column = get_column(schema, name);
+    if (!column) {
+      fprintf(stderr, "invalid column '%s'\n", name);
+      exit(1);
+    }
+
+    proj->columns[proj->ncolumns++] = column->index;
+    if (column->index > proj->maxcolumn) {
+      proj->maxcolumn = column->index;
+    }
+  }
+
+  if (!proj->ncolumns) {
+    fprintf(stderr, "no columns selected\n");
+    exit(1);
+  }
+}
+
+// Outputs the header of the selected columns.
+void
+print_header(const schema_t *schema, const projection_t *proj) {
+  printf("#db");
+
+  int i;
+  for (i = 0; i < proj->ncolumns; i++) {
+    column_t *column;
+    for (column = schema->head; column->index != proj->columns[i];
+         column = column->flink);
+    printf("\t%s:%s", column->name, column->type);
+  }
+
+  printf("\n");
+  fflush(stdout);
+}
+
+// Outputs the selected fields of each record. Missing fields are output as
+// empty.
+void
+cut(reader_t *reader, const projection_t *proj) {
+  batch_t batch;
+  batch_init(&batch, BATCH_SIZE, proj->maxcolumn);
+
+  writer_t out;
+  writer_init(&out, STDOUT_FILENO, WRITER_BUFSIZE);
+
+  size_t count;
+  while ((count = reader_batch(reader, &batch))) {
+    size_t r;
+    for (r = 0; r < count; r++) {
+      record_t *record = &batch.records[r];
+
+      int i;
+      for (i = 0; i < proj->ncolumns; i++) {
+        const field_t *field = record_field(record, proj->columns[i]);
+        if (i) {
+          writer_write(&out, "\t", 1);
+        }
+        if (field) {
+          writer_write(&out, field->ptr, field->len);
+        }
+      }
+
+      if (writer_write(&out, "\n", 1) == -1) {
+        errno = out.error;
+        perror("write error");
+        exit(1);
+      }
+    }
+  }
+
+  if (reader->error) {
+    errno = reader->error;
+    perror("read error");
+    exit(1);
+  }
+
+  if (writer_free(&out) == -1) {
+    errno = out.error;
+    perror("write error");
+    exit(1);
+  }
+
+#ifdef DEBUG
+  batch_free(&batch);
+#endif
+}
+
+int
+main(int argc, char **argv) {
+  static struct option lopts[] = {
+    {"help", no_argument, NULL, 'h'},
+    {"columns", required_argument, NULL, 'c'},
+    {NULL, 0, NULL, 0}
+  };
+  const char *sopts = "hc:";
+  int opt;
+
+  char *columns = NULL;
+
+  // Parse arguments.
+  while ((opt = getopt_long(argc, argv, sopts, lopts, NULL)) != -1) {
+    switch (opt) {
+      case 'c':
+        columns = optarg;
+        break;
+      default:
+        printf("Usage: %s [OPTIONS] -c COLNAME[,COLNAME]...\n\n", argv[0]);
+        printf("-h | --help           print this text and exit\n");
+        printf("-c | --columns        comma-separated columns to output, in "
+               "order\n\n");
+        printf("Reads db data from stdin.\n\n");
+        printf("Examples:\n\n");
+        printf("Output the source and destination address columns:\n");
+        printf("dbcat flows.db.gz | %s -c sip,dip\n", argv[0]);
+        return 0;
+    }
+  }
+
+  if (!columns) {
+    fprintf(stderr, "-c (--columns) is required\n");
+    return 1;
+  }
+
+  reader_t reader;
+  reader_init(&reader, STDIN_FILENO, READER_BUFSIZE);
+  posix_fadvise(STDIN_FILENO, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  char *header = reader_header(&reader);
+  schema_t schema;
+  if (!header || parse_header(header, &schema) != 0) {
+    fprintf(stderr, "error parsing #db header\n");
+    return 1;
+  }
+
+  projection_t proj;
+  parse_columns(&schema, columns, &proj);
+
+  print_header(&schema, &proj);
+  cut(&reader, &proj);
+
+#ifdef DEBUG
+  free(proj.columns);
+  free_schema(&schema);
+  free(header);
+  reader_free(&reader);
+#endif
+
+  return 0;
+}
@@ -39,7 +39,9 @@
 
 #include <errno.h>
 #include <getopt.h>
+#include <inttypes.h>
 #include <libgen.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -48,32 +50,94 @@
 #include "cdb.h"
 #include "netacl.h"
 
-#define BUFSIZE 16384
 #define MAX(a,b) (((a)>(b))?(a):(b))
 
 typedef struct {
   netacl_t **acls;
   int size;
+  const char **paths;           // ACL paths, by column.
+  const char *profile_path;     // Where to dump profiles, or NULL.
+  netacl_profile_t *profiles;   // Profiles, by column, if profiling.
+  netacl_router_t *routers;     // Compiled ACLs, by column.
+  const schema_t *schema;
 } acls_t;
 
+// Set by SIGUSR1 to request a profile dump.
+static volatile sig_atomic_t dump_requested = 0;
+
+static void
+request_dump(int signum) {
+  dump_requested = 1;
+}
+
+// Writes the ACL profiles to the profile path as a db stream.
+static void
+dump_profiles(const acls_t *acls) {
+  FILE *fp = fopen(acls->profile_path, "w");
+  if (!fp) {
+    perror("could not open profile output file");
+    return;
+  }
+
+  fprintf(fp, "#db\tacl:str\tcolumn:str\tmetric:str\tkey:str\tvalue:int\n");
+
+  const column_t *column;
+  for (column = acls->schema->head; column; column = column->flink) {
+    int c = column->index - 1;
+    if (c >= acls->size || !acls->acls[c]) {
+      continue;
+    }
+
+    const netacl_t *acl = acls->acls[c];
+    const netacl_profile_t *profile = &acls->profiles[c];
+    const char *path = acls->paths[c];
+
+    fprintf(fp, "%s\t%s\tlookups\t\t%" PRIu64 "\n", path, column->name,
+            profile->lookups);
+    fprintf(fp, "%s\t%s\tpassed\t\t%" PRIu64 "\n", path, column->name,
+            profile->passed);
+    fprintf(fp, "%s\t%s\tsampled\t\t%" PRIu64 "\n", path, column->name,
+            profile->sampled);
+
+    // Latency buckets are keyed by their exclusive upper bound in ns.
+    int i;
+    for (i = 0; i < NETACL_LATENCY_BUCKETS; i++) {
+      if (profile->latency[i]) {
+        fprintf(fp, "%s\t%s\tlatency_ns\t%" PRIu64 "\t%" PRIu64 "\n", path,
+                column->name, (uint64_t)1 << i, profile->latency[i]);
+      }
+    }
+
+    for (i = 0; i < acl->include.size; i++) {
+      char *rule = cidr_to_str(acl->include.cidrs[i], CIDR_NOFLAGS);
+      fprintf(fp, "%s\t%s\tinclude\t%s\t%" PRIu64 "\n", path, column->name,
+              rule, profile->include_hits[i]);
+      free(rule);
+    }
+
+    for (i = 0; i < acl->exclude.size; i++) {
+      char *rule = cidr_to_str(acl->exclude.cidrs[i], CIDR_NOFLAGS);
+      fprintf(fp, "%s\t%s\texclude\t%s\t%" PRIu64 "\n", path, column->name,
+              rule, profile->exclude_hits[i]);
+      free(rule);
+    }
+  }
+
+  if (fclose(fp) == EOF) {
+    perror("fclose() error");
+  }
+}
+
 // Apply the ACLs to the input data.
 void
-filter(acls_t *acls) {
-  size_t bufsize = BUFSIZE;
-  char *buf = malloc(bufsize);
-  size_t offset = 0;
-
-  while (fgets(buf + offset, bufsize - offset, stdin)) {
-    size_t len = strlen(buf);
-
-    if (buf[len - 1] == '\n') {
-      offset = 0;
-    } else {
-      // Grow the line buffer.
-      bufsize *= 2;
-      buf = realloc(buf, bufsize);
-      offset = len;
-      continue;
+filter(acls_t *acls, reader_t *reader) {
+  char *buf;
+  size_t len;
+
+  while ((buf = reader_next(reader, &len))) {
+    if (dump_requested) {
+      dump_requested = 0;
+      dump_profiles(acls);
     }
 
     size_t offset = 0;
@@ -95,7 +159,10 @@ filter(acls_t *acls) {
 
       // Check.
       netacl_t *acl = acls->acls[i];
-      if (acl && !netacl_pass(acl, token)) {
+      if (acl && !(acls->profiles ?
+                   netacl_router_pass_profile(&acls->routers[i], token,
+                                              &acls->profiles[i]) :
+                   netacl_router_pass(&acls->routers[i], token))) {
         pass = 0;
         break;
       }
@@ -106,13 +173,103 @@ filter(acls_t *acls) {
     }
 
     if (pass) {
-      printf("%s", buf);
+      fwrite(buf, 1, len, stdout);
     }
   }
 
-#ifdef DEBUG
-  free(buf);
-#endif
+  if (reader->error) {
+    errno = reader->error;
+    perror("read error");
+    exit(EXIT_FAILURE);
+  }
+}
+
+// Route the input data to the outputs of the ACLs that pass the address in the
+// column with the given index. If first is set, each record is written only
+// to the output of the first ACL that passes it. Records that pass no ACL are
+// written to fallback, if it is not NULL.
+void
+route(reader_t *reader, const netacl_router_t *router, int index,
+      FILE **outputs, FILE *fallback, char first) {
+  char *buf;
+  size_t len;
+  uint64_t *pass = malloc(sizeof (uint64_t) * router->words);
+
+  while ((buf = reader_next(reader, &len))) {
+    // Find the token.
+    char *token = buf;
+    int i;
+    for (i = 1; i < index; i++) {
+      token = strchr(token, '\t');
+      if (!token) {
+        break;
+      }
+      token++;
+    }
+
+    int count = 0;
+    if (token) {
+      size_t j = strcspn(token, "\t\n");
+      char repl = token[j];
+      token[j] = '\0';
+      count = netacl_route(router, token, pass);
+      token[j] = repl;
+    }
+
+    if (!count) {
+      if (fallback) {
+        fwrite(buf, 1, len, fallback);
+      }
+      continue;
+    }
+
+    uint32_t w;
+    if (first) {
+      // count is nonzero, so some word has a bit set.
+      for (w = 0; !pass[w]; w++);
+      fwrite(buf, 1, len, outputs[w * 64 + __builtin_ctzll(pass[w])]);
+      continue;
+    }
+
+    for (w = 0; w < router->words; w++) {
+      uint64_t bits = pass[w];
+      while (bits) {
+        fwrite(buf, 1, len, outputs[w * 64 + __builtin_ctzll(bits)]);
+        bits &= bits - 1;
+      }
+    }
+  }
+
+  free(pass);
+
+  if (reader->error) {
+    errno = reader->error;
+    perror("read error");
+    exit(EXIT_FAILURE);
+  }
+}
+
+// Opens an output file and writes the #db header to it.
+static FILE *
+open_output(const char *path, const char *header) {
+  FILE *fp = fopen(path, "w");
+  if (fp) {
+    fprintf(fp, "%s\n", header);
+  }
+
+  return fp;
+}
+
+// Loads an ACL, normalizing it if requested. Exits on error.
+static netacl_t *
+load_acl(const char *path, char normalize) {
+  netacl_t *acl = malloc(sizeof (netacl_t));
+  if (netacl_load(path, acl, normalize) != 0) {
+    fprintf(stderr, "could not initialize ACL from path '%s'\n", path);
+    exit(EXIT_FAILURE);
+  }
+
+  return acl;
 }
 
 // Prints an error message to stderr.
@@ -128,9 +285,26 @@ perr(char *prog, const char *fmt, ...) {
 // Prints usage and exits.
 void
 usage(char *prog, int status) {
-  printf("Usage: <data stream> | %s [OPTION]... [[COLUMN] [ACL PATH]]...\n\n",
+  printf("Usage: <data stream> | %s [OPTION]... [[COLUMN] [ACL PATH]]...\n",
          basename(prog));
+  printf("  or:  <data stream> | %s [OPTION]... -r COLUMN "
+         "[[ACL PATH] [OUTPUT PATH]]...\n\n", basename(prog));
   printf("  -h, --help                  Print this text and exit.\n");
+  printf("  -n, --normalize             Merge and drop redundant ACL rules "
+         "before\n"
+         "                              filtering and report the reduction.\n");
+  printf("  -p, --profile PATH          Count rule hits and lookup latency "
+         "and write\n"
+         "                              them to PATH as db data on exit or "
+         "SIGUSR1.\n");
+  printf("  -r, --route COLUMN          Write each record to the output of "
+         "every ACL\n"
+         "                              that passes the address in COLUMN.\n");
+  printf("  -1, --first                 With -r, write each record only to "
+         "the output\n"
+         "                              of the first ACL that passes it.\n");
+  printf("  -d, --default PATH          With -r, write records that pass no "
+         "ACL to PATH.\n");
   printf("\nACL PATH should contain a list of rules with the following "
          "syntax:\n\n");
   printf("  (+|-)CIDR\n\n");
@@ -145,15 +319,40 @@ main(int argc, char **argv) {
   // Parse options.
   static struct option long_options[] = {
     {"help", no_argument, NULL, 'h'},
+    {"normalize", no_argument, NULL, 'n'},
+    {"profile", required_argument, NULL, 'p'},
+    {"route", required_argument, NULL, 'r'},
+    {"first", no_argument, NULL, '1'},
+    {"default", required_argument, NULL, 'd'},
     {NULL, 0, NULL, 0}
   };
-  const char *options = "h";
+  const char *options = "hnp:r:1d:";
   char opt;
+  char *route_column = NULL;
+  char *default_path = NULL;
+  char *profile_path = NULL;
+  char first = 0;
+  char normalize = 0;
   while ((opt = getopt_long(argc, argv, options, long_options, NULL)) != -1) {
     switch (opt) {
       case 'h':
         usage(argv[0], EXIT_SUCCESS);
         break;
+      case 'n':
+        normalize = 1;
+        break;
+      case 'p':
+        profile_path = optarg;
+        break;
+      case 'r':
+        route_column = optarg;
+        break;
+      case '1':
+        first = 1;
+        break;
+      case 'd':
+        default_path = optarg;
+        break;
       default:
         perr(argv[0], "unrecognized option '%c'\n", opt);
         usage(argv[0], EXIT_FAILURE);
@@ -163,24 +362,103 @@ main(int argc, char **argv) {
 
   int nargs = argc - optind;
   if (nargs == 0 || nargs % 2 != 0) {
-    // Expected at least one column name, ACL path pair.
+    // Expected at least one column name, ACL path pair (or ACL path, output
+    // path pair in route mode).
     perr(argv[0], "missing required arguments\n");
     exit(EXIT_FAILURE);
   }
 
-  // Parse the input #db header and replay it.
-  char *header = read_header(stdin);
+  if (!route_column && (first || default_path)) {
+    perr(argv[0], "-1 (--first) and -d (--default) require -r (--route)\n");
+    exit(EXIT_FAILURE);
+  }
+
+  if (route_column && profile_path) {
+    perr(argv[0], "-p (--profile) may not be used with -r (--route)\n");
+    exit(EXIT_FAILURE);
+  }
+
+  // Parse the input #db header.
+  reader_t reader;
+  reader_init(&reader, STDIN_FILENO, READER_BUFSIZE);
+  char *header = reader_header(&reader);
   schema_t schema;
-  if (parse_header(header, &schema) != 0) {
+  if (!header || parse_header(header, &schema) != 0) {
     perr(argv[0], "error parsing #db header\n");
     exit(EXIT_FAILURE);
   }
-  printf("%s\n", header);
 
   int i;
 
+  if (route_column) {
+    column_t *column = get_column(&schema, route_column);
+    if (!column) {
+      fprintf(stderr, "column '%s' is not present\n", route_column);
+      exit(EXIT_FAILURE);
+    }
+
+    // Load the ACLs and open their outputs.
+    uint32_t nacls = nargs / 2;
+    const netacl_t **acls = malloc(sizeof (netacl_t *) * nacls);
+    FILE **outputs = malloc(sizeof (FILE *) * nacls);
+    for (i = 0; i < nacls; i++) {
+      char *acl_path = argv[optind + 2*i];
+      char *output_path = argv[optind + 2*i + 1];
+
+      acls[i] = load_acl(acl_path, normalize);
+
+      if (!(outputs[i] = open_output(output_path, header))) {
+        perror("could not open output file");
+        exit(EXIT_FAILURE);
+      }
+    }
+
+    FILE *fallback = NULL;
+    if (default_path && !(fallback = open_output(default_path, header))) {
+      perror("could not open output file");
+      exit(EXIT_FAILURE);
+    }
+
+    netacl_router_t router;
+    netacl_router_init(&router, acls, nacls);
+
+    route(&reader, &router, column->index, outputs, fallback, first);
+
+    for (i = 0; i < nacls; i++) {
+      if (fclose(outputs[i]) == EOF) {
+        perror("fclose() error");
+        exit(EXIT_FAILURE);
+      }
+    }
+
+    if (fallback && fclose(fallback) == EOF) {
+      perror("fclose() error");
+      exit(EXIT_FAILURE);
+    }
+
+#ifdef DEBUG
+    netacl_router_destroy(&router);
+    for (i = 0; i < nacls; i++) {
+      netacl_destroy((netacl_t *)acls[i]);
+      free((netacl_t *)acls[i]);
+    }
+    free(acls);
+    free(outputs);
+    free_schema(&schema);
+    free(header);
+    reader_free(&reader);
+#endif
+
+    return 0;
+  }
+
+  // Replay the header.
+  printf("%s\n", header);
+
   // Initialize ACLs.
-  acls_t acls = {calloc(sizeof (netacl_t *), schema.ncols), 0};
+  acls_t acls = {calloc(sizeof (netacl_t *), schema.ncols), 0,
+                 calloc(sizeof (char *), schema.ncols), profile_path, NULL,
+                 calloc(sizeof (netacl_router_t), schema.ncols), &schema};
   for (i = optind; i < argc; i += 2) {
     char *name = argv[i];
     char *acl_path = argv[i+1];
@@ -195,29 +473,49 @@ main(int argc, char **argv) {
     // can short circuit tokenization later.
     acls.size = MAX(column->index, acls.size);
 
-    int ret;
-    netacl_t *acl = malloc(sizeof (netacl_t));
-    if ((ret = netacl_from_path(acl_path, acl)) != 0) {
-      fprintf(stderr, "could not initialize ACL from path '%s'\n", acl_path);
-      exit(EXIT_FAILURE);
+    netacl_t *acl = load_acl(acl_path, normalize);
+    acls.acls[column->index - 1] = acl;
+    acls.paths[column->index - 1] = acl_path;
+    netacl_router_init(&acls.routers[column->index - 1],
+                       (const netacl_t **)&acl, 1);
+  }
+
+  if (profile_path) {
+    acls.profiles = calloc(sizeof (netacl_profile_t), schema.ncols);
+    for (i = 0; i < acls.size; i++) {
+      if (acls.acls[i]) {
+        netacl_profile_init(&acls.profiles[i], acls.acls[i]);
+      }
     }
 
-    acls.acls[column->index - 1] = acl;
+    signal(SIGUSR1, request_dump);
   }
 
   // Apply the ACLs to the input data.
-  filter(&acls);
+  filter(&acls, &reader);
+
+  if (profile_path) {
+    dump_profiles(&acls);
+  }
 
 #ifdef DEBUG
   // Free things.
   for (i = 0; i < acls.size; i++) {
     if (acls.acls[i]) {
       netacl_destroy(acls.acls[i]);
+      netacl_router_destroy(&acls.routers[i]);
+      if (acls.profiles) {
+        netacl_profile_free(&acls.profiles[i]);
+      }
     }
   }
   free(acls.acls);
+  free(acls.paths);
+  free(acls.profiles);
+  free(acls.routers);
   free_schema(&schema);
   free(header);
+  reader_free(&reader);
 #endif
 
   return 0;
@@ -0,0 +1,649 @@
+// dbfilter-set
+//
+// Copyright (c) 2015, Los Alamos National Security, LLC
+// All rights reserved.
+//
+// Copyright (2015). Los Alamos National Security, LLC. This software was
+// produced under U.S. Government contract DE-AC52-06NA25396 for Los Alamos
+// National Laboratory (LANL), which is operated by Los Alamos National
+// Security, LLC for the U.S. Department of Energy. The U.S. Government has
+// rights to use, reproduce, and distribute this software. NEITHER THE
+// GOVERNMENT NOR LOS ALAMOS NATIONAL SECURITY, LLC MAKES ANY WARRANTY, EXPRESS
+// OR IMPLIED, OR ASSUMES ANY LIABILITY FOR THE USE OF THIS SOFTWARE. If
+// software is modified to produce derivative works, such modified software
+// should be clearly marked, so as not to confuse it with the version available
+// from LANL.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//
+// Filter db data records by membership of column values in sets of exact
+// values.
+//
+// Author: Curt Hash <chash@lanl.gov>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <libgen.h>
+#include <math.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cdb.h"
+
+#define BUFSIZE 16384
+#define MAX(a,b) (((a)>(b))?(a):(b))
+
+#define SET_MAGIC "#dbset1"
+#define BLOOM_BITS_PER_VALUE 10
+#define BLOOM_K 7
+#define TAG_SHIFT 48
+#define OFFSET_MASK ((1ULL << TAG_SHIFT) - 1)
+
+// A set image. Sets are laid out identically in memory and on disk (in host
+// byte order), so that compiled sets can be used straight from mmap():
+//
+//   set_header_t
+//   bloom:  bloom_blocks * 8 uint64_t words (a blocked Bloom filter)
+//   slots:  nslots uint64_t (hash tag << 48 | pool offset + 1), 0 if empty
+//   pool:   values, each a uint32_t length followed by the bytes
+typedef struct {
+  char magic[8];
+  uint64_t nvalues;
+  uint64_t nslots;        // Power of 2.
+  uint64_t bloom_blocks;  // Power of 2, or 0 if there is no Bloom filter.
+  uint64_t pool_size;
+  uint64_t reserved[3];
+} set_header_t;
+
+typedef struct {
+  const set_header_t *header;
+  const uint64_t *bloom;
+  const uint64_t *slots;
+  const char *pool;
+  size_t size;
+  char mapped;
+} set_t;
+
+typedef struct {
+  set_t **sets;
+  int size;
+  char invert;
+} sets_t;
+
+// Returns a 64-bit hash of a byte string.
+static inline uint64_t
+hash_bytes(const char *s, size_t len) {
+  const uint64_t m = 0xc6a4a7935bd1e995ULL;
+  uint64_t h = 0x9e3779b97f4a7c15ULL ^ (len * m);
+  uint64_t k;
+
+  while (len >= 8) {
+    memcpy(&k, s, 8);
+    k *= m;
+    k ^= k >> 47;
+    h = (h ^ k * m) * m;
+    s += 8;
+    len -= 8;
+  }
+
+  if (len) {
+    k = 0;
+    memcpy(&k, s, len);
+    h = (h ^ k) * m;
+  }
+
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+
+  return h;
+}
+
+// Returns the Bloom filter bit for the i'th probe of a hash, within its block
+// of 512 bits. The low bits of the hash choose the block, so each probe takes
+// its own 9 bits of a remix of the high half (BLOOM_K * 9 <= 64).
+static inline uint32_t
+bloom_bit(uint64_t h, int i) {
+  uint64_t g = (h >> 32 | h << 32) * 0x9e3779b97f4a7c15ULL;
+  return (g >> (9 * i)) & 511;
+}
+
+// Returns the number of bytes in a set image.
+static size_t
+set_image_size(uint64_t nslots, uint64_t bloom_blocks, uint64_t pool_size) {
+  return sizeof (set_header_t) + bloom_blocks * 64 + nslots * 8 + pool_size;
+}
+
+// Points the set's sections into its image.
+static void
+set_attach(set_t *set, const void *image, size_t size) {
+  set->header = image;
+  set->bloom = (const uint64_t *)(set->header + 1);
+  set->slots = set->bloom + set->header->bloom_blocks * 8;
+  set->pool = (const char *)(set->slots + set->header->nslots);
+  set->size = size;
+}
+
+// Returns 1 if the value is in the set.
+static inline int
+set_contains(const set_t *set, const char *value, size_t len) {
+  const set_header_t *header = set->header;
+  uint64_t h = hash_bytes(value, len);
+
+  if (header->bloom_blocks) {
+    const uint64_t *block = set->bloom +
+                            (h & (header->bloom_blocks - 1)) * 8;
+    int i;
+    for (i = 0; i < BLOOM_K; i++) {
+      uint32_t bit = bloom_bit(h, i);
+      if (!(block[bit / 64] & (1ULL << (bit % 64)))) {
+        return 0;
+      }
+    }
+  }
+
+  uint64_t mask = header->nslots - 1;
+  uint64_t tag = h >> TAG_SHIFT;
+  uint64_t i = (h >> 16) & mask;
+  for (;;) {
+    uint64_t slot = set->slots[i];
+    if (!slot) {
+      return 0;
+    }
+
+    if (slot >> TAG_SHIFT == tag) {
+      const char *entry = set->pool + (slot & OFFSET_MASK) - 1;
+      uint32_t entry_len;
+      memcpy(&entry_len, entry, sizeof (uint32_t));
+      if (entry_len == len && memcmp(entry + sizeof (uint32_t), value,
+                                     len) == 0) {
+        return 1;
+      }
+    }
+
+    i = (i + 1) & mask;
+  }
+}
+
+#ifdef DEBUG
+// Prints the Bloom filter's false positive rate, measured with values that
+// can't be in the set, and warns if it is well above what a Bloom filter of
+// its size should give.
+static void
+set_check_bloom(const set_t *set) {
+  const set_header_t *header = set->header;
+  const uint64_t nprobes = 1000000;
+  uint64_t positives = 0;
+  char value[32];
+  uint64_t n;
+
+  for (n = 0; n < nprobes; n++) {
+    // Values never contain newlines.
+    int len = sprintf(value, "\n%lu", n);
+    uint64_t h = hash_bytes(value, len);
+    const uint64_t *block = set->bloom + (h & (header->bloom_blocks - 1)) * 8;
+    int i;
+    for (i = 0; i < BLOOM_K; i++) {
+      uint32_t bit = bloom_bit(h, i);
+      if (!(block[bit / 64] & (1ULL << (bit % 64)))) {
+        break;
+      }
+    }
+    positives += i == BLOOM_K;
+  }
+
+  // The expected rate of a blocked filter averages that of a 512-bit filter
+  // over the Poisson distribution of values per block.
+  double load = (double)header->nvalues / header->bloom_blocks;
+  double p = exp(-load);
+  double expected = 0;
+  int j;
+  for (j = 0; j < load * 4 + 64; j++) {
+    expected += p * pow(1 - pow(1 - 1.0 / 512, BLOOM_K * j), BLOOM_K);
+    p *= load / (j + 1);
+  }
+
+  double rate = (double)positives / nprobes;
+  fprintf(stderr, "dbfilter-set: bloom false positive rate %.4f%% "
+          "(expected %.4f%%)\n", rate * 100, expected * 100);
+  if (rate > expected * 2 + 0.0001) {
+    fprintf(stderr, "dbfilter-set: warning: bloom false positive rate is too "
+            "high\n");
+  }
+}
+#endif
+
+// Builds a set image from a file of values, one per line. Blank lines are
+// ignored. Returns 0 if successful.
+static int
+set_build(const char *path, char bloom, set_t *set) {
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    return errno;
+  }
+
+  // Slurp the value file.
+  size_t size = 0;
+  size_t capacity = BUFSIZE;
+  char *data = malloc(capacity);
+  ssize_t bytes;
+  while ((bytes = read(fd, data + size, capacity - size)) > 0) {
+    size += bytes;
+    if (size == capacity) {
+      capacity *= 2;
+      data = realloc(data, capacity);
+    }
+  }
+  close(fd);
+  if (bytes == -1) {
+    free(data);
+    return errno;
+  }
+
+  // Count the values to size the table at a load factor of at most 1/2.
+  uint64_t nlines = 0;
+  size_t i;
+  for (i = 0; i < size; i++) {
+    nlines += data[i] == '\n';
+  }
+  nlines++;
+
+  uint64_t nslots = 16;
+  while (nslots < nlines * 2) {
+    nslots *= 2;
+  }
+
+  uint64_t bloom_blocks = 0;
+  if (bloom) {
+    bloom_blocks = 1;
+    while (bloom_blocks * 512 < nlines * BLOOM_BITS_PER_VALUE) {
+      bloom_blocks *= 2;
+    }
+  }
+
+  // The pool can't be bigger than the file plus a length per line.
+  uint64_t pool_capacity = size + nlines * sizeof (uint32_t);
+  char *image = calloc(1, set_image_size(nslots, bloom_blocks, pool_capacity));
+  set_header_t *header = (set_header_t *)image;
+  memcpy(header->magic, SET_MAGIC, sizeof (header->magic));
+  header->nslots = nslots;
+  header->bloom_blocks = bloom_blocks;
+
+  uint64_t *bloom_words = (uint64_t *)(header + 1);
+  uint64_t *slots = bloom_words + bloom_blocks * 8;
+  char *pool = (char *)(slots + nslots);
+
+  const char *line = data;
+  const char *end = data + size;
+  while (line < end) {
+    const char *nl = memchr(line, '\n', end - line);
+    if (!nl) {
+      nl = end;
+    }
+    size_t len = nl - line;
+    const char *value = line;
+    line = nl + 1;
+
+    if (!len) {
+      continue;
+    }
+
+    uint64_t h = hash_bytes(value, len);
+    uint64_t tag = h >> TAG_SHIFT;
+    uint64_t mask = nslots - 1;
+    uint64_t j = (h >> 16) & mask;
+    int duplicate = 0;
+    while (slots[j]) {
+      if (slots[j] >> TAG_SHIFT == tag) {
+        const char *entry = pool + (slots[j] & OFFSET_MASK) - 1;
+        uint32_t entry_len;
+        memcpy(&entry_len, entry, sizeof (uint32_t));
+        if (entry_len == len &&
+            memcmp(entry + sizeof (uint32_t), value, len) == 0) {
+          duplicate = 1;
+          break;
+        }
+      }
+      j = (j + 1) & mask;
+    }
+
+    if (duplicate) {
+      continue;
+    }
+
+    uint32_t entry_len = len;
+    memcpy(pool + header->pool_size, &entry_len, sizeof (uint32_t));
+    memcpy(pool + header->pool_size + sizeof (uint32_t), value, len);
+    slots[j] = tag << TAG_SHIFT | (header->pool_size + 1);
+    header->pool_size += sizeof (uint32_t) + len;
+    header->nvalues++;
+
+    if (bloom_blocks) {
+      uint64_t *block = bloom_words + (h & (bloom_blocks - 1)) * 8;
+      int k;
+      for (k = 0; k < BLOOM_K; k++) {
+        uint32_t bit = bloom_bit(h, k);
+        block[bit / 64] |= 1ULL << (bit % 64);
+      }
+    }
+  }
+
+  free(data);
+
+  set_attach(set, image, set_image_size(nslots, bloom_blocks,
+                                        header->pool_size));
+  set->mapped = 0;
+
+#ifdef DEBUG
+  fprintf(stderr, "dbfilter-set: %lu values, %lu slots, %lu bloom blocks\n",
+          header->nvalues, nslots, bloom_blocks);
+  if (bloom_blocks) {
+    set_check_bloom(set);
+  }
+#endif
+
+  return 0;
+}
+
+// Loads a set from a path. Compiled sets are mapped into memory; anything
+// else is read as a file of values. Returns 0 if successful.
+static int
+set_load(const char *path, char bloom, set_t *set) {
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    return errno;
+  }
+
+  struct stat st;
+  char magic[sizeof (SET_MAGIC)] = {0};
+  if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) ||
+      st.st_size < sizeof (set_header_t) ||
+      read(fd, magic, sizeof (magic)) != sizeof (magic) ||
+      memcmp(magic, SET_MAGIC, sizeof (magic)) != 0) {
+    close(fd);
+    return set_build(path, bloom, set);
+  }
+
+  void *image = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (image == MAP_FAILED) {
+    return errno;
+  }
+
+  const set_header_t *header = image;
+  if (set_image_size(header->nslots, header->bloom_blocks, header->pool_size) !=
+      st.st_size) {
+    munmap(image, st.st_size);
+    return EINVAL;
+  }
+
+  set_attach(set, image, st.st_size);
+  set->mapped = 1;
+
+  return 0;
+}
+
+// Frees a set.
+static void
+set_free(set_t *set) {
+  if (set->mapped) {
+    munmap((void *)set->header, set->size);
+  } else {
+    free((void *)set->header);
+  }
+}
+
+// Writes a set image to a path.
+static int
+set_write(const set_t *set, const char *path) {
+  FILE *fp = fopen(path, "w");
+  if (!fp) {
+    return errno;
+  }
+
+  if (fwrite(set->header, 1, set->size, fp) != set->size) {
+    fclose(fp);
+    return EIO;
+  }
+
+  return fclose(fp) == EOF ? errno : 0;
+}
+
+// Apply the sets to the input data.
+void
+filter(sets_t *sets, reader_t *reader) {
+  batch_t batch;
+  batch_init(&batch, BATCH_SIZE, sets->size);
+
+  writer_t out;
+  writer_init(&out, STDOUT_FILENO, WRITER_BUFSIZE);
+  fflush(stdout);
+
+  size_t count;
+  while ((count = reader_batch(reader, &batch))) {
+    size_t r;
+    for (r = 0; r < count; r++) {
+      record_t *record = &batch.records[r];
+
+      int i;
+      int pass = 1;
+      for (i = 0; i < sets->size; i++) {
+        set_t *set = sets->sets[i];
+        if (!set) {
+          continue;
+        }
+
+        // Missing trailing columns are tested as empty values.
+        const field_t *field = record_field(record, i + 1);
+        if (set_contains(set, field ? field->ptr : "", field ? field->len : 0)
+            == sets->invert) {
+          pass = 0;
+          break;
+        }
+      }
+
+      if (pass && writer_write(&out, record->line, record->len) == -1) {
+        break;
+      }
+    }
+  }
+
+  if (reader->error) {
+    errno = reader->error;
+    perror("read error");
+    exit(EXIT_FAILURE);
+  }
+
+  if (writer_free(&out) == -1) {
+    errno = out.error;
+    perror("write error");
+    exit(EXIT_FAILURE);
+  }
+
+#ifdef DEBUG
+  batch_free(&batch);
+#endif
+}
+
+// Prints an error message to stderr.
+static void
+perr(char *prog, const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  fprintf(stderr, "%s error: ", basename(prog));
+  vfprintf(stderr, fmt, ap);
+  va_end(ap);
+}
+
+// Prints usage and exits.
+void
+usage(char *prog, int status) {
+  printf("Usage: <data stream> | %s [OPTION]... [[COLUMN] [SET PATH]]...\n",
+         basename(prog));
+  printf("  or:  %s [OPTION]... -c VALUE PATH OUTPUT PATH\n\n",
+         basename(prog));
+  printf("  -h, --help                  Print this text and exit.\n");
+  printf("  -b, --bloom                 Check a Bloom filter before the hash "
+         "table.\n");
+  printf("  -c, --compile               Compile a value file into a set file "
+         "and exit.\n");
+  printf("  -v, --invert                Pass records whose values are not in "
+         "the sets.\n");
+  printf("\nSET PATH is either a set file written by -c or a file of values, "
+         "one per\nline. Blank lines are ignored.\n");
+
+  exit(status);
+}
+
+int
+main(int argc, char **argv) {
+  // Parse options.
+  static struct option long_options[] = {
+    {"help", no_argument, NULL, 'h'},
+    {"bloom", no_argument, NULL, 'b'},
+    {"compile", no_argument, NULL, 'c'},
+    {"invert", no_argument, NULL, 'v'},
+    {NULL, 0, NULL, 0}
+  };
+  const char *options = "hbcv";
+  char opt;
+  char bloom = 0;
+  char compile = 0;
+  char invert = 0;
+  while ((opt = getopt_long(argc, argv, options, long_options, NULL)) != -1) {
+    switch (opt) {
+      case 'h':
+        usage(argv[0], EXIT_SUCCESS);
+        break;
+      case 'b':
+        bloom = 1;
+        break;
+      case 'c':
+        compile = 1;
+        break;
+      case 'v':
+        invert = 1;
+        break;
+      default:
+        perr(argv[0], "unrecognized option '%c'\n", opt);
+        usage(argv[0], EXIT_FAILURE);
+        break;
+    }
+  }
+
+  int nargs = argc - optind;
+  int ret;
+
+  if (compile) {
+    if (nargs != 2) {
+      perr(argv[0], "expected VALUE PATH and OUTPUT PATH\n");
+      exit(EXIT_FAILURE);
+    }
+
+    set_t set;
+    if ((ret = set_build(argv[optind], bloom, &set)) != 0) {
+      perr(argv[0], "could not read values from '%s': %s\n", argv[optind],
+           strerror(ret));
+      exit(EXIT_FAILURE);
+    }
+
+    if ((ret = set_write(&set, argv[optind+1])) != 0) {
+      perr(argv[0], "could not write set to '%s': %s\n", argv[optind+1],
+           strerror(ret));
+      exit(EXIT_FAILURE);
+    }
+
+    set_free(&set);
+
+    return 0;
+  }
+
+  if (nargs == 0 || nargs % 2 != 0) {
+    // Expected at least one column name, set path pair.
+    perr(argv[0], "missing required arguments\n");
+    exit(EXIT_FAILURE);
+  }
+
+  // Parse the input #db header and replay it.
+  reader_t reader;
+  reader_init(&reader, STDIN_FILENO, READER_BUFSIZE);
+  char *header = reader_header(&reader);
+  schema_t schema;
+  if (!header || parse_header(header, &schema) != 0) {
+    perr(argv[0], "error parsing #db header\n");
+    exit(EXIT_FAILURE);
+  }
+  printf("%s\n", header);
+
+  int i;
+
+  // Initialize sets.
+  sets_t sets = {calloc(sizeof (set_t *), schema.ncols), 0, invert};
+  for (i = optind; i < argc; i += 2) {
+    char *name = argv[i];
+    char *set_path = argv[i+1];
+
+    column_t *column = get_column(&schema, name);
+    if (!column) {
+      fprintf(stderr, "column '%s' is not present\n", name);
+      exit(EXIT_FAILURE);
+    }
+
+    // Determine the maximum column index for which a set exists, so that we
+    // can short circuit tokenization later.
+    sets.size = MAX(column->index, sets.size);
+
+    set_t *set = malloc(sizeof (set_t));
+    if ((ret = set_load(set_path, bloom, set)) != 0) {
+      fprintf(stderr, "could not initialize set from path '%s': %s\n",
+              set_path, strerror(ret));
+      exit(EXIT_FAILURE);
+    }
+
+    sets.sets[column->index - 1] = set;
+  }
+
+  // Apply the sets to the input data.
+  filter(&sets, &reader);
+
+#ifdef DEBUG
+  // Free things.
+  for (i = 0; i < sets.size; i++) {
+    if (sets.sets[i]) {
+      set_free(sets.sets[i]);
+      free(sets.sets[i]);
+    }
+  }
+  free(sets.sets);
+  free_schema(&schema);
+  free(header);
+  reader_free(&reader);
+#endif
+
+  return 0;
+}
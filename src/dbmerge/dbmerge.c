@@ -0,0 +1,420 @@
+// dbmerge
+//
+// Copyright (c) 2015, Los Alamos National Security, LLC
+// All rights reserved.
+//
+// Copyright (2015). Los Alamos National Security, LLC. This software was
+// produced under U.S. Government contract DE-AC52-06NA25396 for Los Alamos
+// National Laboratory (LANL), which is operated by Los Alamos National
+// Security, LLC for the U.S. Department of Energy. The U.S. Government has
+// rights to use, reproduce, and distribute this software. NEITHER THE
+// GOVERNMENT NOR LOS ALAMOS NATIONAL SECURITY, LLC MAKES ANY WARRANTY, EXPRESS
+// OR IMPLIED, OR ASSUMES ANY LIABILITY FOR THE USE OF THIS SOFTWARE. If
+// software is modified to produce derivative works, such modified software
+// should be clearly marked, so as not to confuse it with the version available
+// from LANL.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//
+// Merges db data files that are already sorted on a key column into a single
+// sorted stream.
+//
+// Author: Curt Hash <chash@lanl.gov>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cdb.h"
+
+#define BUFSIZE 1048576
+
+typedef enum {
+  KEY_STR,
+  KEY_INT,
+  KEY_REAL
+} key_type_t;
+
+typedef struct {
+  const char *key;
+  size_t buffer_size;
+  char reverse;
+} options_t;
+
+// A key value. Only the member for the key column's type is set.
+typedef struct {
+  int64_t i;
+  double d;
+  const char *str;
+  size_t len;
+} value_t;
+
+// An input file and its current record.
+typedef struct {
+  const char *path;
+  int fd;
+  int index;          // Position on the command line; breaks ties.
+  reader_t reader;
+  char *record;       // Current record, in the reader's buffer.
+  size_t len;         // Length of the current record, including the newline.
+  unsigned long line;
+  value_t value;      // Key value of the current record.
+  value_t prev;       // Key value of the previous record.
+  char *prevbuf;      // Copy of the previous str key value.
+  size_t prevcap;
+  unsigned long malformed;  // Key values that are not numbers.
+} input_t;
+
+typedef struct {
+  int column;         // Index of the key column in each record.
+  key_type_t type;
+  char reverse;
+} sort_key_t;
+
+// Advances to the next record. Returns 0 at the end of the input.
+int
+next_record(input_t *in) {
+  in->record = reader_next(&in->reader, &in->len);
+  if (!in->record) {
+    if (in->reader.error) {
+      errno = in->reader.error;
+      perror(in->path);
+      exit(1);
+    }
+    return 0;
+  }
+
+  in->line++;
+
+  return 1;
+}
+
+// Parses the key value of the current record.
+void
+parse_key(input_t *in, const sort_key_t *key) {
+  char *p = in->record;
+  char *end = p + in->len - 1;
+
+  int i;
+  for (i=1; i<key->column && p; i++) {
+    p = memchr(p, '\t', end - p);
+    if (p) {
+      p++;
+    }
+  }
+
+  if (!p) {
+    // Missing column.
+    p = end;
+  }
+
+  char *tab = memchr(p, '\t', end - p);
+  size_t len = (tab ? tab : end) - p;
+
+  // Malformed numbers are compared as 0.
+  switch (key->type) {
+    case KEY_INT:
+      if (parse_int64(p, len, &in->value.i) == -1) {
+        in->value.i = 0;
+        in->malformed++;
+      }
+      break;
+    case KEY_REAL:
+      if (parse_double(p, len, &in->value.d) == -1) {
+        in->value.d = 0;
+        in->malformed++;
+      }
+      break;
+    default:
+      in->value.str = p;
+      in->value.len = len;
+      break;
+  }
+}
+
+// Compares two key values.
+int
+cmp_value(const value_t *a, const value_t *b, const sort_key_t *key) {
+  int c = 0;
+
+  switch (key->type) {
+    case KEY_INT:
+      c = (a->i > b->i) - (a->i < b->i);
+      break;
+    case KEY_REAL:
+      c = (a->d > b->d) - (a->d < b->d);
+      break;
+    default:
+      c = memcmp(a->str, b->str, a->len < b->len ? a->len : b->len);
+      if (c == 0) {
+        c = (a->len > b->len) - (a->len < b->len);
+      }
+      break;
+  }
+
+  return key->reverse ? -c : c;
+}
+
+// Heap order. Equal keys come out in command line order, so the merge is
+// stable.
+static inline int
+before(const input_t *a, const input_t *b, const sort_key_t *key) {
+  int c = cmp_value(&a->value, &b->value, key);
+  return c < 0 || (c == 0 && a->index < b->index);
+}
+
+// Restores the heap property below position i.
+void
+sift_down(input_t **heap, int n, int i, const sort_key_t *key) {
+  input_t *in = heap[i];
+
+  for (;;) {
+    int child = 2 * i + 1;
+    if (child >= n) {
+      break;
+    }
+    if (child + 1 < n && before(heap[child+1], heap[child], key)) {
+      child++;
+    }
+    if (!before(heap[child], in, key)) {
+      break;
+    }
+    heap[i] = heap[child];
+    i = child;
+  }
+
+  heap[i] = in;
+}
+
+// Reads the next record of an input and checks that the input is sorted.
+// Returns 0 at the end of the input.
+int
+advance(input_t *in, const sort_key_t *key, const char *keyname) {
+  char first = in->line == 1;
+
+  // Save the current key value. A str value has to be copied, because the
+  // record may move when the buffer is refilled.
+  in->prev = in->value;
+  if (key->type == KEY_STR && !first) {
+    if (in->prevcap < in->value.len) {
+      in->prevcap = in->value.len;
+      in->prevbuf = realloc(in->prevbuf, in->prevcap);
+    }
+    memcpy(in->prevbuf, in->value.str, in->value.len);
+    in->prev.str = in->prevbuf;
+  }
+
+  if (!next_record(in)) {
+    return 0;
+  }
+
+  parse_key(in, key);
+
+  if (!first && cmp_value(&in->value, &in->prev, key) < 0) {
+    fprintf(stderr, "%s: line %lu is out of order on '%s'\n", in->path,
+            in->line, keyname);
+    exit(1);
+  }
+
+  return 1;
+}
+
+// Merges the inputs to stdout.
+void
+merge(options_t *options, char **paths, int npaths) {
+  input_t *inputs = calloc(npaths, sizeof (input_t));
+  input_t **heap = malloc(sizeof (input_t *) * npaths);
+  char *header = NULL;
+  sort_key_t key;
+  int n = 0;
+
+  int i;
+  for (i=0; i<npaths; i++) {
+    input_t *in = &inputs[i];
+    in->path = paths[i];
+    in->index = i;
+
+    if (strcmp(paths[i], "-") == 0) {
+      in->path = "stdin";
+      in->fd = STDIN_FILENO;
+    } else {
+      in->fd = open(paths[i], O_RDONLY);
+      if (in->fd == -1) {
+        perror(paths[i]);
+        exit(1);
+      }
+    }
+    posix_fadvise(in->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    reader_init(&in->reader, in->fd, options->buffer_size);
+    char *h = reader_header(&in->reader);
+    in->line = 1;
+    if (!h) {
+      fprintf(stderr, "%s: missing header\n", in->path);
+      exit(1);
+    }
+
+    if (!header) {
+      // The first header determines the key column for all of the inputs.
+      schema_t schema;
+      if (parse_header(h, &schema) != 0) {
+        fprintf(stderr, "%s: invalid header\n", in->path);
+        exit(1);
+      }
+
+      column_t *column = get_column(&schema, options->key);
+      if (!column) {
+        fprintf(stderr, "invalid key column '%s'\n", options->key);
+        exit(1);
+      }
+
+      key.column = column->index;
+      key.reverse = options->reverse;
+      if (strcmp(column->type, "int") == 0) {
+        key.type = KEY_INT;
+      } else if (strcmp(column->type, "real") == 0) {
+        key.type = KEY_REAL;
+      } else {
+        key.type = KEY_STR;
+      }
+
+      free_schema(&schema);
+
+      header = h;
+      printf("%s\n", header);
+    } else {
+      if (strcmp(h, header) != 0) {
+        fprintf(stderr, "%s: header differs from %s\n", in->path,
+                inputs[0].path);
+        exit(1);
+      }
+      free(h);
+    }
+
+    if (advance(in, &key, options->key)) {
+      heap[n++] = in;
+    }
+  }
+
+  for (i=n/2-1; i>=0; i--) {
+    sift_down(heap, n, i, &key);
+  }
+
+  // Output the smallest record and replace it with the next record from the
+  // same input.
+  while (n) {
+    input_t *in = heap[0];
+    fwrite(in->record, 1, in->len, stdout);
+
+    if (!advance(in, &key, options->key)) {
+      heap[0] = heap[--n];
+    }
+    sift_down(heap, n, 0, &key);
+  }
+
+  if (fflush(stdout) == EOF) {
+    perror("stdout");
+    exit(1);
+  }
+
+  for (i=0; i<npaths; i++) {
+    if (inputs[i].malformed) {
+      fprintf(stderr, "%s: %lu malformed '%s' values compared as 0\n",
+              inputs[i].path, inputs[i].malformed, options->key);
+    }
+  }
+
+#ifdef DEBUG
+  for (i=0; i<npaths; i++) {
+    close(inputs[i].fd);
+    reader_free(&inputs[i].reader);
+    free(inputs[i].prevbuf);
+  }
+  free(inputs);
+  free(heap);
+  free(header);
+#endif
+}
+
+int
+main(int argc, char **argv) {
+  static struct option lopts[] = {
+    {"help", no_argument, NULL, 'h'},
+    {"key", required_argument, NULL, 'k'},
+    {"reverse", no_argument, NULL, 'r'},
+    {"buffer-size", required_argument, NULL, 'b'},
+    {NULL, 0, NULL, 0}
+  };
+  const char *sopts = "hk:rb:";
+  int opt;
+
+  options_t options = {NULL, BUFSIZE, 0};
+
+  // Parse arguments.
+  while ((opt = getopt_long(argc, argv, sopts, lopts, NULL)) != -1) {
+    switch (opt) {
+      case 'k':
+        options.key = optarg;
+        break;
+      case 'r':
+        options.reverse = 1;
+        break;
+      case 'b':
+        options.buffer_size = strtoul(optarg, NULL, 10);
+        if (options.buffer_size < 2) {
+          fprintf(stderr, "invalid buffer size '%s'\n", optarg);
+          return 1;
+        }
+        break;
+      default:
+        printf("Usage: %s [OPTIONS] -k COLNAME FILE...\n\n", argv[0]);
+        printf("-h | --help           print this text and exit\n");
+        printf("-k | --key            column the inputs are sorted on\n");
+        printf("-r | --reverse        the inputs are sorted in descending "
+               "order\n");
+        printf("-b | --buffer-size    read buffer size per input (default "
+               "%d)\n\n", BUFSIZE);
+        printf("Examples:\n\n");
+        printf("Merge per-sensor files sorted on 'ts':\n");
+        printf("%s -k ts sensor1.db sensor2.db sensor3.db\n", argv[0]);
+        return 0;
+    }
+  }
+
+  if (!options.key) {
+    fprintf(stderr, "-k (--key) is required\n");
+    return 1;
+  }
+
+  if (optind == argc) {
+    fprintf(stderr, "no input files\n");
+    return 1;
+  }
+
+  // Output is written in large blocks.
+  setvbuf(stdout, NULL, _IOFBF, BUFSIZE);
+
+  merge(&options, argv + optind, argc - optind);
+
+  return 0;
+}
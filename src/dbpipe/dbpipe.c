@@ -0,0 +1,579 @@
+// dbpipe
+//
+// Copyright (c) 2015, Los Alamos National Security, LLC
+// All rights reserved.
+//
+// Copyright (2015). Los Alamos National Security, LLC. This software was
+// produced under U.S. Government contract DE-AC52-06NA25396 for Los Alamos
+// National Laboratory (LANL), which is operated by Los Alamos National
+// Security, LLC for the U.S. Department of Energy. The U.S. Government has
+// rights to use, reproduce, and distribute this software. NEITHER THE
+// GOVERNMENT NOR LOS ALAMOS NATIONAL SECURITY, LLC MAKES ANY WARRANTY, EXPRESS
+// OR IMPLIED, OR ASSUMES ANY LIABILITY FOR THE USE OF THIS SOFTWARE. If
+// software is modified to produce derivative works, such modified software
+// should be clearly marked, so as not to confuse it with the version available
+// from LANL.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//
+// Runs a pipeline of db tools, fusing the stages that it implements natively
+// into a single process that reads and splits each record once.
+//
+// Author: Curt Hash <chash@lanl.gov>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <libgen.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "cdb.h"
+#include "netacl.h"
+
+#define MAX_ADDR 64
+
+typedef enum {
+  STAGE_EXEC,   // Run as a subprocess.
+  STAGE_CUT,    // dbcut -c COLUMNS
+  STAGE_CIDR    // dbfilter-cidr [-n] [COLUMN ACL]...
+} stage_type_t;
+
+typedef struct {
+  stage_type_t type;
+  char **argv;         // NULL-terminated.
+  int argc;
+  char *columns;       // STAGE_CUT: the -c argument.
+  char normalize;      // STAGE_CIDR: -n.
+  char **args;         // STAGE_CIDR: COLUMN ACL pairs.
+  int nargs;
+} stage_t;
+
+// The columns of the stream between fused stages. Projections only change
+// the view, so each column maps back to a field of the input record.
+typedef struct {
+  char *header;
+  schema_t schema;
+  int *map;            // Input field of each column.
+} view_t;
+
+// An ACL applied to a field of the input record.
+typedef struct {
+  int field;
+  netacl_t *acl;
+  netacl_router_t router;
+} check_t;
+
+// A fused step: either ACL checks or a projection.
+typedef struct {
+  check_t *checks;
+  int nchecks;
+} step_t;
+
+// A run of consecutive stages executed by one process.
+typedef struct {
+  stage_t *stages;
+  int nstages;
+  char native;
+} unit_t;
+
+// Classifies a stage, parsing the options of a native stage. A stage with
+// options that are not implemented natively is run as a subprocess.
+void
+parse_stage(stage_t *stage) {
+  static struct option cut_opts[] = {
+    {"columns", required_argument, NULL, 'c'},
+    {NULL, 0, NULL, 0}
+  };
+  static struct option cidr_opts[] = {
+    {"normalize", no_argument, NULL, 'n'},
+    {NULL, 0, NULL, 0}
+  };
+
+  const char *name = basename(strdup(stage->argv[0]));
+  int opt;
+
+  stage->type = STAGE_EXEC;
+  opterr = 0;
+  optind = 0;
+
+  if (strcmp(name, "dbcut") == 0) {
+    while ((opt = getopt_long(stage->argc, stage->argv, "+c:", cut_opts,
+                              NULL)) != -1) {
+      if (opt != 'c') {
+        return;
+      }
+      stage->columns = optarg;
+    }
+    if (stage->columns && optind == stage->argc) {
+      stage->type = STAGE_CUT;
+    }
+  } else if (strcmp(name, "dbfilter-cidr") == 0) {
+    while ((opt = getopt_long(stage->argc, stage->argv, "+n", cidr_opts,
+                              NULL)) != -1) {
+      if (opt != 'n') {
+        return;
+      }
+      stage->normalize = 1;
+    }
+    stage->nargs = stage->argc - optind;
+    if (stage->nargs && stage->nargs % 2 == 0) {
+      stage->args = stage->argv + optind;
+      stage->type = STAGE_CIDR;
+    }
+  }
+}
+
+// Initializes a view from a header, mapping its columns to the given fields.
+void
+make_view(view_t *view, char *header, int *map) {
+  view->header = header;
+  view->map = map;
+  if (parse_header(header, &view->schema) != 0) {
+    fprintf(stderr, "error parsing #db header\n");
+    exit(1);
+  }
+}
+
+// Returns the column of a view with the given name. Exits if there is none.
+column_t *
+view_column(const view_t *view, const char *name) {
+  column_t *column = get_column(&view->schema, name);
+  if (!column) {
+    fprintf(stderr, "column '%s' is not present\n", name);
+    exit(1);
+  }
+
+  return column;
+}
+
+// Applies a projection to a view.
+void
+project(view_t *view, char *columns) {
+  size_t size = strlen(view->header) + 1;
+  char *header = malloc(size);
+  int *map = malloc(sizeof (int) * (strlen(columns) / 2 + 1));
+  int n = 0;
+
+  strcpy(header, "#db");
+  size_t len = 3;
+
+  char *saveptr;
+  char *name;
+  for (name = strtok_r(columns, ",", &saveptr); name;
+       name = strtok_r(NULL, ",", &saveptr)) {
+    column_t *column = view_column(view, name);
+    size_t need = len + strlen(column->name) + strlen(column->type) + 3;
+    if (need > size) {
+      size = 2 * need;
+      header = realloc(header, size);
+    }
+    len += sprintf(header + len, "\t%s:%s", column->name, column->type);
+    map[n++] = view->map[column->index - 1];
+  }
+
+  if (!n) {
+    fprintf(stderr, "no columns selected\n");
+    exit(1);
+  }
+
+  free_schema(&view->schema);
+  free(view->header);
+  free(view->map);
+  make_view(view, header, map);
+}
+
+// Loads the ACLs of a dbfilter-cidr stage.
+void
+load_checks(const view_t *view, const stage_t *stage, step_t *step) {
+  step->nchecks = stage->nargs / 2;
+  step->checks = calloc(step->nchecks, sizeof (check_t));
+
+  int i;
+  for (i = 0; i < step->nchecks; i++) {
+    check_t *check = &step->checks[i];
+    const char *path = stage->args[2 * i + 1];
+
+    check->field = view->map[view_column(view, stage->args[2 * i])->index - 1];
+    check->acl = malloc(sizeof (netacl_t));
+    if (netacl_load(path, check->acl, stage->normalize) != 0) {
+      fprintf(stderr, "could not initialize ACL from path '%s'\n", path);
+      exit(1);
+    }
+
+    netacl_router_init(&check->router, (const netacl_t **)&check->acl, 1);
+  }
+}
+
+// Returns whether the field of a record passes an ACL. Missing fields are
+// checked as empty.
+static inline int
+check_pass(const check_t *check, record_t *record) {
+  char addr[MAX_ADDR];
+  const field_t *field = record_field(record, check->field);
+  size_t len = field ? field->len : 0;
+  if (len >= sizeof addr) {
+    len = 0;
+  }
+
+  memcpy(addr, field ? field->ptr : "", len);
+  addr[len] = '\0';
+
+  return netacl_router_pass(&check->router, addr);
+}
+
+// Runs fused stages from stdin to stdout.
+void
+run_native(const unit_t *unit) {
+  reader_t reader;
+  reader_init(&reader, STDIN_FILENO, READER_BUFSIZE);
+  posix_fadvise(STDIN_FILENO, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  char *header = reader_header(&reader);
+  if (!header) {
+    fprintf(stderr, "error parsing #db header\n");
+    exit(1);
+  }
+
+  // Start with the identity view of the input.
+  view_t view;
+  make_view(&view, header, NULL);
+  int ninput = view.schema.ncols;
+  view.map = malloc(sizeof (int) * (ninput ? ninput : 1));
+
+  int i;
+  for (i = 0; i < ninput; i++) {
+    view.map[i] = i + 1;
+  }
+
+  step_t *steps = calloc(unit->nstages, sizeof (step_t));
+  int projected = 0;
+  for (i = 0; i < unit->nstages; i++) {
+    if (unit->stages[i].type == STAGE_CUT) {
+      project(&view, unit->stages[i].columns);
+      projected = 1;
+    } else {
+      load_checks(&view, &unit->stages[i], &steps[i]);
+    }
+  }
+
+  // Fields past the last one used are never split.
+  int maxfield = 1;
+  for (i = 0; i < unit->nstages; i++) {
+    int j;
+    for (j = 0; j < steps[i].nchecks; j++) {
+      if (steps[i].checks[j].field > maxfield) {
+        maxfield = steps[i].checks[j].field;
+      }
+    }
+  }
+  if (projected) {
+    for (i = 0; i < view.schema.ncols; i++) {
+      if (view.map[i] > maxfield) {
+        maxfield = view.map[i];
+      }
+    }
+  }
+
+  writer_t out;
+  writer_init(&out, STDOUT_FILENO, WRITER_BUFSIZE);
+  writer_write(&out, view.header, strlen(view.header));
+  writer_write(&out, "\n", 1);
+
+  batch_t batch;
+  batch_init(&batch, BATCH_SIZE, maxfield);
+
+  size_t count;
+  while ((count = reader_batch(&reader, &batch))) {
+    size_t r;
+    for (r = 0; r < count; r++) {
+      record_t *record = &batch.records[r];
+
+      int pass = 1;
+      for (i = 0; i < unit->nstages && pass; i++) {
+        int j;
+        for (j = 0; j < steps[i].nchecks && pass; j++) {
+          pass = check_pass(&steps[i].checks[j], record);
+        }
+      }
+      if (!pass) {
+        continue;
+      }
+
+      int ret;
+      if (!projected) {
+        ret = writer_write(&out, record->line, record->len);
+      } else {
+        for (i = 0; i < view.schema.ncols; i++) {
+          const field_t *field = record_field(record, view.map[i]);
+          if (i) {
+            writer_write(&out, "\t", 1);
+          }
+          if (field) {
+            writer_write(&out, field->ptr, field->len);
+          }
+        }
+        ret = writer_write(&out, "\n", 1);
+      }
+
+      if (ret == -1) {
+        errno = out.error;
+        perror("write error");
+        exit(1);
+      }
+    }
+  }
+
+  if (reader.error) {
+    errno = reader.error;
+    perror("read error");
+    exit(1);
+  }
+
+  if (writer_free(&out) == -1) {
+    errno = out.error;
+    perror("write error");
+    exit(1);
+  }
+
+#ifdef DEBUG
+  for (i = 0; i < unit->nstages; i++) {
+    int j;
+    for (j = 0; j < steps[i].nchecks; j++) {
+      netacl_router_destroy(&steps[i].checks[j].router);
+      netacl_destroy(steps[i].checks[j].acl);
+      free(steps[i].checks[j].acl);
+    }
+    free(steps[i].checks);
+  }
+  free(steps);
+  batch_free(&batch);
+  reader_free(&reader);
+  free_schema(&view.schema);
+  free(view.header);
+  free(view.map);
+#endif
+}
+
+// Groups the stages into units. Consecutive native stages share a unit
+// unless fusion is disabled.
+int
+make_units(stage_t *stages, int nstages, char fuse, unit_t *units) {
+  int n = 0;
+  int i;
+  for (i = 0; i < nstages; i++) {
+    char native = fuse && stages[i].type != STAGE_EXEC;
+    if (n && native && units[n - 1].native) {
+      units[n - 1].nstages++;
+      continue;
+    }
+
+    units[n].stages = &stages[i];
+    units[n].nstages = 1;
+    units[n].native = native;
+    n++;
+  }
+
+  return n;
+}
+
+// Describes the units on stderr.
+void
+print_plan(const unit_t *units, int nunits) {
+  int i;
+  for (i = 0; i < nunits; i++) {
+    fprintf(stderr, "%s:", units[i].native ? "fused" : "exec");
+
+    int j;
+    for (j = 0; j < units[i].nstages; j++) {
+      char **arg;
+      fprintf(stderr, "%s", j ? " |" : "");
+      for (arg = units[i].stages[j].argv; *arg; arg++) {
+        fprintf(stderr, " %s", *arg);
+      }
+    }
+    fprintf(stderr, "\n");
+  }
+}
+
+// Starts a process for each unit, connected by pipes, and waits for them.
+// Returns 0 if they all succeed. A unit killed by SIGPIPE is not counted as
+// a failure, because the unit after it exited first.
+int
+run(const unit_t *units, int nunits) {
+  pid_t *pids = malloc(sizeof (pid_t) * nunits);
+  int in = STDIN_FILENO;
+
+  int i;
+  for (i = 0; i < nunits; i++) {
+    int fds[2] = {-1, STDOUT_FILENO};
+    if (i < nunits - 1 && pipe(fds) == -1) {
+      perror("pipe");
+      exit(1);
+    }
+
+    pids[i] = fork();
+    if (pids[i] == -1) {
+      perror("fork");
+      exit(1);
+    }
+
+    if (pids[i] == 0) {
+      if (in != STDIN_FILENO) {
+        dup2(in, STDIN_FILENO);
+        close(in);
+      }
+      if (fds[1] != STDOUT_FILENO) {
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[1]);
+        close(fds[0]);
+      }
+
+      if (units[i].native) {
+        run_native(&units[i]);
+        exit(0);
+      }
+
+      execvp(units[i].stages[0].argv[0], units[i].stages[0].argv);
+      perror(units[i].stages[0].argv[0]);
+      _exit(127);
+    }
+
+    if (in != STDIN_FILENO) {
+      close(in);
+    }
+    if (fds[1] != STDOUT_FILENO) {
+      close(fds[1]);
+    }
+    in = fds[0];
+  }
+
+  int ret = 0;
+  for (i = 0; i < nunits; i++) {
+    int status;
+    while (waitpid(pids[i], &status, 0) == -1 && errno == EINTR);
+
+    if (WIFSIGNALED(status) && WTERMSIG(status) != SIGPIPE) {
+      fprintf(stderr, "%s: killed by signal %d\n",
+              units[i].stages[0].argv[0], WTERMSIG(status));
+      ret = 1;
+    } else if (WIFEXITED(status) && WEXITSTATUS(status)) {
+      ret = 1;
+    }
+  }
+
+  free(pids);
+
+  return ret;
+}
+
+int
+main(int argc, char **argv) {
+  static struct option lopts[] = {
+    {"help", no_argument, NULL, 'h'},
+    {"no-fuse", no_argument, NULL, 'x'},
+    {"verbose", no_argument, NULL, 'v'},
+    {NULL, 0, NULL, 0}
+  };
+  const char *sopts = "+hxv";
+  int opt;
+
+  char fuse = 1;
+  char verbose = 0;
+
+  // Parse arguments.
+  while ((opt = getopt_long(argc, argv, sopts, lopts, NULL)) != -1) {
+    switch (opt) {
+      case 'x':
+        fuse = 0;
+        break;
+      case 'v':
+        verbose = 1;
+        break;
+      default:
+        printf("Usage: %s [OPTIONS] COMMAND ['|' COMMAND]...\n\n", argv[0]);
+        printf("-h | --help           print this text and exit\n");
+        printf("-x | --no-fuse        run every command as a subprocess\n");
+        printf("-v | --verbose        describe how the commands are run\n\n");
+        printf("Runs a pipeline of commands on db data from stdin. "
+               "Consecutive dbcut -c and\n");
+        printf("dbfilter-cidr filter commands run in one process that "
+               "reads each record\n");
+        printf("once; other commands run as subprocesses.\n\n");
+        printf("Examples:\n\n");
+        printf("Filter on 'sip', select columns, and split on 'sip':\n");
+        printf("dbcat flows.db.gz | %s dbfilter-cidr sip local.acl '|' "
+               "dbcut -c ts,sip,dip '|' dbsplit -k sip -n 4\n", argv[0]);
+        return 0;
+    }
+  }
+
+  if (optind == argc) {
+    fprintf(stderr, "no commands\n");
+    return 1;
+  }
+
+  // Split the commands on '|' arguments.
+  int nstages = 1;
+  int i;
+  for (i = optind; i < argc; i++) {
+    nstages += strcmp(argv[i], "|") == 0;
+  }
+
+  stage_t *stages = calloc(nstages, sizeof (stage_t));
+  int n = 0;
+  stages[0].argv = argv + optind;
+  for (i = optind; i <= argc; i++) {
+    if (i == argc || strcmp(argv[i], "|") == 0) {
+      stages[n].argc = argv + i - stages[n].argv;
+      if (!stages[n].argc) {
+        fprintf(stderr, "empty command in pipeline\n");
+        return 1;
+      }
+      argv[i] = NULL;
+      if (++n < nstages) {
+        stages[n].argv = argv + i + 1;
+      }
+    }
+  }
+
+  for (i = 0; i < nstages; i++) {
+    parse_stage(&stages[i]);
+  }
+
+  unit_t *units = malloc(sizeof (unit_t) * nstages);
+  int nunits = make_units(stages, nstages, fuse, units);
+
+  if (verbose) {
+    print_plan(units, nunits);
+  }
+
+  int ret = run(units, nunits);
+
+#ifdef DEBUG
+  free(units);
+  free(stages);
+#endif
+
+  return ret;
+}
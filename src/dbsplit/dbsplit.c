@@ -176,9 +176,13 @@ get_uniq_fp(fp_map_t **uniq_fp_map, char *key, const char *prefix, int *part,
 void
 split(options_t *options) {
   // Read and parse the #db header of the input data.
-  char *header = read_header(stdin);
+  reader_t reader;
+  reader_init(&reader, STDIN_FILENO, READER_BUFSIZE);
+  char *header = reader_header(&reader);
   schema_t schema;
-  parse_header(header, &schema);
+  if (!header || parse_header(header, &schema) != 0) {
+    exit(1);
+  }
 
   int *indexes = NULL;
   if (options->keylen) {
@@ -200,11 +204,11 @@ split(options_t *options) {
     fps = open_output_files(options, header);
   }
 
-  // Allocate line buffers.
+  // Allocate buffers. Lines are read in place from the reader's buffer.
   size_t bufsize = BUFSIZE;
-  char *line = malloc(bufsize);
+  char *line;
+  size_t len;
   char *copy = malloc(bufsize);
-  size_t offset = 0;
 
   char *key_tokens[options->keylen];
   size_t key_token_sizes[options->keylen];
@@ -221,23 +225,18 @@ split(options_t *options) {
   XXH32_stateSpace_t state;
 
   // Read lines from the input data.
-  while (fgets(line + offset, bufsize - offset, stdin)) {
-    if (line[strlen(line)-1] == '\n') {
-      offset = 0;
-    } else {
-      // fgets() did not read an entire line. Grow the buffer and try again.
-      bufsize *= 2;
+  while ((line = reader_next(&reader, &len))) {
+    if (len >= bufsize) {
+      // Grow the copy buffer to fit the line.
+      while (len >= bufsize) {
+        bufsize *= 2;
+      }
 
 #ifdef DEBUG
       fprintf(stderr, "line buffer doubled to %lu bytes\n", bufsize);
 #endif
 
-      line = realloc(line, bufsize);
       copy = realloc(copy, bufsize);
-
-      // Set offset so that the next fgets() is concatenated to the buffer.
-      offset = strlen(line);
-      continue;
     }
 
     FILE *fp = NULL;
@@ -338,7 +337,13 @@ split(options_t *options) {
     }
 
     // Output the line to the output file.
-    fwrite(line, 1, strlen(line), fp);
+    fwrite(line, 1, len, fp);
+  }
+
+  if (reader.error) {
+    errno = reader.error;
+    perror("read error");
+    exit(-errno);
   }
 
   // Close output files.
@@ -378,7 +383,7 @@ split(options_t *options) {
   }
 
   free(copy);
-  free(line);
+  reader_free(&reader);
 
   fp_map_t *item;
   fp_map_t *tmp;
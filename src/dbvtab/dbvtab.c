@@ -0,0 +1,953 @@
+// dbvtab
+//
+// Copyright (c) 2015, Los Alamos National Security, LLC
+// All rights reserved.
+//
+// Copyright (2015). Los Alamos National Security, LLC. This software was
+// produced under U.S. Government contract DE-AC52-06NA25396 for Los Alamos
+// National Laboratory (LANL), which is operated by Los Alamos National
+// Security, LLC for the U.S. Department of Energy. The U.S. Government has
+// rights to use, reproduce, and distribute this software. NEITHER THE
+// GOVERNMENT NOR LOS ALAMOS NATIONAL SECURITY, LLC MAKES ANY WARRANTY, EXPRESS
+// OR IMPLIED, OR ASSUMES ANY LIABILITY FOR THE USE OF THIS SOFTWARE. If
+// software is modified to produce derivative works, such modified software
+// should be clearly marked, so as not to confuse it with the version available
+// from LANL.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//
+// An SQLite module that queries a db data file in place, without importing
+// it:
+//
+//   .load /usr/lib/dbvtab
+//   CREATE VIRTUAL TABLE flows USING db('flows.db.gz');
+//   SELECT sip, count(*) FROM flows WHERE ts >= 1420070400 GROUP BY sip;
+//
+// Columns get INTEGER, REAL, or TEXT affinity from the #db header. Only the
+// fields up to the last column that a query uses are split, and comparisons
+// of columns to constants are checked as records are read, before SQLite sees
+// them. The rowid is the record number, starting at 1. Compressed files are
+// read through dbcat.
+//
+// With an 'index' argument, the module keeps a sidecar PATH.idx with the
+// offset of every INDEX_STRIDE-th record of an uncompressed file, so that
+// rowid lookups and ranges seek instead of scanning from the start. It is
+// rebuilt when the file's size or mtime changes.
+//
+// Author: Curt Hash <chash@lanl.gov>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <sqlite3ext.h>
+SQLITE_EXTENSION_INIT1
+
+#include "cdb.h"
+
+#define INDEX_MAGIC "DBI1"
+#define INDEX_STRIDE 4096
+
+// Size of the sidecar index before its offsets.
+#define INDEX_HEADER 36
+
+typedef enum {
+  AFFINITY_INT,
+  AFFINITY_REAL,
+  AFFINITY_TEXT
+} affinity_t;
+
+typedef struct {
+  sqlite3_vtab base;
+  char *path;
+  char compressed;
+  affinity_t *affinities;
+  int ncols;
+  uint64_t size;       // File size, for cost estimates.
+  uint64_t *index;     // Offset of record k * INDEX_STRIDE + 1.
+  uint64_t nindex;
+  uint64_t nrecords;   // Set if there is an index.
+} db_vtab_t;
+
+// A comparison of a column to a constant. Column 0 is the rowid.
+typedef struct {
+  int column;
+  int op;
+  int type;            // SQLITE_INTEGER, SQLITE_FLOAT, or SQLITE_TEXT.
+  int64_t i;
+  double d;
+  char *s;
+  size_t len;
+} filter_t;
+
+typedef struct {
+  sqlite3_vtab_cursor base;
+  int fd;
+  pid_t pid;           // dbcat, for a compressed file.
+  reader_t reader;
+  batch_t batch;
+  char open;
+  size_t count;        // Records in the batch.
+  size_t pos;
+  int64_t rowid;
+  int64_t last;        // Last rowid to return.
+  char eof;
+  filter_t *filters;
+  int nfilters;
+} db_cursor_t;
+
+static uint64_t
+get_u64(const uint8_t *p) {
+  uint64_t v = 0;
+  int i;
+  for (i = 0; i < 8; i++) {
+    v |= (uint64_t)p[i] << (8 * i);
+  }
+
+  return v;
+}
+
+static void
+put_u64(uint8_t *p, uint64_t v) {
+  int i;
+  for (i = 0; i < 8; i++) {
+    p[i] = v >> (8 * i);
+  }
+}
+
+// Returns whether a file starts with the magic of a compression format.
+static int
+is_compressed(int fd) {
+  static const struct {
+    const char *magic;
+    size_t len;
+  } formats[] = {
+    {"\x1f\x8b", 2},            // gzip
+    {"BZh", 3},                 // bzip2
+    {"\xfd" "7zXZ", 5},         // xz
+    {"\x28\xb5\x2f\xfd", 4}     // zstd
+  };
+
+  char buf[8];
+  ssize_t n = pread(fd, buf, sizeof buf, 0);
+
+  size_t i;
+  for (i = 0; i < sizeof formats / sizeof formats[0]; i++) {
+    if (n >= (ssize_t)formats[i].len &&
+        memcmp(buf, formats[i].magic, formats[i].len) == 0) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+// Opens a db data file, through dbcat if it is compressed. Sets pid to the
+// dbcat process, or to 0. Returns an fd, or -1.
+static int
+open_input(db_vtab_t *vtab, pid_t *pid) {
+  *pid = 0;
+
+  int fd = open(vtab->path, O_RDONLY);
+  if (fd == -1 || !vtab->compressed) {
+    return fd;
+  }
+  close(fd);
+
+  int fds[2];
+  if (pipe(fds) == -1) {
+    return -1;
+  }
+
+  *pid = fork();
+  if (*pid == -1) {
+    close(fds[0]);
+    close(fds[1]);
+    return -1;
+  }
+
+  if (*pid == 0) {
+    dup2(fds[1], STDOUT_FILENO);
+    close(fds[0]);
+    close(fds[1]);
+    execlp("dbcat", "dbcat", vtab->path, (char *)NULL);
+    _exit(127);
+  }
+
+  close(fds[1]);
+  return fds[0];
+}
+
+// Closes an input, stopping dbcat if it is still running. Returns 0, or -1
+// if dbcat failed.
+static int
+close_input(int fd, pid_t pid, char finished) {
+  close(fd);
+  if (!pid) {
+    return 0;
+  }
+
+  if (!finished) {
+    kill(pid, SIGTERM);
+  }
+
+  int status;
+  while (waitpid(pid, &status, 0) == -1 && errno == EINTR);
+
+  return !finished || (WIFEXITED(status) && WEXITSTATUS(status) == 0) ? 0 : -1;
+}
+
+// Reads the sidecar index if it matches the file.
+static int
+read_index(db_vtab_t *vtab, const char *path, const struct stat *st) {
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    return -1;
+  }
+
+  uint8_t header[INDEX_HEADER];
+  int ret = -1;
+  if (read(fd, header, sizeof header) == sizeof header &&
+      memcmp(header, INDEX_MAGIC, 4) == 0 &&
+      get_u64(header + 4) == (uint64_t)st->st_size &&
+      get_u64(header + 12) == (uint64_t)st->st_mtime &&
+      get_u64(header + 20) == INDEX_STRIDE) {
+    vtab->nrecords = get_u64(header + 28);
+    vtab->nindex = (vtab->nrecords + INDEX_STRIDE - 1) / INDEX_STRIDE;
+
+    size_t len = sizeof (uint64_t) * vtab->nindex;
+    uint8_t *buf = malloc(len + 1);
+    if (read(fd, buf, len) == (ssize_t)len) {
+      vtab->index = malloc(len + 1);
+      uint64_t k;
+      for (k = 0; k < vtab->nindex; k++) {
+        vtab->index[k] = get_u64(buf + 8 * k);
+      }
+      ret = 0;
+    }
+    free(buf);
+  }
+
+  close(fd);
+  return ret;
+}
+
+// Scans the file for the offsets of the index, and saves them to the sidecar
+// if it can. Returns 0, or -1 if the file could not be read.
+static int
+build_index(db_vtab_t *vtab, const char *path, const struct stat *st) {
+  int fd = open(vtab->path, O_RDONLY);
+  if (fd == -1) {
+    return -1;
+  }
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  reader_t reader;
+  reader_init(&reader, fd, READER_BUFSIZE);
+  char *header = reader_header(&reader);
+  uint64_t offset = header ? strlen(header) + 1 : 0;
+  free(header);
+
+  size_t cap = 1024;
+  vtab->index = malloc(sizeof (uint64_t) * cap);
+  vtab->nindex = 0;
+  vtab->nrecords = 0;
+
+  char *record;
+  size_t len;
+  while ((record = reader_next(&reader, &len))) {
+    if (vtab->nrecords % INDEX_STRIDE == 0) {
+      if (vtab->nindex == cap) {
+        cap *= 2;
+        vtab->index = realloc(vtab->index, sizeof (uint64_t) * cap);
+      }
+      vtab->index[vtab->nindex++] = offset;
+    }
+    vtab->nrecords++;
+    offset += len;
+  }
+
+  int error = reader.error;
+  reader_free(&reader);
+  close(fd);
+  if (error) {
+    return -1;
+  }
+
+  // The index is still used for this connection if it can't be saved.
+  fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd != -1) {
+    writer_t out;
+    writer_init(&out, fd, WRITER_BUFSIZE);
+
+    uint8_t buf[INDEX_HEADER];
+    memcpy(buf, INDEX_MAGIC, 4);
+    put_u64(buf + 4, st->st_size);
+    put_u64(buf + 12, st->st_mtime);
+    put_u64(buf + 20, INDEX_STRIDE);
+    put_u64(buf + 28, vtab->nrecords);
+    writer_write(&out, buf, sizeof buf);
+
+    uint64_t k;
+    for (k = 0; k < vtab->nindex; k++) {
+      put_u64(buf, vtab->index[k]);
+      writer_write(&out, buf, 8);
+    }
+
+    if (writer_free(&out) == -1 || close(fd) == -1) {
+      unlink(path);
+    }
+  }
+
+  return 0;
+}
+
+// Returns an argument without the quotes around it.
+static char *
+unquote(const char *arg) {
+  size_t len = strlen(arg);
+  if (len >= 2 && (arg[0] == '\'' || arg[0] == '"') && arg[len - 1] == arg[0]) {
+    char *s = sqlite3_malloc(len);
+    size_t i, j = 0;
+    for (i = 1; i < len - 1; i++) {
+      s[j++] = arg[i];
+      if (arg[i] == arg[0] && arg[i + 1] == arg[0]) {
+        i++;
+      }
+    }
+    s[j] = '\0';
+    return s;
+  }
+
+  return sqlite3_mprintf("%s", arg);
+}
+
+static void
+free_vtab(db_vtab_t *vtab) {
+  sqlite3_free(vtab->path);
+  free(vtab->affinities);
+  free(vtab->index);
+  sqlite3_free(vtab);
+}
+
+// Creates a table for the file named by the first argument. The schema comes
+// from its #db header.
+static int
+db_connect(sqlite3 *db, void *aux, int argc, const char *const *argv,
+           sqlite3_vtab **out, char **err) {
+  if (argc < 4 || argc > 5) {
+    *err = sqlite3_mprintf("usage: CREATE VIRTUAL TABLE name USING "
+                           "db(PATH [, index])");
+    return SQLITE_ERROR;
+  }
+
+  db_vtab_t *vtab = sqlite3_malloc(sizeof (db_vtab_t));
+  memset(vtab, 0, sizeof (db_vtab_t));
+  vtab->path = unquote(argv[3]);
+
+  char *option = argc == 5 ? unquote(argv[4]) : NULL;
+  char use_index = option && strcasecmp(option, "index") == 0;
+  if (option && !use_index) {
+    *err = sqlite3_mprintf("unknown option '%s'", option);
+    sqlite3_free(option);
+    free_vtab(vtab);
+    return SQLITE_ERROR;
+  }
+  sqlite3_free(option);
+
+  struct stat st;
+  int fd = open(vtab->path, O_RDONLY);
+  if (fd == -1 || fstat(fd, &st) == -1) {
+    *err = sqlite3_mprintf("%s: %s", vtab->path, strerror(errno));
+    free_vtab(vtab);
+    return SQLITE_ERROR;
+  }
+  vtab->size = st.st_size;
+  vtab->compressed = is_compressed(fd);
+  close(fd);
+
+  if (use_index) {
+    if (vtab->compressed) {
+      *err = sqlite3_mprintf("%s: an index requires an uncompressed file",
+                             vtab->path);
+      free_vtab(vtab);
+      return SQLITE_ERROR;
+    }
+
+    char *path = sqlite3_mprintf("%s.idx", vtab->path);
+    int ret = 0;
+    if (read_index(vtab, path, &st) == -1) {
+      free(vtab->index);
+      vtab->index = NULL;
+      ret = build_index(vtab, path, &st);
+    }
+    sqlite3_free(path);
+
+    if (ret == -1) {
+      *err = sqlite3_mprintf("%s: error reading file", vtab->path);
+      free_vtab(vtab);
+      return SQLITE_ERROR;
+    }
+  }
+
+  pid_t pid;
+  fd = open_input(vtab, &pid);
+  reader_t reader;
+  reader_init(&reader, fd, READER_BUFSIZE);
+  char *header = fd == -1 ? NULL : reader_header(&reader);
+  reader_free(&reader);
+  if (fd != -1) {
+    close_input(fd, pid, 0);
+  }
+
+  schema_t schema;
+  if (!header || parse_header(header, &schema) != 0) {
+    *err = sqlite3_mprintf("%s: error parsing #db header", vtab->path);
+    free(header);
+    free_vtab(vtab);
+    return SQLITE_ERROR;
+  }
+
+  vtab->ncols = schema.ncols;
+  vtab->affinities = malloc(sizeof (affinity_t) * (schema.ncols + 1));
+
+  sqlite3_str *ddl = sqlite3_str_new(db);
+  sqlite3_str_appendf(ddl, "CREATE TABLE x(");
+
+  column_t *column;
+  for (column = schema.head; column; column = column->flink) {
+    affinity_t affinity = AFFINITY_TEXT;
+    const char *type = "TEXT";
+    if (strcmp(column->type, "int") == 0) {
+      affinity = AFFINITY_INT;
+      type = "INTEGER";
+    } else if (strcmp(column->type, "real") == 0) {
+      affinity = AFFINITY_REAL;
+      type = "REAL";
+    }
+
+    vtab->affinities[column->index - 1] = affinity;
+    sqlite3_str_appendf(ddl, "%s\"%w\" %s", column->index > 1 ? ", " : "",
+                        column->name, type);
+  }
+  sqlite3_str_appendf(ddl, ")");
+
+  free_schema(&schema);
+  free(header);
+
+  char *sql = sqlite3_str_finish(ddl);
+  int ret = sqlite3_declare_vtab(db, sql);
+  sqlite3_free(sql);
+  if (ret != SQLITE_OK) {
+    *err = sqlite3_mprintf("%s: %s", vtab->path, sqlite3_errmsg(db));
+    free_vtab(vtab);
+    return ret;
+  }
+
+  *out = &vtab->base;
+  return SQLITE_OK;
+}
+
+static int
+db_disconnect(sqlite3_vtab *base) {
+  free_vtab((db_vtab_t *)base);
+  return SQLITE_OK;
+}
+
+static int
+pushed_op(int op) {
+  return op == SQLITE_INDEX_CONSTRAINT_EQ || op == SQLITE_INDEX_CONSTRAINT_GT ||
+         op == SQLITE_INDEX_CONSTRAINT_LE || op == SQLITE_INDEX_CONSTRAINT_LT ||
+         op == SQLITE_INDEX_CONSTRAINT_GE;
+}
+
+// Passes comparisons of columns to constants to xFilter in idxStr, as
+// "column:op," for each argument, with column 0 for the rowid. SQLite still
+// checks them, so a comparison the scanner can't decide is left to SQLite.
+// idxNum is the last field that has to be split.
+static int
+db_best_index(sqlite3_vtab *base, sqlite3_index_info *info) {
+  db_vtab_t *vtab = (db_vtab_t *)base;
+  sqlite3_str *str = sqlite3_str_new(NULL);
+  int nargs = 0;
+  int maxfield = 0;
+  double rows = vtab->nrecords ? vtab->nrecords : vtab->size / 64 + 1;
+  double cost = rows;
+  char rowid_eq = 0;
+  int i;
+
+  for (i = 0; i < info->nConstraint; i++) {
+    const struct sqlite3_index_constraint *c = &info->aConstraint[i];
+    if (!c->usable || !pushed_op(c->op)) {
+      continue;
+    }
+
+    // Text is only compared with the default collation.
+    if (c->iColumn >= 0 && vtab->affinities[c->iColumn] == AFFINITY_TEXT &&
+        strcasecmp(sqlite3_vtab_collation(info, i), "BINARY") != 0) {
+      continue;
+    }
+
+    info->aConstraintUsage[i].argvIndex = ++nargs;
+    sqlite3_str_appendf(str, "%d:%d,", c->iColumn + 1, c->op);
+
+    if (c->iColumn < 0) {
+      if (c->op == SQLITE_INDEX_CONSTRAINT_EQ) {
+        rowid_eq = 1;
+      }
+      rows /= 4;
+    } else {
+      rows /= c->op == SQLITE_INDEX_CONSTRAINT_EQ ? 10 : 3;
+    }
+  }
+
+  if (rowid_eq) {
+    rows = 1;
+    info->idxFlags |= SQLITE_INDEX_SCAN_UNIQUE;
+    cost = vtab->index ? INDEX_STRIDE : cost / 2;
+  } else if (vtab->index && rows < cost) {
+    cost = rows + INDEX_STRIDE;
+  }
+
+  // Each record is only split as far as the last column used.
+  for (i = 0; i < vtab->ncols && i < 63; i++) {
+    if (info->colUsed & ((sqlite3_uint64)1 << i)) {
+      maxfield = i + 1;
+    }
+  }
+  if (info->colUsed & ((sqlite3_uint64)1 << 63)) {
+    // Bit 63 stands for every column past the 63rd.
+    maxfield = vtab->ncols;
+  }
+
+  // Records are read in rowid order.
+  if (info->nOrderBy == 1 && info->aOrderBy[0].iColumn < 0 &&
+      !info->aOrderBy[0].desc) {
+    info->orderByConsumed = 1;
+  }
+
+  info->idxNum = maxfield;
+  info->idxStr = sqlite3_str_finish(str);
+  info->needToFreeIdxStr = 1;
+  info->estimatedRows = rows;
+  info->estimatedCost = cost;
+
+  return SQLITE_OK;
+}
+
+static int
+db_open(sqlite3_vtab *base, sqlite3_vtab_cursor **out) {
+  db_cursor_t *cursor = sqlite3_malloc(sizeof (db_cursor_t));
+  memset(cursor, 0, sizeof (db_cursor_t));
+  cursor->fd = -1;
+  *out = &cursor->base;
+
+  return SQLITE_OK;
+}
+
+static void
+clear_filters(db_cursor_t *cursor) {
+  int i;
+  for (i = 0; i < cursor->nfilters; i++) {
+    free(cursor->filters[i].s);
+  }
+  free(cursor->filters);
+  cursor->filters = NULL;
+  cursor->nfilters = 0;
+}
+
+// Closes the current scan. Returns -1 if dbcat failed after the scan read to
+// the end of the file.
+static int
+end_scan(db_cursor_t *cursor, char finished) {
+  int ret = 0;
+  if (cursor->open) {
+    batch_free(&cursor->batch);
+    reader_free(&cursor->reader);
+    ret = close_input(cursor->fd, cursor->pid, finished);
+    cursor->open = 0;
+    cursor->fd = -1;
+  }
+
+  return ret;
+}
+
+static int
+db_close(sqlite3_vtab_cursor *base) {
+  db_cursor_t *cursor = (db_cursor_t *)base;
+  end_scan(cursor, 0);
+  clear_filters(cursor);
+  sqlite3_free(cursor);
+
+  return SQLITE_OK;
+}
+
+static int
+cmp_int(int64_t a, int64_t b) {
+  return (a > b) - (a < b);
+}
+
+static int
+cmp_real(long double a, long double b) {
+  return (a > b) - (a < b);
+}
+
+static int
+op_matches(int op, int c) {
+  switch (op) {
+    case SQLITE_INDEX_CONSTRAINT_EQ:
+      return c == 0;
+    case SQLITE_INDEX_CONSTRAINT_GT:
+      return c > 0;
+    case SQLITE_INDEX_CONSTRAINT_LE:
+      return c <= 0;
+    case SQLITE_INDEX_CONSTRAINT_LT:
+      return c < 0;
+    default:
+      return c >= 0;
+  }
+}
+
+// Parses a decimal real. parse_double also takes inf and nan, which SQLite
+// keeps as text, so those are left for the caller to return as text.
+static int
+parse_real(const char *s, size_t len, double *v) {
+  if (!len || ((unsigned)(s[len - 1] - '0') > 9 && s[len - 1] != '.')) {
+    return -1;
+  }
+  return parse_double(s, len, v);
+}
+
+// Returns whether a record may match a filter. A value that SQLite would not
+// compare as a number, such as a malformed int, is left for SQLite to check.
+static int
+filter_pass(const db_vtab_t *vtab, const filter_t *filter, record_t *record) {
+  const field_t *field = record_field(record, filter->column);
+  size_t len = field ? field->len : 0;
+  int64_t i;
+  double d;
+
+  if (filter->type == SQLITE_TEXT) {
+    int c = memcmp(field ? field->ptr : "", filter->s,
+                   len < filter->len ? len : filter->len);
+    return op_matches(filter->op, c ? c : cmp_int(len, filter->len));
+  }
+
+  if (!len) {
+    // NULL matches no comparison.
+    return 0;
+  }
+
+  if (vtab->affinities[filter->column - 1] == AFFINITY_INT &&
+      parse_int64(field->ptr, len, &i) == 0) {
+    return op_matches(filter->op, filter->type == SQLITE_INTEGER ?
+                      cmp_int(i, filter->i) : cmp_real(i, filter->d));
+  }
+
+  if (parse_real(field->ptr, len, &d) == 0) {
+    return op_matches(filter->op, filter->type == SQLITE_INTEGER ?
+                      cmp_real(d, filter->i) : cmp_real(d, filter->d));
+  }
+
+  return 1;
+}
+
+// Advances to the next record that is within the rowid range and passes the
+// filters.
+static int
+db_next(sqlite3_vtab_cursor *base) {
+  db_cursor_t *cursor = (db_cursor_t *)base;
+  db_vtab_t *vtab = (db_vtab_t *)base->pVtab;
+
+  while (!cursor->eof) {
+    if (++cursor->pos >= cursor->count) {
+      cursor->count = reader_batch(&cursor->reader, &cursor->batch);
+      cursor->pos = 0;
+      if (!cursor->count) {
+        cursor->eof = 1;
+        if (cursor->reader.error || end_scan(cursor, 1) == -1) {
+          sqlite3_free(vtab->base.zErrMsg);
+          vtab->base.zErrMsg = sqlite3_mprintf("%s: error reading file",
+                                               vtab->path);
+          return SQLITE_ERROR;
+        }
+        break;
+      }
+    }
+
+    if (++cursor->rowid > cursor->last) {
+      cursor->eof = 1;
+      break;
+    }
+
+    record_t *record = &cursor->batch.records[cursor->pos];
+    int i;
+    for (i = 0; i < cursor->nfilters; i++) {
+      if (cursor->filters[i].column &&
+          !filter_pass(vtab, &cursor->filters[i], record)) {
+        break;
+      }
+    }
+    if (i == cursor->nfilters) {
+      break;
+    }
+  }
+
+  return SQLITE_OK;
+}
+
+// Narrows the rowid range by a comparison. Returns 0 if no rowid can match.
+static int
+bound_rowid(int op, sqlite3_value *value, int64_t *first, int64_t *last) {
+  double d = sqlite3_value_double(value);
+  int64_t lo = INT64_MIN;
+  int64_t hi = INT64_MAX;
+
+  if (d >= 9.2e18 || d <= -9.2e18) {
+    // Beyond any record number.
+    return d > 0 ? op == SQLITE_INDEX_CONSTRAINT_LT ||
+                   op == SQLITE_INDEX_CONSTRAINT_LE :
+                   op == SQLITE_INDEX_CONSTRAINT_GT ||
+                   op == SQLITE_INDEX_CONSTRAINT_GE;
+  }
+
+  switch (op) {
+    case SQLITE_INDEX_CONSTRAINT_EQ:
+      if (d != floor(d)) {
+        return 0;
+      }
+      lo = hi = d;
+      break;
+    case SQLITE_INDEX_CONSTRAINT_GT:
+      lo = floor(d) + 1;
+      break;
+    case SQLITE_INDEX_CONSTRAINT_GE:
+      lo = ceil(d);
+      break;
+    case SQLITE_INDEX_CONSTRAINT_LT:
+      hi = ceil(d) - 1;
+      break;
+    default:
+      hi = floor(d);
+      break;
+  }
+
+  if (sqlite3_value_type(value) == SQLITE_INTEGER) {
+    int64_t i = sqlite3_value_int64(value);
+    if (op == SQLITE_INDEX_CONSTRAINT_EQ) {
+      lo = hi = i;
+    } else if (op == SQLITE_INDEX_CONSTRAINT_GT) {
+      lo = i + 1;
+    } else if (op == SQLITE_INDEX_CONSTRAINT_GE) {
+      lo = i;
+    } else if (op == SQLITE_INDEX_CONSTRAINT_LT) {
+      hi = i - 1;
+    } else {
+      hi = i;
+    }
+  }
+
+  if (lo > *first) {
+    *first = lo;
+  }
+  if (hi < *last) {
+    *last = hi;
+  }
+
+  return 1;
+}
+
+// Starts a scan, seeking with the index to the first record in the rowid
+// range.
+static int
+db_filter(sqlite3_vtab_cursor *base, int idxNum, const char *idxStr, int argc,
+          sqlite3_value **argv) {
+  db_cursor_t *cursor = (db_cursor_t *)base;
+  db_vtab_t *vtab = (db_vtab_t *)base->pVtab;
+  int64_t first = 1;
+  int i;
+
+  end_scan(cursor, 0);
+  clear_filters(cursor);
+  cursor->eof = 0;
+  cursor->last = INT64_MAX;
+  cursor->filters = calloc(argc + 1, sizeof (filter_t));
+
+  char *p = (char *)idxStr;
+  for (i = 0; i < argc && p && *p; i++) {
+    filter_t *filter = &cursor->filters[cursor->nfilters];
+    filter->column = strtol(p, &p, 10);
+    filter->op = strtol(p + 1, &p, 10);
+    p++;
+
+    int type = sqlite3_value_type(argv[i]);
+    if (type == SQLITE_NULL) {
+      // NULL matches no comparison.
+      cursor->eof = 1;
+      return SQLITE_OK;
+    }
+
+    if (!filter->column) {
+      if ((type == SQLITE_INTEGER || type == SQLITE_FLOAT) &&
+          !bound_rowid(filter->op, argv[i], &first, &cursor->last)) {
+        cursor->eof = 1;
+        return SQLITE_OK;
+      }
+      continue;
+    }
+
+    // Only comparisons with the column's own kind of value are checked.
+    char text = vtab->affinities[filter->column - 1] == AFFINITY_TEXT;
+    if (text && type == SQLITE_TEXT) {
+      filter->len = sqlite3_value_bytes(argv[i]);
+      filter->s = malloc(filter->len + 1);
+      memcpy(filter->s, sqlite3_value_text(argv[i]), filter->len);
+    } else if (!text && type == SQLITE_INTEGER) {
+      filter->i = sqlite3_value_int64(argv[i]);
+    } else if (!text && type == SQLITE_FLOAT) {
+      filter->d = sqlite3_value_double(argv[i]);
+    } else {
+      continue;
+    }
+    filter->type = type;
+    cursor->nfilters++;
+  }
+
+  if (first > cursor->last) {
+    cursor->eof = 1;
+    return SQLITE_OK;
+  }
+
+  cursor->fd = open_input(vtab, &cursor->pid);
+  if (cursor->fd == -1) {
+    sqlite3_free(vtab->base.zErrMsg);
+    vtab->base.zErrMsg = sqlite3_mprintf("%s: %s", vtab->path,
+                                         strerror(errno));
+    return SQLITE_ERROR;
+  }
+  posix_fadvise(cursor->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  reader_init(&cursor->reader, cursor->fd, READER_BUFSIZE);
+  batch_init(&cursor->batch, BATCH_SIZE, idxNum ? idxNum : 1);
+  cursor->open = 1;
+  cursor->count = 0;
+  cursor->pos = 0;
+  cursor->rowid = 0;
+
+  uint64_t k = first > 1 && vtab->index ? (first - 1) / INDEX_STRIDE : 0;
+  if (k && k < vtab->nindex &&
+      lseek(cursor->fd, vtab->index[k], SEEK_SET) != -1) {
+    cursor->rowid = k * INDEX_STRIDE;
+  } else {
+    free(reader_header(&cursor->reader));
+  }
+
+  // Records before the range are skipped without being split.
+  while (cursor->rowid < first - 1) {
+    size_t len;
+    if (!reader_next(&cursor->reader, &len)) {
+      cursor->eof = 1;
+      return SQLITE_OK;
+    }
+    cursor->rowid++;
+  }
+
+  return db_next(base);
+}
+
+static int
+db_eof(sqlite3_vtab_cursor *base) {
+  return ((db_cursor_t *)base)->eof;
+}
+
+// Returns a field with the column's affinity. Empty int and real fields are
+// NULL, and values that aren't numbers are text.
+static int
+db_column(sqlite3_vtab_cursor *base, sqlite3_context *ctx, int i) {
+  db_cursor_t *cursor = (db_cursor_t *)base;
+  db_vtab_t *vtab = (db_vtab_t *)base->pVtab;
+  const field_t *field = record_field(&cursor->batch.records[cursor->pos],
+                                      i + 1);
+  const char *s = field ? field->ptr : "";
+  size_t len = field ? field->len : 0;
+  int64_t v;
+  double d;
+
+  if (vtab->affinities[i] == AFFINITY_TEXT) {
+    sqlite3_result_text(ctx, s, len, SQLITE_TRANSIENT);
+  } else if (!len) {
+    sqlite3_result_null(ctx);
+  } else if (vtab->affinities[i] == AFFINITY_INT &&
+             parse_int64(s, len, &v) == 0) {
+    sqlite3_result_int64(ctx, v);
+  } else if (parse_real(s, len, &d) == 0) {
+    sqlite3_result_double(ctx, d);
+  } else {
+    sqlite3_result_text(ctx, s, len, SQLITE_TRANSIENT);
+  }
+
+  return SQLITE_OK;
+}
+
+static int
+db_rowid(sqlite3_vtab_cursor *base, sqlite_int64 *rowid) {
+  *rowid = ((db_cursor_t *)base)->rowid;
+  return SQLITE_OK;
+}
+
+static sqlite3_module db_module = {
+  0,               // iVersion
+  db_connect,      // xCreate
+  db_connect,      // xConnect
+  db_best_index,
+  db_disconnect,
+  db_disconnect,   // xDestroy
+  db_open,
+  db_close,
+  db_filter,
+  db_next,
+  db_eof,
+  db_column,
+  db_rowid,
+  NULL,            // xUpdate: the table is read-only.
+  NULL,
+  NULL,
+  NULL,
+  NULL,
+  NULL,
+  NULL,
+  NULL,
+  NULL,
+  NULL,
+  NULL
+};
+
+int
+sqlite3_dbvtab_init(sqlite3 *db, char **err, const sqlite3_api_routines *api) {
+  SQLITE_EXTENSION_INIT2(api);
+  return sqlite3_create_module(db, "db", &db_module, NULL);
+}
@@ -0,0 +1,361 @@
+// jsonfilter-cidr
+//
+// Copyright (c) 2015, Los Alamos National Security, LLC
+// All rights reserved.
+//
+// Copyright (2015). Los Alamos National Security, LLC. This software was
+// produced under U.S. Government contract DE-AC52-06NA25396 for Los Alamos
+// National Laboratory (LANL), which is operated by Los Alamos National
+// Security, LLC for the U.S. Department of Energy. The U.S. Government has
+// rights to use, reproduce, and distribute this software. NEITHER THE
+// GOVERNMENT NOR LOS ALAMOS NATIONAL SECURITY, LLC MAKES ANY WARRANTY, EXPRESS
+// OR IMPLIED, OR ASSUMES ANY LIABILITY FOR THE USE OF THIS SOFTWARE. If
+// software is modified to produce derivative works, such modified software
+// should be clearly marked, so as not to confuse it with the version available
+// from LANL.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//
+// Filter JSON records with IP values based on include/exclude rules specified
+// in ACL files.
+//
+// Author: Curt Hash <chash@lanl.gov>
+
+#include <getopt.h>
+#include <libgen.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "netacl.h"
+
+#define BUFSIZE 16384
+#define MAX_VALUE 128
+
+typedef struct {
+  const char *name;
+  size_t namelen;
+  netacl_t *acl;
+  netacl_router_t router;
+} field_t;
+
+typedef struct {
+  field_t *fields;
+  int size;
+} fields_t;
+
+// Returns a pointer to the closing quote of the JSON string starting at s, the
+// character after the opening quote, or NULL if the line ends first. Sets
+// *escaped if the string contains escape sequences.
+static inline const char *
+scan_string(const char *s, int *escaped) {
+  for (;;) {
+    const char *q = strpbrk(s, "\"\\\n");
+    if (!q || *q == '\n') {
+      return NULL;
+    }
+
+    if (*q == '"') {
+      return q;
+    }
+
+    // Skip the escaped character.
+    *escaped = 1;
+    if (!q[1]) {
+      return NULL;
+    }
+    s = q + 2;
+  }
+}
+
+// Copies a JSON string value into buf, resolving the escapes that can occur in
+// an address ("\/" in particular). Other escapes are copied as-is, which makes
+// the value an invalid address, as it would be anyway.
+static void
+unescape(const char *s, size_t len, char *buf) {
+  size_t i, j;
+  for (i = 0, j = 0; i < len && j < MAX_VALUE - 1; i++) {
+    if (s[i] == '\\' && i + 1 < len && (s[i+1] == '/' || s[i+1] == '\\' ||
+                                         s[i+1] == '"')) {
+      i++;
+    }
+    buf[j++] = s[i];
+  }
+
+  buf[j] = '\0';
+}
+
+// Tests a field value against its ACL.
+static inline int
+test_value(const field_t *field, const char *value, size_t len, int escaped) {
+  char buf[MAX_VALUE];
+
+  if (escaped) {
+    unescape(value, len, buf);
+  } else if (len < MAX_VALUE) {
+    memcpy(buf, value, len);
+    buf[len] = '\0';
+  } else {
+    // Much too long for an address.
+    buf[0] = '\0';
+  }
+
+  return netacl_router_pass(&field->router, buf);
+}
+
+// Scans the top-level keys of the JSON object on a line and tests the values of
+// the filtered fields. Fields missing from the record are tested as empty
+// values. Nested objects and arrays are skipped without being parsed. Returns
+// 1 if the record passes every ACL.
+static int
+test_record(const fields_t *fields, const char *line, char *seen) {
+  memset(seen, 0, fields->size);
+
+  const char *p = line;
+  int depth = 0;
+  int expect_key = 0;
+
+  for (; *p && *p != '\n'; p++) {
+    switch (*p) {
+      case '{':
+      case '[':
+        depth++;
+        expect_key = depth == 1 && *p == '{';
+        continue;
+      case '}':
+      case ']':
+        depth--;
+        continue;
+      case ',':
+        expect_key = depth == 1;
+        continue;
+      case '"':
+        break;
+      default:
+        continue;
+    }
+
+    // A string.
+    int escaped = 0;
+    const char *start = p + 1;
+    const char *end = scan_string(start, &escaped);
+    if (!end) {
+      break;
+    }
+    p = end;
+
+    if (!expect_key) {
+      continue;
+    }
+    expect_key = 0;
+
+    int i;
+    for (i = 0; i < fields->size; i++) {
+      const field_t *field = &fields->fields[i];
+      if (!seen[i] && field->namelen == end - start && !escaped &&
+          memcmp(field->name, start, field->namelen) == 0) {
+        break;
+      }
+    }
+
+    if (i == fields->size) {
+      continue;
+    }
+    seen[i] = 1;
+
+    // Find the value.
+    p = end + 1;
+    p += strspn(p, " \t\r");
+    if (*p != ':') {
+      break;
+    }
+    p++;
+    p += strspn(p, " \t\r");
+
+    const char *value;
+    size_t len;
+    escaped = 0;
+    if (*p == '"') {
+      value = p + 1;
+      end = scan_string(value, &escaped);
+      if (!end) {
+        break;
+      }
+      len = end - value;
+      p = end;
+    } else if (*p == '{' || *p == '[') {
+      // Not an address; the scan continues into it.
+      value = "";
+      len = 0;
+      p--;
+    } else {
+      // Number, literal or garbage.
+      value = p;
+      len = strcspn(p, " \t\r\n,}]");
+      p = value + len - 1;
+    }
+
+    if (!test_value(&fields->fields[i], value, len, escaped)) {
+      return 0;
+    }
+  }
+
+  // Test missing fields as empty values.
+  int i;
+  for (i = 0; i < fields->size; i++) {
+    if (!seen[i] && !netacl_router_pass(&fields->fields[i].router, "")) {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+// Apply the ACLs to the input data.
+void
+filter(const fields_t *fields) {
+  size_t bufsize = BUFSIZE;
+  char *buf = malloc(bufsize);
+  size_t offset = 0;
+  char *seen = malloc(fields->size);
+
+  while (fgets(buf + offset, bufsize - offset, stdin)) {
+    size_t len = strlen(buf);
+
+    if (buf[len - 1] == '\n') {
+      offset = 0;
+    } else if (feof(stdin)) {
+      // Last line without a new line.
+      offset = 0;
+    } else {
+      // Grow the line buffer.
+      bufsize *= 2;
+      buf = realloc(buf, bufsize);
+      offset = len;
+      continue;
+    }
+
+    if (test_record(fields, buf, seen)) {
+      fwrite(buf, 1, len, stdout);
+    }
+  }
+
+  free(seen);
+
+#ifdef DEBUG
+  free(buf);
+#endif
+}
+
+// Prints an error message to stderr.
+static void
+perr(char *prog, const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  fprintf(stderr, "%s error: ", basename(prog));
+  vfprintf(stderr, fmt, ap);
+  va_end(ap);
+}
+
+// Prints usage and exits.
+void
+usage(char *prog, int status) {
+  printf("Usage: <data stream> | %s [OPTION]... [[FIELD] [ACL PATH]]...\n\n",
+         basename(prog));
+  printf("  -h, --help                  Print this text and exit.\n");
+  printf("  -n, --normalize             Merge and drop redundant ACL rules "
+         "before\n"
+         "                              filtering and report the reduction.\n");
+  printf("\nFIELD is the name of a top-level field of the JSON records.\n");
+  printf("\nACL PATH should contain a list of rules with the following "
+         "syntax:\n\n");
+  printf("  (+|-)CIDR\n\n");
+  printf("'+' and '-' denote include and exclude rules, respectively.\n");
+  printf("Blank lines and lines beginning with '#' are ignored.\n");
+
+  exit(status);
+}
+
+int
+main(int argc, char **argv) {
+  // Parse options.
+  static struct option long_options[] = {
+    {"help", no_argument, NULL, 'h'},
+    {"normalize", no_argument, NULL, 'n'},
+    {NULL, 0, NULL, 0}
+  };
+  const char *options = "hn";
+  char opt;
+  char normalize = 0;
+  while ((opt = getopt_long(argc, argv, options, long_options, NULL)) != -1) {
+    switch (opt) {
+      case 'h':
+        usage(argv[0], EXIT_SUCCESS);
+        break;
+      case 'n':
+        normalize = 1;
+        break;
+      default:
+        perr(argv[0], "unrecognized option '%c'\n", opt);
+        usage(argv[0], EXIT_FAILURE);
+        break;
+    }
+  }
+
+  int nargs = argc - optind;
+  if (nargs == 0 || nargs % 2 != 0) {
+    // Expected at least one field name, ACL path pair.
+    perr(argv[0], "missing required arguments\n");
+    exit(EXIT_FAILURE);
+  }
+
+  // Initialize ACLs.
+  fields_t fields = {malloc(sizeof (field_t) * nargs / 2), nargs / 2};
+  int i;
+  for (i = 0; i < fields.size; i++) {
+    field_t *field = &fields.fields[i];
+    char *acl_path = argv[optind + 2*i + 1];
+
+    field->name = argv[optind + 2*i];
+    field->namelen = strlen(field->name);
+    field->acl = malloc(sizeof (netacl_t));
+    if (netacl_load(acl_path, field->acl, normalize) != 0) {
+      fprintf(stderr, "could not initialize ACL from path '%s'\n", acl_path);
+      exit(EXIT_FAILURE);
+    }
+
+    netacl_router_init(&field->router, (const netacl_t **)&field->acl, 1);
+  }
+
+  // Apply the ACLs to the input data.
+  filter(&fields);
+
+#ifdef DEBUG
+  // Free things.
+  for (i = 0; i < fields.size; i++) {
+    netacl_router_destroy(&fields.fields[i].router);
+    netacl_destroy(fields.fields[i].acl);
+    free(fields.fields[i].acl);
+  }
+  free(fields.fields);
+#endif
+
+  return 0;
+}
@@ -0,0 +1,1687 @@
+// arrow
+//
+// Copyright (c) 2015, Los Alamos National Security, LLC
+// All rights reserved.
+//
+// Copyright (2015). Los Alamos National Security, LLC. This software was
+// produced under U.S. Government contract DE-AC52-06NA25396 for Los Alamos
+// National Laboratory (LANL), which is operated by Los Alamos National
+// Security, LLC for the U.S. Department of Energy. The U.S. Government has
+// rights to use, reproduce, and distribute this software. NEITHER THE
+// GOVERNMENT NOR LOS ALAMOS NATIONAL SECURITY, LLC MAKES ANY WARRANTY, EXPRESS
+// OR IMPLIED, OR ASSUMES ANY LIABILITY FOR THE USE OF THIS SOFTWARE. If
+// software is modified to produce derivative works, such modified software
+// should be clearly marked, so as not to confuse it with the version available
+// from LANL.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//
+//
+// Author: Curt Hash <chash@lanl.gov>
+
+#include <errno.h>
+#include <inttypes.h>
+
+#include "arrow.h"
+#include "dbc.h"
+
+// Marks the start of a message.
+#define CONTINUATION 0xffffffffu
+
+#define METADATA_V5 4
+
+// Message header types.
+#define HEADER_SCHEMA 1
+#define HEADER_DICTIONARY 2
+#define HEADER_RECORD_BATCH 3
+
+// Field types.
+#define TYPE_INT 2
+#define TYPE_FLOAT 3
+#define TYPE_UTF8 5
+#define TYPE_BOOL 6
+#define TYPE_LARGE_UTF8 20
+
+#define PRECISION_SINGLE 1
+#define PRECISION_DOUBLE 2
+
+// Most fields in a flatbuffer table.
+#define FB_FIELDS 8
+
+// Largest message metadata.
+#define MAX_META 1073741824
+
+// A growable byte buffer.
+typedef struct {
+  uint8_t *data;
+  size_t len;
+  size_t size;
+} bytes_t;
+
+static void
+put_bytes(bytes_t *b, const void *data, size_t len) {
+  if (b->len + len > b->size) {
+    if (!b->size) {
+      b->size = 4096;
+    }
+    while (b->len + len > b->size) {
+      b->size *= 2;
+    }
+    b->data = realloc(b->data, b->size);
+  }
+
+  if (len) {
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+  }
+}
+
+static void
+put_le(uint8_t *p, uint64_t v, int width) {
+  int i;
+  for (i = 0; i < width; i++) {
+    p[i] = v >> (8 * i);
+  }
+}
+
+static uint64_t
+get_le(const uint8_t *p, int width) {
+  uint64_t v = 0;
+  int i;
+  for (i = 0; i < width; i++) {
+    v |= (uint64_t)p[i] << (8 * i);
+  }
+
+  return v;
+}
+
+static int
+big_endian(void) {
+  uint16_t x = 1;
+  return *(uint8_t *)&x == 0;
+}
+
+static uint32_t
+hash_bytes(const char *s, size_t len) {
+  uint32_t h = 2166136261u;
+  size_t i;
+  for (i = 0; i < len; i++) {
+    h = (h ^ (unsigned char)s[i]) * 16777619u;
+  }
+
+  return h;
+}
+
+// A flatbuffer, built back to front so that every object is written before
+// the offsets that refer to it. Positions are counted from the end.
+typedef struct {
+  uint8_t *buf;
+  size_t size;
+  size_t used;
+  size_t minalign;
+  size_t fields[FB_FIELDS];  // Positions of the fields of the open table.
+  int nfields;
+  size_t start;
+} fb_t;
+
+static void
+fb_init(fb_t *b) {
+  memset(b, 0, sizeof (fb_t));
+  b->minalign = 8;
+}
+
+static void
+fb_reserve(fb_t *b, size_t len) {
+  if (b->buf && b->used + len <= b->size) {
+    return;
+  }
+
+  size_t size = b->size ? b->size : 1024;
+  while (b->used + len > size) {
+    size *= 2;
+  }
+
+  uint8_t *buf = malloc(size);
+  if (b->used) {
+    memcpy(buf + size - b->used, b->buf + b->size - b->used, b->used);
+  }
+  free(b->buf);
+  b->buf = buf;
+  b->size = size;
+}
+
+static void
+fb_push(fb_t *b, const void *data, size_t len) {
+  fb_reserve(b, len);
+  b->used += len;
+  memcpy(b->buf + b->size - b->used, data, len);
+}
+
+static void
+fb_pad(fb_t *b, size_t len) {
+  fb_reserve(b, len);
+  b->used += len;
+  memset(b->buf + b->size - b->used, 0, len);
+}
+
+// Pads so that the buffer is aligned to align after len more bytes.
+static void
+fb_prep(fb_t *b, size_t align, size_t len) {
+  if (align > b->minalign) {
+    b->minalign = align;
+  }
+  fb_pad(b, (~(b->used + len) + 1) & (align - 1));
+}
+
+static void
+fb_scalar(fb_t *b, uint64_t v, int width) {
+  uint8_t buf[8];
+  put_le(buf, v, width);
+  fb_prep(b, width, 0);
+  fb_push(b, buf, width);
+}
+
+// Pushes an offset to the object at position off.
+static void
+fb_offset(fb_t *b, size_t off) {
+  fb_prep(b, 4, 0);
+  fb_scalar(b, b->used + 4 - off, 4);
+}
+
+static size_t
+fb_string(fb_t *b, const char *s, size_t len) {
+  fb_prep(b, 4, len + 1);
+  fb_pad(b, 1);
+  fb_push(b, s, len);
+  fb_scalar(b, len, 4);
+  return b->used;
+}
+
+// Starts a vector of n elements, which are then pushed last to first.
+static void
+fb_vector_start(fb_t *b, size_t elem_size, size_t n, size_t align) {
+  fb_prep(b, 4, elem_size * n);
+  fb_prep(b, align, elem_size * n);
+}
+
+static size_t
+fb_vector_end(fb_t *b, size_t n) {
+  fb_scalar(b, n, 4);
+  return b->used;
+}
+
+// Starts a table. Objects it refers to must already be written.
+static void
+fb_start(fb_t *b, int nfields) {
+  memset(b->fields, 0, sizeof b->fields);
+  b->nfields = nfields;
+  b->start = b->used;
+}
+
+static void
+fb_add(fb_t *b, int id, uint64_t v, int width) {
+  fb_scalar(b, v, width);
+  b->fields[id] = b->used;
+}
+
+static void
+fb_add_offset(fb_t *b, int id, size_t off) {
+  fb_offset(b, off);
+  b->fields[id] = b->used;
+}
+
+// Ends a table, writing its vtable just before it.
+static size_t
+fb_end(fb_t *b) {
+  fb_scalar(b, 0, 4);
+  size_t table = b->used;
+
+  int id;
+  for (id = b->nfields - 1; id >= 0; id--) {
+    fb_scalar(b, b->fields[id] ? table - b->fields[id] : 0, 2);
+  }
+  fb_scalar(b, table - b->start, 2);
+  fb_scalar(b, 4 + 2 * b->nfields, 2);
+
+  put_le(b->buf + b->size - table, b->used - table, 4);
+
+  return table;
+}
+
+// Writes the root offset. Returns the start of the finished buffer, which is
+// b->used bytes long.
+static const uint8_t *
+fb_finish(fb_t *b, size_t root) {
+  fb_prep(b, b->minalign, 4);
+  fb_offset(b, root);
+  return b->buf + b->size - b->used;
+}
+
+// A flatbuffer being read. Positions are counted from the start, and 0 means
+// that an object is absent. Reads out of bounds set bad and return 0.
+typedef struct {
+  const uint8_t *buf;
+  size_t len;
+  int bad;
+} fbr_t;
+
+static uint64_t
+fbr_get(fbr_t *r, size_t pos, int width) {
+  if (pos > r->len || (size_t)width > r->len - pos) {
+    r->bad = 1;
+    return 0;
+  }
+
+  return get_le(r->buf + pos, width);
+}
+
+// Returns the position of a field of a table, or 0 if it is absent.
+static size_t
+fbr_field(fbr_t *r, size_t table, int id) {
+  if (!table) {
+    return 0;
+  }
+
+  int64_t vtable = (int64_t)table - (int32_t)fbr_get(r, table, 4);
+  if (vtable < 0 || (uint64_t)vtable >= r->len) {
+    r->bad = 1;
+    return 0;
+  }
+
+  size_t vsize = fbr_get(r, vtable, 2);
+  if ((size_t)(4 + 2 * id + 2) > vsize) {
+    return 0;
+  }
+
+  size_t off = fbr_get(r, vtable + 4 + 2 * id, 2);
+  return off ? table + off : 0;
+}
+
+static uint64_t
+fbr_scalar(fbr_t *r, size_t table, int id, int width, uint64_t def) {
+  size_t pos = fbr_field(r, table, id);
+  return pos ? fbr_get(r, pos, width) : def;
+}
+
+// Follows the offset at pos.
+static size_t
+fbr_follow(fbr_t *r, size_t pos) {
+  uint64_t target = pos + fbr_get(r, pos, 4);
+  if (target >= r->len) {
+    r->bad = 1;
+    return 0;
+  }
+
+  return target;
+}
+
+// Returns the table, vector, or string that a field refers to, or 0.
+static size_t
+fbr_ref(fbr_t *r, size_t table, int id) {
+  size_t pos = fbr_field(r, table, id);
+  return pos ? fbr_follow(r, pos) : 0;
+}
+
+// Returns the position of the first element of a vector field, and sets n to
+// its length.
+static size_t
+fbr_vector(fbr_t *r, size_t table, int id, size_t elem_size, uint64_t *n) {
+  *n = 0;
+  size_t pos = fbr_ref(r, table, id);
+  if (!pos) {
+    return 0;
+  }
+
+  uint64_t len = fbr_get(r, pos, 4);
+  if (r->bad || len * elem_size > r->len - pos - 4) {
+    r->bad = 1;
+    return 0;
+  }
+
+  *n = len;
+  return pos + 4;
+}
+
+// Returns a copy of a string field, or NULL if it is absent.
+static char *
+fbr_string(fbr_t *r, size_t table, int id) {
+  uint64_t len;
+  size_t pos = fbr_vector(r, table, id, 1, &len);
+  if (!pos) {
+    return NULL;
+  }
+
+  char *s = malloc(len + 1);
+  memcpy(s, r->buf + pos, len);
+  s[len] = '\0';
+
+  return s;
+}
+
+// A buffer of a message body.
+typedef struct {
+  uint64_t offset;
+  uint64_t len;
+} buffer_t;
+
+// The length and null count of a column in a record batch.
+typedef struct {
+  int64_t length;
+  int64_t nulls;
+} node_t;
+
+// Appends a buffer to a message body, padded to 8 bytes.
+static void
+put_buffer(bytes_t *body, buffer_t *buffers, int *n, const void *data,
+           size_t len) {
+  static const uint8_t zeros[8];
+
+  buffers[*n].offset = body->len;
+  buffers[*n].len = len;
+  (*n)++;
+
+  put_bytes(body, data, len);
+  put_bytes(body, zeros, (8 - len % 8) % 8);
+}
+
+static size_t
+fb_message(fb_t *b, int header_type, size_t header, uint64_t body_len) {
+  fb_start(b, 5);
+  fb_add(b, 3, body_len, 8);
+  fb_add_offset(b, 2, header);
+  fb_add(b, 0, METADATA_V5, 2);
+  fb_add(b, 1, header_type, 1);
+  return fb_end(b);
+}
+
+static size_t
+fb_record_batch(fb_t *b, int64_t nrows, const node_t *nodes, int nnodes,
+                const buffer_t *buffers, int nbuffers) {
+  uint8_t s[16];
+  int i;
+
+  fb_vector_start(b, 16, nbuffers, 8);
+  for (i = nbuffers - 1; i >= 0; i--) {
+    put_le(s, buffers[i].offset, 8);
+    put_le(s + 8, buffers[i].len, 8);
+    fb_push(b, s, 16);
+  }
+  size_t buffers_off = fb_vector_end(b, nbuffers);
+
+  fb_vector_start(b, 16, nnodes, 8);
+  for (i = nnodes - 1; i >= 0; i--) {
+    put_le(s, nodes[i].length, 8);
+    put_le(s + 8, nodes[i].nulls, 8);
+    fb_push(b, s, 16);
+  }
+  size_t nodes_off = fb_vector_end(b, nnodes);
+
+  fb_start(b, 5);
+  fb_add(b, 0, nrows, 8);
+  fb_add_offset(b, 1, nodes_off);
+  fb_add_offset(b, 2, buffers_off);
+  return fb_end(b);
+}
+
+// Builds the schema. Each column keeps its #db type in its metadata, and a
+// dictionary encoded column uses its index as its dictionary id.
+static size_t
+fb_schema(fb_t *b, const arrow_writer_t *writer) {
+  size_t *fields = malloc(sizeof (size_t) * (writer->ncols + 1));
+  int i;
+
+  for (i = 0; i < writer->ncols; i++) {
+    const arrow_column_t *column = &writer->columns[i];
+
+    size_t key = fb_string(b, "db.type", 7);
+    size_t value = fb_string(b, column->db_type, strlen(column->db_type));
+    fb_start(b, 2);
+    fb_add_offset(b, 0, key);
+    fb_add_offset(b, 1, value);
+    size_t kv = fb_end(b);
+
+    fb_vector_start(b, 4, 1, 4);
+    fb_offset(b, kv);
+    size_t metadata = fb_vector_end(b, 1);
+
+    fb_vector_start(b, 4, 0, 4);
+    size_t children = fb_vector_end(b, 0);
+
+    size_t name = fb_string(b, column->name, strlen(column->name));
+
+    int type_type;
+    size_t type;
+    switch (column->type) {
+      case ARROW_INT:
+        fb_start(b, 2);
+        fb_add(b, 0, 64, 4);
+        fb_add(b, 1, 1, 1);
+        type_type = TYPE_INT;
+        break;
+      case ARROW_REAL:
+        fb_start(b, 1);
+        fb_add(b, 0, PRECISION_DOUBLE, 2);
+        type_type = TYPE_FLOAT;
+        break;
+      default:
+        fb_start(b, 0);
+        type_type = TYPE_UTF8;
+        break;
+    }
+    type = fb_end(b);
+
+    size_t dict = 0;
+    if (column->dict) {
+      fb_start(b, 2);
+      fb_add(b, 0, 32, 4);
+      fb_add(b, 1, 1, 1);
+      size_t index = fb_end(b);
+
+      fb_start(b, 4);
+      fb_add(b, 0, i, 8);
+      fb_add_offset(b, 1, index);
+      dict = fb_end(b);
+    }
+
+    fb_start(b, 7);
+    fb_add_offset(b, 0, name);
+    fb_add_offset(b, 3, type);
+    if (dict) {
+      fb_add_offset(b, 4, dict);
+    }
+    fb_add_offset(b, 5, children);
+    fb_add_offset(b, 6, metadata);
+    fb_add(b, 1, 1, 1);
+    fb_add(b, 2, type_type, 1);
+    fields[i] = fb_end(b);
+  }
+
+  fb_vector_start(b, 4, writer->ncols, 4);
+  for (i = writer->ncols - 1; i >= 0; i--) {
+    fb_offset(b, fields[i]);
+  }
+  size_t fields_off = fb_vector_end(b, writer->ncols);
+  free(fields);
+
+  fb_start(b, 4);
+  fb_add_offset(b, 1, fields_off);
+  fb_add(b, 0, big_endian(), 2);
+  return fb_end(b);
+}
+
+// Writes data to the output.
+static int
+emit(arrow_writer_t *writer, const void *data, size_t len) {
+  writer->offset += len;
+  return writer_write(&writer->out, data, len);
+}
+
+// Writes a message and its body, and sets block to its location.
+static int
+write_message(arrow_writer_t *writer, fb_t *b, size_t message,
+              const bytes_t *body, arrow_block_t *block) {
+  const uint8_t *meta = fb_finish(b, message);
+  uint8_t prefix[8];
+  put_le(prefix, CONTINUATION, 4);
+  put_le(prefix + 4, b->used, 4);
+
+  block->offset = writer->offset;
+  block->meta_size = 8 + b->used;
+  block->body_size = body ? body->len : 0;
+
+  if (emit(writer, prefix, 8) == -1 || emit(writer, meta, b->used) == -1) {
+    return -1;
+  }
+
+  return body ? emit(writer, body->data, body->len) : 0;
+}
+
+static void
+add_block(arrow_block_t **blocks, size_t *n, size_t *size,
+          const arrow_block_t *block) {
+  if (*n == *size) {
+    *size = *size ? 2 * *size : 64;
+    *blocks = realloc(*blocks, sizeof (arrow_block_t) * *size);
+  }
+  (*blocks)[(*n)++] = *block;
+}
+
+int
+arrow_writer_init(arrow_writer_t *writer, int fd, const schema_t *schema,
+                  size_t batch_rows, char file) {
+  memset(writer, 0, sizeof (arrow_writer_t));
+  writer_init(&writer->out, fd, WRITER_BUFSIZE);
+  writer->file = file;
+  writer->batch_rows = batch_rows;
+  writer->ncols = schema->ncols;
+  writer->columns = calloc(schema->ncols + 1, sizeof (arrow_column_t));
+
+  column_t *c;
+  for (c = schema->head; c; c = c->flink) {
+    arrow_column_t *column = &writer->columns[c->index - 1];
+    column->name = c->name;
+    column->db_type = c->type;
+    if (strcmp(c->type, "int") == 0) {
+      column->type = ARROW_INT;
+    } else if (strcmp(c->type, "real") == 0) {
+      column->type = ARROW_REAL;
+    } else {
+      column->type = ARROW_STR;
+    }
+  }
+
+  if (file) {
+    return emit(writer, ARROW_MAGIC "\0", 8);
+  }
+
+  return 0;
+}
+
+static void
+dict_rehash(arrow_column_t *column, size_t table_size) {
+  free(column->table);
+  column->table = calloc(table_size, sizeof (uint32_t));
+  column->table_size = table_size;
+
+  uint32_t i;
+  for (i = 0; i < column->ndict; i++) {
+    uint64_t start = i ? column->dict_ends[i - 1] : 0;
+    size_t slot = hash_bytes(column->dict_text + start,
+                             column->dict_ends[i] - start) & (table_size - 1);
+    while (column->table[slot]) {
+      slot = (slot + 1) & (table_size - 1);
+    }
+    column->table[slot] = i + 1;
+  }
+}
+
+// Returns the dictionary index of a value, adding it if it is new.
+static uint32_t
+dict_add(arrow_column_t *column, const char *s, size_t len) {
+  if (2 * (column->ndict + 1) > column->table_size) {
+    dict_rehash(column, column->table_size ? 2 * column->table_size : 1024);
+  }
+
+  size_t mask = column->table_size - 1;
+  size_t slot = hash_bytes(s, len) & mask;
+  while (column->table[slot]) {
+    uint32_t j = column->table[slot] - 1;
+    uint64_t start = j ? column->dict_ends[j - 1] : 0;
+    if (column->dict_ends[j] - start == len &&
+        memcmp(column->dict_text + start, s, len) == 0) {
+      return j;
+    }
+    slot = (slot + 1) & mask;
+  }
+
+  if (column->dict_len + len > column->dict_size) {
+    if (!column->dict_size) {
+      column->dict_size = 65536;
+    }
+    while (column->dict_len + len > column->dict_size) {
+      column->dict_size *= 2;
+    }
+    column->dict_text = realloc(column->dict_text, column->dict_size);
+  }
+  if (column->ndict == column->dict_cap) {
+    column->dict_cap = column->dict_cap ? 2 * column->dict_cap : 1024;
+    column->dict_ends = realloc(column->dict_ends,
+                                sizeof (uint64_t) * column->dict_cap);
+  }
+
+  memcpy(column->dict_text + column->dict_len, s, len);
+  column->dict_len += len;
+  column->dict_ends[column->ndict] = column->dict_len;
+  column->table[slot] = ++column->ndict;
+
+  return column->ndict - 1;
+}
+
+static void
+dict_reset(arrow_column_t *column) {
+  column->ndict = 0;
+  column->dict_len = 0;
+  column->emitted = 0;
+  memset(column->table, 0, sizeof (uint32_t) * column->table_size);
+}
+
+// Chooses how each column is stored from the first record batch. int and real
+// columns are stored as strings if any value is malformed, and str columns are
+// dictionary encoded if at most half of their values are distinct.
+static void
+choose_types(arrow_writer_t *writer) {
+  size_t nrows = writer->nrows;
+  int i;
+
+  for (i = 0; i < writer->ncols; i++) {
+    arrow_column_t *column = &writer->columns[i];
+    size_t r;
+
+    for (r = 0; r < nrows && column->type != ARROW_STR; r++) {
+      uint64_t start = r ? column->ends[r - 1] : 0;
+      size_t len = column->ends[r] - start;
+      int64_t v;
+      double d;
+      if (len && (column->type == ARROW_INT ?
+                  parse_int64(column->text + start, len, &v) :
+                  parse_double(column->text + start, len, &d)) == -1) {
+        column->type = ARROW_STR;
+      }
+    }
+
+    if (column->type != ARROW_STR || nrows < 2) {
+      continue;
+    }
+
+    for (r = 0; r < nrows && 2 * column->ndict <= nrows; r++) {
+      uint64_t start = r ? column->ends[r - 1] : 0;
+      dict_add(column, column->text + start, column->ends[r] - start);
+    }
+
+    column->dict = 2 * column->ndict <= nrows;
+    if (!column->dict) {
+      dict_reset(column);
+    }
+  }
+}
+
+// Writes the dictionary entries added since the last dictionary batch. They
+// are written as a delta, unless the dictionary is new or was replaced.
+static int
+write_dictionary(arrow_writer_t *writer, arrow_column_t *column, int64_t id) {
+  uint32_t first = column->emitted;
+  uint32_t n = column->ndict - first;
+  uint64_t base = first ? column->dict_ends[first - 1] : 0;
+
+  int32_t *offsets = malloc(sizeof (int32_t) * (n + 1));
+  offsets[0] = 0;
+  uint32_t k;
+  for (k = 0; k < n; k++) {
+    offsets[k + 1] = column->dict_ends[first + k] - base;
+  }
+
+  bytes_t body = {NULL, 0, 0};
+  buffer_t buffers[3];
+  int nbuffers = 0;
+  put_buffer(&body, buffers, &nbuffers, NULL, 0);
+  put_buffer(&body, buffers, &nbuffers, offsets, sizeof (int32_t) * (n + 1));
+  put_buffer(&body, buffers, &nbuffers, column->dict_text + base,
+             column->dict_len - base);
+
+  node_t node = {n, 0};
+  fb_t b;
+  fb_init(&b);
+  size_t data = fb_record_batch(&b, n, &node, 1, buffers, nbuffers);
+  fb_start(&b, 3);
+  fb_add(&b, 0, id, 8);
+  fb_add_offset(&b, 1, data);
+  fb_add(&b, 2, first > 0, 1);
+  size_t dict = fb_end(&b);
+
+  arrow_block_t block;
+  int ret = write_message(writer, &b,
+                          fb_message(&b, HEADER_DICTIONARY, dict, body.len),
+                          &body, &block);
+  if (writer->file) {
+    add_block(&writer->dicts, &writer->ndicts, &writer->dicts_size, &block);
+  }
+  column->emitted = column->ndict;
+
+  free(b.buf);
+  free(body.data);
+  free(offsets);
+
+  return ret;
+}
+
+static int
+write_schema(arrow_writer_t *writer) {
+  fb_t b;
+  fb_init(&b);
+  size_t schema = fb_schema(&b, writer);
+
+  arrow_block_t block;
+  int ret = write_message(writer, &b,
+                          fb_message(&b, HEADER_SCHEMA, schema, 0), NULL,
+                          &block);
+  free(b.buf);
+  writer->started = 1;
+
+  return ret;
+}
+
+// Encodes and writes the current record batch, and any dictionary entries it
+// adds. Empty int and real values, and malformed ones, are written as nulls.
+static int
+write_batch(arrow_writer_t *writer) {
+  if (!writer->started) {
+    choose_types(writer);
+    if (write_schema(writer) == -1) {
+      return -1;
+    }
+  }
+
+  size_t nrows = writer->nrows;
+  if (!nrows) {
+    return 0;
+  }
+
+  int ncols = writer->ncols;
+  node_t *nodes = malloc(sizeof (node_t) * (ncols + 1));
+  buffer_t *buffers = malloc(sizeof (buffer_t) * (3 * ncols + 1));
+  int nbuffers = 0;
+  bytes_t body = {NULL, 0, 0};
+  size_t bitmap_size = (nrows + 7) / 8;
+  uint8_t *bitmap = malloc(bitmap_size);
+  uint64_t *values = malloc(sizeof (uint64_t) * nrows);
+  int32_t *offsets = malloc(sizeof (int32_t) * (nrows + 1));
+  int ret = 0;
+  int i;
+
+  for (i = 0; i < ncols && ret == 0; i++) {
+    arrow_column_t *column = &writer->columns[i];
+    int64_t *ints = (int64_t *)values;
+    double *reals = (double *)values;
+    uint32_t *indexes = (uint32_t *)values;
+    int64_t nulls = 0;
+    size_t r;
+
+    memset(bitmap, 0xff, bitmap_size);
+
+    if (column->dict && !writer->file && column->ndict > ARROW_DICT_MAX) {
+      // Replace a stream's dictionary to bound its size.
+      dict_reset(column);
+    }
+
+    for (r = 0; r < nrows; r++) {
+      uint64_t start = r ? column->ends[r - 1] : 0;
+      const char *s = column->text + start;
+      size_t len = column->ends[r] - start;
+      int null = 0;
+
+      switch (column->type) {
+        case ARROW_INT:
+          null = !len || parse_int64(s, len, &ints[r]) == -1;
+          if (null) {
+            ints[r] = 0;
+          }
+          break;
+        case ARROW_REAL:
+          null = !len || parse_double(s, len, &reals[r]) == -1;
+          if (null) {
+            reals[r] = 0;
+          }
+          break;
+        default:
+          if (column->dict) {
+            indexes[r] = dict_add(column, s, len);
+          } else {
+            offsets[r + 1] = column->ends[r];
+          }
+          break;
+      }
+
+      if (null) {
+        bitmap[r / 8] &= ~(1 << (r % 8));
+        column->malformed += len > 0;
+        nulls++;
+      }
+    }
+
+    nodes[i].length = nrows;
+    nodes[i].nulls = nulls;
+    put_buffer(&body, buffers, &nbuffers, bitmap, nulls ? bitmap_size : 0);
+
+    if (column->type != ARROW_STR) {
+      put_buffer(&body, buffers, &nbuffers, values, sizeof (uint64_t) * nrows);
+    } else if (column->dict) {
+      put_buffer(&body, buffers, &nbuffers, indexes,
+                 sizeof (uint32_t) * nrows);
+      if (column->ndict > column->emitted || !column->emitted) {
+        ret = write_dictionary(writer, column, i);
+      }
+    } else {
+      offsets[0] = 0;
+      put_buffer(&body, buffers, &nbuffers, offsets,
+                 sizeof (int32_t) * (nrows + 1));
+      put_buffer(&body, buffers, &nbuffers, column->text, column->len);
+    }
+  }
+
+  if (ret == 0) {
+    fb_t b;
+    fb_init(&b);
+    size_t batch = fb_record_batch(&b, nrows, nodes, ncols, buffers,
+                                   nbuffers);
+    arrow_block_t block;
+    ret = write_message(writer, &b,
+                        fb_message(&b, HEADER_RECORD_BATCH, batch, body.len),
+                        &body, &block);
+    if (writer->file) {
+      add_block(&writer->batches, &writer->nbatches, &writer->batches_size,
+                &block);
+    }
+    free(b.buf);
+  }
+
+  writer->nrows = 0;
+  writer->text_len = 0;
+  for (i = 0; i < ncols; i++) {
+    writer->columns[i].len = 0;
+  }
+
+  free(nodes);
+  free(buffers);
+  free(body.data);
+  free(bitmap);
+  free(values);
+  free(offsets);
+
+  return ret;
+}
+
+int
+arrow_writer_add(arrow_writer_t *writer, record_t *record) {
+  int i;
+
+  if (writer->nrows == writer->rows_size) {
+    writer->rows_size = writer->rows_size ? 2 * writer->rows_size : 4096;
+    if (writer->rows_size > writer->batch_rows) {
+      writer->rows_size = writer->batch_rows;
+    }
+    for (i = 0; i < writer->ncols; i++) {
+      writer->columns[i].ends = realloc(writer->columns[i].ends,
+                                        sizeof (uint64_t) * writer->rows_size);
+    }
+  }
+
+  for (i = 0; i < writer->ncols; i++) {
+    arrow_column_t *column = &writer->columns[i];
+    const field_t *field = record_field(record, i + 1);
+    size_t len = field ? field->len : 0;
+
+    if (column->len + len > column->size) {
+      if (!column->size) {
+        column->size = 65536;
+      }
+      while (column->len + len > column->size) {
+        column->size *= 2;
+      }
+      column->text = realloc(column->text, column->size);
+    }
+
+    if (len) {
+      memcpy(column->text + column->len, field->ptr, len);
+      column->len += len;
+      writer->text_len += len;
+    }
+    column->ends[writer->nrows] = column->len;
+  }
+
+  if (++writer->nrows == writer->batch_rows ||
+      writer->text_len >= ARROW_BATCH_BYTES) {
+    return write_batch(writer);
+  }
+
+  return 0;
+}
+
+// Builds a vector of the blocks of an Arrow file.
+static size_t
+fb_blocks(fb_t *b, const arrow_block_t *blocks, size_t n) {
+  uint8_t s[24];
+  fb_vector_start(b, 24, n, 8);
+
+  size_t i;
+  for (i = n; i > 0; i--) {
+    memset(s, 0, sizeof s);
+    put_le(s, blocks[i - 1].offset, 8);
+    put_le(s + 8, blocks[i - 1].meta_size, 4);
+    put_le(s + 16, blocks[i - 1].body_size, 8);
+    fb_push(b, s, 24);
+  }
+
+  return fb_vector_end(b, n);
+}
+
+int
+arrow_writer_close(arrow_writer_t *writer) {
+  int ret = write_batch(writer);
+
+  uint8_t eos[8];
+  put_le(eos, CONTINUATION, 4);
+  put_le(eos + 4, 0, 4);
+  if (ret == 0) {
+    ret = emit(writer, eos, 8);
+  }
+
+  if (ret == 0 && writer->file) {
+    // The footer locates the schema and every batch, for random access.
+    fb_t b;
+    fb_init(&b);
+    size_t schema = fb_schema(&b, writer);
+    size_t dicts = fb_blocks(&b, writer->dicts, writer->ndicts);
+    size_t batches = fb_blocks(&b, writer->batches, writer->nbatches);
+    fb_start(&b, 5);
+    fb_add_offset(&b, 1, schema);
+    fb_add_offset(&b, 2, dicts);
+    fb_add_offset(&b, 3, batches);
+    fb_add(&b, 0, METADATA_V5, 2);
+    const uint8_t *footer = fb_finish(&b, fb_end(&b));
+
+    uint8_t len[4];
+    put_le(len, b.used, 4);
+    if (emit(writer, footer, b.used) == -1 || emit(writer, len, 4) == -1 ||
+        emit(writer, ARROW_MAGIC, 6) == -1) {
+      ret = -1;
+    }
+    free(b.buf);
+  }
+
+  if (writer_free(&writer->out) == -1) {
+    ret = -1;
+  }
+
+  int i;
+  for (i = 0; i < writer->ncols; i++) {
+    arrow_column_t *column = &writer->columns[i];
+    if (column->malformed) {
+      fprintf(stderr, "%" PRIu64 " malformed '%s' values written as null\n",
+              column->malformed, column->name);
+      if (ret == 0) {
+        ret = 1;
+      }
+    }
+    free(column->text);
+    free(column->ends);
+    free(column->dict_text);
+    free(column->dict_ends);
+    free(column->table);
+  }
+  free(writer->columns);
+  free(writer->dicts);
+  free(writer->batches);
+
+  return ret;
+}
+
+static int
+corrupt(const arrow_reader_t *reader) {
+  fprintf(stderr, "%s: corrupt arrow data\n", reader->path);
+  return -1;
+}
+
+// Reads len bytes. Returns 1, 0 if the input ends before any are read, or -1
+// after printing an error.
+static int
+read_full(arrow_reader_t *reader, void *buf, size_t len) {
+  size_t n = 0;
+  while (n < len) {
+    ssize_t r = read(reader->fd, (char *)buf + n, len - n);
+    if (r == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror(reader->path);
+      return -1;
+    } else if (r == 0) {
+      if (n == 0) {
+        return 0;
+      }
+      fprintf(stderr, "%s: truncated arrow data\n", reader->path);
+      return -1;
+    }
+    n += r;
+  }
+
+  return 1;
+}
+
+// Like read_full, but the input may not end.
+static int
+read_more(arrow_reader_t *reader, void *buf, size_t len) {
+  int ret = read_full(reader, buf, len);
+  if (ret == 0) {
+    fprintf(stderr, "%s: truncated arrow data\n", reader->path);
+    return -1;
+  }
+
+  return ret;
+}
+
+// Reads the next message and its body, starting with the 4 bytes in first if
+// they were already read. Sets header to its header table and type to its
+// header type. Returns 1, 0 at the end of the stream, or -1 after printing an
+// error.
+static int
+read_message(arrow_reader_t *reader, const uint8_t *first, fbr_t *r,
+             size_t *header, int *type) {
+  uint8_t prefix[4];
+  if (first) {
+    memcpy(prefix, first, 4);
+  } else {
+    int ret = read_full(reader, prefix, 4);
+    if (ret <= 0) {
+      return ret;
+    }
+  }
+
+  // Old streams have no continuation marker.
+  uint32_t len = get_le(prefix, 4);
+  if (len == CONTINUATION) {
+    if (read_more(reader, prefix, 4) == -1) {
+      return -1;
+    }
+    len = get_le(prefix, 4);
+  }
+
+  if (len == 0) {
+    return 0;
+  } else if (len > MAX_META) {
+    return corrupt(reader);
+  }
+
+  if (len > reader->meta_size) {
+    reader->meta_size = len;
+    reader->meta = realloc(reader->meta, len);
+  }
+  if (read_more(reader, reader->meta, len) == -1) {
+    return -1;
+  }
+
+  r->buf = reader->meta;
+  r->len = len;
+  r->bad = 0;
+
+  size_t message = fbr_get(r, 0, 4);
+  *type = fbr_scalar(r, message, 1, 1, 0);
+  *header = fbr_ref(r, message, 2);
+  int64_t body_len = fbr_scalar(r, message, 3, 8, 0);
+  if (r->bad || !message || !*header || body_len < 0) {
+    return corrupt(reader);
+  }
+
+  if ((uint64_t)body_len > reader->body_size) {
+    free(reader->body);
+    reader->body = malloc(body_len);
+    if (!reader->body) {
+      fprintf(stderr, "%s: message body too large\n", reader->path);
+      return -1;
+    }
+    reader->body_size = body_len;
+  }
+  reader->body_len = body_len;
+  if (body_len && read_more(reader, reader->body, body_len) == -1) {
+    return -1;
+  }
+
+  return 1;
+}
+
+static int
+unsupported(const arrow_reader_t *reader, const char *name) {
+  fprintf(stderr, "%s: column '%s' has an unsupported type\n", reader->path,
+          name);
+  return -1;
+}
+
+// Parses a field of the schema.
+static int
+parse_field(arrow_reader_t *reader, fbr_t *r, size_t table,
+            arrow_field_t *field) {
+  field->name = fbr_string(r, table, 0);
+  if (!field->name) {
+    field->name = strdup("");
+  }
+
+  int type_type = fbr_scalar(r, table, 2, 1, 0);
+  size_t type = fbr_ref(r, table, 3);
+  switch (type_type) {
+    case TYPE_INT:
+      field->type = ARROW_INT;
+      field->width = fbr_scalar(r, type, 0, 4, 0);
+      field->is_signed = fbr_scalar(r, type, 1, 1, 0);
+      if (field->width != 8 && field->width != 16 && field->width != 32 &&
+          field->width != 64) {
+        return unsupported(reader, field->name);
+      }
+      break;
+    case TYPE_FLOAT:
+      field->type = ARROW_REAL;
+      switch (fbr_scalar(r, type, 0, 2, 0)) {
+        case PRECISION_SINGLE:
+          field->width = 32;
+          break;
+        case PRECISION_DOUBLE:
+          field->width = 64;
+          break;
+        default:
+          return unsupported(reader, field->name);
+      }
+      break;
+    case TYPE_BOOL:
+      field->type = ARROW_BOOL;
+      field->width = 1;
+      break;
+    case TYPE_UTF8:
+    case TYPE_LARGE_UTF8:
+      field->type = ARROW_STR;
+      field->width = type_type == TYPE_UTF8 ? 32 : 64;
+      break;
+    default:
+      return unsupported(reader, field->name);
+  }
+
+  // Dictionaries are shared by id.
+  field->dict_id = -1;
+  size_t dict = fbr_ref(r, table, 4);
+  if (dict) {
+    if (field->type != ARROW_STR) {
+      return unsupported(reader, field->name);
+    }
+
+    field->dict_id = fbr_scalar(r, dict, 0, 8, 0);
+    size_t index = fbr_ref(r, dict, 1);
+    field->index_width = index ? fbr_scalar(r, index, 0, 4, 0) : 32;
+    if (field->index_width != 8 && field->index_width != 16 &&
+        field->index_width != 32 && field->index_width != 64) {
+      return unsupported(reader, field->name);
+    }
+
+    int i;
+    for (i = 0; i < reader->ndicts; i++) {
+      if (reader->dicts[i].id == field->dict_id) {
+        break;
+      }
+    }
+    if (i == reader->ndicts) {
+      reader->dicts[reader->ndicts].id = field->dict_id;
+      reader->dicts[reader->ndicts++].width = field->width;
+    }
+    field->dict = &reader->dicts[i];
+  }
+
+  uint64_t n;
+  size_t metadata = fbr_vector(r, table, 6, 4, &n);
+  uint64_t i;
+  for (i = 0; i < n && !field->db_type; i++) {
+    size_t kv = fbr_follow(r, metadata + 4 * i);
+    char *key = fbr_string(r, kv, 0);
+    if (key && strcmp(key, "db.type") == 0) {
+      field->db_type = fbr_string(r, kv, 1);
+    }
+    free(key);
+  }
+
+  if (!field->db_type) {
+    field->db_type = strdup(field->type == ARROW_REAL ? "real" :
+                            field->type == ARROW_STR ? "str" : "int");
+  }
+
+  return 0;
+}
+
+int
+arrow_reader_init(arrow_reader_t *reader, int fd, const char *path) {
+  memset(reader, 0, sizeof (arrow_reader_t));
+  reader->fd = fd;
+  reader->path = path;
+
+  // A file starts with its magic, and then holds a stream.
+  uint8_t magic[8];
+  const uint8_t *first = magic;
+  int ret = read_full(reader, magic, 4);
+  if (ret == 0) {
+    fprintf(stderr, "%s: empty input\n", path);
+    return -1;
+  } else if (ret == -1) {
+    return -1;
+  }
+
+  if (memcmp(magic, ARROW_MAGIC, 4) == 0) {
+    if (read_more(reader, magic + 4, 4) == -1) {
+      return -1;
+    }
+    first = NULL;
+  }
+
+  fbr_t r;
+  size_t schema;
+  int type;
+  ret = read_message(reader, first, &r, &schema, &type);
+  if (ret == -1) {
+    return -1;
+  } else if (ret == 0 || type != HEADER_SCHEMA) {
+    fprintf(stderr, "%s: not an arrow stream or file\n", path);
+    return -1;
+  }
+
+  if (fbr_scalar(&r, schema, 0, 2, 0) != (uint64_t)big_endian()) {
+    fprintf(stderr, "%s: arrow data has a different byte order\n", path);
+    return -1;
+  }
+
+  uint64_t n;
+  size_t fields = fbr_vector(&r, schema, 1, 4, &n);
+  if (r.bad) {
+    return corrupt(reader);
+  } else if (!n) {
+    fprintf(stderr, "%s: arrow schema has no columns\n", path);
+    return -1;
+  }
+
+  reader->ncols = n;
+  reader->fields = calloc(n, sizeof (arrow_field_t));
+  reader->dicts = calloc(n, sizeof (arrow_dict_t));
+
+  uint64_t i;
+  for (i = 0; i < n; i++) {
+    size_t field = fbr_follow(&r, fields + 4 * i);
+    if (parse_field(reader, &r, field, &reader->fields[i]) == -1) {
+      return -1;
+    }
+  }
+
+  if (r.bad) {
+    return corrupt(reader);
+  }
+
+  return 0;
+}
+
+char *
+arrow_reader_header(const arrow_reader_t *reader) {
+  size_t size = 4;
+  int i;
+  for (i = 0; i < reader->ncols; i++) {
+    size += strlen(reader->fields[i].name) +
+            strlen(reader->fields[i].db_type) + 2;
+  }
+
+  char *header = malloc(size);
+  size_t len = sprintf(header, "#db");
+  for (i = 0; i < reader->ncols; i++) {
+    size_t start = len + 1;
+    len += sprintf(header + len, "\t%s", reader->fields[i].name);
+
+    // Characters that would split the header can't be in a column name.
+    size_t j;
+    for (j = start; j < len; j++) {
+      if (header[j] == '\t' || header[j] == '\n' || header[j] == ':') {
+        header[j] = '_';
+      }
+    }
+
+    len += sprintf(header + len, ":%s", reader->fields[i].db_type);
+  }
+
+  return header;
+}
+
+// Reads element i of an array of ints of the given width.
+static inline int64_t
+get_int(const uint8_t *data, int64_t i, int width, char is_signed) {
+  switch (width) {
+    case 8:
+      return is_signed ? (int8_t)data[i] : data[i];
+    case 16: {
+      uint16_t v;
+      memcpy(&v, data + 2 * i, 2);
+      return is_signed ? (int16_t)v : v;
+    }
+    case 32: {
+      uint32_t v;
+      memcpy(&v, data + 4 * i, 4);
+      return is_signed ? (int32_t)v : v;
+    }
+    default: {
+      int64_t v;
+      memcpy(&v, data + 8 * i, 8);
+      return v;
+    }
+  }
+}
+
+// The nodes and buffers of a record batch, consumed in order.
+typedef struct {
+  fbr_t *r;
+  size_t nodes;
+  uint64_t nnodes;
+  uint64_t node;
+  size_t buffers;
+  uint64_t nbuffers;
+  uint64_t buffer;
+  const uint8_t *body;
+  uint64_t body_len;
+} cursor_t;
+
+static int
+init_cursor(arrow_reader_t *reader, fbr_t *r, size_t batch, cursor_t *c) {
+  if (fbr_ref(r, batch, 3)) {
+    fprintf(stderr, "%s: compressed arrow data is not supported\n",
+            reader->path);
+    return -1;
+  }
+
+  memset(c, 0, sizeof (cursor_t));
+  c->r = r;
+  c->nodes = fbr_vector(r, batch, 1, 16, &c->nnodes);
+  c->buffers = fbr_vector(r, batch, 2, 16, &c->nbuffers);
+  c->body = reader->body;
+  c->body_len = reader->body_len;
+
+  return r->bad ? corrupt(reader) : 0;
+}
+
+static int
+next_buffer(cursor_t *c, const uint8_t **data, uint64_t *len) {
+  if (c->buffer == c->nbuffers) {
+    return -1;
+  }
+
+  size_t pos = c->buffers + 16 * c->buffer++;
+  uint64_t offset = fbr_get(c->r, pos, 8);
+  *len = fbr_get(c->r, pos + 8, 8);
+  if (offset > c->body_len || *len > c->body_len - offset) {
+    return -1;
+  }
+
+  *data = c->body + offset;
+  return 0;
+}
+
+// Loads the buffers of an array of nrows values, and checks their sizes. The
+// values of a dictionary encoded column are its indexes.
+static int
+load_array(cursor_t *c, arrow_field_t *field, arrow_type_t type, int width,
+           int64_t nrows) {
+  if (c->node == c->nnodes) {
+    return -1;
+  }
+
+  size_t pos = c->nodes + 16 * c->node++;
+  int64_t length = fbr_get(c->r, pos, 8);
+  int64_t nulls = fbr_get(c->r, pos + 8, 8);
+  if (length != nrows || nulls < 0) {
+    return -1;
+  }
+
+  const uint8_t *validity;
+  uint64_t len;
+  if (next_buffer(c, &validity, &len) == -1 ||
+      (nulls && len < (uint64_t)(nrows + 7) / 8)) {
+    return -1;
+  }
+  field->validity = nulls ? validity : NULL;
+
+  if (type == ARROW_STR) {
+    if (next_buffer(c, &field->offsets, &len) == -1 ||
+        len < (uint64_t)(nrows + 1) * (width / 8) ||
+        next_buffer(c, &field->data, &len) == -1) {
+      return -1;
+    }
+
+    int64_t prev = get_int(field->offsets, 0, width, 1);
+    int64_t i;
+    for (i = 1; i <= nrows; i++) {
+      int64_t offset = get_int(field->offsets, i, width, 1);
+      if (offset < prev) {
+        return -1;
+      }
+      prev = offset;
+    }
+    if (nrows && (get_int(field->offsets, 0, width, 1) < 0 ||
+                  (uint64_t)prev > len)) {
+      return -1;
+    }
+  } else {
+    uint64_t need = type == ARROW_BOOL ? (uint64_t)(nrows + 7) / 8 :
+                    (uint64_t)nrows * (width / 8);
+    if (next_buffer(c, &field->data, &len) == -1 || len < need) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+static int
+is_valid(const uint8_t *validity, int64_t i) {
+  return !validity || (validity[i >> 3] >> (i & 7)) & 1;
+}
+
+// Adds or replaces the values of a dictionary.
+static int
+read_dictionary(arrow_reader_t *reader, fbr_t *r, size_t table) {
+  int64_t id = fbr_scalar(r, table, 0, 8, 0);
+  size_t batch = fbr_ref(r, table, 1);
+  int delta = fbr_scalar(r, table, 2, 1, 0);
+
+  arrow_dict_t *dict = NULL;
+  int i;
+  for (i = 0; i < reader->ndicts; i++) {
+    if (reader->dicts[i].id == id) {
+      dict = &reader->dicts[i];
+    }
+  }
+  if (!dict || !batch) {
+    return corrupt(reader);
+  }
+
+  cursor_t c;
+  if (init_cursor(reader, r, batch, &c) == -1) {
+    return -1;
+  }
+
+  int64_t n = fbr_scalar(r, batch, 0, 8, 0);
+  arrow_field_t values;
+  memset(&values, 0, sizeof values);
+  if (n < 0 || load_array(&c, &values, ARROW_STR, dict->width, n) == -1 ||
+      r->bad) {
+    return corrupt(reader);
+  }
+
+  if (!delta) {
+    dict->n = 0;
+    dict->len = 0;
+  }
+
+  int64_t j;
+  for (j = 0; j < n; j++) {
+    int64_t start = get_int(values.offsets, j, dict->width, 1);
+    size_t len = get_int(values.offsets, j + 1, dict->width, 1) - start;
+    if (!is_valid(values.validity, j)) {
+      len = 0;
+    }
+
+    if (dict->len + len > dict->size) {
+      dict->size = dict->size ? dict->size : 65536;
+      while (dict->len + len > dict->size) {
+        dict->size *= 2;
+      }
+      dict->text = realloc(dict->text, dict->size);
+    }
+    if (dict->n == dict->cap) {
+      dict->cap = dict->cap ? 2 * dict->cap : 1024;
+      dict->ends = realloc(dict->ends, sizeof (uint64_t) * dict->cap);
+    }
+
+    memcpy(dict->text + dict->len, values.data + start, len);
+    dict->len += len;
+    dict->ends[dict->n++] = dict->len;
+  }
+
+  return 0;
+}
+
+// Loads the columns of a record batch.
+static int
+load_batch(arrow_reader_t *reader, fbr_t *r, size_t batch) {
+  cursor_t c;
+  if (init_cursor(reader, r, batch, &c) == -1) {
+    return -1;
+  }
+
+  int64_t nrows = fbr_scalar(r, batch, 0, 8, 0);
+  if (nrows < 0) {
+    return corrupt(reader);
+  }
+
+  int i;
+  for (i = 0; i < reader->ncols; i++) {
+    arrow_field_t *field = &reader->fields[i];
+
+    if (!field->dict) {
+      if (load_array(&c, field, field->type, field->width, nrows) == -1) {
+        return corrupt(reader);
+      }
+      continue;
+    }
+
+    if (load_array(&c, field, ARROW_INT, field->index_width, nrows) == -1) {
+      return corrupt(reader);
+    }
+
+    int64_t j;
+    for (j = 0; j < nrows; j++) {
+      if (is_valid(field->validity, j)) {
+        uint64_t index = get_int(field->data, j, field->index_width, 1);
+        if (index >= field->dict->n) {
+          return corrupt(reader);
+        }
+      }
+    }
+  }
+
+  if (r->bad) {
+    return corrupt(reader);
+  }
+
+  reader->nrows = nrows;
+  return 0;
+}
+
+int
+arrow_reader_next(arrow_reader_t *reader) {
+  for (;;) {
+    fbr_t r;
+    size_t header;
+    int type;
+    int ret = read_message(reader, NULL, &r, &header, &type);
+    if (ret <= 0) {
+      return ret;
+    }
+
+    switch (type) {
+      case HEADER_DICTIONARY:
+        if (read_dictionary(reader, &r, header) == -1) {
+          return -1;
+        }
+        break;
+      case HEADER_RECORD_BATCH:
+        return load_batch(reader, &r, header) == -1 ? -1 : 1;
+      default:
+        return corrupt(reader);
+    }
+  }
+}
+
+// Formats a float as the shortest text that reads back as the same value.
+static int
+format_float(char *buf, size_t size, float f) {
+  int precision;
+  for (precision = 6; precision < 9; precision++) {
+    int n = snprintf(buf, size, "%.*g", precision, f);
+    if (strtof(buf, NULL) == f) {
+      return n;
+    }
+  }
+
+  return snprintf(buf, size, "%.9g", f);
+}
+
+void
+arrow_reader_value(const arrow_reader_t *reader, int column, int64_t row,
+                   char *buf, field_t *field) {
+  const arrow_field_t *f = &reader->fields[column - 1];
+  field->ptr = buf;
+  field->len = 0;
+
+  if (!is_valid(f->validity, row)) {
+    return;
+  }
+
+  if (f->dict) {
+    uint64_t i = get_int(f->data, row, f->index_width, 1);
+    uint64_t start = i ? f->dict->ends[i - 1] : 0;
+    field->ptr = f->dict->text + start;
+    field->len = f->dict->ends[i] - start;
+    return;
+  }
+
+  switch (f->type) {
+    case ARROW_INT:
+      if (f->is_signed || f->width < 64) {
+        field->len = snprintf(buf, ARROW_TEXT_MAX, "%" PRId64,
+                              get_int(f->data, row, f->width, f->is_signed));
+      } else {
+        field->len = snprintf(buf, ARROW_TEXT_MAX, "%" PRIu64,
+                              (uint64_t)get_int(f->data, row, 64, 0));
+      }
+      break;
+    case ARROW_REAL:
+      if (f->width == 32) {
+        float v;
+        memcpy(&v, f->data + 4 * row, 4);
+        field->len = format_float(buf, ARROW_TEXT_MAX, v);
+      } else {
+        double v;
+        memcpy(&v, f->data + 8 * row, 8);
+        field->len = dbc_format_real(buf, ARROW_TEXT_MAX, v);
+      }
+      break;
+    case ARROW_BOOL:
+      buf[0] = '0' + is_valid(f->data, row);
+      field->len = 1;
+      break;
+    default: {
+      int64_t start = get_int(f->offsets, row, f->width, 1);
+      field->ptr = (const char *)f->data + start;
+      field->len = get_int(f->offsets, row + 1, f->width, 1) - start;
+      break;
+    }
+  }
+}
+
+void
+arrow_reader_free(arrow_reader_t *reader) {
+  int i;
+  for (i = 0; i < reader->ncols; i++) {
+    free(reader->fields[i].name);
+    free(reader->fields[i].db_type);
+  }
+  for (i = 0; i < reader->ndicts; i++) {
+    free(reader->dicts[i].text);
+    free(reader->dicts[i].ends);
+  }
+  free(reader->fields);
+  free(reader->dicts);
+  free(reader->meta);
+  free(reader->body);
+}
@@ -0,0 +1,211 @@
+// arrow
+//
+// Copyright (c) 2015, Los Alamos National Security, LLC
+// All rights reserved.
+//
+// Copyright (2015). Los Alamos National Security, LLC. This software was
+// produced under U.S. Government contract DE-AC52-06NA25396 for Los Alamos
+// National Laboratory (LANL), which is operated by Los Alamos National
+// Security, LLC for the U.S. Department of Energy. The U.S. Government has
+// rights to use, reproduce, and distribute this software. NEITHER THE
+// GOVERNMENT NOR LOS ALAMOS NATIONAL SECURITY, LLC MAKES ANY WARRANTY, EXPRESS
+// OR IMPLIED, OR ASSUMES ANY LIABILITY FOR THE USE OF THIS SOFTWARE. If
+// software is modified to produce derivative works, such modified software
+// should be clearly marked, so as not to confuse it with the version available
+// from LANL.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//
+//
+// Arrow IPC streams and files. db data is written as record batches of int64,
+// double, and utf8 columns, with low cardinality str columns dictionary
+// encoded, so analysis tools can load it without parsing text. Every buffer
+// is 8-byte aligned, so a reader can map an Arrow file and use its columns in
+// place.
+//
+// The flatbuffers that describe each message are built and parsed here, so
+// there is no dependency on the Arrow libraries.
+//
+// Author: Curt Hash <chash@lanl.gov>
+
+#ifndef ARROW_H
+#define ARROW_H
+
+#include <stdint.h>
+
+#include "cdb.h"
+
+#define ARROW_MAGIC "ARROW1"
+#define ARROW_BATCH_ROWS 65536
+#define ARROW_BATCH_BYTES 67108864  // Text per record batch.
+#define ARROW_DICT_MAX 1048576      // Dictionary size before it is replaced.
+#define ARROW_TEXT_MAX 32           // Size of a formatted number.
+
+typedef enum {
+  ARROW_INT,
+  ARROW_REAL,
+  ARROW_STR,
+  ARROW_BOOL
+} arrow_type_t;
+
+// The location of a message in an Arrow file.
+typedef struct {
+  uint64_t offset;
+  uint32_t meta_size;
+  uint64_t body_size;
+} arrow_block_t;
+
+// A column being written. Its values for the current batch are kept as text
+// until the batch is written.
+typedef struct {
+  const char *name;
+  const char *db_type;
+  arrow_type_t type;
+  char dict;           // Dictionary encoded.
+  char *text;
+  size_t len;
+  size_t size;
+  uint64_t *ends;      // End offset in text of each value.
+  uint64_t malformed;  // int or real values written as null.
+
+  // Dictionary of a dictionary encoded column.
+  char *dict_text;
+  size_t dict_len;
+  size_t dict_size;
+  uint64_t *dict_ends;
+  uint32_t ndict;
+  uint32_t dict_cap;
+  uint32_t emitted;    // Entries already written.
+  uint32_t *table;     // Hash table of entry index + 1.
+  size_t table_size;
+} arrow_column_t;
+
+// An Arrow stream or file being written.
+typedef struct {
+  writer_t out;
+  uint64_t offset;     // Bytes written so far.
+  char file;           // Random access file format.
+  char started;        // The schema has been written.
+  int ncols;
+  size_t batch_rows;
+  size_t nrows;        // Rows in the current batch.
+  size_t rows_size;    // Capacity of the ends arrays.
+  size_t text_len;     // Text in the current batch.
+  arrow_column_t *columns;
+  arrow_block_t *dicts;    // Dictionary batches, for the file footer.
+  size_t ndicts;
+  size_t dicts_size;
+  arrow_block_t *batches;  // Record batches, for the file footer.
+  size_t nbatches;
+  size_t batches_size;
+} arrow_writer_t;
+
+// A dictionary read from a stream. Only str values are supported.
+typedef struct {
+  int64_t id;
+  char *text;
+  size_t len;
+  size_t size;
+  uint64_t *ends;
+  uint64_t n;
+  uint64_t cap;
+  int width;           // Bits of a value offset.
+} arrow_dict_t;
+
+// A column being read, and its buffers in the current record batch.
+typedef struct {
+  char *name;
+  char *db_type;
+  arrow_type_t type;
+  int width;           // Bits of an int or real, or of a str offset.
+  char is_signed;
+  int64_t dict_id;     // -1 if the column is not dictionary encoded.
+  int index_width;
+  arrow_dict_t *dict;
+
+  const uint8_t *validity;
+  const uint8_t *data;
+  const uint8_t *offsets;
+} arrow_field_t;
+
+// An Arrow stream or file being read.
+typedef struct {
+  int fd;
+  const char *path;
+  int ncols;
+  arrow_field_t *fields;
+  arrow_dict_t *dicts;
+  int ndicts;
+  uint8_t *meta;
+  size_t meta_size;
+  uint8_t *body;
+  size_t body_size;
+  uint64_t body_len;
+  int64_t nrows;       // Rows in the current record batch.
+} arrow_reader_t;
+
+// Initializes a writer for fd. The file format is written if file is set,
+// and otherwise the stream format. Each record batch holds up to batch_rows
+// records. The schema must outlive the writer. Returns 0, or -1 if a write
+// failed.
+extern int
+arrow_writer_init(arrow_writer_t *writer, int fd, const schema_t *schema,
+                  size_t batch_rows, char file);
+
+// Adds a record, whose batch must split at least as many fields as the schema
+// has columns. Missing fields are written as empty. Returns 0, or -1 if a
+// write failed.
+extern int
+arrow_writer_add(arrow_writer_t *writer, record_t *record);
+
+// Writes the last record batch and the end of the stream, reports any
+// malformed int or real values on stderr, and frees the writer. The fd is left
+// open. Returns 0, 1 if any malformed values were written as null, or -1 if a
+// write failed.
+extern int
+arrow_writer_close(arrow_writer_t *writer);
+
+// Initializes a reader for an Arrow stream or file on fd and reads its
+// schema. Returns 0, or -1 after printing an error.
+extern int
+arrow_reader_init(arrow_reader_t *reader, int fd, const char *path);
+
+// Returns a #db header for the columns of a reader. Tabs, newlines, and colons
+// in column names are replaced with underscores. The caller frees it.
+extern char *
+arrow_reader_header(const arrow_reader_t *reader);
+
+// Reads the next record batch, and any dictionaries before it. Returns 1, 0
+// at the end of the stream, or -1 after printing an error.
+extern int
+arrow_reader_next(arrow_reader_t *reader);
+
+// Sets field to the text of a value (starting at 0) of a column (starting at
+// 1) in the current record batch. Numbers are formatted into buf, which must
+// hold ARROW_TEXT_MAX bytes, and strings point into the batch. Nulls are
+// empty.
+extern void
+arrow_reader_value(const arrow_reader_t *reader, int column, int64_t row,
+                   char *buf, field_t *field);
+
+// Frees a reader. The fd is left open.
+extern void
+arrow_reader_free(arrow_reader_t *reader);
+
+#endif
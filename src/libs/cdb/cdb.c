@@ -36,6 +36,13 @@
 //
 // Author: Curt Hash <chash@lanl.gov>
 
+#include <errno.h>
+#include <stdint.h>
+#include <strings.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "cdb.h"
 
 char *
@@ -62,6 +69,577 @@ read_header(FILE *fp) {
   return header;
 }
 
+void
+reader_init(reader_t *reader, int fd, size_t size) {
+  reader->fd = fd;
+  reader->buf = malloc(size + 1);
+  reader->size = size;
+  reader->start = 0;
+  reader->len = 0;
+  reader->end = 0;
+  reader->saved = '\0';
+  reader->eof = 0;
+  reader->error = 0;
+}
+
+// Reads more data, keeping the unconsumed bytes and growing the buffer if
+// they fill it.
+static void
+reader_fill(reader_t *reader) {
+  if (reader->start) {
+    memmove(reader->buf, reader->buf + reader->start,
+            reader->end - reader->start);
+    reader->end -= reader->start;
+    reader->start = 0;
+  }
+
+  if (reader->end == reader->size) {
+    reader->size *= 2;
+    reader->buf = realloc(reader->buf, reader->size + 1);
+  }
+
+  ssize_t n;
+  do {
+    n = read(reader->fd, reader->buf + reader->end,
+             reader->size - reader->end);
+  } while (n == -1 && errno == EINTR);
+
+  if (n == -1) {
+    reader->error = errno;
+    reader->eof = 1;
+  } else if (n == 0) {
+    reader->eof = 1;
+  } else {
+    reader->end += n;
+  }
+}
+
+char *
+reader_next(reader_t *reader, size_t *len) {
+  if (reader->len) {
+    // Restore the byte displaced by the previous record's terminator.
+    reader->buf[reader->start + reader->len] = reader->saved;
+    reader->start += reader->len;
+    reader->len = 0;
+  }
+
+  char *nl;
+  while (!(nl = memchr(reader->buf + reader->start, '\n',
+                       reader->end - reader->start))) {
+    if (reader->eof) {
+      if (reader->error || reader->start == reader->end) {
+        return NULL;
+      }
+
+      // Terminate a last record that is missing its newline.
+      if (reader->end == reader->size) {
+        reader->size *= 2;
+        reader->buf = realloc(reader->buf, reader->size + 1);
+      }
+      reader->buf[reader->end++] = '\n';
+      continue;
+    }
+
+    reader_fill(reader);
+  }
+
+  reader->len = nl - (reader->buf + reader->start) + 1;
+  reader->saved = reader->buf[reader->start + reader->len];
+  reader->buf[reader->start + reader->len] = '\0';
+  *len = reader->len;
+
+  return reader->buf + reader->start;
+}
+
+char *
+reader_header(reader_t *reader) {
+  size_t len;
+  char *line = reader_next(reader, &len);
+  if (!line) {
+    fprintf(stderr, "read_header error\n");
+    return NULL;
+  }
+
+  char *header = malloc(len);
+  memcpy(header, line, len - 1);
+  header[len - 1] = '\0';
+
+  return header;
+}
+
+void
+reader_free(reader_t *reader) {
+  free(reader->buf);
+  reader->buf = NULL;
+}
+
+void
+batch_init(batch_t *batch, size_t capacity, int maxfields) {
+  batch->records = malloc(sizeof (record_t) * capacity);
+  batch->count = 0;
+  batch->capacity = capacity;
+  batch->maxfields = maxfields > 0 ? maxfields : 1;
+  batch->fields = malloc(sizeof (field_t) * capacity * batch->maxfields);
+}
+
+size_t
+reader_batch(reader_t *reader, batch_t *batch) {
+  batch->count = 0;
+
+  if (reader->len) {
+    // Finish a record returned by reader_next.
+    reader->buf[reader->start + reader->len] = reader->saved;
+    reader->start += reader->len;
+    reader->len = 0;
+  }
+
+  while (batch->count < batch->capacity) {
+    char *line = reader->buf + reader->start;
+    char *nl = memchr(line, '\n', reader->end - reader->start);
+    if (!nl) {
+      if (batch->count) {
+        // Leave the partial record for the next batch.
+        break;
+      }
+
+      if (reader->eof) {
+        if (reader->error || reader->start == reader->end) {
+          return 0;
+        }
+
+        // Terminate a last record that is missing its newline.
+        if (reader->end == reader->size) {
+          reader->size *= 2;
+          reader->buf = realloc(reader->buf, reader->size + 1);
+        }
+        reader->buf[reader->end++] = '\n';
+        continue;
+      }
+
+      reader_fill(reader);
+      continue;
+    }
+
+    record_t *record = &batch->records[batch->count];
+    record->line = line;
+    record->len = nl - line + 1;
+    record->fields = batch->fields + batch->count * batch->maxfields;
+    record->nfields = 0;
+    record->maxfields = batch->maxfields;
+    record->scanned = 0;
+    record->done = 0;
+
+    reader->start += record->len;
+    batch->count++;
+  }
+
+  return batch->count;
+}
+
+// Splits the fields of a record up to the given column. Tabs are found 16
+// bytes at a time where SSE2 is available.
+static void
+split_fields(record_t *record, int column) {
+  const char *line = record->line;
+  const char *end = line + record->len - 1;
+  const char *start = line + record->scanned;
+  const char *p = start;
+  int n = record->nfields;
+
+#ifdef __SSE2__
+  const __m128i tabs = _mm_set1_epi8('\t');
+  while (n < column && p + 16 <= end) {
+    uint32_t mask = _mm_movemask_epi8(
+        _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)p), tabs));
+    while (mask && n < column) {
+      const char *tab = p + __builtin_ctz(mask);
+      record->fields[n].ptr = start;
+      record->fields[n].len = tab - start;
+      n++;
+      start = tab + 1;
+      mask &= mask - 1;
+    }
+    p += 16;
+  }
+
+  if (p < start) {
+    p = start;
+  }
+#endif
+
+  while (n < column) {
+    const char *tab = memchr(p, '\t', end - p);
+    record->fields[n].ptr = start;
+    record->fields[n].len = (tab ? tab : end) - start;
+    n++;
+    if (!tab) {
+      record->done = 1;
+      break;
+    }
+    start = p = tab + 1;
+  }
+
+  record->nfields = n;
+  record->scanned = start - line;
+}
+
+const field_t *
+record_field(record_t *record, int column) {
+  if (column < 1 || column > record->maxfields) {
+    return NULL;
+  }
+
+  if (column > record->nfields && !record->done) {
+    split_fields(record, column);
+  }
+
+  return column <= record->nfields ? &record->fields[column - 1] : NULL;
+}
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+// Returns whether the 8 bytes of v are all ASCII digits.
+static inline int
+eight_digits(uint64_t v) {
+  return ((v & 0xf0f0f0f0f0f0f0f0ull) |
+          (((v + 0x0606060606060606ull) & 0xf0f0f0f0f0f0f0f0ull) >> 4)) ==
+         0x3333333333333333ull;
+}
+
+// Returns the value of 8 ASCII digits, the first in the low byte of v.
+static inline uint32_t
+parse_eight_digits(uint64_t v) {
+  v -= 0x3030303030303030ull;
+  v = v * 10 + (v >> 8);
+  v = ((v & 0x000000ff000000ffull) * (100 + (1000000ull << 32)) +
+       ((v >> 16) & 0x000000ff000000ffull) * (1 + (10000ull << 32))) >> 32;
+
+  return v;
+}
+#endif
+
+// Parses up to 19 digits into x. Returns -1 if a byte is not a digit.
+static inline int
+parse_digits(const char *p, const char *end, uint64_t *x) {
+  uint64_t v = *x;
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  while (end - p >= 8) {
+    uint64_t chunk;
+    memcpy(&chunk, p, 8);
+    if (!eight_digits(chunk)) {
+      return -1;
+    }
+    v = v * 100000000 + parse_eight_digits(chunk);
+    p += 8;
+  }
+#endif
+
+  while (p < end) {
+    unsigned d = (unsigned char)*p++ - '0';
+    if (d > 9) {
+      return -1;
+    }
+    v = v * 10 + d;
+  }
+
+  *x = v;
+
+  return 0;
+}
+
+int
+parse_int64(const char *s, size_t len, int64_t *v) {
+  const char *p = s;
+  const char *end = s + len;
+  int neg = 0;
+
+  if (p < end && (*p == '-' || *p == '+')) {
+    neg = *p++ == '-';
+  }
+  if (p == end) {
+    return -1;
+  }
+
+  while (end - p > 1 && *p == '0') {
+    p++;
+  }
+
+  uint64_t x = 0;
+  if (end - p > 19 || parse_digits(p, end, &x) == -1 ||
+      x > (uint64_t)INT64_MAX + neg) {
+    return -1;
+  }
+
+  *v = neg ? (int64_t)(0 - x) : (int64_t)x;
+
+  return 0;
+}
+
+// Powers of ten that are exact as doubles.
+static const double exact_pow10[] = {
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13,
+  1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+// Parses a real with strtod. The text has already been validated, or is one
+// of the special values.
+static int
+parse_double_slow(const char *s, size_t len, double *v) {
+  char buf[128];
+  char *copy = len < sizeof buf ? buf : malloc(len + 1);
+  memcpy(copy, s, len);
+  copy[len] = '\0';
+
+  char *end;
+  *v = strtod(copy, &end);
+  int ret = end == copy + len ? 0 : -1;
+
+  if (copy != buf) {
+    free(copy);
+  }
+
+  return ret;
+}
+
+int
+parse_double(const char *s, size_t len, double *v) {
+  const char *p = s;
+  const char *end = s + len;
+  int neg = 0;
+
+  if (p < end && (*p == '-' || *p == '+')) {
+    neg = *p++ == '-';
+  }
+
+  // The mantissa, and the number of its significant digits.
+  uint64_t m = 0;
+  int digits = 0;
+  int ndigits = 0;
+  int exp = 0;
+
+  for (; p < end && (unsigned)(*p - '0') <= 9; p++, ndigits++) {
+    if (m || *p != '0') {
+      digits++;
+      m = m * 10 + (*p - '0');
+    }
+  }
+  if (p < end && *p == '.') {
+    for (p++; p < end && (unsigned)(*p - '0') <= 9; p++, ndigits++) {
+      if (m || *p != '0') {
+        digits++;
+        m = m * 10 + (*p - '0');
+      }
+      exp--;
+    }
+  }
+
+  if (!ndigits) {
+    // Not a decimal number, but maybe inf or nan.
+    size_t n = end - p;
+    if ((n == 3 && (strncasecmp(p, "inf", 3) == 0 ||
+                    strncasecmp(p, "nan", 3) == 0)) ||
+        (n == 8 && strncasecmp(p, "infinity", 8) == 0)) {
+      return parse_double_slow(s, len, v);
+    }
+    return -1;
+  }
+
+  if (p < end && (*p == 'e' || *p == 'E')) {
+    int eneg = 0;
+    int e = 0;
+    p++;
+    if (p < end && (*p == '-' || *p == '+')) {
+      eneg = *p++ == '-';
+    }
+    if (p == end) {
+      return -1;
+    }
+    for (; p < end && (unsigned)(*p - '0') <= 9; p++) {
+      if (e < 100000) {
+        e = e * 10 + (*p - '0');
+      }
+    }
+    exp += eneg ? -e : e;
+  }
+
+  if (p != end) {
+    return -1;
+  }
+
+  // With a mantissa and a power of ten that are both exact, one
+  // multiplication or division is correctly rounded.
+  if (digits > 19 || m > (1ull << 53) || exp < -22 || exp > 22) {
+    return parse_double_slow(s, len, v);
+  }
+
+  double d = (double)m;
+  d = exp < 0 ? d / exact_pow10[-exp] : d * exact_pow10[exp];
+  *v = neg ? -d : d;
+
+  return 0;
+}
+
+int
+record_int(record_t *record, int column, int64_t *v) {
+  const field_t *field = record_field(record, column);
+  return field ? parse_int64(field->ptr, field->len, v) : -1;
+}
+
+int
+record_real(record_t *record, int column, double *v) {
+  const field_t *field = record_field(record, column);
+  return field ? parse_double(field->ptr, field->len, v) : -1;
+}
+
+size_t
+batch_ints(batch_t *batch, int column, int64_t *values, char *valid) {
+  size_t bad = 0;
+  size_t i;
+  for (i = 0; i < batch->count; i++) {
+    int ok = record_int(&batch->records[i], column, &values[i]) == 0;
+    if (!ok) {
+      values[i] = 0;
+      bad++;
+    }
+    if (valid) {
+      valid[i] = ok;
+    }
+  }
+
+  return bad;
+}
+
+size_t
+batch_reals(batch_t *batch, int column, double *values, char *valid) {
+  size_t bad = 0;
+  size_t i;
+  for (i = 0; i < batch->count; i++) {
+    int ok = record_real(&batch->records[i], column, &values[i]) == 0;
+    if (!ok) {
+      values[i] = 0;
+      bad++;
+    }
+    if (valid) {
+      valid[i] = ok;
+    }
+  }
+
+  return bad;
+}
+
+void
+batch_free(batch_t *batch) {
+  free(batch->records);
+  free(batch->fields);
+  batch->records = NULL;
+  batch->fields = NULL;
+}
+
+void
+writer_init(writer_t *writer, int fd, size_t size) {
+  writer->fd = fd;
+  writer->buf = malloc(size);
+  writer->size = size;
+  writer->len = 0;
+  writer->error = 0;
+}
+
+// Writes all of data to the writer's fd.
+static int
+write_all(writer_t *writer, const char *data, size_t len) {
+  while (len) {
+    ssize_t n = write(writer->fd, data, len);
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      writer->error = errno;
+      return -1;
+    }
+    data += n;
+    len -= n;
+  }
+
+  return 0;
+}
+
+int
+writer_flush(writer_t *writer) {
+  if (writer->error) {
+    return -1;
+  }
+
+  int ret = write_all(writer, writer->buf, writer->len);
+  writer->len = 0;
+
+  return ret;
+}
+
+int
+writer_write(writer_t *writer, const void *data, size_t len) {
+  if (writer->len + len > writer->size) {
+    if (writer_flush(writer) == -1) {
+      return -1;
+    }
+
+    // Data that doesn't fit in the buffer is written directly.
+    if (len >= writer->size) {
+      return write_all(writer, data, len);
+    }
+  }
+
+  memcpy(writer->buf + writer->len, data, len);
+  writer->len += len;
+
+  return 0;
+}
+
+int
+writer_free(writer_t *writer) {
+  int ret = writer_flush(writer);
+  free(writer->buf);
+  writer->buf = NULL;
+
+  return ret;
+}
+
+// FNV-1a hash of a column name.
+static uint32_t
+hash_name(const char *name) {
+  uint32_t h = 2166136261u;
+  while (*name) {
+    h = (h ^ (unsigned char)*name++) * 16777619u;
+  }
+
+  return h;
+}
+
+// Builds the column hash table of a parsed schema. The table is at least
+// twice as large as the number of columns.
+static void
+index_schema(schema_t *schema) {
+  schema->table_size = 4;
+  while (schema->table_size < 2 * (size_t)schema->ncols) {
+    schema->table_size *= 2;
+  }
+  schema->table = calloc(schema->table_size, sizeof (column_t *));
+
+  column_t *column;
+  for (column = schema->head; column; column = column->flink) {
+    size_t i = hash_name(column->name) & (schema->table_size - 1);
+    while (schema->table[i]) {
+      if (strcmp(schema->table[i]->name, column->name) == 0) {
+        // Duplicate names resolve to the first column, as before.
+        break;
+      }
+      i = (i + 1) & (schema->table_size - 1);
+    }
+    if (!schema->table[i]) {
+      schema->table[i] = column;
+    }
+  }
+}
+
 int
 parse_header(const char *header, schema_t *schema) {
   int ret = 0;
@@ -71,6 +649,8 @@ parse_header(const char *header, schema_t *schema) {
 
   schema->head = schema->tail = NULL;
   schema->ncols = 0;
+  schema->table = NULL;
+  schema->table_size = 0;
 
   const char *delim = "\t\r\n";
   char *saveptr1;
@@ -114,11 +694,27 @@ parse_header(const char *header, schema_t *schema) {
 cleanup:
   free(copy);
 
+  if (ret == 0) {
+    index_schema(schema);
+  }
+
   return ret;
 }
 
 column_t *
 get_column(const schema_t *schema, const char *name) {
+  if (schema->table) {
+    size_t i = hash_name(name) & (schema->table_size - 1);
+    while (schema->table[i]) {
+      if (strcmp(schema->table[i]->name, name) == 0) {
+        return schema->table[i];
+      }
+      i = (i + 1) & (schema->table_size - 1);
+    }
+
+    return NULL;
+  }
+
   column_t *column = schema->head;
 
   while (column) {
@@ -145,6 +741,10 @@ free_schema(schema_t *schema) {
     free(del);
   }
 
+  free(schema->table);
+
   schema->head = schema->tail = NULL;
   schema->ncols = 0;
+  schema->table = NULL;
+  schema->table_size = 0;
 }
@@ -36,12 +36,19 @@
 //
 // Author: Curt Hash <chash@lanl.gov>
 
+#ifndef CDB_H
+#define CDB_H
+
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
 #define MAX_HEADER 8092
+#define READER_BUFSIZE 65536
+#define WRITER_BUFSIZE 65536
+#define BATCH_SIZE 1024
 
 typedef struct _column {
   char *name;
@@ -54,12 +61,157 @@ typedef struct {
   column_t *head;
   column_t *tail;
   int ncols;
+  column_t **table;  // Open-addressed hash of the columns by name.
+  size_t table_size;
 } schema_t;
 
-// Reads and returns the header line from the specified file.
+// A buffered reader for a db data stream. The header and the records are read
+// from the same buffer with large reads, so nothing read past the header is
+// lost, and no reads of the fd should be mixed in.
+typedef struct {
+  int fd;
+  char *buf;
+  size_t size;   // Capacity, not counting a byte reserved for a terminator.
+  size_t start;  // Offset of the current record.
+  size_t len;    // Length of the current record, including its newline.
+  size_t end;    // End of the data in the buffer.
+  char saved;    // Byte displaced by the current record's terminator.
+  char eof;
+  int error;     // errno of a failed read, or 0.
+} reader_t;
+
+// A field of a record. It is not NUL-terminated; the tab or newline that ends
+// it follows it.
+typedef struct {
+  const char *ptr;
+  size_t len;
+} field_t;
+
+// A record in a batch. Its fields are split on demand, up to the batch's
+// maxfields.
+typedef struct {
+  const char *line;  // Record, including its newline.
+  size_t len;
+  field_t *fields;
+  int nfields;       // Fields split so far.
+  int maxfields;
+  size_t scanned;    // Offset of the first field not yet split.
+  char done;         // All of the fields have been split.
+} record_t;
+
+// A batch of records read in place from a reader's buffer. The records are
+// valid until the reader is used again.
+typedef struct {
+  record_t *records;
+  size_t count;
+  size_t capacity;
+  int maxfields;
+  field_t *fields;   // capacity * maxfields slices.
+} batch_t;
+
+// A buffered writer for an fd.
+typedef struct {
+  int fd;
+  char *buf;
+  size_t size;
+  size_t len;
+  int error;         // errno of a failed write, or 0.
+} writer_t;
+
+// Reads and returns the header line from the specified file. It reads one
+// byte at a time so that the stream can be read with stdio afterwards; use a
+// reader_t instead where possible.
 extern char *
 read_header(FILE *fp);
 
+// Initializes a reader for fd with an initial buffer of size bytes. The
+// buffer grows to fit long records.
+extern void
+reader_init(reader_t *reader, int fd, size_t size);
+
+// Reads and returns the header line, without its newline. Returns NULL if the
+// stream ends first.
+extern char *
+reader_header(reader_t *reader);
+
+// Returns the next record, including its newline, and stores its length in
+// len. The record is NUL-terminated and may be modified in place until the
+// next call. A last record without a newline is given one. Returns NULL at
+// EOF or on error.
+extern char *
+reader_next(reader_t *reader, size_t *len);
+
+// Frees a reader's buffer. The fd is left open.
+extern void
+reader_free(reader_t *reader);
+
+// Initializes a batch of up to capacity records, whose fields are split up to
+// column maxfields.
+extern void
+batch_init(batch_t *batch, size_t capacity, int maxfields);
+
+// Fills a batch with the complete records in the reader's buffer, reading
+// more only if there are none. Returns the number of records, or 0 at EOF or
+// on error. Must not be mixed with reader_next().
+extern size_t
+reader_batch(reader_t *reader, batch_t *batch);
+
+// Returns the field of a record in the given column (starting at 1), or NULL
+// if the record has fewer fields or the column is past the batch's maxfields.
+extern const field_t *
+record_field(record_t *record, int column);
+
+// Parses a decimal int, with an optional sign, that fits in 64 bits. Returns
+// 0, or -1 if the text is malformed.
+extern int
+parse_int64(const char *s, size_t len, int64_t *v);
+
+// Parses a decimal real, with an optional sign, fraction and exponent, or inf
+// or nan. Returns 0, or -1 if the text is malformed.
+extern int
+parse_double(const char *s, size_t len, double *v);
+
+// Parses the field of a record in the given column as an int. Returns 0, or
+// -1 if the field is missing or malformed.
+extern int
+record_int(record_t *record, int column, int64_t *v);
+
+// Parses the field of a record in the given column as a real. Returns 0, or
+// -1 if the field is missing or malformed.
+extern int
+record_real(record_t *record, int column, double *v);
+
+// Parses a column of each record of a batch into values. Missing and
+// malformed values are stored as 0 and, if valid is not NULL, flagged 0 in
+// valid. Returns the number of missing and malformed values.
+extern size_t
+batch_ints(batch_t *batch, int column, int64_t *values, char *valid);
+
+// Like batch_ints() for a real column.
+extern size_t
+batch_reals(batch_t *batch, int column, double *values, char *valid);
+
+// Frees a batch.
+extern void
+batch_free(batch_t *batch);
+
+// Initializes a writer for fd with a buffer of size bytes.
+extern void
+writer_init(writer_t *writer, int fd, size_t size);
+
+// Buffers data for writing. Returns 0, or -1 if a write failed.
+extern int
+writer_write(writer_t *writer, const void *data, size_t len);
+
+// Writes the buffered data. Returns 0, or -1 if a write failed.
+extern int
+writer_flush(writer_t *writer);
+
+// Flushes and frees a writer. The fd is left open. Returns 0, or -1 if a
+// write failed.
+extern int
+writer_free(writer_t *writer);
+
 // Parses a header. Returns 0 if successful.
 extern int
 parse_header(const char *header, schema_t *schema);
@@ -71,3 +223,5 @@ get_column(const schema_t *schema, const char *name);
 // Frees a schema_t.
 extern void
 free_schema(schema_t *schema);
+
+#endif
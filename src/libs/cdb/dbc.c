@@ -0,0 +1,942 @@
+// dbc
+//
+// Copyright (c) 2015, Los Alamos National Security, LLC
+// All rights reserved.
+//
+// Copyright (2015). Los Alamos National Security, LLC. This software was
+// produced under U.S. Government contract DE-AC52-06NA25396 for Los Alamos
+// National Laboratory (LANL), which is operated by Los Alamos National
+// Security, LLC for the U.S. Department of Energy. The U.S. Government has
+// rights to use, reproduce, and distribute this software. NEITHER THE
+// GOVERNMENT NOR LOS ALAMOS NATIONAL SECURITY, LLC MAKES ANY WARRANTY, EXPRESS
+// OR IMPLIED, OR ASSUMES ANY LIABILITY FOR THE USE OF THIS SOFTWARE. If
+// software is modified to produce derivative works, such modified software
+// should be clearly marked, so as not to confuse it with the version available
+// from LANL.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//
+// Columnar db files.
+//
+// Author: Curt Hash <chash@lanl.gov>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <math.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "dbc.h"
+
+// Size of a chunk entry in the footer.
+#define CHUNK_ENTRY 43
+
+// Size of the trailer.
+#define TRAILER 20
+
+// A growable byte buffer.
+typedef struct {
+  uint8_t *data;
+  size_t len;
+  size_t size;
+} bytes_t;
+
+static void
+put_bytes(bytes_t *b, const void *data, size_t len) {
+  if (b->len + len > b->size) {
+    if (!b->size) {
+      b->size = 4096;
+    }
+    while (b->len + len > b->size) {
+      b->size *= 2;
+    }
+    b->data = realloc(b->data, b->size);
+  }
+
+  memcpy(b->data + b->len, data, len);
+  b->len += len;
+}
+
+static void
+put_u64(bytes_t *b, uint64_t v) {
+  uint8_t buf[8];
+  int i;
+  for (i = 0; i < 8; i++) {
+    buf[i] = v >> (8 * i);
+  }
+  put_bytes(b, buf, 8);
+}
+
+static void
+put_varint(bytes_t *b, uint64_t v) {
+  uint8_t buf[10];
+  int n = 0;
+  while (v >= 0x80) {
+    buf[n++] = v | 0x80;
+    v >>= 7;
+  }
+  buf[n++] = v;
+  put_bytes(b, buf, n);
+}
+
+static uint64_t
+get_u64(const uint8_t *p) {
+  uint64_t v = 0;
+  int i;
+  for (i = 0; i < 8; i++) {
+    v |= (uint64_t)p[i] << (8 * i);
+  }
+
+  return v;
+}
+
+// Reads a varint. Returns -1 if it runs past end.
+static int
+get_varint(const uint8_t **p, const uint8_t *end, uint64_t *v) {
+  const uint8_t *q = *p;
+  uint64_t x = 0;
+  int shift;
+  for (shift = 0; shift < 64 && q < end; shift += 7) {
+    x |= (uint64_t)(*q & 0x7f) << shift;
+    if (!(*q++ & 0x80)) {
+      *v = x;
+      *p = q;
+      return 0;
+    }
+  }
+
+  return -1;
+}
+
+static inline uint64_t
+zigzag(int64_t v) {
+  return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static inline int64_t
+unzigzag(uint64_t v) {
+  return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+dbc_type_t
+dbc_type(const char *type) {
+  if (strcmp(type, "int") == 0) {
+    return DBC_INT;
+  } else if (strcmp(type, "real") == 0) {
+    return DBC_REAL;
+  }
+
+  return DBC_STR;
+}
+
+int
+dbc_format_real(char *buf, size_t size, double d) {
+  int precision;
+  for (precision = 15; precision < 17; precision++) {
+    int n = snprintf(buf, size, "%.*g", precision, d);
+    if (strtod(buf, NULL) == d) {
+      return n;
+    }
+  }
+
+  return snprintf(buf, size, "%.17g", d);
+}
+
+// Parses an int that prints back exactly as it is written: no plus sign, no
+// leading zeros, and no negative zero.
+static int
+parse_int(const char *s, size_t len, int64_t *v) {
+  if (parse_int64(s, len, v) == -1 || s[0] == '+') {
+    return 0;
+  }
+
+  const char *digits = s[0] == '-' ? s + 1 : s;
+  return digits[0] != '0' || (len == 1 && s[0] == '0');
+}
+
+// Parses a real that prints back exactly as it is written.
+static int
+parse_real(const char *s, size_t len, double *v) {
+  char check[64];
+  if (parse_double(s, len, v) == -1 || isnan(*v) || len >= sizeof check) {
+    return 0;
+  }
+
+  return dbc_format_real(check, sizeof check, *v) == (int)len &&
+         memcmp(check, s, len) == 0;
+}
+
+// Writes data to the file.
+static int
+emit(dbc_writer_t *writer, const void *data, size_t len) {
+  writer->offset += len;
+  return writer_write(&writer->out, data, len);
+}
+
+int
+dbc_writer_init(dbc_writer_t *writer, int fd, const char *header,
+                const schema_t *schema, size_t group_rows, int level) {
+  writer_init(&writer->out, fd, WRITER_BUFSIZE);
+  writer->offset = 0;
+  writer->ncols = schema->ncols;
+  writer->level = level;
+  writer->group_rows = group_rows;
+  writer->nrows = 0;
+  writer->rows_size = 0;
+  writer->values = calloc(schema->ncols, sizeof (dbc_values_t));
+  writer->groups = NULL;
+  writer->ngroups = 0;
+  writer->groups_size = 0;
+
+  column_t *column;
+  for (column = schema->head; column; column = column->flink) {
+    writer->values[column->index - 1].type = dbc_type(column->type);
+  }
+
+  uint32_t len = strlen(header);
+  uint8_t buf[8];
+  memcpy(buf, DBC_MAGIC, 4);
+  int i;
+  for (i = 0; i < 4; i++) {
+    buf[4 + i] = len >> (8 * i);
+  }
+
+  if (emit(writer, buf, sizeof buf) == -1 ||
+      emit(writer, header, len) == -1) {
+    return -1;
+  }
+
+  return 0;
+}
+
+// Encodes int values, as deltas or as runs, whichever is smaller.
+static void
+encode_ints(const int64_t *ints, size_t nrows, bytes_t *out,
+            dbc_chunk_t *chunk) {
+  bytes_t delta = {NULL, 0, 0};
+  bytes_t rle = {NULL, 0, 0};
+  uint64_t prev = 0;
+  size_t i = 0;
+
+  chunk->min.i = chunk->max.i = ints[0];
+  while (i < nrows) {
+    size_t run = 1;
+    while (i + run < nrows && ints[i + run] == ints[i]) {
+      run++;
+    }
+    put_varint(&rle, zigzag(ints[i]));
+    put_varint(&rle, run);
+
+    size_t j;
+    for (j = i; j < i + run; j++) {
+      // Unsigned arithmetic wraps the same way when the deltas are summed.
+      put_varint(&delta, zigzag((int64_t)((uint64_t)ints[j] - prev)));
+      prev = ints[j];
+    }
+
+    if (ints[i] < chunk->min.i) {
+      chunk->min.i = ints[i];
+    }
+    if (ints[i] > chunk->max.i) {
+      chunk->max.i = ints[i];
+    }
+
+    i += run;
+  }
+
+  if (rle.len < delta.len) {
+    chunk->encoding = DBC_RLE;
+    *out = rle;
+    free(delta.data);
+  } else {
+    chunk->encoding = DBC_DELTA;
+    *out = delta;
+    free(rle.data);
+  }
+  chunk->flags |= DBC_STATS;
+}
+
+static void
+encode_reals(const double *reals, size_t nrows, bytes_t *out,
+             dbc_chunk_t *chunk) {
+  chunk->min.d = chunk->max.d = reals[0];
+
+  size_t i;
+  for (i = 0; i < nrows; i++) {
+    uint64_t bits;
+    memcpy(&bits, &reals[i], 8);
+    put_u64(out, bits);
+
+    if (reals[i] < chunk->min.d) {
+      chunk->min.d = reals[i];
+    }
+    if (reals[i] > chunk->max.d) {
+      chunk->max.d = reals[i];
+    }
+  }
+
+  chunk->encoding = DBC_PLAIN;
+  chunk->flags |= DBC_STATS;
+}
+
+static uint32_t
+hash_bytes(const char *s, size_t len) {
+  uint32_t h = 2166136261u;
+  size_t i;
+  for (i = 0; i < len; i++) {
+    h = (h ^ (unsigned char)s[i]) * 16777619u;
+  }
+
+  return h;
+}
+
+// Encodes strings with a dictionary if at most half of them are distinct, and
+// otherwise as they are.
+static void
+encode_strs(const dbc_values_t *values, size_t nrows, bytes_t *out,
+            dbc_chunk_t *chunk) {
+  size_t table_size = 4;
+  while (table_size < 2 * nrows) {
+    table_size *= 2;
+  }
+
+  uint32_t *table = calloc(table_size, sizeof (uint32_t));
+  uint32_t *dict = malloc(sizeof (uint32_t) * (nrows / 2 + 1));
+  uint32_t *indexes = malloc(sizeof (uint32_t) * nrows);
+  size_t ndict = 0;
+
+  size_t i;
+  for (i = 0; i < nrows; i++) {
+    uint64_t start = i ? values->ends[i - 1] : 0;
+    size_t len = values->ends[i] - start;
+    const char *s = values->text + start;
+
+    size_t slot = hash_bytes(s, len) & (table_size - 1);
+    while (table[slot]) {
+      uint32_t j = dict[table[slot] - 1];
+      uint64_t jstart = j ? values->ends[j - 1] : 0;
+      if (values->ends[j] - jstart == len &&
+          memcmp(values->text + jstart, s, len) == 0) {
+        break;
+      }
+      slot = (slot + 1) & (table_size - 1);
+    }
+
+    if (!table[slot]) {
+      if (ndict == nrows / 2) {
+        break;
+      }
+      dict[ndict++] = i;
+      table[slot] = ndict;
+    }
+    indexes[i] = table[slot] - 1;
+  }
+
+  if (i < nrows || nrows < 2) {
+    for (i = 0; i < nrows; i++) {
+      uint64_t start = i ? values->ends[i - 1] : 0;
+      put_varint(out, values->ends[i] - start);
+      put_bytes(out, values->text + start, values->ends[i] - start);
+    }
+    chunk->encoding = DBC_PLAIN;
+  } else {
+    put_varint(out, ndict);
+    for (i = 0; i < ndict; i++) {
+      uint32_t j = dict[i];
+      uint64_t start = j ? values->ends[j - 1] : 0;
+      put_varint(out, values->ends[j] - start);
+      put_bytes(out, values->text + start, values->ends[j] - start);
+    }
+
+    bytes_t plain = {NULL, 0, 0};
+    bytes_t rle = {NULL, 0, 0};
+    i = 0;
+    while (i < nrows) {
+      size_t run = 1;
+      while (i + run < nrows && indexes[i + run] == indexes[i]) {
+        run++;
+      }
+      put_varint(&rle, indexes[i]);
+      put_varint(&rle, run);
+
+      for (; run; run--) {
+        put_varint(&plain, indexes[i++]);
+      }
+    }
+
+    if (rle.len < plain.len) {
+      chunk->encoding = DBC_DICT_RLE;
+      put_bytes(out, rle.data, rle.len);
+    } else {
+      chunk->encoding = DBC_DICT;
+      put_bytes(out, plain.data, plain.len);
+    }
+    free(plain.data);
+    free(rle.data);
+  }
+
+  free(table);
+  free(dict);
+  free(indexes);
+}
+
+// Encodes and writes a column of the current row group. int and real values
+// are stored as strings if any of them would not print back as written.
+static int
+write_chunk(dbc_writer_t *writer, const dbc_values_t *values,
+            dbc_chunk_t *chunk) {
+  size_t nrows = writer->nrows;
+  bytes_t enc = {NULL, 0, 0};
+  size_t i;
+
+  chunk->type = values->type;
+  chunk->flags = 0;
+
+  if (chunk->type == DBC_INT) {
+    int64_t *ints = malloc(sizeof (int64_t) * nrows);
+    for (i = 0; i < nrows; i++) {
+      uint64_t start = i ? values->ends[i - 1] : 0;
+      if (!parse_int(values->text + start, values->ends[i] - start,
+                     &ints[i])) {
+        break;
+      }
+    }
+    if (i == nrows) {
+      encode_ints(ints, nrows, &enc, chunk);
+    } else {
+      chunk->type = DBC_STR;
+    }
+    free(ints);
+  } else if (chunk->type == DBC_REAL) {
+    double *reals = malloc(sizeof (double) * nrows);
+    for (i = 0; i < nrows; i++) {
+      uint64_t start = i ? values->ends[i - 1] : 0;
+      if (!parse_real(values->text + start, values->ends[i] - start,
+                      &reals[i])) {
+        break;
+      }
+    }
+    if (i == nrows) {
+      encode_reals(reals, nrows, &enc, chunk);
+    } else {
+      chunk->type = DBC_STR;
+    }
+    free(reals);
+  }
+
+  if (chunk->type == DBC_STR) {
+    encode_strs(values, nrows, &enc, chunk);
+  }
+
+  const void *data = enc.data;
+  chunk->size = chunk->raw_size = enc.len;
+
+#ifdef HAVE_ZSTD
+  void *z = NULL;
+  if (writer->level > 0 && enc.len) {
+    size_t bound = ZSTD_compressBound(enc.len);
+    z = malloc(bound);
+    size_t n = ZSTD_compress(z, bound, enc.data, enc.len, writer->level);
+    if (!ZSTD_isError(n) && n < enc.len) {
+      data = z;
+      chunk->size = n;
+      chunk->flags |= DBC_ZSTD;
+    }
+  }
+#endif
+
+  chunk->offset = writer->offset;
+  int ret = emit(writer, data, chunk->size);
+
+#ifdef HAVE_ZSTD
+  free(z);
+#endif
+  free(enc.data);
+
+  return ret;
+}
+
+// Writes the current row group.
+static int
+write_group(dbc_writer_t *writer) {
+  if (!writer->nrows) {
+    return 0;
+  }
+
+  if (writer->ngroups == writer->groups_size) {
+    writer->groups_size = writer->groups_size ? 2 * writer->groups_size : 16;
+    writer->groups = realloc(writer->groups,
+                             sizeof (dbc_group_t) * writer->groups_size);
+  }
+
+  dbc_group_t *group = &writer->groups[writer->ngroups++];
+  group->nrows = writer->nrows;
+  group->chunks = calloc(writer->ncols, sizeof (dbc_chunk_t));
+
+  int i;
+  for (i = 0; i < writer->ncols; i++) {
+    if (write_chunk(writer, &writer->values[i], &group->chunks[i]) == -1) {
+      return -1;
+    }
+    writer->values[i].len = 0;
+  }
+  writer->nrows = 0;
+
+  return 0;
+}
+
+int
+dbc_writer_add(dbc_writer_t *writer, record_t *record) {
+  int i;
+
+  if (writer->nrows == writer->rows_size) {
+    writer->rows_size = writer->rows_size ? 2 * writer->rows_size : 4096;
+    if (writer->rows_size > writer->group_rows) {
+      writer->rows_size = writer->group_rows;
+    }
+    for (i = 0; i < writer->ncols; i++) {
+      writer->values[i].ends = realloc(writer->values[i].ends,
+                                       sizeof (uint64_t) * writer->rows_size);
+    }
+  }
+
+  for (i = 0; i < writer->ncols; i++) {
+    dbc_values_t *values = &writer->values[i];
+    const field_t *field = record_field(record, i + 1);
+    size_t len = field ? field->len : 0;
+
+    if (values->len + len > values->size) {
+      if (!values->size) {
+        values->size = 65536;
+      }
+      while (values->len + len > values->size) {
+        values->size *= 2;
+      }
+      values->text = realloc(values->text, values->size);
+    }
+
+    if (len) {
+      memcpy(values->text + values->len, field->ptr, len);
+      values->len += len;
+    }
+    values->ends[writer->nrows] = values->len;
+  }
+
+  if (++writer->nrows == writer->group_rows) {
+    return write_group(writer);
+  }
+
+  return 0;
+}
+
+int
+dbc_writer_close(dbc_writer_t *writer) {
+  int ret = write_group(writer);
+
+  if (ret == 0) {
+    bytes_t footer = {NULL, 0, 0};
+    uint64_t footer_offset = writer->offset;
+
+    uint64_t g;
+    for (g = 0; g < writer->ngroups; g++) {
+      dbc_group_t *group = &writer->groups[g];
+      put_u64(&footer, group->nrows);
+
+      int i;
+      for (i = 0; i < writer->ncols; i++) {
+        dbc_chunk_t *chunk = &group->chunks[i];
+        put_u64(&footer, chunk->offset);
+        put_u64(&footer, chunk->size);
+        put_u64(&footer, chunk->raw_size);
+        put_bytes(&footer, &chunk->type, 1);
+        put_bytes(&footer, &chunk->encoding, 1);
+        put_bytes(&footer, &chunk->flags, 1);
+        put_u64(&footer, chunk->min.i);
+        put_u64(&footer, chunk->max.i);
+      }
+    }
+
+    put_u64(&footer, footer_offset);
+    put_u64(&footer, writer->ngroups);
+    put_bytes(&footer, DBC_MAGIC, 4);
+
+    ret = emit(writer, footer.data, footer.len);
+    free(footer.data);
+  }
+
+  if (writer_free(&writer->out) == -1) {
+    ret = -1;
+  }
+
+  uint64_t g;
+  for (g = 0; g < writer->ngroups; g++) {
+    free(writer->groups[g].chunks);
+  }
+  free(writer->groups);
+
+  int i;
+  for (i = 0; i < writer->ncols; i++) {
+    free(writer->values[i].text);
+    free(writer->values[i].ends);
+  }
+  free(writer->values);
+
+  return ret;
+}
+
+static int
+corrupt(const dbc_t *dbc) {
+  fprintf(stderr, "%s: corrupt dbc file\n", dbc->path);
+  return -1;
+}
+
+// Returns the most rows a chunk could hold. Plain numbers take eight bytes a
+// row and the other encodings at least a byte, except runs, which are only
+// held to what a column array can address.
+static uint64_t
+max_rows(const dbc_chunk_t *chunk) {
+  switch (chunk->encoding) {
+    case DBC_PLAIN:
+      return chunk->type == DBC_STR ? chunk->raw_size : chunk->raw_size / 8;
+    case DBC_RLE:
+    case DBC_DICT_RLE:
+      return SIZE_MAX / sizeof (field_t);
+    default:
+      return chunk->raw_size;
+  }
+}
+
+int
+dbc_open(dbc_t *dbc, const char *path) {
+  memset(dbc, 0, sizeof (dbc_t));
+  dbc->path = path;
+
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    perror(path);
+    return -1;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) == -1) {
+    perror(path);
+    close(fd);
+    return -1;
+  }
+
+  if (st.st_size < 8 + TRAILER) {
+    fprintf(stderr, "%s: not a dbc file\n", path);
+    close(fd);
+    return -1;
+  }
+
+  dbc->size = st.st_size;
+  void *map = mmap(NULL, dbc->size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    perror(path);
+    return -1;
+  }
+  dbc->map = map;
+
+  const uint8_t *p = dbc->map;
+  if (memcmp(p, DBC_MAGIC, 4) != 0 ||
+      memcmp(p + dbc->size - 4, DBC_MAGIC, 4) != 0) {
+    fprintf(stderr, "%s: not a dbc file\n", path);
+    dbc_close(dbc);
+    return -1;
+  }
+
+  uint64_t data_start = 8 + (p[4] | p[5] << 8 | p[6] << 16 |
+                             (uint64_t)p[7] << 24);
+  uint64_t footer = get_u64(p + dbc->size - TRAILER);
+  dbc->ngroups = get_u64(p + dbc->size - TRAILER + 8);
+
+  if (data_start > footer || footer > dbc->size - TRAILER) {
+    dbc_close(dbc);
+    return corrupt(dbc);
+  }
+
+  dbc->header = malloc(data_start - 8 + 1);
+  memcpy(dbc->header, p + 8, data_start - 8);
+  dbc->header[data_start - 8] = '\0';
+  if (parse_header(dbc->header, &dbc->schema) != 0) {
+    free(dbc->header);
+    dbc->header = NULL;
+    dbc_close(dbc);
+    return corrupt(dbc);
+  }
+
+  int ncols = dbc->schema.ncols;
+  uint64_t entry = 8 + (uint64_t)ncols * CHUNK_ENTRY;
+  if (dbc->ngroups > dbc->size / entry ||
+      dbc->ngroups * entry != dbc->size - TRAILER - footer) {
+    dbc_close(dbc);
+    return corrupt(dbc);
+  }
+
+  dbc->groups = calloc(dbc->ngroups, sizeof (dbc_group_t));
+  p += footer;
+
+  uint64_t g;
+  for (g = 0; g < dbc->ngroups; g++) {
+    dbc_group_t *group = &dbc->groups[g];
+    group->nrows = get_u64(p);
+    group->chunks = malloc(sizeof (dbc_chunk_t) * ncols);
+    p += 8;
+
+    int i;
+    for (i = 0; i < ncols; i++) {
+      dbc_chunk_t *chunk = &group->chunks[i];
+      chunk->offset = get_u64(p);
+      chunk->size = get_u64(p + 8);
+      chunk->raw_size = get_u64(p + 16);
+      chunk->type = p[24];
+      chunk->encoding = p[25];
+      chunk->flags = p[26];
+      chunk->min.i = get_u64(p + 27);
+      chunk->max.i = get_u64(p + 35);
+      p += CHUNK_ENTRY;
+
+      if (chunk->offset < data_start || chunk->size > footer ||
+          chunk->offset > footer - chunk->size || chunk->type > DBC_STR ||
+          chunk->encoding > DBC_DICT_RLE ||
+          (!(chunk->flags & DBC_ZSTD) && chunk->raw_size != chunk->size) ||
+          group->nrows > max_rows(chunk)) {
+        dbc_close(dbc);
+        return corrupt(dbc);
+      }
+    }
+  }
+
+  return 0;
+}
+
+// Decodes runs of int values.
+static int
+decode_runs(const uint8_t **p, const uint8_t *end, uint64_t nrows,
+            int64_t *ints) {
+  uint64_t i = 0;
+  while (i < nrows) {
+    uint64_t v, run;
+    if (get_varint(p, end, &v) == -1 || get_varint(p, end, &run) == -1 ||
+        run == 0 || run > nrows - i) {
+      return -1;
+    }
+    while (run--) {
+      ints[i++] = unzigzag(v);
+    }
+  }
+
+  return 0;
+}
+
+// Decodes a string dictionary and the index of each row.
+static int
+decode_dict(const uint8_t **p, const uint8_t *end, uint64_t nrows,
+            int rle, field_t *strs) {
+  uint64_t ndict, i;
+  if (get_varint(p, end, &ndict) == -1 || ndict > (uint64_t)(end - *p)) {
+    return -1;
+  }
+
+  int ret = 0;
+  field_t *dict = malloc(sizeof (field_t) * (ndict ? ndict : 1));
+  for (i = 0; i < ndict && ret == 0; i++) {
+    uint64_t len;
+    if (get_varint(p, end, &len) == -1 || len > (uint64_t)(end - *p)) {
+      ret = -1;
+      break;
+    }
+    dict[i].ptr = (const char *)*p;
+    dict[i].len = len;
+    *p += len;
+  }
+
+  i = 0;
+  while (ret == 0 && i < nrows) {
+    uint64_t index, run = 1;
+    if (get_varint(p, end, &index) == -1 || index >= ndict ||
+        (rle && get_varint(p, end, &run) == -1) || run == 0 ||
+        run > nrows - i) {
+      ret = -1;
+      break;
+    }
+    while (run--) {
+      strs[i++] = dict[index];
+    }
+  }
+
+  free(dict);
+
+  return ret;
+}
+
+int
+dbc_read_column(dbc_t *dbc, uint64_t group, int column, dbc_column_t *out) {
+  memset(out, 0, sizeof (dbc_column_t));
+
+  if (group >= dbc->ngroups || column < 1 || column > dbc->schema.ncols) {
+    fprintf(stderr, "%s: no column %d in row group %" PRIu64 "\n", dbc->path,
+            column, group);
+    return -1;
+  }
+
+  const dbc_chunk_t *chunk = &dbc->groups[group].chunks[column - 1];
+  uint64_t nrows = dbc->groups[group].nrows;
+  const uint8_t *p = dbc->map + chunk->offset;
+  const uint8_t *end = p + chunk->size;
+
+  out->type = chunk->type;
+  out->nrows = nrows;
+
+  if (chunk->flags & DBC_ZSTD) {
+#ifdef HAVE_ZSTD
+    if (ZSTD_getFrameContentSize(p, chunk->size) != chunk->raw_size) {
+      goto corrupt;
+    }
+    out->buf = malloc(chunk->raw_size ? chunk->raw_size : 1);
+    if (!out->buf) {
+      goto corrupt;
+    }
+    size_t n = ZSTD_decompress(out->buf, chunk->raw_size, p, chunk->size);
+    if (ZSTD_isError(n) || n != chunk->raw_size) {
+      goto corrupt;
+    }
+    p = out->buf;
+    end = p + n;
+#else
+    fprintf(stderr, "%s: zstd support not built\n", dbc->path);
+    return -1;
+#endif
+  }
+
+  uint64_t i;
+  switch (chunk->type) {
+    case DBC_INT:
+      out->ints = malloc(sizeof (int64_t) * (nrows ? nrows : 1));
+      if (!out->ints) {
+        goto corrupt;
+      }
+      if (chunk->encoding == DBC_DELTA) {
+        uint64_t acc = 0;
+        for (i = 0; i < nrows; i++) {
+          uint64_t v;
+          if (get_varint(&p, end, &v) == -1) {
+            goto corrupt;
+          }
+          acc += (uint64_t)unzigzag(v);
+          out->ints[i] = acc;
+        }
+      } else if (chunk->encoding != DBC_RLE ||
+                 decode_runs(&p, end, nrows, out->ints) == -1) {
+        goto corrupt;
+      }
+      break;
+
+    case DBC_REAL:
+      if (chunk->encoding != DBC_PLAIN || nrows > (uint64_t)(end - p) / 8) {
+        goto corrupt;
+      }
+      out->reals = malloc(sizeof (double) * (nrows ? nrows : 1));
+      if (!out->reals) {
+        goto corrupt;
+      }
+      for (i = 0; i < nrows; i++, p += 8) {
+        uint64_t bits = get_u64(p);
+        memcpy(&out->reals[i], &bits, 8);
+      }
+      break;
+
+    default:
+      out->strs = malloc(sizeof (field_t) * (nrows ? nrows : 1));
+      if (!out->strs) {
+        goto corrupt;
+      }
+      if (chunk->encoding == DBC_PLAIN) {
+        for (i = 0; i < nrows; i++) {
+          uint64_t len;
+          if (get_varint(&p, end, &len) == -1 ||
+              len > (uint64_t)(end - p)) {
+            goto corrupt;
+          }
+          out->strs[i].ptr = (const char *)p;
+          out->strs[i].len = len;
+          p += len;
+        }
+      } else if ((chunk->encoding != DBC_DICT &&
+                  chunk->encoding != DBC_DICT_RLE) ||
+                 decode_dict(&p, end, nrows,
+                             chunk->encoding == DBC_DICT_RLE,
+                             out->strs) == -1) {
+        goto corrupt;
+      }
+      break;
+  }
+
+  if (p == end) {
+    return 0;
+  }
+
+corrupt:
+  fprintf(stderr, "%s: corrupt chunk, row group %" PRIu64 ", column %d\n",
+          dbc->path, group, column);
+  dbc_column_free(out);
+
+  return -1;
+}
+
+void
+dbc_column_free(dbc_column_t *column) {
+  free(column->ints);
+  free(column->reals);
+  free(column->strs);
+  free(column->buf);
+  column->ints = NULL;
+  column->reals = NULL;
+  column->strs = NULL;
+  column->buf = NULL;
+}
+
+void
+dbc_close(dbc_t *dbc) {
+  if (dbc->map) {
+    munmap((void *)dbc->map, dbc->size);
+    dbc->map = NULL;
+  }
+
+  if (dbc->groups) {
+    uint64_t g;
+    for (g = 0; g < dbc->ngroups; g++) {
+      free(dbc->groups[g].chunks);
+    }
+    free(dbc->groups);
+    dbc->groups = NULL;
+  }
+
+  if (dbc->header) {
+    free(dbc->header);
+    free_schema(&dbc->schema);
+    dbc->header = NULL;
+  }
+}
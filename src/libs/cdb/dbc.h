@@ -0,0 +1,193 @@
+// dbc
+//
+// Copyright (c) 2015, Los Alamos National Security, LLC
+// All rights reserved.
+//
+// Copyright (2015). Los Alamos National Security, LLC. This software was
+// produced under U.S. Government contract DE-AC52-06NA25396 for Los Alamos
+// National Laboratory (LANL), which is operated by Los Alamos National
+// Security, LLC for the U.S. Department of Energy. The U.S. Government has
+// rights to use, reproduce, and distribute this software. NEITHER THE
+// GOVERNMENT NOR LOS ALAMOS NATIONAL SECURITY, LLC MAKES ANY WARRANTY, EXPRESS
+// OR IMPLIED, OR ASSUMES ANY LIABILITY FOR THE USE OF THIS SOFTWARE. If
+// software is modified to produce derivative works, such modified software
+// should be clearly marked, so as not to confuse it with the version available
+// from LANL.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//
+// Columnar db files. A .dbc file holds the same records as a db data file,
+// stored as row groups with each column encoded separately:
+//
+//   "DBC1" | header length (u32) | #db header
+//   column chunks of row group 0, in column order
+//   ...
+//   column chunks of row group N-1
+//   footer: per row group, its row count (u64) and a chunk entry per column
+//   footer offset (u64) | row group count (u64) | "DBC1"
+//
+// Integers are little-endian. int and real columns are stored as numbers,
+// with their min/max in the footer, unless a value in the row group would not
+// print back exactly as it was written; then that chunk is stored as strings.
+// Chunks may be compressed with zstd.
+//
+// Author: Curt Hash <chash@lanl.gov>
+
+#ifndef DBC_H
+#define DBC_H
+
+#include <stdint.h>
+
+#include "cdb.h"
+
+#define DBC_MAGIC "DBC1"
+#define DBC_GROUP_ROWS 1048576
+#define DBC_LEVEL 3
+
+typedef enum {
+  DBC_INT,
+  DBC_REAL,
+  DBC_STR
+} dbc_type_t;
+
+typedef enum {
+  DBC_PLAIN,     // Fixed-width numbers, or length-prefixed strings.
+  DBC_DELTA,     // Varint deltas of int values.
+  DBC_RLE,       // Varint runs of int values.
+  DBC_DICT,      // A string dictionary and a varint index per row.
+  DBC_DICT_RLE   // A string dictionary and varint runs of indexes.
+} dbc_encoding_t;
+
+// Chunk flags.
+#define DBC_ZSTD 0x1   // The encoded chunk is compressed with zstd.
+#define DBC_STATS 0x2  // min and max are set.
+
+typedef union {
+  int64_t i;
+  double d;
+} dbc_value_t;
+
+// One column of one row group.
+typedef struct {
+  uint64_t offset;
+  uint64_t size;      // Stored size.
+  uint64_t raw_size;  // Encoded size before compression.
+  uint8_t type;
+  uint8_t encoding;
+  uint8_t flags;
+  dbc_value_t min;
+  dbc_value_t max;
+} dbc_chunk_t;
+
+typedef struct {
+  uint64_t nrows;
+  dbc_chunk_t *chunks;  // One per column.
+} dbc_group_t;
+
+// A .dbc file, mapped into memory.
+typedef struct {
+  const char *path;
+  const uint8_t *map;
+  size_t size;
+  char *header;
+  schema_t schema;
+  uint64_t ngroups;
+  dbc_group_t *groups;
+} dbc_t;
+
+// A decoded column chunk. Only the array for its type is set. Strings point
+// into the file or into buf, and are valid until the column is freed.
+typedef struct {
+  dbc_type_t type;
+  uint64_t nrows;
+  int64_t *ints;
+  double *reals;
+  field_t *strs;
+  uint8_t *buf;  // Decompressed chunk.
+} dbc_column_t;
+
+// Values of one column of the row group being written.
+typedef struct {
+  dbc_type_t type;
+  char *text;
+  size_t len;
+  size_t size;
+  uint64_t *ends;  // End offset in text of each value.
+} dbc_values_t;
+
+// A .dbc file being written.
+typedef struct {
+  writer_t out;
+  uint64_t offset;  // Bytes written so far.
+  int ncols;
+  int level;        // zstd level, or 0.
+  size_t group_rows;
+  size_t nrows;     // Rows in the current row group.
+  size_t rows_size; // Capacity of the ends arrays.
+  dbc_values_t *values;
+  dbc_group_t *groups;
+  uint64_t ngroups;
+  uint64_t groups_size;
+} dbc_writer_t;
+
+// Returns the dbc type of a #db column type.
+extern dbc_type_t
+dbc_type(const char *type);
+
+// Formats a real as the shortest text that reads back as the same value.
+// Returns the length of the text.
+extern int
+dbc_format_real(char *buf, size_t size, double d);
+
+// Opens and maps a .dbc file. Returns 0, or -1 after printing an error.
+extern int
+dbc_open(dbc_t *dbc, const char *path);
+
+// Decodes a column (starting at 1) of a row group. Returns 0, or -1 after
+// printing an error.
+extern int
+dbc_read_column(dbc_t *dbc, uint64_t group, int column, dbc_column_t *out);
+
+// Frees a decoded column.
+extern void
+dbc_column_free(dbc_column_t *column);
+
+// Unmaps and frees a .dbc file.
+extern void
+dbc_close(dbc_t *dbc);
+
+// Initializes a writer for fd and writes the file header. Row groups hold up
+// to group_rows records, and chunks are compressed at the given zstd level if
+// zstd support is built and level is above 0.
+extern int
+dbc_writer_init(dbc_writer_t *writer, int fd, const char *header,
+                const schema_t *schema, size_t group_rows, int level);
+
+// Adds a record, whose batch must split at least as many fields as the schema
+// has columns. Missing fields are stored as empty. Returns 0, or -1 if a
+// write failed.
+extern int
+dbc_writer_add(dbc_writer_t *writer, record_t *record);
+
+// Writes the last row group and the footer, and frees the writer. The fd is
+// left open. Returns 0, or -1 if a write failed.
+extern int
+dbc_writer_close(dbc_writer_t *writer);
+
+#endif
@@ -38,6 +38,7 @@ Author: Curt Hash <chash@lanl.gov>
 """
 
 from db.header import *
+from db.reader import *
 
 __author__ = 'Curt Hash <chash@lanl.gov>'
 __version__ = '0.2'
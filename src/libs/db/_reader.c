@@ -0,0 +1,415 @@
+// _reader
+//
+// Copyright (c) 2015, Los Alamos National Security, LLC
+// All rights reserved.
+//
+// Copyright (2015). Los Alamos National Security, LLC. This software was
+// produced under U.S. Government contract DE-AC52-06NA25396 for Los Alamos
+// National Laboratory (LANL), which is operated by Los Alamos National
+// Security, LLC for the U.S. Department of Energy. The U.S. Government has
+// rights to use, reproduce, and distribute this software. NEITHER THE
+// GOVERNMENT NOR LOS ALAMOS NATIONAL SECURITY, LLC MAKES ANY WARRANTY, EXPRESS
+// OR IMPLIED, OR ASSUMES ANY LIABILITY FOR THE USE OF THIS SOFTWARE. If
+// software is modified to produce derivative works, such modified software
+// should be clearly marked, so as not to confuse it with the version available
+// from LANL.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//
+// C record reader for the db package. Records are read and split by cdb and
+// converted to Python values according to the column types of the header.
+//
+// Author: Curt Hash <chash@lanl.gov>
+
+#include <Python.h>
+
+#include <errno.h>
+
+#include "cdb.h"
+
+typedef struct {
+  PyObject_HEAD
+  reader_t reader;
+  batch_t batch;
+  int ncols;       // Typed columns, or 0 to return all fields as strings.
+  char *types;     // 'i', 'r' or 's' per column.
+  int strip_cr;    // Strip carriage returns from the end of each record.
+  int ready;
+} Reader;
+
+// Converts a field to a value of the given type. Text that the fast parsers
+// reject goes through int() or float(), so the results and errors are the
+// same as in Python.
+static PyObject *
+make_value(char type, const char *ptr, size_t len) {
+  int64_t i;
+  double d;
+  PyObject *str;
+  PyObject *value;
+
+  switch (type) {
+    case 'i':
+      if (parse_int64(ptr, len, &i) == 0) {
+        if (i >= LONG_MIN && i <= LONG_MAX) {
+          return PyInt_FromLong(i);
+        }
+        return PyLong_FromLongLong(i);
+      }
+      str = PyString_FromStringAndSize(ptr, len);
+      if (!str) {
+        return NULL;
+      }
+      value = PyNumber_Int(str);
+      Py_DECREF(str);
+      return value;
+
+    case 'r':
+      if (parse_double(ptr, len, &d) == 0) {
+        return PyFloat_FromDouble(d);
+      }
+      str = PyString_FromStringAndSize(ptr, len);
+      if (!str) {
+        return NULL;
+      }
+      value = PyFloat_FromString(str, NULL);
+      Py_DECREF(str);
+      return value;
+
+    default:
+      return PyString_FromStringAndSize(ptr, len);
+  }
+}
+
+// Returns the length of a field, without the carriage returns at the end of
+// the record if they are being stripped.
+static inline size_t
+field_len(Reader *self, const record_t *record, const char *ptr, size_t len) {
+  if (self->strip_cr && ptr + len == record->line + record->len - 1) {
+    while (len && ptr[len - 1] == '\r') {
+      len--;
+    }
+  }
+
+  return len;
+}
+
+// Returns a tuple of all of the fields of a record, as strings.
+static PyObject *
+split_record(Reader *self, const record_t *record) {
+  const char *p = record->line;
+  const char *end = p + record->len - 1;
+  Py_ssize_t n = 1;
+  const char *tab;
+
+  for (tab = memchr(p, '\t', end - p); tab;
+       tab = memchr(tab + 1, '\t', end - tab - 1)) {
+    n++;
+  }
+
+  PyObject *tuple = PyTuple_New(n);
+  if (!tuple) {
+    return NULL;
+  }
+
+  Py_ssize_t i;
+  for (i = 0; i < n; i++) {
+    tab = memchr(p, '\t', end - p);
+    size_t len = (tab ? tab : end) - p;
+    PyObject *value = PyString_FromStringAndSize(
+        p, field_len(self, record, p, len));
+    if (!value) {
+      Py_DECREF(tuple);
+      return NULL;
+    }
+    PyTuple_SET_ITEM(tuple, i, value);
+    p += len + 1;
+  }
+
+  return tuple;
+}
+
+// Converts column i of a record, raising IndexError if it is missing.
+static PyObject *
+record_value(Reader *self, record_t *record, int i) {
+  const field_t *field = record_field(record, i + 1);
+  if (!field) {
+    PyErr_SetString(PyExc_IndexError, "list index out of range");
+    return NULL;
+  }
+
+  return make_value(self->types[i], field->ptr,
+                    field_len(self, record, field->ptr, field->len));
+}
+
+// Returns a tuple of the typed columns of a record.
+static PyObject *
+make_record(Reader *self, record_t *record) {
+  if (!self->ncols) {
+    return split_record(self, record);
+  }
+
+  PyObject *tuple = PyTuple_New(self->ncols);
+  if (!tuple) {
+    return NULL;
+  }
+
+  int i;
+  for (i = 0; i < self->ncols; i++) {
+    PyObject *value = record_value(self, record, i);
+    if (!value) {
+      Py_DECREF(tuple);
+      return NULL;
+    }
+    PyTuple_SET_ITEM(tuple, i, value);
+  }
+
+  return tuple;
+}
+
+// Reads the next batch of records. Returns the number of records, 0 at EOF,
+// or -1 with an exception set.
+static Py_ssize_t
+next_batch(Reader *self) {
+  size_t count;
+
+  if (!self->ready) {
+    PyErr_SetString(PyExc_ValueError, "reader is not initialized");
+    return -1;
+  }
+
+  Py_BEGIN_ALLOW_THREADS
+  count = reader_batch(&self->reader, &self->batch);
+  Py_END_ALLOW_THREADS
+
+  if (!count && self->reader.error) {
+    errno = self->reader.error;
+    PyErr_SetFromErrno(PyExc_IOError);
+    return -1;
+  }
+
+  return count;
+}
+
+static PyObject *
+Reader_read_batch(Reader *self) {
+  Py_ssize_t count = next_batch(self);
+  if (count == -1) {
+    return NULL;
+  }
+
+  PyObject *list = PyList_New(count);
+  if (!list) {
+    return NULL;
+  }
+
+  Py_ssize_t i;
+  for (i = 0; i < count; i++) {
+    PyObject *record = make_record(self, &self->batch.records[i]);
+    if (!record) {
+      Py_DECREF(list);
+      return NULL;
+    }
+    PyList_SET_ITEM(list, i, record);
+  }
+
+  return list;
+}
+
+static PyObject *
+Reader_read_columns(Reader *self) {
+  if (!self->ncols) {
+    PyErr_SetString(PyExc_ValueError, "read_columns() requires types");
+    return NULL;
+  }
+
+  Py_ssize_t count = next_batch(self);
+  if (count == -1) {
+    return NULL;
+  }
+  if (!count) {
+    return PyList_New(0);
+  }
+
+  PyObject *columns = PyList_New(self->ncols);
+  if (!columns) {
+    return NULL;
+  }
+
+  int c;
+  for (c = 0; c < self->ncols; c++) {
+    PyObject *column = PyList_New(count);
+    if (!column) {
+      Py_DECREF(columns);
+      return NULL;
+    }
+    PyList_SET_ITEM(columns, c, column);
+  }
+
+  // Convert a record at a time, so that a missing field is reported the same
+  // way as by read_batch().
+  Py_ssize_t i;
+  for (i = 0; i < count; i++) {
+    for (c = 0; c < self->ncols; c++) {
+      PyObject *value = record_value(self, &self->batch.records[i], c);
+      if (!value) {
+        Py_DECREF(columns);
+        return NULL;
+      }
+      PyList_SET_ITEM(PyList_GET_ITEM(columns, c), i, value);
+    }
+  }
+
+  return columns;
+}
+
+static int
+Reader_init(Reader *self, PyObject *args, PyObject *kwds) {
+  static char *kwlist[] = {"fd", "types", "strip_cr", NULL};
+  int fd;
+  PyObject *types = Py_None;
+  int strip_cr = 0;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "i|Oi", kwlist, &fd, &types,
+                                   &strip_cr)) {
+    return -1;
+  }
+
+  int ncols = 0;
+  char *codes = NULL;
+  if (types != Py_None) {
+    PyObject *seq = PySequence_Fast(types, "types must be a sequence");
+    if (!seq) {
+      return -1;
+    }
+
+    ncols = PySequence_Fast_GET_SIZE(seq);
+    codes = malloc(ncols ? ncols : 1);
+
+    int i;
+    for (i = 0; i < ncols; i++) {
+      const char *type = PyString_AsString(PySequence_Fast_GET_ITEM(seq, i));
+      if (!type) {
+        free(codes);
+        Py_DECREF(seq);
+        return -1;
+      }
+      codes[i] = strcmp(type, "int") == 0 ? 'i' :
+                 strcmp(type, "real") == 0 ? 'r' : 's';
+    }
+    Py_DECREF(seq);
+
+    if (!ncols) {
+      free(codes);
+      PyErr_SetString(PyExc_ValueError, "types is empty");
+      return -1;
+    }
+  }
+
+  if (self->ready) {
+    reader_free(&self->reader);
+    batch_free(&self->batch);
+    free(self->types);
+  }
+
+  reader_init(&self->reader, fd, READER_BUFSIZE);
+  batch_init(&self->batch, BATCH_SIZE, ncols);
+  self->ncols = ncols;
+  self->types = codes;
+  self->strip_cr = strip_cr;
+  self->ready = 1;
+
+  return 0;
+}
+
+static void
+Reader_dealloc(Reader *self) {
+  if (self->ready) {
+    reader_free(&self->reader);
+    batch_free(&self->batch);
+    free(self->types);
+  }
+  Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static PyMethodDef Reader_methods[] = {
+  {"read_batch", (PyCFunction)Reader_read_batch, METH_NOARGS,
+   "Returns a list of up to 1024 records as tuples, or [] at EOF."},
+  {"read_columns", (PyCFunction)Reader_read_columns, METH_NOARGS,
+   "Returns a list of column lists for up to 1024 records, or [] at EOF."},
+  {NULL, NULL, 0, NULL}
+};
+
+static PyTypeObject ReaderType = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  "db._reader.Reader",                       // tp_name
+  sizeof (Reader),                           // tp_basicsize
+  0,                                         // tp_itemsize
+  (destructor)Reader_dealloc,                // tp_dealloc
+  0,                                         // tp_print
+  0,                                         // tp_getattr
+  0,                                         // tp_setattr
+  0,                                         // tp_compare
+  0,                                         // tp_repr
+  0,                                         // tp_as_number
+  0,                                         // tp_as_sequence
+  0,                                         // tp_as_mapping
+  0,                                         // tp_hash
+  0,                                         // tp_call
+  0,                                         // tp_str
+  0,                                         // tp_getattro
+  0,                                         // tp_setattro
+  0,                                         // tp_as_buffer
+  Py_TPFLAGS_DEFAULT,                        // tp_flags
+  "Reader(fd, types=None, strip_cr=False)\n\n"
+  "Reads db records from fd, after the header. Fields of int and real\n"
+  "columns are converted as by int() and float(). Without types, every\n"
+  "field of each record is returned as a string.",  // tp_doc
+  0,                                         // tp_traverse
+  0,                                         // tp_clear
+  0,                                         // tp_richcompare
+  0,                                         // tp_weaklistoffset
+  0,                                         // tp_iter
+  0,                                         // tp_iternext
+  Reader_methods,                            // tp_methods
+  0,                                         // tp_members
+  0,                                         // tp_getset
+  0,                                         // tp_base
+  0,                                         // tp_dict
+  0,                                         // tp_descr_get
+  0,                                         // tp_descr_set
+  0,                                         // tp_dictoffset
+  (initproc)Reader_init,                     // tp_init
+};
+
+PyMODINIT_FUNC
+init_reader(void) {
+  ReaderType.tp_new = PyType_GenericNew;
+  if (PyType_Ready(&ReaderType) < 0) {
+    return;
+  }
+
+  PyObject *module = Py_InitModule3("_reader", NULL,
+                                    "C record reader for the db package.");
+  if (!module) {
+    return;
+  }
+
+  Py_INCREF(&ReaderType);
+  PyModule_AddObject(module, "Reader", (PyObject *)&ReaderType);
+}
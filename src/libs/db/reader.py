@@ -0,0 +1,138 @@
+"""reader
+
+Copyright (c) 2015, Los Alamos National Security, LLC
+All rights reserved.
+
+Copyright (2015). Los Alamos National Security, LLC. This software was produced
+under U.S. Government contract DE-AC52-06NA25396 for Los Alamos National
+Laboratory (LANL), which is operated by Los Alamos National Security, LLC for
+the U.S. Department of Energy. The U.S. Government has rights to use,
+reproduce, and distribute this software. NEITHER THE GOVERNMENT NOR LOS ALAMOS
+NATIONAL SECURITY, LLC MAKES ANY WARRANTY, EXPRESS OR IMPLIED, OR ASSUMES ANY
+LIABILITY FOR THE USE OF THIS SOFTWARE. If software is modified to produce
+derivative works, such modified software should be clearly marked, so as not to
+confuse it with the version available from LANL.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+Read db records in batches, with the values of int and real columns converted.
+The C reader in db._reader is used if it is built.
+
+Author: Curt Hash <chash@lanl.gov>
+
+"""
+
+import itertools
+import os
+import sys
+
+try:
+    from db import _reader
+except ImportError:
+    _reader = None
+
+__all__ = ['batches', 'columns', 'records']
+
+BATCH_SIZE = 1024
+
+
+def _types(schema):
+    """Returns the column types of a schema like that returned by
+    parse_header(), in column order.
+
+    """
+    items = schema.items()
+    items.sort(key=lambda i: i[1][0])
+
+    return [datatype for _, (_, datatype) in items]
+
+
+def _python_batches(fd, types, strip_cr):
+    """Reads batches of records as tuples without the C reader. """
+    infile = sys.stdin if fd == 0 else os.fdopen(os.dup(fd))
+    strip = '\r\n' if strip_cr else '\n'
+
+    if types is None:
+        convert = None
+    else:
+        converters = [{'int': int, 'real': float}.get(t, str) for t in types]
+        convert = zip(range(len(types)), converters)
+
+    while True:
+        lines = list(itertools.islice(infile, BATCH_SIZE))
+        if not lines:
+            break
+
+        batch = []
+        for line in lines:
+            fields = line.rstrip(strip).split('\t')
+            if convert is None:
+                batch.append(tuple(fields))
+            else:
+                batch.append(tuple(f(fields[i]) for i, f in convert))
+
+        yield batch
+
+
+def batches(schema=None, fd=0, strip_cr=False):
+    """Reads the records that follow the header on fd, and yields lists of
+    them as tuples. With a schema, each tuple has the columns of the schema in
+    order, converted by int() or float() if their type is int or real.
+    Without one, each tuple has all of the fields of the record as strings.
+    strip_cr strips carriage returns from the end of each record.
+
+    """
+    types = None if schema is None else _types(schema)
+
+    if _reader is None:
+        for batch in _python_batches(fd, types, strip_cr):
+            yield batch
+        return
+
+    reader = _reader.Reader(fd, types, strip_cr)
+    while True:
+        batch = reader.read_batch()
+        if not batch:
+            break
+        yield batch
+
+
+def columns(schema, fd=0, strip_cr=False):
+    """Like batches(), but yields a list of the values of each column for each
+    batch of records.
+
+    """
+    if _reader is None:
+        for batch in _python_batches(fd, _types(schema), strip_cr):
+            yield [list(column) for column in zip(*batch)]
+        return
+
+    reader = _reader.Reader(fd, _types(schema), strip_cr)
+    while True:
+        batch = reader.read_columns()
+        if not batch:
+            break
+        yield batch
+
+
+def records(schema=None, fd=0, strip_cr=False):
+    """Like batches(), but yields one record at a time. """
+    for batch in batches(schema, fd, strip_cr):
+        for record in batch:
+            yield record
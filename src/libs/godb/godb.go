@@ -39,6 +39,7 @@
 package godb
 
 import (
+	"bufio"
 	"fmt"
 	"io"
 	"os"
@@ -77,19 +78,36 @@ func (schema Schema) HasColumn(name string) bool {
 	return ok
 }
 
+// Reads the header line from handle, without its newline. A *bufio.Reader is
+// read a line at a time. Other readers are read a byte at a time, so that
+// nothing past the header is consumed. Returns what was read if the read
+// fails first.
 func ReadHeader(handle io.Reader) string {
-	header := ""
+	header, _ := ReadHeaderLine(handle)
+	return header
+}
+
+// Like ReadHeader, but also returns the error of a read that failed before
+// the end of the header, which is io.EOF if there is no newline.
+func ReadHeaderLine(handle io.Reader) (string, error) {
+	if br, ok := handle.(*bufio.Reader); ok {
+		line, err := br.ReadString('\n')
+		return strings.TrimSuffix(line, "\n"), err
+	}
+
+	header := make([]byte, 0, 256)
 	b := make([]byte, 1)
 	for {
-		handle.Read(b)
-		c := string(b)
-		if (c == "\n") {
-			break
+		n, err := handle.Read(b)
+		if n == 1 {
+			if b[0] == '\n' {
+				return string(header), nil
+			}
+			header = append(header, b[0])
+		} else if err != nil {
+			return string(header), err
 		}
-		header += c
 	}
-
-	return header
 }
 
 // If arg is a string, it is treated as the header. If arg is an io.Reader, the
@@ -0,0 +1,245 @@
+// godb
+//
+// Copyright (c) 2015, Los Alamos National Security, LLC
+// All rights reserved.
+//
+// Copyright (2015). Los Alamos National Security, LLC. This software was
+// produced under U.S. Government contract DE-AC52-06NA25396 for Los Alamos
+// National Laboratory (LANL), which is operated by Los Alamos National
+// Security, LLC for the U.S. Department of Energy. The U.S. Government has
+// rights to use, reproduce, and distribute this software. NEITHER THE
+// GOVERNMENT NOR LOS ALAMOS NATIONAL SECURITY, LLC MAKES ANY WARRANTY, EXPRESS
+// OR IMPLIED, OR ASSUMES ANY LIABILITY FOR THE USE OF THIS SOFTWARE. If
+// software is modified to produce derivative works, such modified software
+// should be clearly marked, so as not to confuse it with the version available
+// from LANL.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//
+// Read db data records without allocating per record.
+//
+// Author: Curt Hash <chash@lanl.gov>
+
+package godb
+
+import (
+	"bufio"
+	"bytes"
+	"io"
+	"sync"
+)
+
+// Size of the read buffer used by NewRecordReader.
+const ReaderBufferSize = 65536
+
+// Reads records from a db data stream. The header must be read with
+// ReadHeader on the RecordReader itself, or have been read from the stream
+// one byte at a time, so that no records are lost.
+type RecordReader struct {
+	r      *bufio.Reader
+	line   []byte   // Scratch space for records longer than the buffer.
+	fields [][]byte // Fields of the current record.
+	err    error
+}
+
+// A batch of records copied out of a RecordReader. Its storage is reused by
+// each ReadBatch call.
+type Batch struct {
+	Seq     uint64   // Position of the batch in the stream, starting at 0.
+	Fields  [][]byte // Fields of all of the records.
+	Offsets []int    // Start of each record in Fields, and the end of the last.
+	data    []byte
+	spans   []int // Start and end of each field in data.
+}
+
+// Returns a RecordReader for r. r is used as is if it is a *bufio.Reader with
+// a buffer of at least size bytes.
+func NewRecordReader(r io.Reader, size int) *RecordReader {
+	return &RecordReader{r: bufio.NewReaderSize(r, size)}
+}
+
+// Reads the header line, without its newline.
+func (rr *RecordReader) ReadHeader() (string, error) {
+	return ReadHeaderLine(rr.r)
+}
+
+// Returns the next line, without its newline. The line points into the
+// reader's buffer, or its scratch space if it is longer than the buffer.
+func (rr *RecordReader) readLine() ([]byte, error) {
+	if rr.err != nil {
+		return nil, rr.err
+	}
+
+	line, err := rr.r.ReadSlice('\n')
+	if err == bufio.ErrBufferFull {
+		rr.line = append(rr.line[:0], line...)
+		for err == bufio.ErrBufferFull {
+			line, err = rr.r.ReadSlice('\n')
+			rr.line = append(rr.line, line...)
+		}
+		line = rr.line
+	}
+
+	if err != nil {
+		// A last record without a newline is returned before the error.
+		rr.err = err
+		if len(line) == 0 {
+			return nil, err
+		}
+		return line, nil
+	}
+
+	return line[:len(line)-1], nil
+}
+
+// Appends the fields of line to fields.
+func splitFields(fields [][]byte, line []byte) [][]byte {
+	for {
+		i := bytes.IndexByte(line, '\t')
+		if i == -1 {
+			return append(fields, line)
+		}
+		fields = append(fields, line[:i])
+		line = line[i+1:]
+	}
+}
+
+// Returns the fields of the next record. The fields are only valid until the
+// next call. Returns io.EOF after the last record.
+func (rr *RecordReader) Next() ([][]byte, error) {
+	line, err := rr.readLine()
+	if err != nil {
+		return nil, err
+	}
+
+	rr.fields = splitFields(rr.fields[:0], line)
+
+	return rr.fields, nil
+}
+
+// Returns the number of records in the batch.
+func (b *Batch) Len() int {
+	if len(b.Offsets) == 0 {
+		return 0
+	}
+	return len(b.Offsets) - 1
+}
+
+// Returns the fields of record i of the batch.
+func (b *Batch) Record(i int) [][]byte {
+	return b.Fields[b.Offsets[i]:b.Offsets[i+1]]
+}
+
+// Reads up to n records into b, replacing its contents. Returns the number of
+// records read, which is 0 with io.EOF after the last record.
+func (rr *RecordReader) ReadBatch(b *Batch, n int) (int, error) {
+	b.data = b.data[:0]
+	b.spans = b.spans[:0]
+	b.Offsets = append(b.Offsets[:0], 0)
+
+	var err error
+	count := 0
+	for count < n {
+		var line []byte
+		line, err = rr.readLine()
+		if err != nil {
+			break
+		}
+
+		// Record the spans of the fields, and make the slices once the data
+		// has stopped moving.
+		start := len(b.data)
+		b.data = append(b.data, line...)
+		for {
+			i := bytes.IndexByte(line, '\t')
+			if i == -1 {
+				b.spans = append(b.spans, start, start+len(line))
+				break
+			}
+			b.spans = append(b.spans, start, start+i)
+			start += i + 1
+			line = line[i+1:]
+		}
+
+		b.Offsets = append(b.Offsets, len(b.spans)/2)
+		count++
+	}
+
+	b.Fields = b.Fields[:0]
+	for i := 0; i < len(b.spans); i += 2 {
+		b.Fields = append(b.Fields, b.data[b.spans[i]:b.spans[i+1]])
+	}
+
+	if count > 0 {
+		return count, nil
+	}
+
+	return 0, err
+}
+
+// Reads batches of up to size records and calls fn on each of them from
+// workers goroutines. Batches are reused once fn returns, so fn must not keep
+// them, and they may be processed in any order; Batch.Seq gives their order
+// in the stream. Returns nil at EOF, or the first read error.
+func (rr *RecordReader) Parallel(workers, size int, fn func(*Batch)) error {
+	if workers < 1 {
+		workers = 1
+	}
+
+	free := make(chan *Batch, 2*workers)
+	for i := 0; i < 2*workers; i++ {
+		free <- &Batch{}
+	}
+
+	work := make(chan *Batch, workers)
+	var wg sync.WaitGroup
+	for i := 0; i < workers; i++ {
+		wg.Add(1)
+		go func() {
+			defer wg.Done()
+			for b := range work {
+				fn(b)
+				free <- b
+			}
+		}()
+	}
+
+	var err error
+	var seq uint64
+	for {
+		b := <-free
+		var n int
+		n, err = rr.ReadBatch(b, size)
+		if n == 0 {
+			break
+		}
+		b.Seq = seq
+		seq++
+		work <- b
+	}
+
+	close(work)
+	wg.Wait()
+
+	if err == io.EOF {
+		return nil
+	}
+
+	return err
+}
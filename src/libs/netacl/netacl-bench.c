@@ -0,0 +1,507 @@
+// netacl-bench
+//
+// Copyright (c) 2015, Los Alamos National Security, LLC
+// All rights reserved.
+//
+// Copyright (2015). Los Alamos National Security, LLC. This software was
+// produced under U.S. Government contract DE-AC52-06NA25396 for Los Alamos
+// National Laboratory (LANL), which is operated by Los Alamos National
+// Security, LLC for the U.S. Department of Energy. The U.S. Government has
+// rights to use, reproduce, and distribute this software. NEITHER THE
+// GOVERNMENT NOR LOS ALAMOS NATIONAL SECURITY, LLC MAKES ANY WARRANTY, EXPRESS
+// OR IMPLIED, OR ASSUMES ANY LIABILITY FOR THE USE OF THIS SOFTWARE. If
+// software is modified to produce derivative works, such modified software
+// should be clearly marked, so as not to confuse it with the version available
+// from LANL.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//
+// Microbenchmark and differential test of libcidr and netacl lookups.
+//
+// Author: Curt Hash <chash@lanl.gov>
+
+#include <arpa/inet.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <libgen.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "libcidr.h"
+#include "netacl.h"
+
+#define MAX_ADDR 64
+#define MAX_RUNS 16
+#define DEFAULT_BUDGET 100000000ULL
+#define ROUTE_ACLS 4
+
+// A synthetic rule or address, in network byte order. IPv4 uses addr[0..3].
+typedef struct {
+  uint8_t addr[16];
+  int pflen;
+  char v6;
+  char exclude;
+} prefix_t;
+
+// Synthetic workload: an ACL and a stream of address strings drawn with
+// repetition from a smaller pool of distinct addresses.
+typedef struct {
+  prefix_t *rules;
+  uint64_t nrules;
+  char (*pool)[MAX_ADDR];
+  uint64_t npool;
+  const char **stream;
+  uint64_t nstream;
+} workload_t;
+
+static uint64_t rng_state;
+
+// xorshift64*, so that runs are reproducible across platforms.
+static uint64_t
+rng(void) {
+  rng_state ^= rng_state >> 12;
+  rng_state ^= rng_state << 25;
+  rng_state ^= rng_state >> 27;
+  return rng_state * 2685821657736338717ULL;
+}
+
+// Returns a uniform double in [0, 1).
+static double
+rng_unit(void) {
+  return (rng() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static uint64_t
+now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Clears the bits of addr past pflen.
+static void
+mask(uint8_t *addr, int pflen, int nbytes) {
+  int i;
+  for (i = 0; i < nbytes; i++) {
+    int bits = pflen - i * 8;
+    if (bits <= 0) {
+      addr[i] = 0;
+    } else if (bits < 8) {
+      addr[i] &= 0xff << (8 - bits);
+    }
+  }
+}
+
+// Fills the bits of addr past pflen with random bits.
+static void
+randomize_host(uint8_t *addr, int pflen, int nbytes) {
+  int i;
+  for (i = 0; i < nbytes; i++) {
+    int bits = pflen - i * 8;
+    if (bits <= 0) {
+      addr[i] = rng();
+    } else if (bits < 8) {
+      addr[i] |= rng() & (0xff >> bits);
+    }
+  }
+}
+
+// Formats an address, with a /pflen suffix if pflen >= 0.
+static void
+format(char *buf, const uint8_t *addr, char v6, int pflen) {
+  inet_ntop(v6 ? AF_INET6 : AF_INET, addr, buf, MAX_ADDR);
+  if (pflen >= 0) {
+    sprintf(buf + strlen(buf), "/%d", pflen);
+  }
+}
+
+// Draws a rule. Prefix lengths cluster where real ACLs do: /16-/24 for IPv4
+// and /32-/64 for IPv6, with some host routes.
+static void
+gen_rule(prefix_t *rule, double v6) {
+  uint64_t r = rng();
+  int i;
+
+  rule->v6 = rng_unit() < v6;
+  rule->exclude = r % 10 < 3;
+  for (i = 0; i < 16; i++) {
+    rule->addr[i] = rng();
+  }
+
+  if (rule->v6) {
+    // Keep most rules under a few /16s so that they overlap.
+    rule->addr[0] = 0x20;
+    rule->addr[1] = 0x01 + (r >> 8) % 4;
+    int pflens[] = {32, 40, 48, 48, 56, 64, 64, 64, 96, 128};
+    rule->pflen = pflens[(r >> 16) % 10];
+    mask(rule->addr, rule->pflen, 16);
+  } else {
+    rule->addr[0] = 10 + (r >> 8) % 4;
+    int pflens[] = {8, 12, 16, 16, 20, 22, 24, 24, 24, 28, 32};
+    rule->pflen = pflens[(r >> 16) % 11];
+    mask(rule->addr, rule->pflen, 4);
+  }
+}
+
+// Draws a distinct address. Most fall inside a rule; the rest are uniform
+// over the same address space. About 1% use forms that the fast parser does
+// not handle (IPv4-mapped, CIDR suffixes, junk) to exercise the fallbacks.
+static void
+gen_addr(char *buf, const workload_t *w, double v6) {
+  prefix_t p;
+  uint64_t r = rng();
+
+  if (r % 100 == 0) {
+    gen_rule(&p, 0);
+    randomize_host(p.addr, p.pflen, 4);
+    switch ((r >> 8) % 3) {
+      case 0:
+        strcpy(buf, "::ffff:");
+        format(buf + strlen(buf), p.addr, 0, -1);
+        break;
+      case 1:
+        format(buf, p.addr, 0, 24 + (r >> 16) % 9);
+        break;
+      default:
+        strcpy(buf, (r >> 16) % 2 ? "" : "not-an-address");
+        break;
+    }
+    return;
+  }
+
+  if (r % 4 != 0 && w->nrules) {
+    p = w->rules[(r >> 8) % w->nrules];
+  } else {
+    gen_rule(&p, v6);
+    p.pflen = p.v6 ? 16 : 8;
+  }
+  randomize_host(p.addr, p.pflen, p.v6 ? 16 : 4);
+  format(buf, p.addr, p.v6, -1);
+}
+
+// Builds a workload of nrules rules and nstream addresses. Stream entries are
+// drawn from the pool with a power-law skew, so a few addresses dominate.
+static void
+workload_init(workload_t *w, uint64_t nrules, uint64_t nstream, double v6) {
+  uint64_t i;
+
+  w->nrules = nrules;
+  w->rules = malloc(sizeof (prefix_t) * (nrules ? nrules : 1));
+  for (i = 0; i < nrules; i++) {
+    gen_rule(&w->rules[i], v6);
+  }
+
+  w->npool = nstream / 8 + 1;
+  w->pool = malloc(MAX_ADDR * w->npool);
+  for (i = 0; i < w->npool; i++) {
+    gen_addr(w->pool[i], w, v6);
+  }
+
+  w->nstream = nstream;
+  w->stream = malloc(sizeof (char *) * nstream);
+  for (i = 0; i < nstream; i++) {
+    double u = rng_unit();
+    w->stream[i] = w->pool[(uint64_t)(w->npool * u * u * u)];
+  }
+}
+
+static void
+workload_free(workload_t *w) {
+  free(w->rules);
+  free(w->pool);
+  free(w->stream);
+}
+
+// Loads rules[i] for every i % n == k (all rules if n is 1) through the
+// regular ACL file parser.
+static void
+load_acl(netacl_t *acl, const workload_t *w, uint64_t k, uint64_t n) {
+  FILE *fp = tmpfile();
+  char buf[MAX_ADDR];
+  uint64_t i;
+
+  if (!fp) {
+    perror("tmpfile");
+    exit(EXIT_FAILURE);
+  }
+  for (i = k; i < w->nrules; i += n) {
+    const prefix_t *rule = &w->rules[i];
+    format(buf, rule->addr, rule->v6, rule->pflen);
+    fprintf(fp, "%c%s\n", rule->exclude ? '-' : '+', buf);
+  }
+  rewind(fp);
+
+  if (netacl_from_file(fp, acl) != 0) {
+    fprintf(stderr, "netacl-bench: failed to load synthetic ACL\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+// Prints a result row.
+static void
+report(uint64_t nrules, double v6, const char *op, uint64_t ops,
+       uint64_t ns) {
+  double per_op = ops ? (double)ns / ops : 0.0;
+  printf("%" PRIu64 "\t%.2f\t%s\t%" PRIu64 "\t%.1f\t%.0f\n", nrules, v6, op,
+         ops, per_op, per_op > 0 ? 1e9 / per_op : 0.0);
+}
+
+// Number of stream entries that a linear scan can test within the budget.
+static uint64_t
+linear_ops(const workload_t *w, uint64_t budget) {
+  uint64_t ops = budget / (w->nrules ? w->nrules : 1);
+  if (ops == 0) {
+    ops = 1;
+  }
+  return ops < w->nstream ? ops : w->nstream;
+}
+
+// Times each lookup path over the workload.
+static void
+bench(const workload_t *w, double v6, uint64_t budget) {
+  netacl_t acl;
+  const netacl_t *ptr = &acl;
+  netacl_router_t router;
+  volatile uint64_t sink = 0;
+  uint64_t i, n, start;
+
+  load_acl(&acl, w, 0, 1);
+  netacl_router_init(&router, &ptr, 1);
+
+  // Parsing, including the allocation that every cidr_from_str() caller pays.
+  start = now_ns();
+  for (i = 0; i < w->nstream; i++) {
+    CIDR *cidr = cidr_from_str(w->stream[i]);
+    sink += cidr != NULL;
+    cidr_free(cidr);
+  }
+  report(w->nrules, v6, "cidr_from_str", w->nstream, now_ns() - start);
+
+  // One containment test per op, against rules in turn.
+  n = w->nstream;
+  CIDR **addrs = malloc(sizeof (CIDR *) * n);
+  for (i = 0; i < n; i++) {
+    addrs[i] = cidr_from_str(w->stream[i]);
+  }
+  CIDR **rules = acl.include.size ? acl.include.cidrs : acl.exclude.cidrs;
+  uint64_t nr = acl.include.size ? acl.include.size : acl.exclude.size;
+  if (nr) {
+    start = now_ns();
+    for (i = 0; i < n; i++) {
+      sink += cidr_contains(rules[i % nr], addrs[i]) == 0;
+    }
+    report(w->nrules, v6, "cidr_contains", n, now_ns() - start);
+  }
+  for (i = 0; i < n; i++) {
+    cidr_free(addrs[i]);
+  }
+  free(addrs);
+
+  n = linear_ops(w, budget);
+  start = now_ns();
+  for (i = 0; i < n; i++) {
+    sink += netacl_pass(&acl, w->stream[i]);
+  }
+  report(w->nrules, v6, "netacl_pass", n, now_ns() - start);
+
+  start = now_ns();
+  for (i = 0; i < w->nstream; i++) {
+    sink += netacl_router_pass(&router, w->stream[i]);
+  }
+  report(w->nrules, v6, "netacl_router_pass", w->nstream, now_ns() - start);
+
+  netacl_router_destroy(&router);
+  netacl_destroy(&acl);
+}
+
+// Checks every fast path against the linear scan of the original ACL. Returns
+// the number of mismatches.
+static uint64_t
+check(const workload_t *w, double v6, uint64_t budget) {
+  netacl_t acl, normalized, parts[ROUTE_ACLS];
+  const netacl_t *ptr = &acl;
+  const netacl_t *ptrs[ROUTE_ACLS];
+  netacl_router_t router, multi;
+  uint64_t pass[1];
+  uint64_t i, k, mismatches = 0;
+
+  load_acl(&acl, w, 0, 1);
+  load_acl(&normalized, w, 0, 1);
+  netacl_normalize(&normalized);
+  netacl_router_init(&router, &ptr, 1);
+  for (k = 0; k < ROUTE_ACLS; k++) {
+    load_acl(&parts[k], w, k, ROUTE_ACLS);
+    ptrs[k] = &parts[k];
+  }
+  netacl_router_init(&multi, ptrs, ROUTE_ACLS);
+
+  // Check distinct addresses rather than the skewed stream. The budget covers
+  // the three ACLs that are scanned per address.
+  uint64_t n = linear_ops(w, budget / 3);
+  if (n > w->npool) {
+    n = w->npool;
+  }
+  for (i = 0; i < n; i++) {
+    const char *addr = w->pool[i];
+    int expect = netacl_pass(&acl, addr);
+    const char *path = NULL;
+
+    if (netacl_router_pass(&router, addr) != expect) {
+      path = "netacl_router_pass";
+    } else if (netacl_pass(&normalized, addr) != expect) {
+      path = "netacl_normalize";
+    } else {
+      netacl_route(&multi, addr, pass);
+      for (k = 0; k < ROUTE_ACLS; k++) {
+        if ((int)(pass[0] >> k & 1) != netacl_pass(&parts[k], addr)) {
+          path = "netacl_route";
+          break;
+        }
+      }
+    }
+
+    if (path) {
+      if (mismatches++ < 10) {
+        fprintf(stderr, "netacl-bench: %s disagrees with netacl_pass on "
+                "\"%s\" (%" PRIu64 " rules)\n", path, addr, w->nrules);
+      }
+    }
+  }
+
+  fprintf(stderr, "netacl-bench: checked %" PRIu64 " addresses against %"
+          PRIu64 " rules, %" PRIu64 " mismatches\n", n, w->nrules,
+          mismatches);
+
+  netacl_router_destroy(&multi);
+  for (k = 0; k < ROUTE_ACLS; k++) {
+    netacl_destroy(&parts[k]);
+  }
+  netacl_router_destroy(&router);
+  netacl_destroy(&normalized);
+  netacl_destroy(&acl);
+
+  return mismatches;
+}
+
+// Prints usage and exits.
+static void
+usage(char *prog, int status) {
+  printf("Usage: %s [OPTION]...\n\n", basename(prog));
+  printf("  -h, --help                  Print this text and exit.\n");
+  printf("  -a, --addresses N           Addresses per stream (default "
+         "1000000).\n");
+  printf("  -b, --budget N              Rule comparisons allowed per linear "
+         "scan\n                              (default %llu).\n",
+         DEFAULT_BUDGET);
+  printf("  -c, --check                 Only run the differential check.\n");
+  printf("  -r, --rules N[,N]...        ACL sizes (default "
+         "10,100,...,1000000).\n");
+  printf("  -s, --seed N                Random seed (default 1).\n");
+  printf("  -6, --v6 FRACTION           Fraction of IPv6 rules and addresses "
+         "(default\n                              0.5).\n");
+  printf("\nTimings are printed in db format. The linear scan is timed and "
+         "checked on\nas many addresses as the budget allows. Exits 1 if "
+         "any fast path disagrees\nwith the linear scan.\n");
+
+  exit(status);
+}
+
+int
+main(int argc, char **argv) {
+  static struct option long_options[] = {
+    {"help", no_argument, NULL, 'h'},
+    {"addresses", required_argument, NULL, 'a'},
+    {"budget", required_argument, NULL, 'b'},
+    {"check", no_argument, NULL, 'c'},
+    {"rules", required_argument, NULL, 'r'},
+    {"seed", required_argument, NULL, 's'},
+    {"v6", required_argument, NULL, '6'},
+    {NULL, 0, NULL, 0}
+  };
+  const char *options = "ha:b:cr:s:6:";
+  int opt;
+  uint64_t nstream = 1000000;
+  uint64_t budget = DEFAULT_BUDGET;
+  char check_only = 0;
+  uint64_t sizes[MAX_RUNS] = {10, 100, 1000, 10000, 100000, 1000000};
+  int nsizes = 6;
+  uint64_t seed = 1;
+  double v6 = 0.5;
+  char *s;
+
+  while ((opt = getopt_long(argc, argv, options, long_options, NULL)) != -1) {
+    switch (opt) {
+      case 'h':
+        usage(argv[0], EXIT_SUCCESS);
+        break;
+      case 'a':
+        nstream = strtoull(optarg, NULL, 10);
+        break;
+      case 'b':
+        budget = strtoull(optarg, NULL, 10);
+        break;
+      case 'c':
+        check_only = 1;
+        break;
+      case 'r':
+        for (nsizes = 0, s = strtok(optarg, ","); s && nsizes < MAX_RUNS;
+             s = strtok(NULL, ",")) {
+          sizes[nsizes++] = strtoull(s, NULL, 10);
+        }
+        break;
+      case 's':
+        seed = strtoull(optarg, NULL, 10);
+        break;
+      case '6':
+        v6 = atof(optarg);
+        break;
+      default:
+        usage(argv[0], EXIT_FAILURE);
+        break;
+    }
+  }
+  if (nstream == 0 || nsizes == 0) {
+    usage(argv[0], EXIT_FAILURE);
+  }
+
+  if (!check_only) {
+    printf("#db\trules:int\tv6:real\top:str\tops:int\tns_per_op:real\t"
+           "lookups_per_sec:real\n");
+  }
+
+  uint64_t mismatches = 0;
+  int i;
+  for (i = 0; i < nsizes; i++) {
+    workload_t w;
+
+    rng_state = seed * 0x9e3779b97f4a7c15ULL + sizes[i] + 1;
+    workload_init(&w, sizes[i], nstream, v6);
+    if (!check_only) {
+      bench(&w, v6, budget);
+      fflush(stdout);
+    }
+    mismatches += check(&w, v6, budget);
+    workload_free(&w);
+  }
+
+  return mismatches ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -40,6 +40,7 @@
 #include "errno.h"
 #include "stdlib.h"
 #include "string.h"
+#include "time.h"
 
 #include "netacl.h"
 
@@ -73,6 +74,24 @@ cidr_vector_free(cidr_vector_t *v) {
   free(v->cidrs);
 }
 
+// Returns 1 if a 16-octet IPv6 address is an IPv4-mapped address.
+static inline int
+netacl_v4mapped(const uint8_t *addr) {
+  static const uint8_t prefix[12] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff};
+  return memcmp(addr, prefix, sizeof (prefix)) == 0;
+}
+
+// Turns an IPv4-mapped IPv6 CIDR (::ffff:0:0/96 or longer) into the IPv4
+// CIDR that it maps, so that such addresses and rules match IPv4 ones. libcidr
+// stores IPv4 CIDRs in mapped form already, so only the protocol changes.
+static inline void
+netacl_unmap(CIDR *cidr) {
+  if (cidr->proto == CIDR_IPV6 && netacl_v4mapped(cidr->addr) &&
+      cidr_get_pflen(cidr) >= 96) {
+    cidr->proto = CIDR_IPV4;
+  }
+}
+
 // Initializes an ACL.
 static inline void
 netacl_init(netacl_t *acl) {
@@ -101,6 +120,24 @@ netacl_from_path(const char *path, netacl_t *acl) {
   return netacl_from_file(fp, acl);
 }
 
+// Loads an ACL from a file path and, if requested, normalizes it, reporting
+// the reduction in rules on stderr.
+int
+netacl_load(const char *path, netacl_t *acl, int normalize) {
+  int ret = netacl_from_path(path, acl);
+  if (ret != 0 || !normalize) {
+    return ret;
+  }
+
+  uint32_t before = acl->include.size + acl->exclude.size;
+  netacl_normalize(acl);
+  uint32_t after = acl->include.size + acl->exclude.size;
+  fprintf(stderr, "%s: %u rules normalized to %u (%.1f%% fewer)\n", path,
+          before, after, before ? 100.0 * (before - after) / before : 0.0);
+
+  return 0;
+}
+
 // Loads an ACL from a file descriptor.
 int
 netacl_from_fd(int fd, netacl_t *acl) {
@@ -171,6 +208,7 @@ netacl_from_file(FILE *fp, netacl_t *acl) {
 #endif
       return ERR_SYNTAX;
     }
+    netacl_unmap(cidr);
 
     // Add the CIDR to the include or exclude vector.
     if (rule_type == '+') {
@@ -198,19 +236,26 @@ netacl_from_file(FILE *fp, netacl_t *acl) {
 //  (b) the CIDR does not belong to one of the networks in the exclude vector
 //      or there are no exclude rules.
 //
-// Returns 0 otherwise.
-inline int
-netacl_pass(const netacl_t *acl, const char *addr) {
+// Returns 0 otherwise. If profile is not NULL, the rules that decided the
+// result are counted in it.
+static inline int
+netacl_test(const netacl_t *acl, const char *addr, netacl_profile_t *profile) {
   int i;
   int pass = 1;
 
   CIDR *cidr = cidr_from_str(addr);
+  if (cidr) {
+    netacl_unmap(cidr);
+  }
 
   if (acl->include.size) {
     pass = 0;
     for (i = 0; i < acl->include.size; i++) {
       if (cidr_contains(acl->include.cidrs[i], cidr) == 0) {
         // Matched an include rule.
+        if (profile) {
+          profile->include_hits[i]++;
+        }
         pass = 1;
         break;
       }
@@ -222,6 +267,9 @@ netacl_pass(const netacl_t *acl, const char *addr) {
     for (i = 0; i < acl->exclude.size; i++) {
       if (cidr_contains(acl->exclude.cidrs[i], cidr) == 0) {
         // Matched an exclude rule.
+        if (profile) {
+          profile->exclude_hits[i]++;
+        }
         pass = 0;
         break;
       }
@@ -232,3 +280,766 @@ netacl_pass(const netacl_t *acl, const char *addr) {
 
   return pass;
 }
+
+// Tests an address against an ACL. See netacl_test().
+inline int
+netacl_pass(const netacl_t *acl, const char *addr) {
+  return netacl_test(acl, addr, NULL);
+}
+
+// Initializes a profile for an ACL.
+void
+netacl_profile_init(netacl_profile_t *profile, const netacl_t *acl) {
+  memset(profile, 0, sizeof (netacl_profile_t));
+  profile->ninclude = acl->include.size;
+  profile->nexclude = acl->exclude.size;
+  profile->include_hits = calloc(acl->include.size + 1, sizeof (uint64_t));
+  profile->exclude_hits = calloc(acl->exclude.size + 1, sizeof (uint64_t));
+}
+
+// Adds the counters of src to dst. Both must profile the same ACL.
+void
+netacl_profile_merge(netacl_profile_t *dst, const netacl_profile_t *src) {
+  uint32_t i;
+  for (i = 0; i < dst->ninclude; i++) {
+    dst->include_hits[i] += src->include_hits[i];
+  }
+
+  for (i = 0; i < dst->nexclude; i++) {
+    dst->exclude_hits[i] += src->exclude_hits[i];
+  }
+
+  dst->lookups += src->lookups;
+  dst->passed += src->passed;
+  dst->sampled += src->sampled;
+
+  for (i = 0; i < NETACL_LATENCY_BUCKETS; i++) {
+    dst->latency[i] += src->latency[i];
+  }
+}
+
+// Frees a profile.
+void
+netacl_profile_free(netacl_profile_t *profile) {
+  free(profile->include_hits);
+  free(profile->exclude_hits);
+}
+
+// Counts the latency of a sampled lookup in a profile.
+static void
+netacl_profile_sample(netacl_profile_t *profile, const struct timespec *start,
+                      const struct timespec *end) {
+  uint64_t ns = (end->tv_sec - start->tv_sec) * 1000000000ULL +
+                end->tv_nsec - start->tv_nsec;
+
+  // Bucket i holds latencies in [2^(i-1), 2^i) ns.
+  int bucket = ns ? 64 - __builtin_clzll(ns) : 0;
+  if (bucket >= NETACL_LATENCY_BUCKETS) {
+    bucket = NETACL_LATENCY_BUCKETS - 1;
+  }
+  profile->latency[bucket]++;
+  profile->sampled++;
+}
+
+// Tests an address against an ACL, counting the lookup, the rule that decided
+// it and, for one in every NETACL_SAMPLE_INTERVAL lookups, its latency.
+int
+netacl_pass_profile(const netacl_t *acl, const char *addr,
+                    netacl_profile_t *profile) {
+  int pass;
+
+  if (profile->lookups++ % NETACL_SAMPLE_INTERVAL) {
+    pass = netacl_test(acl, addr, profile);
+  } else {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pass = netacl_test(acl, addr, profile);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    netacl_profile_sample(profile, &start, &end);
+  }
+
+  profile->passed += pass;
+
+  return pass;
+}
+
+// Initializes a trie with an empty root node.
+static void
+netacl_trie_init(netacl_trie_t *trie) {
+  trie->nodes = calloc(INITIAL_VECTOR_SIZE, sizeof (netacl_node_t));
+  trie->nnodes = 1;
+  trie->node_capacity = INITIAL_VECTOR_SIZE;
+  trie->marks = malloc(sizeof (netacl_mark_t) * INITIAL_VECTOR_SIZE);
+  trie->nmarks = 0;
+  trie->mark_capacity = INITIAL_VECTOR_SIZE;
+}
+
+// Frees a trie.
+static void
+netacl_trie_free(netacl_trie_t *trie) {
+  free(trie->nodes);
+  free(trie->marks);
+}
+
+// Returns the index of the child of a node, creating it if necessary.
+static uint32_t
+netacl_trie_child(netacl_trie_t *trie, uint32_t node, int bit) {
+  if (!trie->nodes[node].child[bit]) {
+    if (trie->nnodes == trie->node_capacity) {
+      trie->node_capacity *= 2;
+      trie->nodes = realloc(trie->nodes,
+                            sizeof (netacl_node_t) * trie->node_capacity);
+    }
+
+    memset(&trie->nodes[trie->nnodes], 0, sizeof (netacl_node_t));
+    trie->nodes[node].child[bit] = trie->nnodes++;
+  }
+
+  return trie->nodes[node].child[bit];
+}
+
+// Inserts the network bits of a CIDR into a trie and marks the final node
+// with the rule. Duplicate rules of the same ACL are marked once, so lookups
+// do not pay for them. Rules are inserted one ACL at a time, so the ACL's
+// marks are at the head of the node's list.
+static void
+netacl_trie_insert(netacl_trie_t *trie, const uint8_t *addr, int pflen,
+                   uint32_t acl, uint32_t rule, uint8_t exclude) {
+  uint32_t node = 0;
+
+  int i;
+  for (i = 0; i < pflen; i++) {
+    int bit = (addr[i / 8] >> (7 - i % 8)) & 1;
+    node = netacl_trie_child(trie, node, bit);
+  }
+
+  uint32_t m;
+  for (m = trie->nodes[node].marks; m && trie->marks[m - 1].acl == acl;
+       m = trie->marks[m - 1].next) {
+    if (trie->marks[m - 1].exclude == exclude) {
+      return;
+    }
+  }
+
+  if (trie->nmarks == trie->mark_capacity) {
+    trie->mark_capacity *= 2;
+    trie->marks = realloc(trie->marks,
+                          sizeof (netacl_mark_t) * trie->mark_capacity);
+  }
+
+  netacl_mark_t *mark = &trie->marks[trie->nmarks++];
+  mark->acl = acl;
+  mark->rule = rule;
+  mark->exclude = exclude;
+  mark->next = trie->nodes[node].marks;
+  trie->nodes[node].marks = trie->nmarks;
+}
+
+// Parses a dotted-quad IPv4 host address without allocating. Returns 1 if
+// successful. Anything else (prefixes, octal or hex octets, short forms) is
+// left for cidr_from_str().
+static inline int
+netacl_parse_v4(const char *s, uint8_t *addr) {
+  int i;
+  for (i = 0; i < 4; i++) {
+    if (*s < '0' || *s > '9') {
+      return 0;
+    }
+
+    // A leading zero means octal to cidr_from_str().
+    if (*s == '0' && s[1] >= '0' && s[1] <= '9') {
+      return 0;
+    }
+
+    uint32_t octet = 0;
+    int digits = 0;
+    while (*s >= '0' && *s <= '9' && digits < 4) {
+      octet = octet * 10 + (*s++ - '0');
+      digits++;
+    }
+
+    if (octet > 255 || *s != (i < 3 ? '.' : '\0')) {
+      return 0;
+    }
+
+    addr[i] = octet;
+    s++;
+  }
+
+  return 1;
+}
+
+// Returns the value of a hex digit, or -1.
+static inline int
+netacl_hex(char c) {
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  } else if (c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  } else if (c >= 'A' && c <= 'F') {
+    return c - 'A' + 10;
+  }
+
+  return -1;
+}
+
+// Parses an IPv6 host address without allocating, including the compressed
+// "::" form and a trailing dotted quad. Returns 1 if successful. Prefixes and
+// anything unusual are left for cidr_from_str().
+static inline int
+netacl_parse_v6(const char *s, uint8_t *addr) {
+  uint16_t groups[8];
+  int n = 0;
+  int gap = -1;
+
+  if (*s == ':') {
+    if (s[1] != ':') {
+      return 0;
+    }
+    gap = 0;
+    s += 2;
+  }
+
+  while (*s) {
+    const char *start = s;
+    uint32_t group = 0;
+    int digits = 0;
+    int v;
+    while ((v = netacl_hex(*s)) >= 0) {
+      if (++digits > 4) {
+        return 0;
+      }
+      group = group << 4 | v;
+      s++;
+    }
+
+    if (*s == '.') {
+      // Trailing dotted quad.
+      uint8_t v4[4];
+      if (n > 6 || !netacl_parse_v4(start, v4)) {
+        return 0;
+      }
+      groups[n++] = v4[0] << 8 | v4[1];
+      groups[n++] = v4[2] << 8 | v4[3];
+      break;
+    }
+
+    if (!digits || n == 8) {
+      return 0;
+    }
+    groups[n++] = group;
+
+    if (!*s) {
+      break;
+    } else if (*s != ':') {
+      return 0;
+    }
+
+    if (*++s == ':') {
+      if (gap >= 0) {
+        return 0;
+      }
+      gap = n;
+      s++;
+    } else if (!*s) {
+      // Trailing single colon.
+      return 0;
+    }
+  }
+
+  // "::" stands for at least one group.
+  if (gap < 0 ? n != 8 : n > 7) {
+    return 0;
+  }
+
+  memset(addr, 0, 16);
+  int i;
+  int tail = gap < 0 ? 0 : n - gap;
+  for (i = 0; i < n - tail; i++) {
+    addr[2*i] = groups[i] >> 8;
+    addr[2*i + 1] = groups[i];
+  }
+  for (i = 0; i < tail; i++) {
+    addr[16 - 2*tail + 2*i] = groups[n - tail + i] >> 8;
+    addr[16 - 2*tail + 2*i + 1] = groups[n - tail + i];
+  }
+
+  return 1;
+}
+
+// Inserts the IPv4 or IPv6 rules of a vector into the router's tries.
+static void
+netacl_router_insert(netacl_router_t *router, const cidr_vector_t *v,
+                     uint32_t acl, uint8_t exclude) {
+  uint32_t i;
+  for (i = 0; i < v->size; i++) {
+    const CIDR *cidr = v->cidrs[i];
+    if (cidr->proto == CIDR_IPV4) {
+      netacl_trie_insert(&router->v4, cidr->addr + 12, cidr_get_pflen(cidr),
+                         acl, i, exclude);
+    } else if (cidr->proto == CIDR_IPV6) {
+      netacl_trie_insert(&router->v6, cidr->addr, cidr_get_pflen(cidr), acl,
+                         i, exclude);
+    }
+  }
+}
+
+// Merges a set of ACLs into a router, with one trie for IPv4 rules and one for
+// IPv6 rules.
+int
+netacl_router_init(netacl_router_t *router, const netacl_t **acls,
+                   uint32_t nacls) {
+  router->nacls = nacls;
+  router->words = (nacls + 63) / 64;
+  router->open = calloc(router->words, sizeof (uint64_t));
+  netacl_trie_init(&router->v4);
+  netacl_trie_init(&router->v6);
+
+  uint32_t i;
+  for (i = 0; i < nacls; i++) {
+    const netacl_t *acl = acls[i];
+
+    if (!acl->include.size) {
+      router->open[i / 64] |= (uint64_t)1 << (i % 64);
+    }
+
+    netacl_router_insert(router, &acl->include, i, 0);
+    netacl_router_insert(router, &acl->exclude, i, 1);
+  }
+
+#ifdef DEBUG
+  fprintf(stderr, "netacl: router has %u ACLs, %u+%u nodes, %u+%u marks\n",
+          nacls, router->v4.nnodes, router->v6.nnodes, router->v4.nmarks,
+          router->v6.nmarks);
+#endif
+
+  return 0;
+}
+
+// Frees a router.
+void
+netacl_router_destroy(netacl_router_t *router) {
+  netacl_trie_free(&router->v4);
+  netacl_trie_free(&router->v6);
+  free(router->open);
+}
+
+// Walks a trie along the first depth bits of an address, collecting the rules
+// of every prefix of the address.
+static inline void
+netacl_trie_walk(const netacl_trie_t *trie, const uint8_t *addr, int depth,
+                 uint64_t *include, uint64_t *exclude) {
+  uint32_t node = 0;
+  int i = 0;
+  for (;;) {
+    uint32_t m = trie->nodes[node].marks;
+    while (m) {
+      const netacl_mark_t *mark = &trie->marks[m - 1];
+      uint64_t *set = mark->exclude ? exclude : include;
+      set[mark->acl / 64] |= (uint64_t)1 << (mark->acl % 64);
+      m = mark->next;
+    }
+
+    if (i == depth) {
+      break;
+    }
+
+    node = trie->nodes[node].child[(addr[i / 8] >> (7 - i % 8)) & 1];
+    i++;
+    if (!node) {
+      break;
+    }
+  }
+}
+
+// Walks a trie like netacl_trie_walk(), for a router of a single ACL, finding
+// the first include and exclude rules that match the address, by index in the
+// ACL. Either is UINT32_MAX if no rule matched.
+static inline void
+netacl_trie_walk_rules(const netacl_trie_t *trie, const uint8_t *addr,
+                       int depth, uint32_t *include, uint32_t *exclude) {
+  uint32_t node = 0;
+  int i = 0;
+  for (;;) {
+    uint32_t m = trie->nodes[node].marks;
+    while (m) {
+      const netacl_mark_t *mark = &trie->marks[m - 1];
+      uint32_t *rule = mark->exclude ? exclude : include;
+      if (mark->rule < *rule) {
+        *rule = mark->rule;
+      }
+      m = mark->next;
+    }
+
+    if (i == depth) {
+      break;
+    }
+
+    node = trie->nodes[node].child[(addr[i / 8] >> (7 - i % 8)) & 1];
+    i++;
+    if (!node) {
+      break;
+    }
+  }
+}
+
+// Parses an address for a walk of one of the router's tries. Returns the trie,
+// or NULL if the address is not valid, and sets the bits and depth to walk.
+//
+// Plain host addresses are parsed in place. Anything else goes through
+// cidr_from_str(); a network is matched by the rules whose prefixes are no
+// longer than its own, as with cidr_contains().
+static const netacl_trie_t *
+netacl_router_trie(const netacl_router_t *router, const char *addr,
+                   uint8_t *a, const uint8_t **bits, int *depth) {
+  const netacl_trie_t *trie = NULL;
+  *bits = a;
+  if (netacl_parse_v4(addr, a)) {
+    trie = &router->v4;
+    *depth = 32;
+  } else if (netacl_parse_v6(addr, a)) {
+    if (netacl_v4mapped(a)) {
+      trie = &router->v4;
+      *bits = a + 12;
+      *depth = 32;
+    } else {
+      trie = &router->v6;
+      *depth = 128;
+    }
+  } else {
+    CIDR *cidr = cidr_from_str(addr);
+    if (cidr) {
+      netacl_unmap(cidr);
+      *depth = cidr_get_pflen(cidr);
+      if (cidr->proto == CIDR_IPV4) {
+        trie = &router->v4;
+        memcpy(a, cidr->addr + 12, 4);
+      } else if (cidr->proto == CIDR_IPV6) {
+        trie = &router->v6;
+        memcpy(a, cidr->addr, 16);
+      }
+      cidr_free(cidr);
+    }
+  }
+
+  return trie;
+}
+
+// Sets pass to the bitset of ACLs that pass the address. An ACL passes the
+// address if the address matched one of its include rules (or it has none)
+// and none of its exclude rules, exactly as in netacl_pass().
+int
+netacl_route(const netacl_router_t *router, const char *addr,
+             uint64_t *pass) {
+  uint32_t words = router->words;
+  uint32_t i;
+  int count = 0;
+
+  uint64_t exclude[words];
+  memcpy(pass, router->open, sizeof (uint64_t) * words);
+  memset(exclude, 0, sizeof (uint64_t) * words);
+
+  uint8_t a[16];
+  const uint8_t *bits;
+  int depth;
+  const netacl_trie_t *trie = netacl_router_trie(router, addr, a, &bits,
+                                                 &depth);
+  if (trie) {
+    netacl_trie_walk(trie, bits, depth, pass, exclude);
+  }
+
+  for (i = 0; i < words; i++) {
+    pass[i] &= ~exclude[i];
+    count += __builtin_popcountll(pass[i]);
+  }
+
+  return count;
+}
+
+// Tests an address against a router of a single ACL. Equivalent to
+// netacl_pass() on that ACL.
+int
+netacl_router_pass(const netacl_router_t *router, const char *addr) {
+  uint64_t pass;
+  return netacl_route(router, addr, &pass);
+}
+
+// Tests an address against a router of a single ACL, counting the rules that
+// decided it in the profile. The rules are found in the walk, and are the same
+// ones that netacl_test() would count.
+static int
+netacl_router_test(const netacl_router_t *router, const char *addr,
+                   netacl_profile_t *profile) {
+  uint32_t include = UINT32_MAX;
+  uint32_t exclude = UINT32_MAX;
+
+  uint8_t a[16];
+  const uint8_t *bits;
+  int depth;
+  const netacl_trie_t *trie = netacl_router_trie(router, addr, a, &bits,
+                                                 &depth);
+  if (trie) {
+    netacl_trie_walk_rules(trie, bits, depth, &include, &exclude);
+  }
+
+  // An ACL with no include rules is open.
+  int pass = router->open[0] & 1;
+  if (include != UINT32_MAX) {
+    profile->include_hits[include]++;
+    pass = 1;
+  }
+
+  if (pass && exclude != UINT32_MAX) {
+    profile->exclude_hits[exclude]++;
+    pass = 0;
+  }
+
+  return pass;
+}
+
+// Tests an address against a router of a single ACL, like
+// netacl_pass_profile() on that ACL, without scanning its rules.
+int
+netacl_router_pass_profile(const netacl_router_t *router, const char *addr,
+                           netacl_profile_t *profile) {
+  int pass;
+
+  if (profile->lookups++ % NETACL_SAMPLE_INTERVAL) {
+    pass = netacl_router_test(router, addr, profile);
+  } else {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pass = netacl_router_test(router, addr, profile);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    netacl_profile_sample(profile, &start, &end);
+  }
+
+  profile->passed += pass;
+
+  return pass;
+}
+
+// Returns a new CIDR for the first pflen bits of addr. addr holds 4 octets for
+// IPv4 and 16 for IPv6.
+static CIDR *
+netacl_cidr_from_prefix(int proto, const uint8_t *addr, int pflen) {
+  CIDR *cidr = cidr_alloc();
+  cidr->proto = proto;
+
+  int offset = 0;
+  if (proto == CIDR_IPV4) {
+    // Same layout as cidr_from_str(): a v4-mapped address.
+    memset(cidr->addr + 10, 0xff, 2);
+    memset(cidr->mask, 0xff, 12);
+    offset = 12;
+  }
+
+  int i;
+  for (i = 0; i < pflen; i++) {
+    uint8_t bit = 0x80 >> (i % 8);
+    cidr->mask[offset + i / 8] |= bit;
+    cidr->addr[offset + i / 8] |= addr[i / 8] & bit;
+  }
+
+  return cidr;
+}
+
+// Returns 1 if a rule of the given kind ends at the node.
+static inline int
+netacl_node_has(const netacl_trie_t *trie, const netacl_node_t *n,
+                uint8_t exclude) {
+  uint32_t m;
+  for (m = n->marks; m; m = trie->marks[m - 1].next) {
+    if (trie->marks[m - 1].exclude == exclude) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+// Computes the minimum number of rules needed to reproduce the pass set under
+// a node, both when the output rules above it do (cost[1]) and do not
+// (cost[0]) include it. A NULL node is a region with no rules of its own,
+// which passes iff inc is set.
+static void
+netacl_normalize_cost(const netacl_trie_t *trie, const netacl_node_t *n,
+                      int inc, uint32_t (*costs)[2], uint32_t *cost) {
+  if (n && netacl_node_has(trie, n, 1)) {
+    // Excluded; nothing under the node passes.
+    cost[0] = 0;
+    cost[1] = 1;
+    return;
+  }
+
+  if (n) {
+    inc |= netacl_node_has(trie, n, 0);
+  }
+
+  if (!n || (!n->child[0] && !n->child[1])) {
+    // Uniform region.
+    cost[0] = inc;
+    cost[1] = !inc;
+  } else {
+    uint32_t child[2][2];
+    int b;
+    for (b = 0; b < 2; b++) {
+      const netacl_node_t *c = n->child[b] ? &trie->nodes[n->child[b]] : NULL;
+      netacl_normalize_cost(trie, c, inc, costs, child[b]);
+    }
+
+    // Either leave the children as they are, or include the whole node and
+    // carve the children out of it.
+    uint32_t split = child[0][0] + child[1][0];
+    uint32_t covered = child[0][1] + child[1][1];
+    cost[0] = split < covered + 1 ? split : covered + 1;
+
+    // If nothing under the node passes, one exclude covers it.
+    cost[1] = cost[0] == 0 && covered > 1 ? 1 : covered;
+  }
+
+  if (n) {
+    costs[n - trie->nodes][0] = cost[0];
+    costs[n - trie->nodes][1] = cost[1];
+  }
+}
+
+// Emits the rules chosen by netacl_normalize_cost() into acl.
+static void
+netacl_normalize_emit(const netacl_trie_t *trie, const netacl_node_t *n,
+                      int inc, int covered, uint32_t (*costs)[2], int proto,
+                      uint8_t *addr, int depth, netacl_t *acl) {
+  if (n && netacl_node_has(trie, n, 1)) {
+    if (covered) {
+      cidr_vector_push(&acl->exclude,
+                       netacl_cidr_from_prefix(proto, addr, depth));
+    }
+    return;
+  }
+
+  if (n) {
+    inc |= netacl_node_has(trie, n, 0);
+  }
+
+  if (!n || (!n->child[0] && !n->child[1])) {
+    if (inc && !covered) {
+      cidr_vector_push(&acl->include,
+                       netacl_cidr_from_prefix(proto, addr, depth));
+    } else if (!inc && covered) {
+      cidr_vector_push(&acl->exclude,
+                       netacl_cidr_from_prefix(proto, addr, depth));
+    }
+    return;
+  }
+
+  const netacl_node_t *child[2];
+  uint32_t split = 0;
+  uint32_t under = 0;
+  int b;
+  for (b = 0; b < 2; b++) {
+    uint32_t cost[2];
+    child[b] = n->child[b] ? &trie->nodes[n->child[b]] : NULL;
+    if (child[b]) {
+      cost[0] = costs[n->child[b]][0];
+      cost[1] = costs[n->child[b]][1];
+    } else {
+      cost[0] = inc;
+      cost[1] = !inc;
+    }
+    split += cost[0];
+    under += cost[1];
+  }
+
+  uint32_t *cost = costs[n - trie->nodes];
+  if (!covered && split >= under + 1) {
+    cidr_vector_push(&acl->include,
+                     netacl_cidr_from_prefix(proto, addr, depth));
+    covered = 1;
+  } else if (covered && cost[0] == 0 && under > 1) {
+    cidr_vector_push(&acl->exclude,
+                     netacl_cidr_from_prefix(proto, addr, depth));
+    return;
+  }
+
+  for (b = 0; b < 2; b++) {
+    uint8_t mask = 0x80 >> (depth % 8);
+    if (b) {
+      addr[depth / 8] |= mask;
+    } else {
+      addr[depth / 8] &= ~mask;
+    }
+    netacl_normalize_emit(trie, child[b], inc, covered, costs, proto, addr,
+                          depth + 1, acl);
+  }
+  addr[depth / 8] &= ~(0x80 >> (depth % 8));
+}
+
+// Normalizes the rules of one protocol family into out.
+static void
+netacl_normalize_proto(const netacl_t *acl, int proto, int covered,
+                       netacl_t *out) {
+  netacl_trie_t trie;
+  netacl_trie_init(&trie);
+
+  int offset = proto == CIDR_IPV4 ? 12 : 0;
+  const cidr_vector_t *vectors[2] = {&acl->include, &acl->exclude};
+
+  int v;
+  uint32_t i;
+  for (v = 0; v < 2; v++) {
+    for (i = 0; i < vectors[v]->size; i++) {
+      const CIDR *cidr = vectors[v]->cidrs[i];
+      if (cidr->proto == proto) {
+        netacl_trie_insert(&trie, cidr->addr + offset, cidr_get_pflen(cidr),
+                           0, i, v);
+      }
+    }
+  }
+
+  uint32_t (*costs)[2] = malloc(sizeof (uint32_t[2]) * trie.nnodes);
+  uint32_t cost[2];
+  netacl_normalize_cost(&trie, trie.nodes, covered, costs, cost);
+
+  uint8_t addr[16] = {0};
+  netacl_normalize_emit(&trie, trie.nodes, covered, covered, costs, proto, addr, 0,
+                        out);
+
+  free(costs);
+  netacl_trie_free(&trie);
+}
+
+// Replaces the rules of an ACL with a minimal rule set: duplicate,
+// shadowed and overlapping rules are dropped, adjacent prefixes are merged and
+// include/exclude overlaps are resolved. The result passes exactly the same
+// host addresses as the original, but not the same networks: a network is
+// passed by a rule that contains it, and merging or splitting rules changes
+// which networks are contained in one. Use it only on host address fields.
+void
+netacl_normalize(netacl_t *acl) {
+  netacl_t out;
+  netacl_init(&out);
+
+  // An ACL without include rules passes everything that isn't excluded. In
+  // that case, start both families out included and covered so that only
+  // excludes are emitted.
+  int open = acl->include.size == 0;
+  netacl_normalize_proto(acl, CIDR_IPV4, open, &out);
+  netacl_normalize_proto(acl, CIDR_IPV6, open, &out);
+
+  if (!open && !out.include.size) {
+    // Nothing passes, but the ACL must keep an include rule or it would pass
+    // everything.
+    uint8_t zero[4] = {0};
+    cidr_vector_push(&out.include, netacl_cidr_from_prefix(CIDR_IPV4, zero, 0));
+    cidr_vector_push(&out.exclude, netacl_cidr_from_prefix(CIDR_IPV4, zero, 0));
+  }
+
+#ifdef DEBUG
+  fprintf(stderr, "netacl: normalized %u+%u rules to %u+%u\n",
+          acl->include.size, acl->exclude.size, out.include.size,
+          out.exclude.size);
+#endif
+
+  netacl_destroy(acl);
+  *acl = out;
+}
@@ -45,6 +45,8 @@
 
 #define INITIAL_VECTOR_SIZE 32
 #define BUFSIZE 16384
+#define NETACL_LATENCY_BUCKETS 32
+#define NETACL_SAMPLE_INTERVAL 64
 
 enum netacl_err {
   ERR_SYNTAX = 256
@@ -63,10 +65,65 @@ typedef struct {
   cidr_vector_t exclude;
 } netacl_t;
 
+// Lookup counters for an ACL. Profiles are not shared between threads; each
+// thread keeps its own and they are merged with netacl_profile_merge().
+typedef struct {
+  uint64_t *include_hits;  // Lookups decided by each include rule.
+  uint64_t *exclude_hits;  // Lookups decided by each exclude rule.
+  uint32_t ninclude;
+  uint32_t nexclude;
+  uint64_t lookups;
+  uint64_t passed;
+  uint64_t sampled;        // Lookups whose latency was measured.
+  uint64_t latency[NETACL_LATENCY_BUCKETS];  // log2(ns) histogram.
+} netacl_profile_t;
+
+// Binary prefix trie node. Children are indexes into the node array; 0 means
+// no child, since the root (index 0) is never a child. marks is the index+1 of
+// the first rule ending at this node, or 0.
+typedef struct {
+  uint32_t child[2];
+  uint32_t marks;
+} netacl_node_t;
+
+// A rule ending at a trie node.
+typedef struct {
+  uint32_t acl;     // Index of the ACL that the rule belongs to.
+  uint32_t rule;    // Index of the first such rule in the ACL's include or
+                    // exclude vector.
+  uint32_t next;    // Index+1 of the next mark at the same node, or 0.
+  uint8_t exclude;  // 1 for an exclude rule, 0 for an include rule.
+} netacl_mark_t;
+
+// Binary prefix trie over IPv4 or IPv6 addresses.
+typedef struct {
+  netacl_node_t *nodes;
+  uint32_t nnodes;
+  uint32_t node_capacity;
+  netacl_mark_t *marks;
+  uint32_t nmarks;
+  uint32_t mark_capacity;
+} netacl_trie_t;
+
+// Set of ACLs merged into a pair of tries, so that an address can be tested
+// against all of them in one walk. IPv4-mapped IPv6 addresses and rules are
+// treated as IPv4.
+typedef struct {
+  uint32_t nacls;
+  uint32_t words;   // Number of uint64_t words in an ACL bitset.
+  uint64_t *open;   // Bitset of ACLs that have no include rules.
+  netacl_trie_t v4;
+  netacl_trie_t v6;
+} netacl_router_t;
+
 // Load from file path.
 int
 netacl_from_path(const char *, netacl_t *);
 
+// Load from file path, normalizing if requested.
+int
+netacl_load(const char *, netacl_t *, int normalize);
+
 // Load from file descriptor.
 int
 netacl_from_fd(int, netacl_t *);
@@ -83,4 +140,48 @@ netacl_pass(const netacl_t *, const char *addr);
 void
 netacl_destroy(netacl_t *);
 
+// Initialize a profile for an ACL.
+void
+netacl_profile_init(netacl_profile_t *, const netacl_t *);
+
+// Test an IP against the ACL, counting rule hits and latency in the profile.
+int
+netacl_pass_profile(const netacl_t *, const char *addr, netacl_profile_t *);
+
+// Add the counters of one profile to another.
+void
+netacl_profile_merge(netacl_profile_t *dst, const netacl_profile_t *src);
+
+// Free a profile.
+void
+netacl_profile_free(netacl_profile_t *);
+
+// Replace the rules of an ACL with a minimal rule set that passes the same host
+// addresses. Networks may be passed differently.
+void
+netacl_normalize(netacl_t *);
+
+// Merge ACLs into a router.
+int
+netacl_router_init(netacl_router_t *, const netacl_t **acls, uint32_t nacls);
+
+// Test an IP against every ACL in the router. Sets the bits of the ACLs that
+// pass it in a bitset of router->words words and returns the number set.
+int
+netacl_route(const netacl_router_t *, const char *addr, uint64_t *pass);
+
+// Test an IP against a router of a single ACL.
+int
+netacl_router_pass(const netacl_router_t *, const char *addr);
+
+// Test an IP against a router of a single ACL, counting rule hits and latency
+// in a profile of that ACL.
+int
+netacl_router_pass_profile(const netacl_router_t *, const char *addr,
+                           netacl_profile_t *);
+
+// Free a router. The ACLs are not freed.
+void
+netacl_router_destroy(netacl_router_t *);
+
 #endif // NETACL_H
@@ -33,195 +33,3023 @@
  * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
  * IN THE SOFTWARE.
  *
- * Multiplex lines from multiple inputs to stdout.
+ * Multiplex lines from multiple inputs to stdout, or concatenate them in
+ * order.
  *
  * Author: Curt Hash <chash@lanl.gov>
  */
 
+#define _GNU_SOURCE
+
+#include <bzlib.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <fnmatch.h>
 #include <getopt.h>
+#include <lzma.h>
+#include <poll.h>
+#include <pthread.h>
+#include <spawn.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
 #include <unistd.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#define RING_SIZE 131072
+#define READ_BUDGET 4
+#define MAX_EVENTS 256
+#define CHUNK_SIZE 65536
+#define COPY_SIZE 1048576
+#define QUEUE_LIMIT 8388608
+#define JOBS 4
+#define CRC_SLOTS 4
+#define BLOCK_TARGET 4194304
+#define BLOCK_MAX 67108864
+#define EVENT_BUFFER 65536
+
+typedef enum {
+  FMT_DB,
+  FMT_JSON
+} format_t;
+
+typedef enum {
+  CODEC_NONE,
+  CODEC_GZIP,
+  CODEC_BZIP2,
+  CODEC_XZ,
+  CODEC_ZSTD,
+  CODEC_7Z
+} codec_t;
+
+typedef struct {
+  char **inputs;
+  int input_count;
+  format_t format;
+  size_t buffer_size;
+  int jobs;
+  int threads;
+  char ordered;
+  char follow;
+} options_t;
+
+typedef struct chunk_s {
+  struct chunk_s *next;
+  size_t length;
+  char *data;
+} chunk_t;
+
+/*
+ * Decompressed data handed from a worker to the writer in order. The worker
+ * blocks once limit bytes are queued. There is one producer and one consumer,
+ * and they never wait at the same time, so one condition variable serves both.
+ */
+typedef struct {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  chunk_t *head;
+  chunk_t *tail;
+  size_t bytes;
+  size_t limit;
+  char done;
+} queue_t;
+
+/*
+ * A worker thread that decompresses an input. When muxing, the output goes to
+ * a pipe, which the input then reads like any other. When concatenating, it
+ * goes to a queue, so that inputs can be decompressed ahead of being written.
+ */
+typedef struct {
+  pthread_t thread;
+  codec_t codec;
+  const char *path;
+  int in;          /* Compressed file. */
+  int out;         /* Write end of the pipe, if muxing. */
+  queue_t *queue;  /* Output queue, if concatenating. */
+  int threads;     /* Threads for block-parallel decompression. */
+  int status;      /* 0 if the whole file was decompressed. */
+  char peeking;    /* Only the first line is wanted. */
+  char *peek;      /* Output so far, if peeking. */
+  size_t peek_len;
+  size_t peek_max; /* Output to peek at past the first line. */
+} worker_t;
+
+/*
+ * The columns of a db header.
+ */
+typedef struct {
+  char **names;
+  char **types;
+  int count;
+} header_t;
+
+/*
+ * Rewrites the lines of an input whose header differs from the output header,
+ * putting its fields in the output column order. Output columns that the input
+ * lacks are left empty. Partial lines are held until they are complete, up to
+ * the size of the input's ring; a longer line is rewritten as it arrives.
+ */
+typedef struct {
+  int *map;            /* Input field of each output column, or -1. */
+  int count;           /* Output columns. */
+  int fields;          /* Input columns. */
+  const char **starts; /* Fields of the line being rewritten. */
+  size_t *lengths;
+  char *line;          /* Partial line. */
+  size_t line_len;
+  size_t line_size;
+  size_t cap;          /* Most bytes of a partial line to hold. */
+  char streaming;      /* Rewriting a line longer than cap as it arrives. */
+  int *cols;           /* Output column of each input field, or -1. */
+  char *state;         /* Of each input field of the streamed line. */
+  size_t *offsets;     /* Of the held fields in hold. */
+  char *hold;          /* Fields that arrived before their output column. */
+  size_t hold_len;
+  size_t hold_size;
+  int field;           /* Input field of the streamed line. */
+  int col;             /* Next output column of the streamed line. */
+  char in_field;       /* The current input field has been started. */
+  char mode;           /* What is done with the current input field. */
+  char *out;           /* Rewritten lines. */
+  size_t out_len;
+  size_t out_size;
+} remap_t;
+
+/* States of the fields of a streamed line. */
+enum {
+  FIELD_PENDING,
+  FIELD_HELD,
+  FIELD_DONE
+};
+
+/* What is done with the current field of a streamed line. */
+enum {
+  FIELD_COPY,
+  FIELD_HOLD,
+  FIELD_SKIP
+};
+
+/*
+ * Output buffers of a gzip member shared between inflate and the thread that
+ * computes their CRC-32. There is one producer and one consumer, and they
+ * never wait at the same time.
+ */
+typedef struct {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  char *bufs[CRC_SLOTS];
+  size_t lengths[CRC_SLOTS];
+  unsigned long produced;  /* Buffers filled by inflate. */
+  unsigned long consumed;  /* Buffers checksummed. */
+  uLong crc;
+  char done;
+} crc_pipe_t;
+
+/*
+ * A run of BGZF members or zstd frames that is decompressed on its own
+ * thread, or a stretch of a file that has to be decompressed serially.
+ */
+typedef struct {
+  pthread_t thread;
+  codec_t codec;
+  const unsigned char *src;
+  size_t srclen;
+  char *dst;
+  size_t dstlen;  /* Known from the member trailers or frame headers. */
+  char serial;
+  int status;
+} block_t;
+
+/*
+ * An input and its ring buffer. head and tail are running byte offsets; the
+ * bytes in [head, tail) are buffered at offset % size. The buffer never grows,
+ * and data is written to stdout straight from it.
+ */
+typedef struct {
+  int fd;
+  char *buffer;
+  size_t size;
+  size_t head;  /* Offset of the first byte not yet written. */
+  size_t tail;  /* Offset just past the last byte read. */
+  char closed;
+  char follow;       /* Keep the fd open at EOF. */
+  char opened;       /* Opened when the schema was read. */
+  char header_read;  /* The header was consumed when the schema was read. */
+  char *rest;        /* Data read along with the header, not to be reread. */
+  size_t rest_len;
+  size_t unscanned;  /* Bytes at the end of the ring not yet scanned. */
+  worker_t *worker;  /* NULL unless the input is compressed. */
+  remap_t *remap;    /* NULL unless the header differs from the output. */
+} fd_t;
+
+typedef struct {
+  options_t *options;
+  int epfd;
+  fd_t **unpolled;     /* Open inputs that epoll cannot watch. */
+  int unpolled_count;
+  fd_t **pending;      /* Compressed inputs waiting for a worker. */
+  int pending_count;
+  int next_pending;
+  int workers;         /* Running workers. */
+  int open_count;      /* Inputs not yet at EOF, including pending ones. */
+} mux_t;
+
+/*
+ * A followed file. Its fd stays open at EOF, and it is read again when inotify
+ * reports that it changed. The fd_t comes first, so that a tail can stand in
+ * for the owner of stdout.
+ */
+typedef struct tail_s {
+  fd_t f;
+  char *path;
+  dev_t dev;
+  ino_t ino;
+  int wd;
+  char *header;       /* db header read so far. */
+  size_t header_len;
+  char in_header;
+  char ready;         /* May have unread data. */
+  char replaced;      /* Another file has been created at its path. */
+  struct tail_s *next;
+} tail_t;
+
+/*
+ * A followed input: a directory that is watched for new files, and a glob
+ * that their names must match.
+ */
+typedef struct {
+  char *prefix;  /* Directory part, including the trailing slash, or "". */
+  char *glob;
+  int wd;
+} pattern_t;
+
+typedef struct {
+  options_t *options;
+  int ifd;
+  pattern_t *patterns;
+  tail_t *tails;
+  tail_t **wds;        /* Tails by watch descriptor. */
+  int wd_count;
+  fd_t *owner;
+  char print;
+  header_t header;     /* Output header, once printed. */
+} follow_t;
+
+/**
+ * Writes all of buf to fd, blocking until the reader has room.
+ */
+int
+write_all(int fd, const char *buf, size_t length) {
+  ssize_t ret;
+
+  while (length) {
+    ret = write(fd, buf, length);
+    if (ret == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    buf += ret;
+    length -= ret;
+  }
+
+  return 0;
+}
+
+/**
+ * Reads the db data header line, without its newline, at most max bytes at a
+ * time. Returns NULL if the input is empty. The bytes read past the header are
+ * given back to the input if it can seek, and returned in rest otherwise.
+ */
+char *
+read_header(int fd, size_t max, char **rest, size_t *rest_len) {
+  char *header = NULL;
+  char *nl = NULL;
+  size_t length = 0;
+  size_t size = 0;
+  size_t extra;
+  ssize_t ret;
+
+  *rest = NULL;
+  *rest_len = 0;
+  while (!nl) {
+    if (length + max > size) {
+      size = (length + max) * 2;
+      header = realloc(header, size);
+    }
+
+    ret = read(fd, header + length, max);
+    if (ret == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("read");
+      exit(errno);
+    } else if (ret == 0) {
+      if (length == 0) {
+        free(header);
+        return NULL;
+      }
+      fprintf(stderr, "EOF before end of header\n");
+      exit(1);
+    }
+
+    nl = memchr(header + length, '\n', ret);
+    length += ret;
+  }
+
+  extra = header + length - (nl + 1);
+  if (extra && lseek(fd, -(off_t)extra, SEEK_CUR) == -1) {
+    *rest = malloc(extra);
+    memcpy(*rest, nl + 1, extra);
+    *rest_len = extra;
+  }
+  *nl = '\0';
+
+  return header;
+}
+
+/**
+ * Parses a db header line into its columns. Returns 0, or -1 if it is not a
+ * valid header.
+ */
+int
+parse_header(const char *path, const char *line, header_t *h) {
+  const char *p;
+  const char *end;
+  const char *colon;
+
+  h->names = NULL;
+  h->types = NULL;
+  h->count = 0;
+
+  if (strncmp(line, "#db", 3) != 0 || (line[3] != '\t' && line[3] != '\0')) {
+    fprintf(stderr, "%s: header missing #db magic\n", path);
+    return -1;
+  }
+
+  for (p=line+3; *p == '\t'; p=end) {
+    p++;
+    end = p + strcspn(p, "\t");
+    colon = memchr(p, ':', end - p);
+    if (!colon) {
+      fprintf(stderr, "%s: db header syntax error, column %d\n", path,
+              h->count + 1);
+      return -1;
+    }
+
+    h->names = realloc(h->names, sizeof (char *) * (h->count + 1));
+    h->types = realloc(h->types, sizeof (char *) * (h->count + 1));
+    h->names[h->count] = strndup(p, colon - p);
+    h->types[h->count] = strndup(colon + 1, end - colon - 1);
+    h->count++;
+  }
+
+  return 0;
+}
+
+void
+free_header(header_t *h) {
+  int i;
+
+  for (i=0; i<h->count; i++) {
+    free(h->names[i]);
+    free(h->types[i]);
+  }
+  free(h->names);
+  free(h->types);
+  h->names = NULL;
+  h->types = NULL;
+  h->count = 0;
+}
+
+/**
+ * Returns the index of a column, or -1.
+ */
+int
+find_column(const header_t *h, const char *name) {
+  int i;
+
+  for (i=0; i<h->count; i++) {
+    if (strcmp(h->names[i], name) == 0) {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+/**
+ * Adds the columns of h that u lacks to the end of u. A column whose type
+ * differs keeps its first type.
+ */
+void
+merge_header(header_t *u, const header_t *h, const char *path) {
+  int i;
+  int j;
+
+  for (i=0; i<h->count; i++) {
+    /* Inputs mostly share their columns, in the same order. */
+    j = i < u->count && strcmp(u->names[i], h->names[i]) == 0 ? i :
+        find_column(u, h->names[i]);
+    if (j == -1) {
+      u->names = realloc(u->names, sizeof (char *) * (u->count + 1));
+      u->types = realloc(u->types, sizeof (char *) * (u->count + 1));
+      u->names[u->count] = strdup(h->names[i]);
+      u->types[u->count] = strdup(h->types[i]);
+      u->count++;
+    } else if (strcmp(u->types[j], h->types[i]) != 0) {
+      fprintf(stderr, "%s: column '%s' is %s, not %s\n", path,
+              h->names[i], h->types[i], u->types[j]);
+    }
+  }
+}
+
+/**
+ * Returns a remapper from the columns of h to the output columns u, or NULL if
+ * they are the same.
+ */
+remap_t *
+make_remap(const header_t *u, const header_t *h, size_t cap) {
+  remap_t *r;
+  int i;
+
+  if (u->count == h->count) {
+    for (i=0; i<u->count; i++) {
+      if (strcmp(u->names[i], h->names[i]) != 0) {
+        break;
+      }
+    }
+    if (i == u->count) {
+      return NULL;
+    }
+  }
+
+  r = calloc(1, sizeof (remap_t));
+  r->cap = cap;
+  r->count = u->count;
+  r->fields = h->count;
+  r->map = malloc(sizeof (int) * (u->count + 1));
+  for (i=0; i<u->count; i++) {
+    r->map[i] = find_column(h, u->names[i]);
+  }
+  r->starts = malloc(sizeof (char *) * (h->count + 1));
+  r->lengths = malloc(sizeof (size_t) * (h->count + 1));
+  r->cols = malloc(sizeof (int) * (h->count + 1));
+  r->state = calloc(h->count + 1, 1);
+  r->offsets = malloc(sizeof (size_t) * (h->count + 1));
+  for (i=0; i<h->count; i++) {
+    r->cols[i] = find_column(u, h->names[i]);
+  }
+
+  return r;
+}
+
+void
+free_remap(remap_t *r) {
+  if (r) {
+    free(r->map);
+    free(r->starts);
+    free(r->lengths);
+    free(r->cols);
+    free(r->state);
+    free(r->offsets);
+    free(r->hold);
+    free(r->line);
+    free(r->out);
+    free(r);
+  }
+}
+
+/**
+ * Writes a header line for the columns of h to stdout.
+ */
+int
+print_header(const header_t *h) {
+  size_t length = 4;
+  char *line;
+  char *p;
+  int i;
+  int ret;
+
+  for (i=0; i<h->count; i++) {
+    length += strlen(h->names[i]) + strlen(h->types[i]) + 2;
+  }
+
+  line = malloc(length + 1);
+  p = line + sprintf(line, "#db");
+  for (i=0; i<h->count; i++) {
+    p += sprintf(p, "\t%s:%s", h->names[i], h->types[i]);
+  }
+  *p++ = '\n';
+
+  ret = write_all(STDOUT_FILENO, line, p - line);
+  if (ret == -1) {
+    perror("write");
+  }
+  free(line);
+
+  return ret;
+}
+
+/**
+ * Rewrites one line, without its newline, into the output buffer.
+ */
+void
+remap_line(remap_t *r, const char *line, size_t length) {
+  const char *end = line + length;
+  const char *tab;
+  int n = 0;
+  int i;
+
+  while (n < r->fields) {
+    tab = memchr(line, '\t', end - line);
+    r->starts[n] = line;
+    r->lengths[n] = (tab ? tab : end) - line;
+    n++;
+    if (!tab) {
+      break;
+    }
+    line = tab + 1;
+  }
+
+  /* Every byte of the line appears at most once, plus a tab per column. */
+  if (r->out_len + length + r->count + 1 > r->out_size) {
+    r->out_size = (r->out_len + length + r->count + 1) * 2;
+    r->out = realloc(r->out, r->out_size);
+  }
+
+  for (i=0; i<r->count; i++) {
+    if (i) {
+      r->out[r->out_len++] = '\t';
+    }
+    if (r->map[i] >= 0 && r->map[i] < n) {
+      memcpy(r->out + r->out_len, r->starts[r->map[i]],
+             r->lengths[r->map[i]]);
+      r->out_len += r->lengths[r->map[i]];
+    }
+  }
+  r->out[r->out_len++] = '\n';
+}
+
+/**
+ * Writes the output columns of a streamed line, from the next one up to the
+ * first whose field has not arrived yet. Held fields are copied, and columns
+ * that the input lacks are left empty.
+ */
+void
+remap_advance(remap_t *r) {
+  int field;
+
+  for (; r->col<r->count; r->col++) {
+    field = r->map[r->col];
+    if (field >= 0 && r->state[field] == FIELD_PENDING) {
+      break;
+    }
+    if (r->col) {
+      r->out[r->out_len++] = '\t';
+    }
+    if (field >= 0 && r->state[field] == FIELD_HELD) {
+      memcpy(r->out + r->out_len, r->hold + r->offsets[field],
+             r->lengths[field]);
+      r->out_len += r->lengths[field];
+    }
+  }
+}
+
+/**
+ * Starts the next input field of a streamed line. The field is copied if its
+ * output column is next, and held otherwise.
+ */
+void
+remap_start_field(remap_t *r) {
+  int col = r->field < r->fields ? r->cols[r->field] : -1;
+
+  remap_advance(r);
+  r->in_field = 1;
+  if (col < 0) {
+    r->mode = FIELD_SKIP;
+  } else if (col == r->col) {
+    if (r->col) {
+      r->out[r->out_len++] = '\t';
+    }
+    r->mode = FIELD_COPY;
+  } else {
+    r->offsets[r->field] = r->hold_len;
+    r->lengths[r->field] = 0;
+    r->mode = FIELD_HOLD;
+  }
+}
+
+/**
+ * Ends the current input field of a streamed line.
+ */
+void
+remap_end_field(remap_t *r) {
+  if (r->mode == FIELD_COPY) {
+    r->state[r->field] = FIELD_DONE;
+    r->col++;
+  } else if (r->mode == FIELD_HOLD) {
+    r->state[r->field] = FIELD_HELD;
+  }
+  r->field++;
+  r->in_field = 0;
+}
+
+/**
+ * Rewrites part of a line that is too long to hold, without its newline, into
+ * the output buffer. Fields are copied as they arrive if they are in output
+ * order. Any others are held until their column comes up, however long they
+ * are, so that no field is lost. eol ends the line.
+ */
+void
+remap_stream(remap_t *r, const char *buf, size_t length, int eol) {
+  const char *end = buf + length;
+  const char *tab;
+  size_t n;
+
+  /* Every byte appears at most once, plus a tab per column. */
+  if (r->out_len + length + r->hold_len + r->count + 1 > r->out_size) {
+    r->out_size = (r->out_len + length + r->hold_len + r->count + 1) * 2;
+    r->out = realloc(r->out, r->out_size);
+  }
+
+  while (buf < end) {
+    if (!r->in_field) {
+      remap_start_field(r);
+    }
+
+    tab = memchr(buf, '\t', end - buf);
+    n = (tab ? tab : end) - buf;
+    if (r->mode == FIELD_COPY) {
+      memcpy(r->out + r->out_len, buf, n);
+      r->out_len += n;
+    } else if (r->mode == FIELD_HOLD) {
+      if (r->hold_len + n > r->hold_size) {
+        r->hold_size = (r->hold_len + n) * 2;
+        r->hold = realloc(r->hold, r->hold_size);
+      }
+      memcpy(r->hold + r->hold_len, buf, n);
+      r->hold_len += n;
+      r->lengths[r->field] += n;
+    }
+    buf += n;
+
+    if (tab) {
+      buf++;
+      remap_end_field(r);
+    }
+  }
+
+  if (!eol) {
+    return;
+  }
+
+  if (!r->in_field) {
+    remap_start_field(r);
+  }
+  remap_end_field(r);
+  for (; r->field<r->fields; r->field++) {
+    r->state[r->field] = FIELD_DONE;
+  }
+  remap_advance(r);
+  r->out[r->out_len++] = '\n';
+
+  /* Fields held past cap are only kept for the line that needed them. */
+  if (r->hold_size > r->cap) {
+    free(r->hold);
+    r->hold = NULL;
+    r->hold_size = 0;
+  }
+  memset(r->state, FIELD_PENDING, r->fields);
+  r->streaming = 0;
+  r->in_field = 0;
+  r->field = 0;
+  r->col = 0;
+  r->hold_len = 0;
+}
+
+/**
+ * Rewrites the complete lines in buf, and holds on to a partial line at the
+ * end.
+ */
+void
+remap_feed(remap_t *r, const char *buf, size_t length) {
+  const char *end = buf + length;
+  const char *nl;
+  size_t n;
+
+  while (buf < end) {
+    nl = memchr(buf, '\n', end - buf);
+    n = (nl ? nl : end) - buf;
+
+    if (!nl || r->line_len || r->streaming) {
+      /* Part of a line that spans buffers. */
+      if (!r->streaming && r->line_len + n > r->cap) {
+        /* The line is longer than the ring. Rewrite what there is. */
+        r->streaming = 1;
+        remap_stream(r, r->line, r->line_len, 0);
+        r->line_len = 0;
+      }
+
+      if (r->streaming) {
+        remap_stream(r, buf, n, nl != NULL);
+      } else {
+        if (r->line_len + n > r->line_size) {
+          r->line_size = (r->line_len + n) * 2;
+          if (r->line_size > r->cap) {
+            r->line_size = r->cap;
+          }
+          r->line = realloc(r->line, r->line_size);
+        }
+        memcpy(r->line + r->line_len, buf, n);
+        r->line_len += n;
+
+        if (nl) {
+          remap_line(r, r->line, r->line_len);
+          r->line_len = 0;
+        }
+      }
+    } else {
+      remap_line(r, buf, n);
+    }
+
+    buf += n + (nl != NULL);
+  }
+}
+
+/**
+ * Writes the rewritten lines to stdout.
+ */
+int
+remap_flush(remap_t *r) {
+  int ret = write_all(STDOUT_FILENO, r->out, r->out_len);
+
+  r->out_len = 0;
+
+  return ret;
+}
+
+/**
+ * Writes data to stdout, rewriting it first if r is not NULL.
+ */
+int
+put(remap_t *r, const char *buf, size_t length) {
+  if (!r) {
+    return write_all(STDOUT_FILENO, buf, length);
+  }
+
+  remap_feed(r, buf, length);
+
+  return remap_flush(r);
+}
+
+/**
+ * Raises the open file limit as far as allowed, so that thousands of inputs
+ * can be muxed.
+ */
+void
+raise_fd_limit(void) {
+  struct rlimit rl;
+
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+  }
+}
+
+/**
+ * Splits length bytes of the ring starting at offset into at most two iovecs.
+ * Returns the number used.
+ */
+int
+ring_iov(fd_t *f, size_t offset, size_t length, struct iovec *iov) {
+  size_t start = offset % f->size;
+
+  iov[0].iov_base = f->buffer + start;
+  if (start + length <= f->size) {
+    iov[0].iov_len = length;
+    return 1;
+  }
+
+  iov[0].iov_len = f->size - start;
+  iov[1].iov_base = f->buffer;
+  iov[1].iov_len = length - iov[0].iov_len;
+  return 2;
+}
+
+/**
+ * Writes the buffered bytes up to offset end to stdout and releases them.
+ */
+int
+write_ring(fd_t *f, size_t end) {
+  struct iovec iov[2];
+  int iovcnt = ring_iov(f, f->head, end - f->head, iov);
+  ssize_t ret;
+
+  while (iovcnt) {
+    ret = writev(STDOUT_FILENO, iov, iovcnt);
+    if (ret == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("writev");
+      return -1;
+    }
+
+    /* Skip past a partial write. */
+    while (iovcnt && (size_t)ret >= iov[0].iov_len) {
+      ret -= iov[0].iov_len;
+      iov[0] = iov[1];
+      iovcnt--;
+    }
+    if (iovcnt) {
+      iov[0].iov_base = (char *)iov[0].iov_base + ret;
+      iov[0].iov_len -= ret;
+    }
+  }
+
+  f->head = end;
+
+  return 0;
+}
+
+/**
+ * Passes everything in the ring through the input's remapper, and writes the
+ * complete lines.
+ */
+int
+remap_ring(fd_t *f) {
+  struct iovec iov[2];
+  int iovcnt = ring_iov(f, f->head, f->tail - f->head, iov);
+  int i;
+
+  for (i=0; i<iovcnt; i++) {
+    remap_feed(f->remap, iov[i].iov_base, iov[i].iov_len);
+  }
+  f->head = f->tail;
+
+  if (remap_flush(f->remap) == -1) {
+    perror("write");
+    return -1;
+  }
+
+  return 0;
+}
+
+/**
+ * Terminates a line that an input has partly written to stdout.
+ */
+int
+end_line(fd_t *f) {
+  if (f->remap && f->remap->streaming) {
+    if (put(f->remap, "\n", 1) == -1) {
+      perror("write");
+      return -1;
+    }
+  } else if (write_all(STDOUT_FILENO, "\n", 1) == -1) {
+    perror("write");
+    return -1;
+  }
+
+  return 0;
+}
+
+/**
+ * Writes the complete lines of an input that end in the last n bytes of its
+ * ring, or what there is of a line longer than the ring. Returns 0, or -1 on
+ * error.
+ */
+int
+scan_input(fd_t *f, size_t n, fd_t **owner) {
+  size_t end;
+
+  /* A remapped input's lines are framed by its remapper, which holds partial
+   * lines itself. It owns stdout only while it writes a line that is too long
+   * to hold. */
+  if (f->remap) {
+    if (remap_ring(f) == -1) {
+      return -1;
+    }
+    if (f->remap->streaming) {
+      *owner = f;
+    } else if (*owner == f) {
+      *owner = NULL;
+    }
+    return 0;
+  }
+
+  /* Search the new bytes for the last newline. */
+  for (end=f->tail; end>f->tail-n; end--) {
+    if (f->buffer[(end-1) % f->size] == '\n') {
+      break;
+    }
+  }
+
+  if (end > f->tail - n) {
+    /* Newline found. Write the complete lines. */
+    if (write_ring(f, end) == -1) {
+      return -1;
+    }
+    if (*owner == f) {
+      *owner = NULL;
+    }
+  } else if (*owner == f || f->tail - f->head == f->size) {
+    /* The line is longer than the ring. Write what there is. */
+    if (write_ring(f, f->tail) == -1) {
+      return -1;
+    }
+    *owner = f;
+  }
+
+  return 0;
+}
+
+/**
+ * Reads from an input until it would block, it reaches EOF, or it has used its
+ * read budget, and writes its complete lines. Returns 0 if the input is still
+ * open, 1 if it reached EOF, or -1 on error.
+ *
+ * A line that does not fit in the ring is written as it arrives. The input
+ * becomes the owner of stdout until the line ends, and no other input may be
+ * written until then.
+ */
+int
+read_input(fd_t *f, fd_t **owner) {
+  struct iovec iov[2];
+  int i;
+  ssize_t ret;
+  size_t n = f->unscanned;
+
+  /* Lines read along with the header. */
+  f->unscanned = 0;
+  if (n && scan_input(f, n, owner) == -1) {
+    return -1;
+  }
+
+  for (i=0; i<READ_BUDGET; i++) {
+    /* Read into all of the free space. */
+    ret = readv(f->fd, iov,
+                ring_iov(f, f->tail, f->size - (f->tail - f->head), iov));
+    if (ret == -1) {
+      if (errno == EAGAIN || errno == EINTR) {
+        return 0;
+      }
+      perror("read");
+      return -1;
+    } else if (ret == 0) {
+      /* A followed file may grow. Its partial line stays buffered. */
+      if (f->follow) {
+        return 1;
+      }
+
+      /* EOF. Closing the fd also removes it from the epoll set. A line that
+       * was being written is terminated; any other partial line is dropped. */
+      if (*owner == f) {
+        if (end_line(f) == -1) {
+          return -1;
+        }
+        *owner = NULL;
+      }
+      close(f->fd);
+      f->closed = 1;
+      return 1;
+    }
+
+    f->tail += ret;
+    if (scan_input(f, ret, owner) == -1) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * Returns the compression format of a regular file, from its magic bytes.
+ * Pipes cannot be peeked at and are treated as uncompressed.
+ */
+codec_t
+detect_codec(int fd) {
+  struct stat st;
+  unsigned char magic[6];
+  ssize_t n;
+
+  if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+    return CODEC_NONE;
+  }
+
+  n = read(fd, magic, sizeof (magic));
+  lseek(fd, 0, SEEK_SET);
+
+  if (n >= 2 && magic[0] == 0x1f && magic[1] == 0x8b) {
+    return CODEC_GZIP;
+  } else if (n >= 3 && memcmp(magic, "BZh", 3) == 0) {
+    return CODEC_BZIP2;
+  } else if (n >= 6 && memcmp(magic, "\xfd" "7zXZ\0", 6) == 0) {
+    return CODEC_XZ;
+  } else if (n >= 4 && memcmp(magic, "\x28\xb5\x2f\xfd", 4) == 0) {
+    return CODEC_ZSTD;
+  } else if (n >= 6 && memcmp(magic, "7z\xbc\xaf\x27\x1c", 6) == 0) {
+    return CODEC_7Z;
+  }
+
+  return CODEC_NONE;
+}
+
+/**
+ * Appends a copy of buf to a queue, waiting while the queue is full.
+ */
+void
+queue_push(queue_t *q, const char *buf, size_t length) {
+  chunk_t *c;
+
+  if (length == 0) {
+    return;
+  }
+
+  c = malloc(sizeof (chunk_t) + length);
+  c->next = NULL;
+  c->length = length;
+  c->data = (char *)(c + 1);
+  memcpy(c->data, buf, length);
+
+  pthread_mutex_lock(&q->lock);
+  while (q->bytes >= q->limit) {
+    pthread_cond_wait(&q->cond, &q->lock);
+  }
+  if (q->tail) {
+    q->tail->next = c;
+  } else {
+    q->head = c;
+  }
+  q->tail = c;
+  q->bytes += length;
+  pthread_cond_signal(&q->cond);
+  pthread_mutex_unlock(&q->lock);
+}
+
+/**
+ * Removes the first chunk from a queue, waiting for one if necessary. Returns
+ * NULL once the queue is empty and finished.
+ */
+chunk_t *
+queue_pop(queue_t *q) {
+  chunk_t *c;
+
+  pthread_mutex_lock(&q->lock);
+  while (!q->head && !q->done) {
+    pthread_cond_wait(&q->cond, &q->lock);
+  }
+  c = q->head;
+  if (c) {
+    q->head = c->next;
+    if (!q->head) {
+      q->tail = NULL;
+    }
+    q->bytes -= c->length;
+    pthread_cond_signal(&q->cond);
+  }
+  pthread_mutex_unlock(&q->lock);
+
+  return c;
+}
+
+/**
+ * Marks a queue as finished; nothing more will be pushed.
+ */
+void
+queue_finish(queue_t *q) {
+  pthread_mutex_lock(&q->lock);
+  q->done = 1;
+  pthread_cond_signal(&q->cond);
+  pthread_mutex_unlock(&q->lock);
+}
+
+/**
+ * Hands decompressed data to the worker's pipe or queue.
+ */
+int
+emit(worker_t *w, const char *buf, size_t length) {
+  if (w->peeking) {
+    /* Stop the decompressor once the first line is complete and there is
+     * peek_max of output, unless the input ends first. */
+    w->peek = realloc(w->peek, w->peek_len + length);
+    memcpy(w->peek + w->peek_len, buf, length);
+    w->peek_len += length;
+    return w->peek_len >= w->peek_max &&
+           memchr(w->peek, '\n', w->peek_len) ? -1 : 0;
+  }
+
+  if (w->queue) {
+    queue_push(w->queue, buf, length);
+    return 0;
+  }
+
+  return write_all(w->out, buf, length);
+}
+
+/**
+ * Returns the little-endian 32-bit value at p.
+ */
+unsigned long
+le32(const unsigned char *p) {
+  return p[0] | p[1] << 8 | (unsigned long)p[2] << 16 |
+         (unsigned long)p[3] << 24;
+}
+
+/**
+ * Returns the length of the gzip member header at src, or 0 if there isn't a
+ * complete one.
+ */
+size_t
+gzip_header(const unsigned char *src, size_t len) {
+  size_t n = 10;
+
+  if (len < n || src[0] != 0x1f || src[1] != 0x8b || src[2] != 8) {
+    return 0;
+  }
+
+  if (src[3] & 4) {
+    /* FEXTRA */
+    if (len < n + 2) {
+      return 0;
+    }
+    n += 2 + (src[n] | src[n+1] << 8);
+  }
+  if (src[3] & 8) {
+    /* FNAME */
+    while (n < len && src[n]) {
+      n++;
+    }
+    n++;
+  }
+  if (src[3] & 16) {
+    /* FCOMMENT */
+    while (n < len && src[n]) {
+      n++;
+    }
+    n++;
+  }
+  if (src[3] & 2) {
+    /* FHCRC */
+    n += 2;
+  }
+
+  return n <= len ? n : 0;
+}
+
+/**
+ * Returns whether the len bytes at src are all zero. Writers that pad files to
+ * a block size leave zeros after the last gzip member, which gzip ignores.
+ */
+int
+all_zero(const unsigned char *src, size_t len) {
+  size_t i;
+
+  for (i=0; i<len; i++) {
+    if (src[i]) {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+/**
+ * Returns the size of the BGZF member at src, or 0 if it is not one. BGZF
+ * members record their size in a "BC" extra subfield, so a file can be split
+ * into members without inflating it.
+ */
+size_t
+bgzf_member(const unsigned char *src, size_t len) {
+  size_t xlen;
+  size_t i;
+  size_t size;
+
+  if (len < 18 || src[0] != 0x1f || src[1] != 0x8b || src[2] != 8 ||
+      !(src[3] & 4)) {
+    return 0;
+  }
+
+  xlen = src[10] | src[11] << 8;
+  for (i=12; i+4<=12+xlen && i+6<=len; i+=4+(src[i+2] | src[i+3] << 8)) {
+    if (src[i] == 'B' && src[i+1] == 'C' && (src[i+2] | src[i+3] << 8) == 2) {
+      size = (src[i+4] | src[i+5] << 8) + 1;
+      return size >= 12 + xlen + 8 && size <= len ? size : 0;
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * CRC thread. Checksums the buffers that inflate hands it.
+ */
+void *
+crc_thread(void *arg) {
+  crc_pipe_t *c = arg;
+  unsigned long slot;
+  uLong crc;
+
+  pthread_mutex_lock(&c->lock);
+  for (;;) {
+    while (c->consumed == c->produced && !c->done) {
+      pthread_cond_wait(&c->cond, &c->lock);
+    }
+    if (c->consumed == c->produced) {
+      break;
+    }
+
+    slot = c->consumed % CRC_SLOTS;
+    crc = c->crc;
+    pthread_mutex_unlock(&c->lock);
+    crc = crc32(crc, (Bytef *)c->bufs[slot], c->lengths[slot]);
+    pthread_mutex_lock(&c->lock);
+
+    c->crc = crc;
+    c->consumed++;
+    pthread_cond_signal(&c->cond);
+  }
+  pthread_mutex_unlock(&c->lock);
+
+  return NULL;
+}
+
+/**
+ * Decompressors return 0 if the data ended cleanly and -1 on error or
+ * truncation. Concatenated streams are decompressed one after another, as the
+ * command line tools do.
+ *
+ * gzip members are inflated raw, and the CRC-32 that zlib would otherwise
+ * compute inline is computed on a second thread from the output buffers.
+ */
+int
+gunzip(worker_t *w, const unsigned char *src, size_t len) {
+  z_stream z;
+  crc_pipe_t c;
+  pthread_t thread;
+  size_t pos = 0;
+  size_t h;
+  size_t n;
+  char *buf;
+  int ret = Z_OK;
+  int ok;
+  int status = -1;
+  int i;
+
+  memset(&z, 0, sizeof (z));
+  if (inflateInit2(&z, -15) != Z_OK) {
+    return -1;
+  }
+
+  memset(&c, 0, sizeof (c));
+  pthread_mutex_init(&c.lock, NULL);
+  pthread_cond_init(&c.cond, NULL);
+  for (i=0; i<CRC_SLOTS; i++) {
+    c.bufs[i] = malloc(CHUNK_SIZE);
+  }
+  c.crc = crc32(0L, Z_NULL, 0);
+  errno = pthread_create(&thread, NULL, crc_thread, &c);
+  if (errno != 0) {
+    perror("pthread_create");
+    return -1;
+  }
+
+  while (pos < len) {
+    h = gzip_header(src + pos, len - pos);
+    if (h == 0) {
+      if (pos > 0 && all_zero(src + pos, len - pos)) {
+        fprintf(stderr, "%s: trailing zero bytes ignored\n", w->path);
+        status = 0;
+      }
+      break;
+    }
+    pos += h;
+
+    inflateReset(&z);
+    z.avail_in = 0;
+    do {
+      if (z.avail_in == 0) {
+        if (pos == len) {
+          break;
+        }
+        /* avail_in is 32 bits. */
+        n = len - pos < 1 << 30 ? len - pos : 1 << 30;
+        z.next_in = (Bytef *)src + pos;
+        z.avail_in = n;
+        pos += n;
+      }
+
+      /* Wait for a buffer that has been checksummed. */
+      pthread_mutex_lock(&c.lock);
+      while (c.produced - c.consumed == CRC_SLOTS) {
+        pthread_cond_wait(&c.cond, &c.lock);
+      }
+      pthread_mutex_unlock(&c.lock);
+
+      buf = c.bufs[c.produced % CRC_SLOTS];
+      z.next_out = (Bytef *)buf;
+      z.avail_out = CHUNK_SIZE;
+      ret = inflate(&z, Z_NO_FLUSH);
+      if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+        break;
+      }
+
+      n = CHUNK_SIZE - z.avail_out;
+      if (n) {
+        pthread_mutex_lock(&c.lock);
+        c.lengths[c.produced % CRC_SLOTS] = n;
+        c.produced++;
+        pthread_cond_signal(&c.cond);
+        pthread_mutex_unlock(&c.lock);
+
+        if (emit(w, buf, n) == -1) {
+          ret = Z_ERRNO;
+          break;
+        }
+      }
+    } while (ret != Z_STREAM_END);
+
+    if (ret != Z_STREAM_END) {
+      break;
+    }
+
+    /* The trailer follows whatever inflate didn't use. */
+    pos -= z.avail_in;
+    if (len - pos < 8) {
+      break;
+    }
+
+    pthread_mutex_lock(&c.lock);
+    while (c.consumed != c.produced) {
+      pthread_cond_wait(&c.cond, &c.lock);
+    }
+    ok = c.crc == le32(src + pos) &&
+         (z.total_out & 0xffffffffUL) == le32(src + pos + 4);
+    c.crc = crc32(0L, Z_NULL, 0);
+    pthread_mutex_unlock(&c.lock);
+
+    if (!ok) {
+      break;
+    }
+    pos += 8;
+
+    if (pos == len) {
+      status = 0;
+    }
+  }
+
+  pthread_mutex_lock(&c.lock);
+  c.done = 1;
+  pthread_cond_signal(&c.cond);
+  pthread_mutex_unlock(&c.lock);
+  pthread_join(thread, NULL);
+
+  for (i=0; i<CRC_SLOTS; i++) {
+    free(c.bufs[i]);
+  }
+  pthread_mutex_destroy(&c.lock);
+  pthread_cond_destroy(&c.cond);
+  inflateEnd(&z);
+
+  return status;
+}
+
+/**
+ * bzip2 and xz are read from the file in CHUNK_SIZE chunks. The output is only
+ * known to be drained when a call leaves room in it, or when a bzip2 stream
+ * has ended, so input is read only then.
+ */
+int
+bunzip2(worker_t *w, char *in, char *out) {
+  bz_stream bz;
+  int ret = BZ_OK;
+  ssize_t n;
+
+  memset(&bz, 0, sizeof (bz));
+  if (BZ2_bzDecompressInit(&bz, 0, 0) != BZ_OK) {
+    return -1;
+  }
+
+  bz.avail_out = 1;
+  for (;;) {
+    if (bz.avail_in == 0 && (bz.avail_out != 0 || ret == BZ_STREAM_END)) {
+      n = read(w->in, in, CHUNK_SIZE);
+      if (n < 0) {
+        ret = BZ_IO_ERROR;
+        break;
+      } else if (n == 0) {
+        /* The input may only end after a whole stream. */
+        break;
+      }
+      bz.next_in = in;
+      bz.avail_in = n;
+    }
+
+    if (ret == BZ_STREAM_END) {
+      /* Another bzip2 stream follows. */
+      BZ2_bzDecompressEnd(&bz);
+      if (BZ2_bzDecompressInit(&bz, 0, 0) != BZ_OK) {
+        return -1;
+      }
+    }
+
+    bz.next_out = out;
+    bz.avail_out = CHUNK_SIZE;
+    ret = BZ2_bzDecompress(&bz);
+    if (ret != BZ_OK && ret != BZ_STREAM_END) {
+      break;
+    }
+
+    if (emit(w, out, CHUNK_SIZE - bz.avail_out) == -1) {
+      break;
+    }
+  }
+
+  BZ2_bzDecompressEnd(&bz);
+
+  return ret == BZ_STREAM_END && bz.avail_in == 0 ? 0 : -1;
+}
+
+int
+unxz(worker_t *w, char *in, char *out) {
+  lzma_stream xz = LZMA_STREAM_INIT;
+  lzma_action action = LZMA_RUN;
+  lzma_ret ret;
+  ssize_t n;
+
+  if (lzma_stream_decoder(&xz, UINT64_MAX, LZMA_CONCATENATED) != LZMA_OK) {
+    return -1;
+  }
+
+  xz.avail_out = 1;
+  for (;;) {
+    if (xz.avail_in == 0 && xz.avail_out != 0 && action == LZMA_RUN) {
+      n = read(w->in, in, CHUNK_SIZE);
+      if (n < 0) {
+        ret = LZMA_DATA_ERROR;
+        break;
+      } else if (n == 0) {
+        action = LZMA_FINISH;
+      }
+      xz.next_in = (uint8_t *)in;
+      xz.avail_in = n;
+    }
+
+    xz.next_out = (uint8_t *)out;
+    xz.avail_out = CHUNK_SIZE;
+    ret = lzma_code(&xz, action);
+    if (ret != LZMA_OK && ret != LZMA_STREAM_END) {
+      break;
+    }
+
+    if (emit(w, out, CHUNK_SIZE - xz.avail_out) == -1) {
+      ret = LZMA_DATA_ERROR;
+      break;
+    }
+
+    if (ret == LZMA_STREAM_END) {
+      break;
+    }
+  }
+
+  lzma_end(&xz);
+
+  return ret == LZMA_STREAM_END ? 0 : -1;
+}
+
+#ifdef HAVE_ZSTD
+int
+unzstd(worker_t *w, const unsigned char *src, size_t len, char *out) {
+  ZSTD_DStream *zs = ZSTD_createDStream();
+  ZSTD_inBuffer zin;
+  ZSTD_outBuffer zout;
+  size_t ret = 0;
+
+  if (!zs) {
+    return -1;
+  }
+  ZSTD_initDStream(zs);
+
+  zin.src = src;
+  zin.size = len;
+  zin.pos = 0;
+  zout.dst = out;
+  zout.size = CHUNK_SIZE;
+
+  /* Frames are decompressed back to back. A full output buffer may leave more
+   * output pending, unless the frame ended. */
+  do {
+    zout.pos = 0;
+    ret = ZSTD_decompressStream(zs, &zout, &zin);
+    if (ZSTD_isError(ret)) {
+      break;
+    }
+
+    if (emit(w, out, zout.pos) == -1) {
+      ret = 1;
+      break;
+    }
+  } while (zin.pos < zin.size || (zout.pos == zout.size && ret != 0));
+
+  ZSTD_freeDStream(zs);
+
+  /* 0 means the last frame was complete. */
+  return ret == 0 ? 0 : -1;
+}
+#endif
+
+/**
+ * Inflates a run of BGZF members into the block's buffer. zlib checks each
+ * member's CRC-32.
+ */
+int
+inflate_members(block_t *b) {
+  z_stream z;
+  size_t pos = 0;
+  size_t out = 0;
+  size_t m;
+
+  memset(&z, 0, sizeof (z));
+  if (inflateInit2(&z, 15 + 16) != Z_OK) {
+    return -1;
+  }
+
+  while (pos < b->srclen) {
+    m = bgzf_member(b->src + pos, b->srclen - pos);
+    inflateReset(&z);
+    z.next_in = (Bytef *)b->src + pos;
+    z.avail_in = m;
+    z.next_out = (Bytef *)b->dst + out;
+    z.avail_out = b->dstlen - out;
+    if (inflate(&z, Z_FINISH) != Z_STREAM_END || z.avail_in != 0) {
+      break;
+    }
+    out += z.total_out;
+    pos += m;
+  }
+
+  inflateEnd(&z);
+
+  return pos == b->srclen && out == b->dstlen ? 0 : -1;
+}
+
+/**
+ * Block thread.
+ */
+void *
+decompress_block(void *arg) {
+  block_t *b = arg;
+#ifdef HAVE_ZSTD
+  size_t n;
+#endif
+
+  b->status = -1;
+  if (b->codec == CODEC_GZIP) {
+    b->status = inflate_members(b);
+  }
+#ifdef HAVE_ZSTD
+  if (b->codec == CODEC_ZSTD) {
+    n = ZSTD_decompress(b->dst, b->dstlen, b->src, b->srclen);
+    b->status = !ZSTD_isError(n) && n == b->dstlen ? 0 : -1;
+  }
+#endif
+
+  return NULL;
+}
+
+/**
+ * Finds the next block of a gzip or zstd file: a run of BGZF members or zstd
+ * frames of known size, up to about BLOCK_TARGET bytes of output. If the file
+ * cannot be split there, the block is the rest of a plain gzip file, or a zstd
+ * frame that is too big or of unknown size, and it is marked serial.
+ */
+void
+next_block(block_t *b, codec_t codec, const unsigned char *src, size_t len) {
+  size_t off = 0;
+  size_t n;
+#ifdef HAVE_ZSTD
+  uint64_t content;
+#endif
+
+  b->codec = codec;
+  b->src = src;
+  b->dstlen = 0;
+  b->serial = 0;
+
+  if (codec == CODEC_GZIP) {
+    while (off < len && b->dstlen < BLOCK_TARGET &&
+           (n = bgzf_member(src + off, len - off))) {
+      b->dstlen += le32(src + off + n - 4);
+      off += n;
+    }
+    if (off == 0) {
+      off = len;
+      b->serial = 1;
+    }
+  }
+#ifdef HAVE_ZSTD
+  if (codec == CODEC_ZSTD) {
+    while (off < len && b->dstlen < BLOCK_TARGET) {
+      n = ZSTD_findFrameCompressedSize(src + off, len - off);
+      content = ZSTD_getFrameContentSize(src + off, len - off);
+      if (ZSTD_isError(n) || content == ZSTD_CONTENTSIZE_UNKNOWN ||
+          content == ZSTD_CONTENTSIZE_ERROR || content > BLOCK_MAX) {
+        if (off == 0) {
+          off = ZSTD_isError(n) ? len : n;
+          b->serial = 1;
+        }
+        break;
+      }
+      b->dstlen += content;
+      off += n;
+    }
+  }
+#endif
+
+  b->srclen = off;
+}
+
+/**
+ * Decompresses a mapped gzip or zstd file in blocks on up to w->threads
+ * threads, and emits the blocks in order. Serial blocks are decompressed by
+ * the worker itself when their turn comes, while the blocks after them keep
+ * running.
+ */
+int
+parallel(worker_t *w, const unsigned char *src, size_t len, char *out) {
+  block_t *blocks = calloc(w->threads, sizeof (block_t));
+  block_t *b;
+  unsigned long launched = 0;
+  unsigned long joined = 0;
+  size_t off = 0;
+  int status = 0;
+
+  while (status == 0 && (joined < launched || off < len)) {
+    while (launched - joined < (unsigned long)w->threads && off < len) {
+      if (w->codec == CODEC_GZIP && off > 0 && all_zero(src + off, len - off)) {
+        fprintf(stderr, "%s: trailing zero bytes ignored\n", w->path);
+        len = off;
+        break;
+      }
+      b = &blocks[launched++ % w->threads];
+      next_block(b, w->codec, src + off, len - off);
+      off += b->srclen;
+      if (b->serial) {
+        continue;
+      }
+
+      b->dst = malloc(b->dstlen ? b->dstlen : 1);
+      errno = pthread_create(&b->thread, NULL, decompress_block, b);
+      if (errno != 0) {
+        perror("pthread_create");
+        free(b->dst);
+        b->serial = 1;
+      }
+    }
+    if (joined == launched) {
+      break;
+    }
+
+    b = &blocks[joined++ % w->threads];
+    if (b->serial) {
+      if (b->codec == CODEC_GZIP) {
+        status = gunzip(w, b->src, b->srclen);
+      }
+#ifdef HAVE_ZSTD
+      if (b->codec == CODEC_ZSTD) {
+        status = unzstd(w, b->src, b->srclen, out);
+      }
+#endif
+    } else {
+      pthread_join(b->thread, NULL);
+      status = b->status;
+      if (status == 0) {
+        status = emit(w, b->dst, b->dstlen);
+      }
+      free(b->dst);
+    }
+  }
+
+  /* Wait for the blocks still running after an error. */
+  while (joined < launched) {
+    b = &blocks[joined++ % w->threads];
+    if (!b->serial) {
+      pthread_join(b->thread, NULL);
+      free(b->dst);
+    }
+  }
+  free(blocks);
+
+  return status;
+}
+
+/**
+ * Maps a gzip or zstd file and decompresses it, in blocks if it can be split
+ * and there are threads for it.
+ */
+int
+decompress_mapped(worker_t *w, char *out) {
+  struct stat st;
+  void *src;
+  int ret = -1;
+
+  if (fstat(w->in, &st) == -1) {
+    perror("fstat");
+    return -1;
+  }
+
+  src = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, w->in, 0);
+  if (src == MAP_FAILED) {
+    perror("mmap");
+    return -1;
+  }
+  madvise(src, st.st_size, MADV_SEQUENTIAL);
+
+  if (w->threads > 1) {
+    ret = parallel(w, src, st.st_size, out);
+  } else if (w->codec == CODEC_GZIP) {
+    ret = gunzip(w, src, st.st_size);
+  }
+#ifdef HAVE_ZSTD
+  else if (w->codec == CODEC_ZSTD) {
+    ret = unzstd(w, src, st.st_size, out);
+  }
+#endif
+
+  munmap(src, st.st_size);
+
+  return ret;
+}
+
+/**
+ * Extracts a 7-zip archive with the 7z command, which is the only format not
+ * decompressed in-process.
+ */
+int
+un7z(worker_t *w, char *in, char *out) {
+  posix_spawn_file_actions_t actions;
+  char *argv[5];
+  int p[2];
+  pid_t pid;
+  int status;
+  ssize_t n;
+  int ret = 0;
+
+  if (pipe2(p, O_CLOEXEC) == -1) {
+    return -1;
+  }
+
+  argv[0] = "7z";
+  argv[1] = "x";
+  argv[2] = "-so";
+  argv[3] = (char *)w->path;
+  argv[4] = NULL;
+
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_adddup2(&actions, p[1], STDOUT_FILENO);
+  errno = posix_spawnp(&pid, "7z", &actions, NULL, argv, environ);
+  posix_spawn_file_actions_destroy(&actions);
+  close(p[1]);
+  if (errno != 0) {
+    perror("7z");
+    close(p[0]);
+    return -1;
+  }
+
+  while ((n = read(p[0], out, CHUNK_SIZE)) != 0) {
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      ret = -1;
+      break;
+    }
+    if (emit(w, out, n) == -1) {
+      ret = -1;
+      break;
+    }
+  }
+  close(p[0]);
+
+  if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) ||
+      WEXITSTATUS(status) != 0) {
+    ret = -1;
+  }
+
+  return ret;
+}
+
+/**
+ * Worker thread. Decompresses an input into its pipe or queue, then closes the
+ * input and the pipe or finishes the queue.
+ */
+void *
+decompress(void *arg) {
+  worker_t *w = arg;
+  char *in = malloc(CHUNK_SIZE);
+  char *out = malloc(CHUNK_SIZE);
+
+  switch (w->codec) {
+    case CODEC_GZIP:
+      w->status = decompress_mapped(w, out);
+      break;
+    case CODEC_BZIP2:
+      w->status = bunzip2(w, in, out);
+      break;
+    case CODEC_XZ:
+      w->status = unxz(w, in, out);
+      break;
+#ifdef HAVE_ZSTD
+    case CODEC_ZSTD:
+      w->status = decompress_mapped(w, out);
+      break;
+#endif
+    case CODEC_7Z:
+      w->status = un7z(w, in, out);
+      break;
+    default:
+      fprintf(stderr, "%s: unsupported compression format\n", w->path);
+      w->status = -1;
+      break;
+  }
+
+  if (w->status != 0 && !w->peeking) {
+    fprintf(stderr, "%s: decompression failed\n", w->path);
+  }
+
+  free(in);
+  free(out);
+  if (w->peeking) {
+    return NULL;
+  }
+  close(w->in);
+  if (w->queue) {
+    queue_finish(w->queue);
+  } else {
+    close(w->out);
+  }
+
+  return NULL;
+}
+
+/**
+ * Opens an input and detects whether it is compressed.
+ */
+int
+open_input(fd_t *f, const char *path, int threads) {
+  codec_t codec;
+
+  f->worker = NULL;
+  f->follow = 0;
+  if (f->header_read) {
+    return 0;
+  }
+
+  if (!f->opened) {
+    f->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (f->fd == -1) {
+      perror(path);
+      return errno;
+    }
+  }
+
+  codec = detect_codec(f->fd);
+  if (codec != CODEC_NONE) {
+    f->worker = calloc(1, sizeof (worker_t));
+    f->worker->codec = codec;
+    f->worker->path = path;
+    f->worker->in = f->fd;
+    f->worker->threads = threads;
+  }
+
+  return 0;
+}
+
+/**
+ * Returns the first line of a compressed input, without its newline, or NULL.
+ * The file is decompressed as far as the end of the line, or less than max
+ * bytes. If the whole file fits, the rest of its output is kept as the input's
+ * rest, and the file is left at its end, not to be decompressed again.
+ * Otherwise it is left at its start.
+ */
+char *
+peek_header(fd_t *f, const char *path, codec_t codec, size_t max) {
+  worker_t w;
+  char *nl;
+  size_t extra;
+
+  memset(&w, 0, sizeof (w));
+  w.codec = codec;
+  w.path = path;
+  w.in = f->fd;
+  w.out = -1;
+  w.threads = 1;
+  w.peeking = 1;
+  w.peek_max = max;
+  decompress(&w);
+
+  nl = w.peek ? memchr(w.peek, '\n', w.peek_len) : NULL;
+  if (!nl) {
+    fprintf(stderr, "%s: could not read header\n", path);
+    free(w.peek);
+    return NULL;
+  }
+  *nl = '\0';
+
+  extra = w.peek + w.peek_len - (nl + 1);
+  if (w.status == 0 && extra < max) {
+    if (extra) {
+      f->rest = malloc(extra);
+      memcpy(f->rest, nl + 1, extra);
+      f->rest_len = extra;
+    }
+    f->header_read = 1;
+    lseek(f->fd, 0, SEEK_END);
+  } else {
+    lseek(f->fd, 0, SEEK_SET);
+  }
+
+  return w.peek;
+}
+
+/**
+ * Reads the db header of every input, and prints the union of their columns:
+ * those of the first input, followed by any others in the order they appear.
+ * Inputs with other columns, or the same columns in another order, are given
+ * a remapper. Empty inputs have no header, and are left out. The other inputs
+ * stay open, uncompressed ones past their header. Whatever was read past a
+ * header is kept, up to QUEUE_LIMIT bytes in all for compressed inputs, and
+ * each input's must fit in its ring.
+ */
+int
+reconcile(options_t *options, fd_t *fds) {
+  header_t u;
+  header_t *headers = calloc(options->input_count, sizeof (header_t));
+  struct stat st;
+  const char *path;
+  char *line;
+  codec_t codec;
+  size_t max;
+  size_t kept = 0;
+  int fd;
+  int i;
+  int ret = 0;
+  int found = 0;
+
+  u.names = NULL;
+  u.types = NULL;
+  u.count = 0;
+
+  for (i=0; i<options->input_count && ret == 0; i++) {
+    path = options->inputs[i];
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+      perror(path);
+      return errno;
+    }
+
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size == 0) {
+      close(fd);
+      continue;
+    }
+
+    fds[i].fd = fd;
+    fds[i].opened = 1;
+    max = options->buffer_size < CHUNK_SIZE ? options->buffer_size :
+          CHUNK_SIZE;
+    codec = detect_codec(fd);
+    if (codec != CODEC_NONE) {
+      line = peek_header(&fds[i], path, codec, kept < QUEUE_LIMIT ? max : 0);
+      kept += fds[i].rest_len;
+    } else {
+      line = read_header(fd, max, &fds[i].rest, &fds[i].rest_len);
+      fds[i].header_read = 1;
+      if (!line) {
+        continue;
+      }
+    }
+
+    if (!line || parse_header(path, line, &headers[i]) != 0) {
+      ret = 1;
+    } else {
+      merge_header(&u, &headers[i], path);
+      found = 1;
+    }
+    free(line);
+  }
+
+  /* An empty input has no lines to rewrite, whatever its remapper. */
+  if (ret == 0 && found) {
+    for (i=0; i<options->input_count; i++) {
+      fds[i].remap = make_remap(&u, &headers[i], options->buffer_size);
+    }
+    if (print_header(&u) == -1) {
+      ret = 1;
+    }
+  }
+
+  for (i=0; i<options->input_count; i++) {
+    free_header(&headers[i]);
+  }
+  free(headers);
+  free_header(&u);
+
+  return ret;
+}
+
+/**
+ * Reads an input's header and registers it with the event loop. Whatever was
+ * read past the header starts the ring, to be scanned on the first read.
+ */
+int
+start_input(mux_t *m, fd_t *f) {
+  struct epoll_event ev;
+
+  f->buffer = malloc(m->options->buffer_size);
+  f->size = m->options->buffer_size;
+  f->head = 0;
+  f->tail = 0;
+  f->closed = 0;
+
+  if (m->options->format == FMT_DB && !f->header_read) {
+    /* The output header has been printed already. */
+    free(read_header(f->fd, f->size < CHUNK_SIZE ? f->size : CHUNK_SIZE,
+                     &f->rest, &f->rest_len));
+  }
+  if (f->rest) {
+    memcpy(f->buffer, f->rest, f->rest_len);
+    f->tail = f->unscanned = f->rest_len;
+    free(f->rest);
+    f->rest = NULL;
+  }
+
+  fcntl(f->fd, F_SETFL, fcntl(f->fd, F_GETFL) | O_NONBLOCK);
+
+  /* Register the fd once. Regular files cannot be polled; they are always
+   * readable, so they are read on every iteration instead. */
+  ev.events = EPOLLIN;
+  ev.data.ptr = f;
+  if (epoll_ctl(m->epfd, EPOLL_CTL_ADD, f->fd, &ev) == -1) {
+    if (errno != EPERM) {
+      perror("epoll_ctl");
+      return errno;
+    }
+    m->unpolled[m->unpolled_count++] = f;
+  }
+
+  return 0;
+}
+
+/**
+ * Starts a worker for a compressed input. The input reads the pipe instead of
+ * the file.
+ */
+int
+start_worker(mux_t *m, fd_t *f) {
+  int p[2];
+
+  /* Close-on-exec, so that 7z children don't hold other pipes open. */
+  if (pipe2(p, O_CLOEXEC) == -1) {
+    perror("pipe2");
+    return errno;
+  }
+
+  f->worker->out = p[1];
+  f->fd = p[0];
+  errno = pthread_create(&f->worker->thread, NULL, decompress, f->worker);
+  if (errno != 0) {
+    perror("pthread_create");
+    return errno;
+  }
+  m->workers++;
+
+  return start_input(m, f);
+}
+
+/**
+ * Reads from an input and, if it reached EOF, retires it. A finished worker
+ * makes room for the next pending compressed input.
+ */
+int
+service(mux_t *m, fd_t *f, fd_t **owner) {
+  worker_t *w = f->worker;
+  int ret = read_input(f, owner);
+
+  if (ret != 1) {
+    return ret == -1 ? 1 : 0;
+  }
+  m->open_count--;
+
+  if (w) {
+    pthread_join(w->thread, NULL);
+    m->workers--;
+    if (w->status != 0) {
+      return 1;
+    }
+
+    if (m->next_pending < m->pending_count) {
+      return start_worker(m, m->pending[m->next_pending++]);
+    }
+  }
+
+  return 0;
+}
+
+int
+mux(options_t *options) {
+  int i;
+  mux_t m;
+  fd_t *fds = NULL;
+  fd_t *owner = NULL;
+  fd_t *f;
+  struct epoll_event events[MAX_EVENTS];
+  struct pollfd pfd;
+  int nevents;
+  int ret;
+
+  raise_fd_limit();
+
+  m.options = options;
+  m.epfd = epoll_create1(0);
+  if (m.epfd == -1) {
+    perror("epoll_create1");
+    return errno;
+  }
+  m.unpolled = malloc(sizeof (fd_t *) * options->input_count);
+  m.unpolled_count = 0;
+  m.pending = malloc(sizeof (fd_t *) * options->input_count);
+  m.pending_count = 0;
+  m.next_pending = 0;
+  m.workers = 0;
+  m.open_count = 0;
+
+  fds = calloc(options->input_count, sizeof (fd_t));
+  if (options->format == FMT_DB) {
+    ret = reconcile(options, fds);
+    if (ret != 0) {
+      return ret;
+    }
+  }
+
+  /* Initialize fds. Compressed inputs are decompressed by at most
+   * options->jobs workers at a time, in order; the rest wait. */
+  for (i=0; i<options->input_count; i++) {
+    f = &fds[i];
+
+    ret = open_input(f, options->inputs[i], options->threads);
+    if (ret != 0) {
+      return ret;
+    }
+    m.open_count++;
+
+    if (!f->worker) {
+      ret = start_input(&m, f);
+    } else if (m.workers < options->jobs) {
+      ret = start_worker(&m, f);
+    } else {
+      m.pending[m.pending_count++] = f;
+    }
+    if (ret != 0) {
+      return ret;
+    }
+  }
+
+  /* Lines are written with writev() from here on. */
+  fflush(stdout);
+
+  /* Write the lines that were read along with the headers of pipes, which
+   * may not be ready again. */
+  for (i=0; i<options->input_count && !owner; i++) {
+    if (fds[i].unscanned) {
+      ret = service(&m, &fds[i], &owner);
+      if (ret != 0) {
+        return ret;
+      }
+    }
+  }
+
+  while (m.open_count) {
+    if (owner) {
+      /* Finish the long line before any other input is written. */
+      pfd.fd = owner->fd;
+      pfd.events = POLLIN;
+      if (poll(&pfd, 1, -1) == -1 && errno != EINTR) {
+        perror("poll");
+        return errno;
+      }
+
+      ret = service(&m, owner, &owner);
+      if (ret != 0) {
+        return ret;
+      }
+      continue;
+    }
+
+    /* Don't block while there are regular files to read. */
+    nevents = epoll_wait(m.epfd, events, MAX_EVENTS,
+                         m.unpolled_count ? 0 : -1);
+    if (nevents == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("epoll_wait");
+      return errno;
+    }
+
+    /* Read from ready fds. Level-triggered, so inputs left with data after
+     * their read budget, or skipped for a long line, are reported again on
+     * the next iteration. */
+    for (i=0; i<nevents && !owner; i++) {
+      ret = service(&m, events[i].data.ptr, &owner);
+      if (ret != 0) {
+        return ret;
+      }
+    }
+
+    for (i=0; i<m.unpolled_count && !owner; i++) {
+      f = m.unpolled[i];
+      if (!f->closed) {
+        ret = service(&m, f, &owner);
+        if (ret != 0) {
+          return ret;
+        }
+      }
+
+      if (f->closed) {
+        /* Replace the closed input with the last one. */
+        m.unpolled[i--] = m.unpolled[--m.unpolled_count];
+      }
+    }
+  }
+
+  close(m.epfd);
+
+#ifdef DEBUG
+  for (i=0; i<options->input_count; i++) {
+    free(fds[i].buffer);
+    free(fds[i].worker);
+    free_remap(fds[i].remap);
+  }
+  free(fds);
+  free(m.unpolled);
+  free(m.pending);
+#endif
+
+  return 0;
+}
+
+/**
+ * Releases stdout if a followed file owns it, terminating the line.
+ */
+int
+release_owner(follow_t *t, tail_t *x) {
+  if (t->owner != &x->f) {
+    return 0;
+  }
+
+  t->owner = NULL;
+
+  return end_line(&x->f);
+}
+
+/**
+ * Starts following a file, unless it is already followed under any name. A
+ * file that is followed at the same path is replaced: it is read to EOF and
+ * then closed.
+ */
+int
+add_tail(follow_t *t, const char *path) {
+  struct stat st;
+  tail_t *x;
+  int fd;
+  int wd;
+
+  fd = open(path, O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+  if (fd == -1) {
+    /* It may already have been removed again. */
+    return 0;
+  }
+
+  if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+    close(fd);
+    return 0;
+  }
+
+  for (x=t->tails; x; x=x->next) {
+    if (x->dev == st.st_dev && x->ino == st.st_ino) {
+      close(fd);
+      return 0;
+    }
+  }
+
+  if (detect_codec(fd) != CODEC_NONE) {
+    fprintf(stderr, "%s: compressed files cannot be followed\n", path);
+    close(fd);
+    return 0;
+  }
+
+  wd = inotify_add_watch(t->ifd, path, IN_MODIFY | IN_ATTRIB);
+  if (wd == -1) {
+    perror(path);
+    close(fd);
+    return errno;
+  }
+
+  for (x=t->tails; x; x=x->next) {
+    if (!x->replaced && strcmp(x->path, path) == 0) {
+      x->replaced = 1;
+      x->ready = 1;
+    }
+  }
 
-#define READ_COUNT 16384
+  if (wd >= t->wd_count) {
+    t->wds = realloc(t->wds, sizeof (tail_t *) * (wd + 1) * 2);
+    memset(t->wds + t->wd_count, 0,
+           sizeof (tail_t *) * ((wd + 1) * 2 - t->wd_count));
+    t->wd_count = (wd + 1) * 2;
+  }
 
-typedef enum {
-  FMT_DB,
-  FMT_JSON
-} format_t;
+  x = calloc(1, sizeof (tail_t));
+  x->f.fd = fd;
+  x->f.buffer = malloc(t->options->buffer_size);
+  x->f.size = t->options->buffer_size;
+  x->f.follow = 1;
+  x->path = strdup(path);
+  x->dev = st.st_dev;
+  x->ino = st.st_ino;
+  x->wd = wd;
+  x->in_header = t->options->format == FMT_DB;
+  x->ready = 1;
+  x->next = t->tails;
+  t->tails = x;
+  t->wds[wd] = x;
 
-typedef struct {
-  char **inputs;
-  int input_count;
-  format_t format;
-} options_t;
+  return 0;
+}
 
-typedef struct {
-  int fd;
-  char *buffer;
-  size_t size;
-  size_t offset;
-  char closed;
-} fd_t;
+/**
+ * Follows the existing files that match a pattern.
+ */
+int
+scan_pattern(follow_t *t, pattern_t *p) {
+  DIR *dir = opendir(*p->prefix ? p->prefix : ".");
+  struct dirent *ent;
+  char *path;
+  int ret = 0;
+
+  if (!dir) {
+    perror(*p->prefix ? p->prefix : ".");
+    return errno;
+  }
+
+  while (ret == 0 && (ent = readdir(dir))) {
+    if (fnmatch(p->glob, ent->d_name, FNM_PERIOD) == 0) {
+      path = malloc(strlen(p->prefix) + strlen(ent->d_name) + 1);
+      sprintf(path, "%s%s", p->prefix, ent->d_name);
+      ret = add_tail(t, path);
+      free(path);
+    }
+  }
+  closedir(dir);
+
+  return ret;
+}
 
 /**
- * Reads and, if specified, prints the db data header.
+ * Reads a followed file's db header, which may be incomplete in a new file.
+ * The first complete header is printed, and the records of files with other
+ * headers are remapped onto it. Returns 0 once the header is read, 1 if it is
+ * still incomplete, or -1 on error.
  */
-void
-read_header(int fd, char print) {
-  int ret;
-  char c = '\0';
+int
+read_tail_header(follow_t *t, tail_t *x) {
+  header_t h;
+  char c;
+  ssize_t ret;
+  int i;
 
-  while (c != '\n') {
-    ret = read(fd, &c, 1);
+  while ((ret = read(x->f.fd, &c, 1)) == 1) {
+    x->header = realloc(x->header, x->header_len + 1);
+    x->header[x->header_len++] = c;
+    if (c == '\n') {
+      x->header[x->header_len - 1] = '\0';
+      ret = parse_header(x->path, x->header, &h);
+      free(x->header);
+      x->header = NULL;
+      x->header_len = 0;
+      if (ret != 0) {
+        return -1;
+      }
+      x->in_header = 0;
+
+      if (t->print) {
+        t->print = 0;
+        t->header = h;
+        return print_header(&h);
+      }
+
+      /* Later files are mapped onto the first header. */
+      for (i=0; i<h.count; i++) {
+        if (find_column(&t->header, h.names[i]) == -1) {
+          fprintf(stderr, "%s: column '%s' is not in the output\n", x->path,
+                  h.names[i]);
+        }
+      }
+      free_remap(x->f.remap);
+      x->f.remap = make_remap(&t->header, &h, t->options->buffer_size);
+      free_header(&h);
+      return 0;
+    }
+  }
+
+  if (ret == -1 && errno != EAGAIN && errno != EINTR) {
+    perror(x->path);
+    return -1;
+  }
+
+  return 1;
+}
+
+/**
+ * Stops following a file.
+ */
+int
+retire_tail(follow_t *t, tail_t *x) {
+  if (release_owner(t, x) == -1) {
+    return -1;
+  }
+
+  inotify_rm_watch(t->ifd, x->wd);
+  t->wds[x->wd] = NULL;
+  close(x->f.fd);
+  x->f.closed = 1;
+
+  return 0;
+}
+
+/**
+ * Reads from a followed file. At EOF, the file is checked for truncation, in
+ * which case it is read again from the start, and retired if it has been
+ * replaced or deleted. Returns 0, or -1 on error.
+ */
+int
+service_tail(follow_t *t, tail_t *x) {
+  struct stat st;
+  off_t offset;
+  int ret = 1;
+
+  if (x->in_header) {
+    ret = read_tail_header(t, x);
     if (ret == -1) {
-      perror("read");
-      exit(errno);
-    } else if (ret == 0) {
-      fprintf(stderr, "EOF before end of header\n");
-      exit(1);
+      return -1;
     }
+  }
 
-    if (print) {
-      printf("%c", c);
+  if (!x->in_header) {
+    ret = read_input(&x->f, &t->owner);
+    if (ret == -1) {
+      return -1;
     }
+  }
 
-    if (c == '\n') {
-      break;
+  if (ret == 0) {
+    /* Used its read budget. */
+    return 0;
+  }
+
+  offset = lseek(x->f.fd, 0, SEEK_CUR);
+  if (fstat(x->f.fd, &st) == -1) {
+    perror(x->path);
+    return -1;
+  }
+
+  if (st.st_size < offset) {
+    /* Truncated. Drop the partial line and start over. */
+    fprintf(stderr, "%s: file truncated\n", x->path);
+    if (release_owner(t, x) == -1) {
+      return -1;
+    }
+    lseek(x->f.fd, 0, SEEK_SET);
+    x->f.head = x->f.tail;
+    if (x->f.remap) {
+      x->f.remap->line_len = 0;
     }
+    x->in_header = t->options->format == FMT_DB;
+    x->header_len = 0;
+    return 0;
+  }
+
+  if (x->replaced || st.st_nlink == 0) {
+    return retire_tail(t, x);
   }
+
+  x->ready = 0;
+
+  return 0;
 }
 
+/**
+ * Reads inotify events and marks the files that changed. New files in watched
+ * directories that match a pattern are followed.
+ */
 int
-mux(options_t *options) {
+read_events(follow_t *t) {
+  union {
+    struct inotify_event ev;
+    char buf[EVENT_BUFFER];
+  } u;
+  struct inotify_event *ev;
+  ssize_t n;
+  char *p;
+  char *path;
+  tail_t *x;
+  int i;
+  int ret;
+
+  while ((n = read(t->ifd, u.buf, sizeof (u.buf))) > 0) {
+    for (p=u.buf; p<u.buf+n; p+=sizeof (struct inotify_event)+ev->len) {
+      ev = (struct inotify_event *)p;
+
+      if (ev->mask & IN_Q_OVERFLOW) {
+        /* Events were lost. Check everything. */
+        for (x=t->tails; x; x=x->next) {
+          x->ready = 1;
+        }
+        for (i=0; i<t->options->input_count; i++) {
+          ret = scan_pattern(t, &t->patterns[i]);
+          if (ret != 0) {
+            return ret;
+          }
+        }
+        continue;
+      }
+
+      if (ev->wd >= 0 && ev->wd < t->wd_count && t->wds[ev->wd]) {
+        t->wds[ev->wd]->ready = 1;
+        continue;
+      }
+
+      if (!ev->len || (ev->mask & IN_ISDIR)) {
+        continue;
+      }
+      for (i=0; i<t->options->input_count; i++) {
+        if (t->patterns[i].wd == ev->wd &&
+            fnmatch(t->patterns[i].glob, ev->name, FNM_PERIOD) == 0) {
+          path = malloc(strlen(t->patterns[i].prefix) + ev->len + 1);
+          sprintf(path, "%s%s", t->patterns[i].prefix, ev->name);
+          ret = add_tail(t, path);
+          free(path);
+          if (ret != 0) {
+            return ret;
+          }
+        }
+      }
+    }
+  }
+
+  if (n == -1 && errno != EAGAIN && errno != EINTR) {
+    perror("inotify");
+    return errno;
+  }
+
+  return 0;
+}
+
+/**
+ * Follows files like tail -F and muxes their lines to stdout. Each input is a
+ * path whose file name may be a glob; its directory is watched for new
+ * matching files. Runs until killed.
+ */
+int
+follow(options_t *options) {
+  follow_t t;
+  pattern_t *p;
+  tail_t *x;
+  tail_t **link;
+  struct pollfd pfd;
+  char *slash;
+  int timeout;
   int i;
-  int j;
-  int fd_open_count = 0;
-  fd_t *fds = NULL;
-  fd_set readfds;
-  int nfds;
-  fd_t *f;
   int ret;
-  int length;
-  int rest;
-  char print = 1;
 
-  /* Initialize fds. */
-  fds = malloc(sizeof (fd_t) * options->input_count);
+  raise_fd_limit();
+
+  t.options = options;
+  t.ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (t.ifd == -1) {
+    perror("inotify_init1");
+    return errno;
+  }
+  t.patterns = malloc(sizeof (pattern_t) * options->input_count);
+  t.tails = NULL;
+  t.wds = NULL;
+  t.wd_count = 0;
+  t.owner = NULL;
+  t.print = 1;
+  t.header.count = 0;
+
+  /* Watch the directories before listing them, so that no new file is
+   * missed. */
   for (i=0; i<options->input_count; i++) {
-    f = &fds[i];
+    p = &t.patterns[i];
+    slash = strrchr(options->inputs[i], '/');
+    p->prefix = strdup(options->inputs[i]);
+    p->prefix[slash ? slash - options->inputs[i] + 1 : 0] = '\0';
+    p->glob = slash ? slash + 1 : options->inputs[i];
+    if (!*p->glob) {
+      fprintf(stderr, "%s: not a file\n", options->inputs[i]);
+      return 1;
+    }
 
-    if (access(options->inputs[i], R_OK) != 0) {
-      perror("access");
+    p->wd = inotify_add_watch(t.ifd, *p->prefix ? p->prefix : ".",
+                              IN_CREATE | IN_MOVED_TO | IN_ONLYDIR);
+    if (p->wd == -1) {
+      perror(*p->prefix ? p->prefix : ".");
       return errno;
     }
+  }
 
-    f->fd = open(options->inputs[i], O_RDONLY);
-    if (f->fd == -1) {
-      perror("open");
+  for (i=0; i<options->input_count; i++) {
+    ret = scan_pattern(&t, &t.patterns[i]);
+    if (ret != 0) {
+      return ret;
+    }
+  }
+
+  pfd.fd = t.ifd;
+  pfd.events = POLLIN;
+  for (;;) {
+    /* Don't block while a file may have unread data. While a long line is
+     * being written, only its file matters. */
+    timeout = -1;
+    for (x=t.tails; x && timeout; x=x->next) {
+      if (x->ready && (!t.owner || t.owner == &x->f)) {
+        timeout = 0;
+      }
+    }
+
+    if (poll(&pfd, 1, timeout) == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("poll");
       return errno;
     }
 
-    if (options->format == FMT_DB) {
-      /* Read the header. Print only the first. */
-      read_header(f->fd, print);
-      print = 0;
+    if (pfd.revents & POLLIN) {
+      ret = read_events(&t);
+      if (ret != 0) {
+        return ret;
+      }
     }
 
-    fd_open_count++;
+    for (x=t.tails; x; x=x->next) {
+      if (t.owner && t.owner != &x->f) {
+        continue;
+      }
+      if (x->ready && !x->f.closed && service_tail(&t, x) == -1) {
+        return 1;
+      }
+    }
 
-    f->buffer = malloc(READ_COUNT);
-    f->size = READ_COUNT;
-    f->offset = 0;
-    f->closed = 0;
+    /* Free the retired files. */
+    link = &t.tails;
+    while (*link) {
+      x = *link;
+      if (x->f.closed) {
+        *link = x->next;
+        free(x->f.buffer);
+        free(x->header);
+        free(x->path);
+        free_remap(x->f.remap);
+        free(x);
+      } else {
+        link = &x->next;
+      }
+    }
   }
 
-  while (fd_open_count) {
-    FD_ZERO(&readfds);
-    nfds = 0;
+  return 0;
+}
 
-    /* Add open fds to the select set. */
-    for (i=0; i<options->input_count; i++) {
-      f = &fds[i];
-      if (!f->closed) {
-        FD_SET(f->fd, &readfds);
+/**
+ * Copies the rest of fd to stdout. sendfile() and splice() move the data
+ * without copying it through user space; read() and write() are the fallback
+ * when neither applies (e.g. a terminal, or stdout opened for appending).
+ */
+int
+copy_fd(int fd, char *buf) {
+  ssize_t n;
 
-        if (f->fd+1 > nfds) {
-          nfds = f->fd+1;
-        }
+  /* Regular files. */
+  for (;;) {
+    n = sendfile(STDOUT_FILENO, fd, NULL, COPY_SIZE);
+    if (n == -1 && errno == EINTR) {
+      continue;
+    } else if (n == -1 && (errno == EINVAL || errno == ENOSYS)) {
+      break;
+    } else if (n <= 0) {
+      return n;
+    }
+  }
 
-        fcntl(f->fd, F_SETFL, O_NONBLOCK);
-      }
+  /* Pipes. */
+  for (;;) {
+    n = splice(fd, NULL, STDOUT_FILENO, NULL, COPY_SIZE, SPLICE_F_MOVE);
+    if (n == -1 && errno == EINTR) {
+      continue;
+    } else if (n == -1 && (errno == EINVAL || errno == ENOSYS)) {
+      break;
+    } else if (n <= 0) {
+      return n;
     }
+  }
 
-    if (select(nfds, &readfds, NULL, NULL, NULL) == -1) {
-      perror("select");
-      return errno;
+  for (;;) {
+    n = read(fd, buf, CHUNK_SIZE);
+    if (n == -1 && errno == EINTR) {
+      continue;
+    } else if (n <= 0) {
+      return n;
     }
 
-    /* Read from ready fds. */
-    for (i=0; i<options->input_count; i++) {
-      f = &fds[i];
+    if (write_all(STDOUT_FILENO, buf, n) == -1) {
+      return -1;
+    }
+  }
+}
 
-      if (f->closed || !FD_ISSET(f->fd, &readfds)) {
-        continue;
-      }
+/**
+ * Copies the rest of fd to stdout through a remapper.
+ */
+int
+remap_fd(int fd, char *buf, remap_t *r) {
+  ssize_t n;
 
-      ret = read(f->fd, f->buffer + f->offset, f->size - f->offset);
-      if (ret == -1) {
-        perror("read");
-        return errno;
-      } else if (ret == 0) {
-        /* EOF. */
-        close(f->fd);
-        f->closed = 1;
-        fd_open_count--;
-        continue;
+  for (;;) {
+    n = read(fd, buf, CHUNK_SIZE);
+    if (n == -1 && errno == EINTR) {
+      continue;
+    } else if (n <= 0) {
+      return n;
+    }
+
+    if (put(r, buf, n) == -1) {
+      return -1;
+    }
+  }
+}
+
+/**
+ * Rewrites the partial line left at the end of an input, as if it ended with
+ * a newline.
+ */
+int
+remap_finish(remap_t *r) {
+  if (!r || (!r->line_len && !r->streaming)) {
+    return 0;
+  }
+
+  return put(r, "\n", 1);
+}
+
+/**
+ * Discards the first line of fd and writes whatever was read after it.
+ */
+int
+skip_header(int fd, char *buf, remap_t *r) {
+  ssize_t n;
+  char *nl;
+
+  for (;;) {
+    n = read(fd, buf, CHUNK_SIZE);
+    if (n == -1 && errno == EINTR) {
+      continue;
+    } else if (n <= 0) {
+      return n;
+    }
+
+    nl = memchr(buf, '\n', n);
+    if (nl) {
+      return put(r, nl + 1, buf + n - nl - 1);
+    }
+  }
+}
+
+/**
+ * Writes a compressed input's queued output as it is decompressed, and waits
+ * for its worker.
+ */
+int
+cat_queue(worker_t *w, char strip, remap_t *r) {
+  chunk_t *c;
+  char *start;
+  int ret = 0;
+
+  while ((c = queue_pop(w->queue))) {
+    start = c->data;
+    if (strip) {
+      start = memchr(c->data, '\n', c->length);
+      if (start) {
+        start++;
+        strip = 0;
       }
+    }
+
+    /* Keep draining after an error so that the worker can finish. */
+    if (start && ret == 0 &&
+        put(r, start, c->data + c->length - start) == -1) {
+      perror("write");
+      ret = -1;
+    }
+    free(c);
+  }
 
-      /* Search for the last newline. */
-      for (j=ret-1; j>=0; j--) {
-        if (f->buffer[f->offset+j] == '\n') {
-          /* Newline found. Output buffered lines. */
-          length = f->offset+j+1;
-          fwrite(f->buffer, 1, length, stdout);
+  pthread_join(w->thread, NULL);
+  if (w->status != 0) {
+    ret = -1;
+  }
+  if (ret == 0 && remap_finish(r) == -1) {
+    perror("write");
+    ret = -1;
+  }
 
-          /* Shift the rest of the buffer and update the offset. */
-          rest = ret-j-1;
-          memmove(f->buffer, f->buffer+length, rest);
-          f->offset = rest;
+  return ret;
+}
 
-          break;
+/**
+ * Starts a worker that decompresses an input into a queue.
+ */
+int
+start_queue_worker(worker_t *w) {
+  w->queue = calloc(1, sizeof (queue_t));
+  pthread_mutex_init(&w->queue->lock, NULL);
+  pthread_cond_init(&w->queue->cond, NULL);
+  w->queue->limit = QUEUE_LIMIT;
+
+  errno = pthread_create(&w->thread, NULL, decompress, w);
+  if (errno != 0) {
+    perror("pthread_create");
+    return errno;
+  }
+
+  return 0;
+}
+
+/**
+ * Concatenates the inputs in order. Up to options->jobs compressed inputs,
+ * starting with the one being written, are decompressed at once, so that the
+ * next inputs are ready when they are reached. When concatenating db data,
+ * the union of the input headers is printed first, and every input's header
+ * is dropped.
+ */
+int
+cat_inputs(options_t *options) {
+  int i;
+  int next = 0;
+  fd_t *fds = calloc(options->input_count, sizeof (fd_t));
+  fd_t *f;
+  char *buf = malloc(CHUNK_SIZE);
+  char strip;
+  int ret;
+
+  raise_fd_limit();
+
+  if (options->format == FMT_DB) {
+    ret = reconcile(options, fds);
+    if (ret != 0) {
+      return ret;
+    }
+  }
+
+  for (i=0; i<options->input_count; i++) {
+    /* Open inputs ahead of this one and start decompressing them. */
+    for (; next<options->input_count && next<i+options->jobs; next++) {
+      ret = open_input(&fds[next], options->inputs[next],
+                       options->threads);
+      if (ret != 0) {
+        return ret;
+      }
+      if (fds[next].worker) {
+        ret = start_queue_worker(fds[next].worker);
+        if (ret != 0) {
+          return ret;
         }
       }
+    }
 
-      if (j < 0) {
-        /* No newline found in the buffer. */
-        f->offset += ret;
+    f = &fds[i];
+    strip = options->format == FMT_DB && !f->header_read;
+    if (f->worker) {
+      ret = cat_queue(f->worker, strip, f->remap);
+      free(f->worker->queue);
+      free(f->worker);
+    } else {
+      ret = strip ? skip_header(f->fd, buf, f->remap) : 0;
+      if (ret == 0 && f->rest) {
+        ret = put(f->remap, f->rest, f->rest_len);
+        free(f->rest);
       }
-
-      /* Grow the buffer if there isn't enough room for another read(). */
-      if (f->size - f->offset < READ_COUNT) {
-        f->size *= 2;
-        f->buffer = realloc(f->buffer, f->size);
+      if (ret == 0) {
+        ret = f->remap ? remap_fd(f->fd, buf, f->remap) : copy_fd(f->fd, buf);
+      }
+      if (ret == 0) {
+        ret = remap_finish(f->remap);
+      }
+      if (ret == -1) {
+        perror(options->inputs[i]);
       }
+      close(f->fd);
+    }
+
+    if (ret != 0) {
+      return 1;
     }
   }
 
-  fflush(stdout);
+#ifdef DEBUG
+  for (i=0; i<options->input_count; i++) {
+    free_remap(fds[i].remap);
+  }
+  free(fds);
+  free(buf);
+#endif
 
   return 0;
 }
 
+/**
+ * Reads input paths from stdin, one per line.
+ */
+char **
+read_paths(int *count) {
+  char **paths = NULL;
+  int capacity = 0;
+  char *line = NULL;
+  size_t size = 0;
+  ssize_t n;
+
+  *count = 0;
+  while ((n = getline(&line, &size, stdin)) != -1) {
+    if (n > 0 && line[n-1] == '\n') {
+      line[--n] = '\0';
+    }
+    if (n == 0) {
+      continue;
+    }
+
+    if (*count == capacity) {
+      capacity = capacity ? capacity * 2 : 64;
+      paths = realloc(paths, sizeof (char *) * capacity);
+    }
+    paths[(*count)++] = strdup(line);
+  }
+  free(line);
+
+  return paths;
+}
+
 void
 usage(const char *prog, int status) {
-  printf("Usage: %s [OPTION]... FORMAT INPUT [INPUT]...\n\n", prog);
-  printf("Format must be one of [db|json].\n\n");
+  printf("Usage: %s [OPTION]... FORMAT [INPUT]...\n\n", prog);
+  printf("Format must be one of [db|json]. If no INPUT is given, input "
+         "paths are read\nfrom stdin.\n\n");
   printf("  -h, --help             Show this text and exit.\n");
+  printf("  -c, --cat              Concatenate the inputs in order instead "
+         "of muxing.\n");
+  printf("  -b, --buffer-size SIZE Buffer at most SIZE bytes per input "
+         "(default %d).\n", RING_SIZE);
+  printf("  -j, --jobs N           Decompress at most N inputs at a time "
+         "(default %d).\n", JOBS);
+  printf("  -t, --threads N        Decompress each BGZF or multi-frame zstd "
+         "input on up to\n                         N threads (default: "
+         "the number of CPUs).\n");
+  printf("  -f, --follow           Follow the inputs as they grow, are "
+         "rotated or\n                         truncated, like tail -F. "
+         "The file name of an input\n                         may be a "
+         "glob, and new matching files are followed.\n");
+  printf("\nLines longer than the buffer are written as they are read, "
+         "and no other\ninput is written until they end.\n");
+  printf("\nThe db output header is the union of the input headers, and "
+         "each input's\nfields are rewritten into its column order.\n");
+  printf("\nInputs compressed with gzip, bzip2, xz, or zstd are "
+         "decompressed in-process;\n7-zip archives are extracted with "
+         "7z.\n");
 
   exit(status);
 }
@@ -234,15 +3062,53 @@ main(int argc, char **argv) {
   /* Parse options. */
   static struct option longopts[] = {
     {"help", no_argument, NULL, 'h'},
+    {"cat", no_argument, NULL, 'c'},
+    {"buffer-size", required_argument, NULL, 'b'},
+    {"jobs", required_argument, NULL, 'j'},
+    {"threads", required_argument, NULL, 't'},
+    {"follow", no_argument, NULL, 'f'},
     {NULL, 0, NULL, 0}
   };
-  const char *optstring = "h";
+  const char *optstring = "hcb:j:t:f";
   char opt;
+
+  options.buffer_size = RING_SIZE;
+  options.jobs = JOBS;
+  options.threads = sysconf(_SC_NPROCESSORS_ONLN);
+  options.ordered = 0;
+  options.follow = 0;
   while ((opt = getopt_long(argc, argv, optstring, longopts, NULL)) != -1) {
     switch (opt) {
       case 'h':
         usage(argv[0], 0);
         break;
+      case 'c':
+        options.ordered = 1;
+        break;
+      case 'b':
+        options.buffer_size = strtoul(optarg, NULL, 10);
+        if (options.buffer_size == 0) {
+          fprintf(stderr, "invalid buffer size '%s'\n", optarg);
+          usage(argv[0], 1);
+        }
+        break;
+      case 'j':
+        options.jobs = atoi(optarg);
+        if (options.jobs < 1) {
+          fprintf(stderr, "invalid job count '%s'\n", optarg);
+          usage(argv[0], 1);
+        }
+        break;
+      case 't':
+        options.threads = atoi(optarg);
+        if (options.threads < 1) {
+          fprintf(stderr, "invalid thread count '%s'\n", optarg);
+          usage(argv[0], 1);
+        }
+        break;
+      case 'f':
+        options.follow = 1;
+        break;
       default:
         fprintf(stderr, "unrecognized option '%c'\n", opt);
         usage(argv[0], 1);
@@ -251,7 +3117,7 @@ main(int argc, char **argv) {
   }
 
   if (argc - optind == 0) {
-    fprintf(stderr, "missing FORMAT and INPUT...\n");
+    fprintf(stderr, "missing FORMAT\n");
     usage(argv[0], 1);
   }
 
@@ -266,12 +3132,23 @@ main(int argc, char **argv) {
   }
 
   options.input_count = argc - optind - 1;
+  options.inputs = argv + optind + 1;
   if (options.input_count == 0) {
-    fprintf(stderr, "missing INPUT...\n");
+    options.inputs = read_paths(&options.input_count);
+    if (options.input_count == 0) {
+      fprintf(stderr, "missing INPUT...\n");
+      usage(argv[0], 1);
+    }
+  }
+
+  if (options.follow && options.ordered) {
+    fprintf(stderr, "--follow cannot be used with --cat\n");
     usage(argv[0], 1);
   }
 
-  options.inputs = argv + optind + 1;
+  if (options.follow) {
+    exit(follow(&options));
+  }
 
-  exit(mux(&options));
+  exit(options.ordered ? cat_inputs(&options) : mux(&options));
 }